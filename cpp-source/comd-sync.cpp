@@ -0,0 +1,803 @@
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "util.hpp"
+#include "comd-sync.hpp"
+
+static void put_uint(std::string* out, uint64_t value, int bytes){
+	for(int shift = (bytes - 1) * 8; shift >= 0; shift -= 8){
+		out->push_back(static_cast<char>((value >> shift) & 0xff));
+	}
+}
+
+static uint64_t get_uint(const char* in, int bytes){
+	uint64_t value = 0;
+	for(int i = 0; i < bytes; ++i){
+		value = value << 8 | static_cast<unsigned char>(in[i]);
+	}
+	return value;
+}
+
+static std::string message(enum ComdSyncMessage type, uint32_t index){
+	std::string result(1, static_cast<char>(type));
+	put_uint(&result, index, 4);
+	return result;
+}
+
+static std::string digest(CryptoPP::SHA256* hash){
+	byte result[CryptoPP::SHA256::DIGESTSIZE];
+	hash->Final(result);
+	return std::string(reinterpret_cast<const char*>(result), CryptoPP::SHA256::DIGESTSIZE);
+}
+
+/**
+ * @brief rsync's rolling checksum: the byte sum and the position weighted byte sum, 16 bits each.
+ */
+static uint32_t rolling_checksum(const unsigned char* data, size_t length, uint32_t* a, uint32_t* b){
+	*a = 0;
+	*b = 0;
+	for(size_t i = 0; i < length; ++i){
+		*a += data[i];
+		*b += static_cast<uint32_t>(length - i) * data[i];
+	}
+	*a &= 0xffff;
+	*b &= 0xffff;
+	return *a | *b << 16;
+}
+
+static std::string strong_checksum(const char* data, size_t length){
+	return Util::sha256_hash(std::string(data, length)).substr(0, COMD_SYNC_STRONG);
+}
+
+/**
+ * @brief About the square root of the file size, so a signature costs as much as the data it usually saves.
+ */
+static uint32_t block_size(uint64_t size){
+	uint64_t root = static_cast<uint64_t>(std::sqrt(static_cast<double>(size))) & ~static_cast<uint64_t>(7);
+	return static_cast<uint32_t>(std::max<uint64_t>(512, std::min<uint64_t>(root, 16384)));
+}
+
+/**
+ * @brief Relative paths only, and nothing that climbs out of the destination.
+ */
+static bool safe_path(const std::string& path){
+	if(path.empty() || path[0] == '/'){
+		return false;
+	}
+	size_t start = 0;
+	while(start <= path.length()){
+		size_t end = path.find('/', start);
+		if(end == std::string::npos){
+			end = path.length();
+		}
+		std::string part = path.substr(start, end - start);
+		if(part.empty() || part == "." || part == ".."){
+			return false;
+		}
+		start = end + 1;
+	}
+	return true;
+}
+
+static bool make_directories(const std::string& path){
+	for(size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)){
+		if(mkdir(path.substr(0, slash).c_str(), 0755) < 0 && errno != EEXIST){
+			return true;
+		}
+	}
+	return mkdir(path.c_str(), 0755) < 0 && errno != EEXIST;
+}
+
+static bool write_all(int fd, const char* data, size_t length){
+	ssize_t len;
+	while(length > 0){
+		if((len = write(fd, data, length)) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return true;
+		}
+		data += len;
+		length -= static_cast<size_t>(len);
+	}
+	return false;
+}
+
+ComdDirectorySync::ComdDirectorySync(std::function<bool(const char*, size_t)> new_send, unsigned int threads)
+:sending(false),
+files_done(0),
+list_ended(false),
+finished(false),
+intact(false),
+outbound_bytes(0),
+failed(false),
+stopping(false),
+files_unchanged(0),
+bytes_matched(0),
+bytes_literal(0),
+send(new_send){
+	for(unsigned int i = 0; i < std::max(threads, 1u); ++i){
+		this->workers.push_back(std::thread(&ComdDirectorySync::work, this));
+	}
+}
+
+ComdDirectorySync::~ComdDirectorySync(){
+	{
+		std::lock_guard<std::mutex> lock(this->tasks_mutex);
+		std::lock_guard<std::mutex> outbound_lock(this->outbound_mutex);
+		this->stopping = true;
+	}
+	this->tasks_condition.notify_all();
+	this->outbound_condition.notify_all();
+	for(std::thread& worker : this->workers){
+		worker.join();
+	}
+	for(SyncFile& f : this->files){
+		if(f.old_fd >= 0){
+			close(f.old_fd);
+		}
+		if(f.new_fd >= 0){
+			close(f.new_fd);
+			unlink((this->root + '/' + f.path + ".jpsync").c_str());
+		}
+	}
+}
+
+void ComdDirectorySync::work(){
+	while(true){
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(this->tasks_mutex);
+			this->tasks_condition.wait(lock, [&]{
+				return this->stopping || !this->tasks.empty();
+			});
+			if(this->stopping){
+				return;
+			}
+			task = std::move(this->tasks.front());
+			this->tasks.pop_front();
+		}
+		task();
+	}
+}
+
+void ComdDirectorySync::submit(std::function<void()> task){
+	{
+		std::lock_guard<std::mutex> lock(this->tasks_mutex);
+		this->tasks.push_back(task);
+	}
+	this->tasks_condition.notify_one();
+}
+
+/**
+ * @param wait Whether to wait for the queue to drain below COMD_SYNC_QUEUED first. Only workers may;
+ * the thread that pumps would wait on itself.
+ */
+void ComdDirectorySync::queue(std::string packet, bool wait){
+	bool was_empty;
+	{
+		std::unique_lock<std::mutex> lock(this->outbound_mutex);
+		if(wait){
+			this->outbound_condition.wait(lock, [&]{
+				return this->stopping || this->outbound_bytes < COMD_SYNC_QUEUED;
+			});
+		}
+		was_empty = this->outbound.empty();
+		this->outbound_bytes += packet.length();
+		this->outbound.push_back(std::move(packet));
+	}
+	// pump always drains the queue, so it only needs waking when the queue was empty.
+	if(was_empty && this->on_ready != nullptr){
+		this->on_ready();
+	}
+}
+
+/**
+ * @brief Tells the other side what went wrong; the sync is over.
+ *
+ * @return true, so callers can return it as the error it is.
+ */
+bool ComdDirectorySync::error(const std::string& text){
+	ERROR("directory sync: " << text)
+	std::string packet(1, static_cast<char>(COMD_SYNC_ERROR));
+	packet += text;
+	this->queue(packet, false);
+	std::lock_guard<std::mutex> lock(this->outbound_mutex);
+	this->failed = true;
+	this->finished = true;
+	this->intact = false;
+	return true;
+}
+
+ComdDirectorySync::SyncFile* ComdDirectorySync::file(uint32_t index){
+	return index < this->files.size() ? &this->files[index] : 0;
+}
+
+void ComdDirectorySync::list(const std::string& directory, const std::string& relative){
+	DIR* dir;
+	struct dirent* entry;
+	struct stat entry_stat;
+
+	if((dir = opendir(directory.c_str())) == 0){
+		perror("directory sync opendir");
+		return;
+	}
+	while((entry = readdir(dir)) != 0){
+		std::string name(entry->d_name);
+		if(name == "." || name == ".."){
+			continue;
+		}
+		std::string path = directory + '/' + name;
+		std::string relative_path = relative.empty() ? name : relative + '/' + name;
+		if(lstat(path.c_str(), &entry_stat) < 0){
+			continue;
+		}
+		if(S_ISDIR(entry_stat.st_mode)){
+			this->list(path, relative_path);
+		}else if(S_ISREG(entry_stat.st_mode)){
+			this->files.push_back(SyncFile(relative_path, static_cast<uint64_t>(entry_stat.st_size),
+				static_cast<uint32_t>(entry_stat.st_mode & 07777)));
+		}
+	}
+	closedir(dir);
+}
+
+/**
+ * @brief Sends local_directory's regular files to be synced into remote_directory on the other side.
+ *
+ * @return true on error.
+ */
+bool ComdDirectorySync::sync(const std::string& local_directory, const std::string& remote_directory){
+	this->sending = true;
+	this->intact = true;
+	this->root = local_directory;
+	this->list(local_directory, std::string());
+	PRINT("Syncing " << this->files.size() << " files.")
+
+	this->queue(std::string(1, static_cast<char>(COMD_SYNC_ROOT)) + remote_directory, false);
+	std::string packet(1, static_cast<char>(COMD_SYNC_LIST));
+	for(uint32_t i = 0; i < this->files.size(); ++i){
+		const SyncFile& f = this->files[i];
+		if(packet.length() + 18 + f.path.length() > COMD_SYNC_MESSAGE){
+			this->queue(packet, false);
+			packet = std::string(1, static_cast<char>(COMD_SYNC_LIST));
+		}
+		put_uint(&packet, i, 4);
+		put_uint(&packet, f.size, 8);
+		put_uint(&packet, f.mode, 4);
+		put_uint(&packet, f.path.length(), 2);
+		packet += f.path;
+	}
+	if(packet.length() > 1){
+		this->queue(packet, false);
+	}
+	this->queue(message(COMD_SYNC_LIST_END, static_cast<uint32_t>(this->files.size())), false);
+
+	if(this->files.empty()){
+		this->finished = true;
+	}
+	return false;
+}
+
+/**
+ * @brief A worker on the receiving side: the signature of what's already at a file's destination.
+ */
+void ComdDirectorySync::sign(uint32_t index){
+	const SyncFile& f = this->files[index];
+	uint32_t size = block_size(f.size);
+	std::string blocks;
+	CryptoPP::SHA256 hash;
+	std::string whole(CryptoPP::SHA256::DIGESTSIZE, 0);
+	std::vector<char> buffer(size);
+	uint32_t a, b;
+	ssize_t len;
+
+	int fd = open((this->root + '/' + f.path).c_str(), O_RDONLY);
+	if(fd >= 0){
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		while(true){
+			size_t got = 0;
+			while(got < size && (len = read(fd, &buffer[got], size - got)) > 0){
+				got += static_cast<size_t>(len);
+			}
+			if(got == 0){
+				break;
+			}
+			hash.Update(reinterpret_cast<const byte*>(&buffer[0]), got);
+			// Only whole blocks are offered; a short tail is cheaper to just send.
+			if(got == size){
+				put_uint(&blocks, rolling_checksum(reinterpret_cast<const unsigned char*>(&buffer[0]), got, &a, &b), 4);
+				blocks += strong_checksum(&buffer[0], got);
+			}
+			if(got < size){
+				break;
+			}
+		}
+		whole = digest(&hash);
+		close(fd);
+	}
+
+	size_t entry = 4 + COMD_SYNC_STRONG;
+	std::string packet = message(COMD_SYNC_SIGNATURE, index);
+	put_uint(&packet, size, 4);
+	put_uint(&packet, blocks.length() / entry, 4);
+	packet += whole;
+	this->queue(packet, true);
+
+	size_t per_message = (COMD_SYNC_MESSAGE / entry) * entry;
+	for(size_t offset = 0; offset < blocks.length(); offset += per_message){
+		this->queue(message(COMD_SYNC_BLOCKS, index) + blocks.substr(offset, per_message), true);
+	}
+}
+
+/**
+ * @brief A worker on the sending side: a file as references to the receiver's blocks and literal data.
+ */
+void ComdDirectorySync::delta(uint32_t index){
+	const SyncFile& f = this->files[index];
+	const size_t size = f.block_size;
+	const std::string failed = message(COMD_SYNC_FILE_END, index) + std::string(CryptoPP::SHA256::DIGESTSIZE, 0);
+	struct stat file_stat;
+
+	int fd = open((this->root + '/' + f.path).c_str(), O_RDONLY);
+	if(fd < 0 || fstat(fd, &file_stat) < 0){
+		perror("directory sync open");
+		this->queue(failed, true);
+		if(fd >= 0){
+			close(fd);
+		}
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	const size_t length = static_cast<size_t>(file_stat.st_size);
+
+	// Read [offset, offset + count) onto the end of buffer; false if the file came up short.
+	auto read_at = [&](std::string* buffer, size_t offset, size_t count){
+		size_t used = buffer->length();
+		buffer->resize(used + count);
+		size_t got = 0;
+		ssize_t len;
+		while(got < count && (len = pread(fd, &(*buffer)[used + got], count - got, static_cast<off_t>(offset + got))) > 0){
+			got += static_cast<size_t>(len);
+		}
+		buffer->resize(used + got);
+		return got == count;
+	};
+
+	CryptoPP::SHA256 hash;
+	std::string buffer;
+	for(size_t offset = 0; offset < length; offset += COMD_SYNC_READ){
+		buffer.clear();
+		if(!read_at(&buffer, offset, std::min(length - offset, static_cast<size_t>(COMD_SYNC_READ)))){
+			ERROR("directory sync: " << f.path << " changed while it was being read")
+			close(fd);
+			this->queue(failed, true);
+			return;
+		}
+		hash.Update(reinterpret_cast<const byte*>(buffer.data()), buffer.length());
+	}
+	std::string whole = digest(&hash);
+
+	if(whole == f.receiver_digest){
+		close(fd);
+		this->files_unchanged++;
+		this->queue(message(COMD_SYNC_UNCHANGED, index), true);
+		return;
+	}
+
+	std::unordered_map<uint32_t /* rolling */, std::vector<uint32_t> /* blocks */> table;
+	size_t entry = 4 + COMD_SYNC_STRONG;
+	for(uint32_t i = 0; i < f.block_count; ++i){
+		table[static_cast<uint32_t>(get_uint(f.blocks.data() + i * entry, 4))].push_back(i);
+	}
+
+	// The file is read again as it's sent; what's hashed is what went out, in case it changed in between.
+	CryptoPP::SHA256 sent;
+	size_t base = 0; // file offset of buffer[0]
+	buffer.clear();
+	std::string packet = message(COMD_SYNC_DELTA, index);
+	uint32_t run_first = 0;
+	uint32_t run_count = 0;
+	auto flush = [&](){
+		if(packet.length() > 5){
+			this->queue(packet, true);
+			packet = message(COMD_SYNC_DELTA, index);
+		}
+	};
+	auto flush_run = [&](){
+		if(run_count > 0){
+			if(packet.length() + 9 > COMD_SYNC_MESSAGE){
+				flush();
+			}
+			packet.push_back('B');
+			put_uint(&packet, run_first, 4);
+			put_uint(&packet, run_count, 4);
+			this->bytes_matched += run_count * size;
+			run_count = 0;
+		}
+	};
+	auto literal = [&](size_t from, size_t to){
+		flush_run();
+		while(from < to){
+			if(packet.length() + 5 + 64 > COMD_SYNC_MESSAGE){
+				flush();
+			}
+			size_t piece = std::min(to - from, COMD_SYNC_MESSAGE - packet.length() - 5);
+			packet.push_back('L');
+			put_uint(&packet, piece, 4);
+			packet.append(buffer.data() + (from - base), piece);
+			this->bytes_literal += piece;
+			from += piece;
+		}
+	};
+
+	size_t literal_start = 0;
+	size_t i = 0;
+	size_t hashed = 0;
+	// Have the buffer reach the file offset end, dropping what's before literal_start.
+	auto fill = [&](size_t end){
+		if(end <= base + buffer.length()){
+			return true;
+		}
+		sent.Update(reinterpret_cast<const byte*>(buffer.data() + (hashed - base)), base + buffer.length() - hashed);
+		hashed = base + buffer.length();
+		buffer.erase(0, literal_start - base);
+		base = literal_start;
+		size_t want = std::max(end, std::min(length, hashed + COMD_SYNC_READ)) - hashed;
+		return read_at(&buffer, hashed, want);
+	};
+	auto at = [&](size_t offset){
+		return static_cast<unsigned char>(buffer[offset - base]);
+	};
+
+	bool intact = true;
+	uint32_t a = 0, b = 0;
+	bool window = false;
+	while(f.block_count > 0 && i + size <= length){
+		// A long stretch without matches goes out as it's found, so the buffer stays small.
+		if(i - literal_start >= COMD_SYNC_READ){
+			literal(literal_start, i);
+			literal_start = i;
+		}
+		if(!fill(std::min(length, i + size + 1))){
+			intact = false;
+			break;
+		}
+		if(!window){
+			rolling_checksum(reinterpret_cast<const unsigned char*>(buffer.data() + (i - base)), size, &a, &b);
+			window = true;
+		}
+		auto found = table.find(a | b << 16);
+		if(found != table.end()){
+			std::string strong = strong_checksum(buffer.data() + (i - base), size);
+			bool matched = false;
+			for(uint32_t block : found->second){
+				if(f.blocks.compare(block * entry + 4, COMD_SYNC_STRONG, strong) == 0){
+					literal(literal_start, i);
+					if(run_count > 0 && run_first + run_count == block){
+						run_count++;
+					}else{
+						flush_run();
+						run_first = block;
+						run_count = 1;
+					}
+					matched = true;
+					break;
+				}
+			}
+			if(matched){
+				i += size;
+				literal_start = i;
+				window = false;
+				continue;
+			}
+		}
+		if(i + size < length){
+			a = (a - at(i) + at(i + size)) & 0xffff;
+			b = (b - static_cast<uint32_t>(size) * at(i) + a) & 0xffff;
+		}
+		i++;
+	}
+	// The tail goes out in pieces too, for the same reason.
+	while(intact && literal_start < length){
+		size_t to = std::min(length, literal_start + COMD_SYNC_READ);
+		if(!fill(to)){
+			intact = false;
+			break;
+		}
+		literal(literal_start, to);
+		literal_start = to;
+	}
+	close(fd);
+	flush_run();
+	flush();
+
+	if(!intact){
+		// It was truncated under us; the receiver throws away what it rebuilt.
+		ERROR("directory sync: " << f.path << " changed while it was being read")
+		this->queue(failed, true);
+		return;
+	}
+	sent.Update(reinterpret_cast<const byte*>(buffer.data() + (hashed - base)), base + buffer.length() - hashed);
+	this->queue(message(COMD_SYNC_FILE_END, index) + digest(&sent), true);
+}
+
+bool ComdDirectorySync::receive_list(const char* data, size_t data_length){
+	size_t offset = 0;
+	while(offset < data_length){
+		if(data_length - offset < 18){
+			return this->error("bad file list");
+		}
+		uint32_t index = static_cast<uint32_t>(get_uint(data + offset, 4));
+		uint64_t size = get_uint(data + offset + 4, 8);
+		uint32_t mode = static_cast<uint32_t>(get_uint(data + offset + 12, 4));
+		size_t path_length = static_cast<size_t>(get_uint(data + offset + 16, 2));
+		offset += 18;
+		if(index != this->files.size() || data_length - offset < path_length){
+			return this->error("bad file list");
+		}
+		std::string path(data + offset, path_length);
+		offset += path_length;
+		if(!safe_path(path)){
+			return this->error("unsafe path " + path);
+		}
+		size_t slash = path.rfind('/');
+		if(slash != std::string::npos && make_directories(this->root + '/' + path.substr(0, slash))){
+			return this->error("can't make the directory for " + path);
+		}
+		this->files.push_back(SyncFile(path, size, mode & 07777));
+	}
+	return false;
+}
+
+/**
+ * @brief Starts rebuilding a file beside the old one, which is only replaced once the new one checks out.
+ */
+bool ComdDirectorySync::open_new(SyncFile* f){
+	if(f->new_fd >= 0){
+		return false;
+	}
+	std::string path = this->root + '/' + f->path;
+	f->old_fd = open(path.c_str(), O_RDONLY);
+	if((f->new_fd = open((path + ".jpsync").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0){
+		perror("directory sync open");
+		return this->error("can't write " + f->path);
+	}
+	return false;
+}
+
+bool ComdDirectorySync::receive_delta(uint32_t index, const char* data, size_t data_length){
+	SyncFile* f = this->file(index);
+	if(f == 0 || this->open_new(f)){
+		return f == 0 ? this->error("bad file index") : true;
+	}
+	uint32_t size = block_size(f->size);
+	std::vector<char> block(size);
+	size_t offset = 0;
+	while(offset < data_length){
+		if(data[offset] == 'B' && data_length - offset >= 9){
+			uint64_t first = get_uint(data + offset + 1, 4);
+			uint64_t count = get_uint(data + offset + 5, 4);
+			offset += 9;
+			for(uint64_t i = first; i < first + count; ++i){
+				if(f->old_fd < 0 || pread(f->old_fd, &block[0], size, static_cast<off_t>(i * size)) != static_cast<ssize_t>(size)){
+					return this->error("missing block of " + f->path);
+				}
+				if(write_all(f->new_fd, &block[0], size)){
+					return this->error("can't write " + f->path);
+				}
+				f->hash.Update(reinterpret_cast<const byte*>(&block[0]), size);
+			}
+		}else if(data[offset] == 'L' && data_length - offset >= 5){
+			size_t literal_length = static_cast<size_t>(get_uint(data + offset + 1, 4));
+			offset += 5;
+			if(data_length - offset < literal_length){
+				return this->error("bad delta");
+			}
+			if(write_all(f->new_fd, data + offset, literal_length)){
+				return this->error("can't write " + f->path);
+			}
+			f->hash.Update(reinterpret_cast<const byte*>(data + offset), literal_length);
+			offset += literal_length;
+		}else{
+			return this->error("bad delta");
+		}
+	}
+	return false;
+}
+
+bool ComdDirectorySync::receive_end(uint32_t index, const std::string& sender_digest){
+	SyncFile* f = this->file(index);
+	if(f == 0 || this->open_new(f)){
+		return f == 0 ? this->error("bad file index") : true;
+	}
+	std::string path = this->root + '/' + f->path;
+	bool ok = digest(&f->hash) == sender_digest &&
+		fchmod(f->new_fd, static_cast<mode_t>(f->mode)) == 0 &&
+		fsync(f->new_fd) == 0;
+	close(f->new_fd);
+	f->new_fd = -1;
+	if(f->old_fd >= 0){
+		close(f->old_fd);
+		f->old_fd = -1;
+	}
+	if(ok){
+		ok = rename((path + ".jpsync").c_str(), path.c_str()) == 0;
+	}else{
+		ERROR("directory sync: " << f->path << " didn't rebuild intact")
+		unlink((path + ".jpsync").c_str());
+	}
+
+	std::string packet = message(COMD_SYNC_FILE_OK, index);
+	packet.push_back(ok ? 1 : 0);
+	this->queue(packet, false);
+	return false;
+}
+
+bool ComdDirectorySync::receive_signature(uint32_t index, const char* data, size_t data_length){
+	SyncFile* f = this->file(index);
+	if(f == 0 || data_length != 8 + CryptoPP::SHA256::DIGESTSIZE){
+		return this->error("bad signature");
+	}
+	f->block_size = static_cast<uint32_t>(get_uint(data, 4));
+	f->block_count = static_cast<uint32_t>(get_uint(data + 4, 4));
+	f->receiver_digest = std::string(data + 8, CryptoPP::SHA256::DIGESTSIZE);
+	if(f->block_size == 0 || f->block_size != block_size(f->size)){
+		return this->error("bad signature");
+	}
+	if(f->block_count == 0){
+		this->submit(std::bind(&ComdDirectorySync::delta, this, index));
+	}
+	return false;
+}
+
+bool ComdDirectorySync::receive_blocks(uint32_t index, const char* data, size_t data_length){
+	SyncFile* f = this->file(index);
+	size_t expected = f == 0 ? 0 : static_cast<size_t>(f->block_count) * (4 + COMD_SYNC_STRONG);
+	if(f == 0 || f->blocks.length() + data_length > expected){
+		return this->error("bad signature");
+	}
+	f->blocks.append(data, data_length);
+	if(f->blocks.length() == expected){
+		this->submit(std::bind(&ComdDirectorySync::delta, this, index));
+	}
+	return false;
+}
+
+bool ComdDirectorySync::receive_ok(uint32_t index, bool ok){
+	SyncFile* f = this->file(index);
+	if(f == 0){
+		return this->error("bad file index");
+	}
+	if(!ok){
+		ERROR("directory sync: " << f->path << " failed")
+		this->intact = false;
+	}
+	if(++this->files_done == this->files.size()){
+		this->finished = true;
+	}
+	return false;
+}
+
+/**
+ * @return true on error, or if the other side gave up; the connection should be closed.
+ */
+bool ComdDirectorySync::on_message(const char* data, size_t data_length){
+	if(data_length == 0){
+		return this->error("empty message");
+	}
+	const char* fields = data + 1;
+	size_t fields_length = data_length - 1;
+	uint32_t index = fields_length >= 4 ? static_cast<uint32_t>(get_uint(fields, 4)) : 0;
+
+	switch(data[0]){
+	case COMD_SYNC_ROOT:
+		if(this->sending || !this->root.empty()){
+			break;
+		}
+		this->root = std::string(fields, fields_length);
+		if(this->root.empty() || make_directories(this->root)){
+			return this->error("can't make " + this->root);
+		}
+		return false;
+	case COMD_SYNC_LIST:
+		if(this->sending || this->root.empty() || this->list_ended){
+			break;
+		}
+		return this->receive_list(fields, fields_length);
+	case COMD_SYNC_LIST_END:
+		if(this->sending || this->root.empty() || this->list_ended || fields_length != 4 || index != this->files.size()){
+			break;
+		}
+		this->list_ended = true;
+		for(uint32_t i = 0; i < this->files.size(); ++i){
+			this->submit(std::bind(&ComdDirectorySync::sign, this, i));
+		}
+		return false;
+	case COMD_SYNC_DELTA:
+		if(this->sending || !this->list_ended || fields_length < 4){
+			break;
+		}
+		return this->receive_delta(index, fields + 4, fields_length - 4);
+	case COMD_SYNC_UNCHANGED:
+		if(this->sending || !this->list_ended || fields_length != 4 || this->file(index) == 0){
+			break;
+		}
+		chmod((this->root + '/' + this->files[index].path).c_str(), static_cast<mode_t>(this->files[index].mode));
+		this->queue(message(COMD_SYNC_FILE_OK, index) + std::string(1, 1), false);
+		return false;
+	case COMD_SYNC_FILE_END:
+		if(this->sending || !this->list_ended || fields_length != 4 + CryptoPP::SHA256::DIGESTSIZE){
+			break;
+		}
+		return this->receive_end(index, std::string(fields + 4, CryptoPP::SHA256::DIGESTSIZE));
+	case COMD_SYNC_SIGNATURE:
+		if(!this->sending || fields_length < 4){
+			break;
+		}
+		return this->receive_signature(index, fields + 4, fields_length - 4);
+	case COMD_SYNC_BLOCKS:
+		if(!this->sending || fields_length < 4){
+			break;
+		}
+		return this->receive_blocks(index, fields + 4, fields_length - 4);
+	case COMD_SYNC_FILE_OK:
+		if(!this->sending || fields_length != 5){
+			break;
+		}
+		return this->receive_ok(index, fields[4] == 1);
+	case COMD_SYNC_ERROR:
+		ERROR("directory sync: the other side says " << std::string(fields, fields_length))
+		this->finished = true;
+		this->intact = false;
+		return true;
+	}
+	return this->error("unexpected message");
+}
+
+/**
+ * @brief Sends whatever the workers have queued. Never waits for them.
+ *
+ * @return true on error.
+ */
+bool ComdDirectorySync::pump(){
+	std::string packet;
+	while(true){
+		{
+			std::lock_guard<std::mutex> lock(this->outbound_mutex);
+			if(this->outbound.empty()){
+				return this->failed;
+			}
+			packet.swap(this->outbound.front());
+			this->outbound.pop_front();
+			this->outbound_bytes -= packet.length();
+		}
+		this->outbound_condition.notify_all();
+		if(this->send(packet.c_str(), packet.length())){
+			return true;
+		}
+	}
+}
+
+bool ComdDirectorySync::is_finished(){
+	return this->finished;
+}
+
+bool ComdDirectorySync::is_intact(){
+	return this->intact;
+}
+
+ComdSyncStats ComdDirectorySync::stats(){
+	ComdSyncStats result;
+	result.files = this->files.size();
+	result.files_unchanged = this->files_unchanged;
+	result.bytes_matched = this->bytes_matched;
+	result.bytes_literal = this->bytes_literal;
+	return result;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "cryptopp/sha.h"
+
+// Signatures and deltas are split into messages of about this size, to fit in a symmetric frame.
+#define COMD_SYNC_MESSAGE 6144
+// Bytes of the strong checksum kept per block (base64 characters of Util::sha256_hash).
+#define COMD_SYNC_STRONG 16
+// Queued outgoing bytes past which workers wait for the connection to catch up.
+#define COMD_SYNC_QUEUED 8388608
+// The sender reads files this much at a time.
+#define COMD_SYNC_READ 1048576
+
+/**
+ * @brief The messages of the directory sync routine. Each starts with one of these, then big endian fields.
+ */
+enum ComdSyncMessage{
+	COMD_SYNC_ROOT = 'P', // destination directory
+	COMD_SYNC_LIST = 'L', // (u32 index, u64 size, u32 mode, u16 path length, path)...
+	COMD_SYNC_LIST_END = 'l', // u32 file count
+	COMD_SYNC_SIGNATURE = 'G', // u32 index, u32 block size, u32 block count, SHA-256 of the receiver's file
+	COMD_SYNC_BLOCKS = 'g', // u32 index, (u32 rolling checksum, strong checksum)...
+	COMD_SYNC_DELTA = 'D', // u32 index, ('B' u32 first block, u32 count | 'L' u32 length, data)...
+	COMD_SYNC_UNCHANGED = 'U', // u32 index
+	COMD_SYNC_FILE_END = 'E', // u32 index, SHA-256 of the sender's file
+	COMD_SYNC_FILE_OK = 'K', // u32 index, u8 1 if the file was rebuilt intact
+	COMD_SYNC_ERROR = 'X' // message
+};
+
+/// Totals for a directory sync, as seen by the sender.
+struct ComdSyncStats{
+	unsigned long files;
+	unsigned long files_unchanged;
+	unsigned long bytes_matched;
+	unsigned long bytes_literal;
+};
+
+/**
+ * @brief One side of an rsync style directory sync between com and comd.
+ *
+ * The sender lists its files. For each one the receiver sends a signature of what it has:
+ * a rolling checksum and a strong checksum per block. The sender slides a window over its copy,
+ * and wherever the rolling checksum and then the strong one match a block, sends a reference
+ * to it instead of the data. The receiver rebuilds the file beside the old one from its own blocks
+ * and the literal data, checks it against the sender's SHA-256, and renames it into place.
+ * Files with the same SHA-256 on both sides aren't sent at all.
+ *
+ * Signatures and deltas are computed by a pool of workers, one file each, and queued;
+ * call pump whenever the connection may be writable or on_ready is called, and on_message with every message received.
+ * Files only on the receiving side are left alone.
+ */
+class ComdDirectorySync{
+private:
+	struct SyncFile{
+		std::string path;
+		uint64_t size;
+		uint32_t mode;
+
+		// Sending: the receiver's signature, as it arrives.
+		uint32_t block_size;
+		uint32_t block_count;
+		std::string receiver_digest;
+		std::string blocks;
+
+		// Receiving: the file being rebuilt.
+		int old_fd;
+		int new_fd;
+		CryptoPP::SHA256 hash;
+
+		SyncFile(const std::string& new_path, uint64_t new_size, uint32_t new_mode)
+		:path(new_path), size(new_size), mode(new_mode), block_size(0), block_count(0), old_fd(-1), new_fd(-1){}
+	};
+
+	bool sending;
+	std::string root;
+	std::vector<SyncFile> files;
+	size_t files_done;
+	bool list_ended;
+	bool finished;
+	bool intact;
+
+	std::mutex outbound_mutex;
+	std::condition_variable outbound_condition;
+	std::deque<std::string> outbound;
+	size_t outbound_bytes;
+	bool failed;
+
+	std::mutex tasks_mutex;
+	std::condition_variable tasks_condition;
+	std::deque<std::function<void()>> tasks;
+	std::vector<std::thread> workers;
+	bool stopping;
+
+	std::atomic<unsigned long> files_unchanged;
+	std::atomic<unsigned long> bytes_matched;
+	std::atomic<unsigned long> bytes_literal;
+
+	void work();
+	void submit(std::function<void()> task);
+	void queue(std::string message, bool wait);
+	bool error(const std::string& message);
+
+	void list(const std::string& directory, const std::string& relative);
+	void sign(uint32_t index);
+	void delta(uint32_t index);
+
+	bool open_new(SyncFile* f);
+	bool receive_list(const char* data, size_t data_length);
+	bool receive_delta(uint32_t index, const char* data, size_t data_length);
+	bool receive_end(uint32_t index, const std::string& digest);
+	bool receive_signature(uint32_t index, const char* data, size_t data_length);
+	bool receive_blocks(uint32_t index, const char* data, size_t data_length);
+	bool receive_ok(uint32_t index, bool ok);
+	SyncFile* file(uint32_t index);
+public:
+	std::function<bool(const char*, size_t)> send;
+	/// Called from the workers when pump has something new to send; optional for callers that pump anyway.
+	std::function<void()> on_ready;
+
+	ComdDirectorySync(std::function<bool(const char*, size_t)> new_send, unsigned int threads = std::thread::hardware_concurrency());
+	~ComdDirectorySync();
+
+	bool sync(const std::string& local_directory, const std::string& remote_directory);
+
+	bool on_message(const char* data, size_t data_length);
+	bool pump();
+
+	bool is_finished();
+	bool is_intact();
+	ComdSyncStats stats();
+};
@@ -0,0 +1,470 @@
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "util.hpp"
+#include "comd-transfer.hpp"
+
+static void put_uint64(std::string* out, uint64_t value){
+	for(int shift = 56; shift >= 0; shift -= 8){
+		out->push_back(static_cast<char>((value >> shift) & 0xff));
+	}
+}
+
+static void put_uint32(std::string* out, uint32_t value){
+	for(int shift = 24; shift >= 0; shift -= 8){
+		out->push_back(static_cast<char>((value >> shift) & 0xff));
+	}
+}
+
+static uint64_t get_uint(const char* in, int bytes){
+	uint64_t value = 0;
+	for(int i = 0; i < bytes; ++i){
+		value = value << 8 | static_cast<unsigned char>(in[i]);
+	}
+	return value;
+}
+
+static std::string digest(CryptoPP::SHA256* hash){
+	byte result[CryptoPP::SHA256::DIGESTSIZE];
+	hash->Final(result);
+	return std::string(reinterpret_cast<const char*>(result), CryptoPP::SHA256::DIGESTSIZE);
+}
+
+ComdFileTransfer::ComdFileTransfer(std::function<bool(const char*, size_t)> new_send)
+:source_fd(-1),
+source_size(0),
+next_offset(0),
+acknowledged(0),
+started(false),
+done_sent(false),
+reader_done(false),
+reader_failed(false),
+stopping(false),
+destination_fd(-1),
+destination_size(0),
+written(0),
+finished(false),
+intact(false),
+send(new_send){}
+
+ComdFileTransfer::~ComdFileTransfer(){
+	{
+		std::lock_guard<std::mutex> lock(this->chunks_mutex);
+		this->stopping = true;
+	}
+	this->chunks_condition.notify_all();
+	if(this->reader.joinable()){
+		this->reader.join();
+	}
+	if(this->source_fd >= 0){
+		close(this->source_fd);
+	}
+	if(this->destination_fd >= 0){
+		close(this->destination_fd);
+	}
+}
+
+/**
+ * @brief Tells the other side what went wrong; the transfer is over.
+ *
+ * @return true, so callers can return it as the error it is.
+ */
+bool ComdFileTransfer::error(const std::string& message){
+	ERROR("file transfer: " << message)
+	std::string packet(1, static_cast<char>(COMD_ERROR));
+	packet += message;
+	this->send(packet.c_str(), packet.length());
+	this->finished = true;
+	this->intact = false;
+	return true;
+}
+
+/**
+ * @return true on error.
+ */
+bool ComdFileTransfer::hash_prefix(int fd, uint64_t length, CryptoPP::SHA256* hash){
+	char buffer[65536];
+	uint64_t offset = 0;
+	ssize_t len;
+	while(offset < length){
+		size_t wanted = static_cast<size_t>(std::min<uint64_t>(sizeof(buffer), length - offset));
+		if((len = pread(fd, buffer, wanted, static_cast<off_t>(offset))) <= 0){
+			return true;
+		}
+		hash->Update(reinterpret_cast<const byte*>(buffer), static_cast<size_t>(len));
+		offset += static_cast<uint64_t>(len);
+	}
+	return false;
+}
+
+void ComdFileTransfer::ready(){
+	if(this->on_ready != nullptr){
+		this->on_ready();
+	}
+}
+
+/**
+ * @brief The reader thread: prepares chunk messages from offset on, staying at most COMD_READ_AHEAD ahead.
+ */
+void ComdFileTransfer::read_chunks(uint64_t offset){
+	char buffer[COMD_CHUNK_SIZE];
+	ssize_t len;
+
+	posix_fadvise(this->source_fd, static_cast<off_t>(offset), 0, POSIX_FADV_SEQUENTIAL);
+	while(offset < this->source_size){
+		{
+			std::unique_lock<std::mutex> lock(this->chunks_mutex);
+			this->chunks_condition.wait(lock, [&]{
+				return this->stopping || this->chunks.size() < COMD_READ_AHEAD;
+			});
+			if(this->stopping){
+				return;
+			}
+		}
+		size_t wanted = static_cast<size_t>(std::min<uint64_t>(COMD_CHUNK_SIZE, this->source_size - offset));
+		if((len = pread(this->source_fd, buffer, wanted, static_cast<off_t>(offset))) <= 0){
+			if(len < 0 && errno == EINTR){
+				continue;
+			}
+			perror("file transfer pread");
+			{
+				std::lock_guard<std::mutex> lock(this->chunks_mutex);
+				this->reader_failed = true;
+			}
+			this->ready();
+			return;
+		}
+		this->source_hash.Update(reinterpret_cast<const byte*>(buffer), static_cast<size_t>(len));
+
+		std::string packet(1, static_cast<char>(COMD_CHUNK));
+		put_uint64(&packet, offset);
+		put_uint32(&packet, static_cast<uint32_t>(crc32(crc32(0, Z_NULL, 0), reinterpret_cast<const Bytef*>(buffer), static_cast<uInt>(len))));
+		packet.append(buffer, static_cast<size_t>(len));
+		offset += static_cast<uint64_t>(len);
+
+		bool was_empty;
+		{
+			std::lock_guard<std::mutex> lock(this->chunks_mutex);
+			was_empty = this->chunks.empty();
+			this->chunks.push_back(std::move(packet));
+		}
+		// pump only stops early on an empty queue (or a full window, which the next ACK reopens).
+		if(was_empty){
+			this->ready();
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(this->chunks_mutex);
+		this->source_digest = digest(&this->source_hash);
+		this->reader_done = true;
+	}
+	this->ready();
+}
+
+/**
+ * @brief Starts sending local_path, to be written at remote_path on the other side.
+ *
+ * @return true on error.
+ */
+bool ComdFileTransfer::send_file(const std::string& local_path, const std::string& remote_path){
+	if((this->source_fd = open(local_path.c_str(), O_RDONLY)) < 0){
+		perror("file transfer open");
+		return true;
+	}
+	struct stat source_stat;
+	if(fstat(this->source_fd, &source_stat) < 0 || !S_ISREG(source_stat.st_mode)){
+		ERROR("file transfer: " << local_path << " isn't a regular file")
+		return true;
+	}
+	this->source_size = static_cast<uint64_t>(source_stat.st_size);
+
+	std::string packet(1, static_cast<char>(COMD_OFFER));
+	put_uint64(&packet, this->source_size);
+	packet += remote_path;
+	return this->send(packet.c_str(), packet.length());
+}
+
+/**
+ * @brief Asks the other side for remote_path, to be written to local_path.
+ *
+ * @return true on error.
+ */
+bool ComdFileTransfer::get_file(const std::string& remote_path, const std::string& local_path){
+	this->destination_path = local_path;
+	std::string packet(1, static_cast<char>(COMD_GET));
+	packet += remote_path;
+	return this->send(packet.c_str(), packet.length());
+}
+
+/**
+ * @brief Answers a COMD_GET by offering the file.
+ */
+bool ComdFileTransfer::offer(const std::string& path){
+	if(this->send_file(path, path)){
+		return this->error("can't read " + path);
+	}
+	return false;
+}
+
+/**
+ * @brief Opens the destination without truncating it, and says how much of it can be kept.
+ *
+ * Only whole chunks are kept; the last one of an interrupted transfer may be torn.
+ */
+bool ComdFileTransfer::receive(uint64_t size, const std::string& path){
+	if(this->destination_path.empty()){
+		this->destination_path = path;
+	}
+	if((this->destination_fd = open(this->destination_path.c_str(), O_RDWR | O_CREAT, 0644)) < 0){
+		perror("file transfer open destination");
+		return this->error("can't write " + this->destination_path);
+	}
+	struct stat destination_stat;
+	if(fstat(this->destination_fd, &destination_stat) < 0){
+		return this->error("can't stat " + this->destination_path);
+	}
+	this->destination_size = size;
+
+	uint64_t existing = std::min(static_cast<uint64_t>(destination_stat.st_size), size);
+	existing -= existing % COMD_CHUNK_SIZE;
+	if(this->hash_prefix(this->destination_fd, existing, &this->destination_hash)){
+		return this->error("can't read " + this->destination_path);
+	}
+	CryptoPP::SHA256 prefix(this->destination_hash);
+	this->written = existing;
+
+	std::string packet(1, static_cast<char>(COMD_RESUME));
+	put_uint64(&packet, existing);
+	packet += digest(&prefix);
+	return this->send(packet.c_str(), packet.length());
+}
+
+/**
+ * @brief Skips what the receiver already has if it matches this file, then starts reading.
+ */
+bool ComdFileTransfer::resume(uint64_t offset, const std::string& prefix_digest){
+	uint64_t start = 0;
+	if(offset > 0 && offset <= this->source_size){
+		CryptoPP::SHA256 hash;
+		if(this->hash_prefix(this->source_fd, offset, &hash)){
+			return this->error("can't read the file being sent");
+		}
+		CryptoPP::SHA256 prefix(hash);
+		if(digest(&prefix) == prefix_digest){
+			this->source_hash = hash;
+			start = offset;
+			PRINT("Resuming at " << start << " of " << this->source_size << " bytes.")
+		}
+	}
+
+	std::string packet(1, static_cast<char>(COMD_START));
+	put_uint64(&packet, start);
+	if(this->send(packet.c_str(), packet.length())){
+		return true;
+	}
+	this->next_offset = start;
+	this->acknowledged = start;
+	this->started = true;
+	this->reader = std::thread(&ComdFileTransfer::read_chunks, this, start);
+	return false;
+}
+
+/**
+ * @brief The sender's answer to COMD_RESUME: keep what's there, or start over.
+ */
+bool ComdFileTransfer::start(uint64_t offset){
+	if(offset != this->written){
+		if(offset != 0){
+			return this->error("bad start offset");
+		}
+		this->destination_hash = CryptoPP::SHA256();
+		this->written = 0;
+	}
+	// Reserve the rest up front so the file isn't fragmented; not every filesystem can.
+	if(this->destination_size > this->written &&
+	fallocate(this->destination_fd, 0, static_cast<off_t>(this->written),
+	static_cast<off_t>(this->destination_size - this->written)) < 0 && errno != EOPNOTSUPP){
+		perror("file transfer fallocate");
+		return this->error("no space for " + this->destination_path);
+	}
+	return false;
+}
+
+/**
+ * @brief Writes a chunk, which has to be the next one, and acknowledges every sixteenth.
+ */
+bool ComdFileTransfer::chunk(uint64_t offset, uint32_t crc, const char* data, size_t data_length){
+	if(offset != this->written || this->written + data_length > this->destination_size){
+		return this->error("chunk out of order");
+	}
+	if(static_cast<uint32_t>(crc32(crc32(0, Z_NULL, 0), reinterpret_cast<const Bytef*>(data), static_cast<uInt>(data_length))) != crc){
+		return this->error("chunk checksum mismatch at " + std::to_string(offset));
+	}
+
+	size_t done = 0;
+	ssize_t len;
+	while(done < data_length){
+		if((len = pwrite(this->destination_fd, data + done, data_length - done, static_cast<off_t>(offset + done))) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			perror("file transfer pwrite");
+			return this->error("can't write " + this->destination_path);
+		}
+		done += static_cast<size_t>(len);
+	}
+	this->destination_hash.Update(reinterpret_cast<const byte*>(data), data_length);
+	this->written += data_length;
+
+	if((this->written / COMD_CHUNK_SIZE) % 16 == 0 || this->written == this->destination_size){
+		std::string packet(1, static_cast<char>(COMD_ACK));
+		put_uint64(&packet, this->written);
+		return this->send(packet.c_str(), packet.length());
+	}
+	return false;
+}
+
+/**
+ * @brief Checks the whole file against the sender's hash and says whether it arrived intact.
+ */
+bool ComdFileTransfer::done(const std::string& source_file_digest){
+	if(this->written != this->destination_size){
+		return this->error("file ended early");
+	}
+	// A longer file from before may have been resumed into.
+	if(ftruncate(this->destination_fd, static_cast<off_t>(this->written)) < 0 || fsync(this->destination_fd) < 0){
+		perror("file transfer sync");
+		return this->error("can't sync " + this->destination_path);
+	}
+	this->intact = digest(&this->destination_hash) == source_file_digest;
+	this->finished = true;
+	if(!this->intact){
+		ERROR("file transfer: " << this->destination_path << " doesn't match the sender's hash")
+	}
+
+	std::string packet(1, static_cast<char>(COMD_FINISHED));
+	packet.push_back(this->intact ? 1 : 0);
+	return this->send(packet.c_str(), packet.length());
+}
+
+/**
+ * @return true on error, or if the other side gave up; the connection should be closed.
+ */
+bool ComdFileTransfer::on_message(const char* data, size_t data_length){
+	if(data_length == 0){
+		return this->error("empty message");
+	}
+	const char* fields = data + 1;
+	size_t fields_length = data_length - 1;
+
+	switch(data[0]){
+	case COMD_GET:
+		return this->offer(std::string(fields, fields_length));
+	case COMD_OFFER:
+		if(fields_length < 8){
+			break;
+		}
+		return this->receive(get_uint(fields, 8), std::string(fields + 8, fields_length - 8));
+	case COMD_RESUME:
+		if(fields_length != 8 + CryptoPP::SHA256::DIGESTSIZE || this->source_fd < 0 || this->started){
+			break;
+		}
+		return this->resume(get_uint(fields, 8), std::string(fields + 8, CryptoPP::SHA256::DIGESTSIZE));
+	case COMD_START:
+		if(fields_length != 8 || this->destination_fd < 0){
+			break;
+		}
+		return this->start(get_uint(fields, 8));
+	case COMD_CHUNK:
+		if(fields_length < 12 || this->destination_fd < 0){
+			break;
+		}
+		return this->chunk(get_uint(fields, 8), static_cast<uint32_t>(get_uint(fields + 8, 4)), fields + 12, fields_length - 12);
+	case COMD_ACK:
+		if(fields_length != 8){
+			break;
+		}
+		this->acknowledged = get_uint(fields, 8);
+		return false;
+	case COMD_DONE:
+		if(fields_length != CryptoPP::SHA256::DIGESTSIZE || this->destination_fd < 0){
+			break;
+		}
+		return this->done(std::string(fields, fields_length));
+	case COMD_FINISHED:
+		if(fields_length != 1){
+			break;
+		}
+		this->finished = true;
+		this->intact = fields[0] == 1;
+		return false;
+	case COMD_ERROR:
+		ERROR("file transfer: the other side says " << std::string(fields, fields_length))
+		this->finished = true;
+		this->intact = false;
+		return true;
+	}
+	return this->error("unexpected message");
+}
+
+/**
+ * @brief Sends read chunks while the window allows, then the whole file's hash. Never blocks on the reader.
+ *
+ * @return true on error.
+ */
+bool ComdFileTransfer::pump(){
+	if(!this->started || this->done_sent){
+		return false;
+	}
+
+	std::string packet;
+	while(this->next_offset - this->acknowledged < static_cast<uint64_t>(COMD_WINDOW) * COMD_CHUNK_SIZE){
+		{
+			std::lock_guard<std::mutex> lock(this->chunks_mutex);
+			if(this->reader_failed){
+				return this->error("can't read the file being sent");
+			}
+			if(this->chunks.empty()){
+				if(!this->reader_done){
+					return false;
+				}
+				packet = std::string(1, static_cast<char>(COMD_DONE)) + this->source_digest;
+			}else{
+				packet.swap(this->chunks.front());
+				this->chunks.pop_front();
+			}
+		}
+		this->chunks_condition.notify_one();
+
+		if(this->send(packet.c_str(), packet.length())){
+			return true;
+		}
+		if(packet[0] == COMD_DONE){
+			this->done_sent = true;
+			return false;
+		}
+		this->next_offset += packet.length() - 13;
+	}
+	return false;
+}
+
+bool ComdFileTransfer::is_finished(){
+	return this->finished;
+}
+
+bool ComdFileTransfer::is_intact(){
+	return this->intact;
+}
+
+/**
+ * @return Bytes acknowledged when sending, or written when receiving.
+ */
+uint64_t ComdFileTransfer::progress(){
+	return this->destination_fd >= 0 ? this->written : this->acknowledged.load();
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include "cryptopp/sha.h"
+
+// Chunks have to fit in one symmetric frame (see PACKET_LIMIT), so throughput comes from the window instead.
+#define COMD_CHUNK_SIZE 4096
+// Chunks sent but not yet acknowledged.
+#define COMD_WINDOW 256
+// Chunks read ahead of the window by the reader thread.
+#define COMD_READ_AHEAD 512
+
+/**
+ * @brief The messages of the file routines. Each starts with one of these, then big endian fields.
+ */
+enum ComdTransferMessage{
+	COMD_OFFER = 'O', // u64 size, destination path
+	COMD_GET = 'G', // source path
+	COMD_RESUME = 'R', // u64 offset, SHA-256 of the first offset bytes
+	COMD_START = 'S', // u64 offset
+	COMD_CHUNK = 'C', // u64 offset, u32 CRC-32, data
+	COMD_ACK = 'A', // u64 bytes written
+	COMD_DONE = 'D', // SHA-256 of the whole file
+	COMD_FINISHED = 'F', // u8 1 if the file arrived intact
+	COMD_ERROR = 'E' // message
+};
+
+/**
+ * @brief One side of a com/comd file transfer, sending or receiving.
+ *
+ * The sender offers the file; the receiver answers with how much of it a previous attempt left behind
+ * and a hash of that part. If the sender's file starts the same way, only the rest is sent.
+ * Chunks are read on a separate thread and sent as long as fewer than COMD_WINDOW are unacknowledged,
+ * so the link stays full however long the round trip is. Each chunk carries a CRC-32 of its data,
+ * and the whole file is checked against the sender's SHA-256 at the end.
+ *
+ * Call pump whenever the connection may be writable or on_ready is called, and on_message with every message received.
+ */
+class ComdFileTransfer{
+private:
+	// Sending.
+	int source_fd;
+	uint64_t source_size;
+	uint64_t next_offset;
+	std::atomic<uint64_t> acknowledged;
+	bool started;
+	bool done_sent;
+	std::thread reader;
+	std::mutex chunks_mutex;
+	std::condition_variable chunks_condition;
+	std::deque<std::string> chunks;
+	bool reader_done;
+	bool reader_failed;
+	bool stopping;
+	CryptoPP::SHA256 source_hash;
+	std::string source_digest;
+
+	// Receiving.
+	int destination_fd;
+	std::string destination_path;
+	uint64_t destination_size;
+	uint64_t written;
+	CryptoPP::SHA256 destination_hash;
+
+	bool finished;
+	bool intact;
+
+	bool error(const std::string& message);
+	void ready();
+	bool hash_prefix(int fd, uint64_t length, CryptoPP::SHA256* hash);
+	void read_chunks(uint64_t offset);
+
+	bool offer(const std::string& path);
+	bool receive(uint64_t size, const std::string& path);
+	bool resume(uint64_t offset, const std::string& digest);
+	bool start(uint64_t offset);
+	bool chunk(uint64_t offset, uint32_t crc, const char* data, size_t data_length);
+	bool done(const std::string& digest);
+public:
+	std::function<bool(const char*, size_t)> send;
+	/// Called from the reader thread when pump has something new to send; optional for callers that pump anyway.
+	std::function<void()> on_ready;
+
+	ComdFileTransfer(std::function<bool(const char*, size_t)> new_send);
+	~ComdFileTransfer();
+
+	bool send_file(const std::string& local_path, const std::string& remote_path);
+	bool get_file(const std::string& remote_path, const std::string& local_path);
+
+	bool on_message(const char* data, size_t data_length);
+	bool pump();
+
+	bool is_finished();
+	bool is_intact();
+	uint64_t progress();
+};
@@ -10,5 +10,6 @@ std::string BAD_ROUTINE = "You have requested an invalid routine!";
 std::map<enum ComdRoutine, std::string> ROUTINES = {
 	{ SHELL, "I would like to use the shell please." },
 	{ SEND_FILE, "I would like to send a file please." },
-	{ RECV_FILE, "I would like to receive a file please." }
+	{ RECV_FILE, "I would like to receive a file please." },
+	{ SYNC_DIRECTORY, "I would like to sync a directory please." }
 };
@@ -32,7 +32,8 @@ extern std::string IDENTITY, VERIFIED;
 enum ComdRoutine {
 	SHELL,
 	SEND_FILE,
-	RECV_FILE
+	RECV_FILE,
+	SYNC_DIRECTORY
 };
 
 enum ComdState {
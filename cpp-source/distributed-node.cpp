@@ -1,14 +1,159 @@
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
 #include "util.hpp"
+#include "msgpack.hpp"
+#include "json-patch.hpp"
 #include "distributed-node.hpp"
 
-DistributedNode::DistributedNode(std::string new_keyfile)
+// Primes compression between nodes with what their messages look like.
+static const std::string NODE_DICTIONARY = "{\"type\":\"ping\",\"to\":\"\",\"root\":\"\",\"port\":\"\",\"incarnation\":\"0\",\"accept\":\"msgpack\","
+	"\"gossip\":[[\"127.0.0.1:30000\",\"a\",\"0\"],[\"\",\"s\",\"\"],[\"\",\"d\",\"\"]]}"
+	"{\"type\":\"ack\",\"you\":\"\",\"root\":\"\"}{\"type\":\"ping-req\",\"target\":\"\"}{\"type\":\"nack\"}"
+	"{\"type\":\"tree\",\"branches\":[],\"leaves\":{}}{\"type\":\"keys\",\"keys\":{}}"
+	"{\"type\":\"exchange\",\"get\":[],\"put\":{\"\":{\"c\":\"\",\"o\":\"\",\"d\":\"1\",\"v\":{}}}}";
+
+static const char* MEMBER_STATES[] = {"a", "s", "d"};
+
+/**
+ * @brief JSON with object keys in order, so equal values have equal digests on every node.
+ */
+static std::string canonical(JsonObject* value){
+	std::string result;
+	switch(value->type){
+	case OBJECT:{
+		std::map<std::string, JsonObject*> sorted(value->objectValues.begin(), value->objectValues.end());
+		result.push_back('{');
+		for(auto it = sorted.begin(); it != sorted.end(); ++it){
+			if(it != sorted.begin()){
+				result.push_back(',');
+			}
+			result += JsonObject::escape(it->first) + ':' + canonical(it->second);
+		}
+		result.push_back('}');
+		break;
+	}
+	case ARRAY:
+		result.push_back('[');
+		for(size_t i = 0; i < value->arrayValues.size(); ++i){
+			if(i > 0){
+				result.push_back(',');
+			}
+			result += canonical(value->arrayValues[i]);
+		}
+		result.push_back(']');
+		break;
+	default:
+		result = value->stringify(false);
+		break;
+	}
+	return result;
+}
+
+/**
+ * @brief FNV-1a, so every node puts a key in the same leaf.
+ */
+static size_t leaf_of(const std::string& key){
+	uint32_t hash = 2166136261u;
+	for(char c : key){
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 16777619u;
+	}
+	return hash % DISTRIBUTED_MERKLE_LEAVES;
+}
+
+static std::string version_string(uint64_t clock, const std::string& origin){
+	return std::to_string(clock) + ':' + origin;
+}
+
+static uint64_t to_uint64(const std::string& value){
+	return std::strtoull(value.c_str(), 0, 10);
+}
+
+/**
+ * @brief Whether version (clock, origin) wins over (other_clock, other_origin): last writer wins, ties by origin.
+ */
+static bool wins(uint64_t clock, const std::string& origin, uint64_t other_clock, const std::string& other_origin){
+	return clock > other_clock || (clock == other_clock && origin > other_origin);
+}
+
+static std::string digest_of(const std::string* digests, size_t count){
+	std::string joined;
+	for(size_t i = 0; i < count; ++i){
+		joined += digests[i];
+	}
+	return joined.empty() ? std::string() : Util::sha256_hash(joined);
+}
+
+DistributedWorkers::DistributedWorkers(size_t count)
+:stopping(false){
+	for(size_t i = 0; i < std::max(count, static_cast<size_t>(1)); ++i){
+		this->threads.push_back(std::thread(&DistributedWorkers::work, this));
+	}
+}
+
+DistributedWorkers::~DistributedWorkers(){
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->condition.notify_all();
+	for(std::thread& thread : this->threads){
+		thread.join();
+	}
+}
+
+void DistributedWorkers::work(){
+	while(true){
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->condition.wait(lock, [&]{
+				return this->stopping || !this->tasks.empty();
+			});
+			if(this->stopping){
+				return;
+			}
+			task = std::move(this->tasks.front());
+			this->tasks.pop_front();
+		}
+		task();
+	}
+}
+
+void DistributedWorkers::submit(std::function<void()> task){
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->tasks.push_back(task);
+	}
+	this->condition.notify_one();
+}
+
+DistributedNode::DistributedNode(std::string new_keyfile, uint16_t first_port)
 :status(OBJECT),
 ddata(OBJECT),
-keyfile(new_keyfile){
-	uint16_t port = 30000;
+keyfile(new_keyfile),
+random(std::random_device()()),
+incarnation(0),
+self_transmissions(0),
+probe_next(0),
+next_connection(0),
+clock(0),
+probers(DISTRIBUTED_PROBERS){
+	for(size_t i = 0; i < DISTRIBUTED_MERKLE_LEAVES; ++i){
+		this->dirty_leaves[i] = false;
+	}
+	// Breaks ties between writes made at the same clock on different nodes.
+	this->id = std::to_string(this->random());
+	this->status.objectValues["hash"] = new JsonObject(std::string());
+	this->status.objectValues["version"] = new JsonObject("0");
+	this->update_tree();
+
+	uint16_t port = first_port;
 	while(true){
 		try{
-			this->server = new SymmetricEpollServer(this->keyfile, port, 10);	
+			this->server = new SymmetricEpollServer(this->keyfile, port, 64);
 		}catch(std::runtime_error& e){
 			if(errno != 98 && errno != 22){
 				PRINT("ERROR: " << errno << ':' << port)
@@ -20,70 +165,893 @@ keyfile(new_keyfile){
 		}
 		break;
 	}
-	
+	this->port = port;
+	this->server->set_compression(true, 128, NODE_DICTIONARY);
+
+	this->server->on_connect = [&](int fd){
+		std::lock_guard<std::mutex> lock(this->connections_mutex);
+		this->connections[fd] = ++this->next_connection;
+	};
+
 	this->server->on_read = [&](int fd, const char* data, ssize_t data_length)->ssize_t{
-		PRINT(data)
 		JsonObject request;
-		request.parse(data);
-		PRINT(request.stringify(true))
-		JsonObject response(OBJECT);
-		
-		if(request.HasObj("hash", STRING)){
-			PRINT("GIVEN HASH: " << request.GetStr("hash"))
-			PRINT("MY HASH: " << this->status.GetStr("hash"))
-			if(request.GetStr("hash") == this->status.GetStr("hash")){
-				response.objectValues["status"] = new JsonObject("Up to date.");
-			}else{
-				response.objectValues["status"] = new JsonObject("Out of date.");
+		if(MsgPack::is_packed(data, static_cast<size_t>(data_length))){
+			if(!MsgPack::unpack(data, static_cast<size_t>(data_length), &request)){
+				ERROR("DistributedNode bad msgpack")
+				return -1;
 			}
+			std::lock_guard<std::mutex> lock(this->connections_mutex);
+			this->packed_clients[fd] = true;
 		}else{
-			response.objectValues["hash"] = new JsonObject(this->status.GetStr("hash"));
-		}
-		
-		if(this->server->send(fd, response.stringify(false))){
-			ERROR("DistributedNode send")
-			return -1;
+			request.parse(data);
+			// Peers that understand msgpack ask for it, otherwise they keep getting JSON.
+			if(request.HasObj("accept", STRING) && request.GetStr("accept") == "msgpack"){
+				std::lock_guard<std::mutex> lock(this->connections_mutex);
+				this->packed_clients[fd] = true;
+			}
 		}
+		DEBUG(request.stringify(true))
 
+		JsonObject response(OBJECT);
+		this->handle(fd, &request, &response);
+		if(response.objectValues.empty()){
+			// Answered later with reply, e.g. by an indirect probe or a service's worker.
+			return data_length;
+		}
+		this->respond(fd, &response);
 		return data_length;
 	};
-	
+
+	this->server->on_disconnect = [&](int fd){
+		std::lock_guard<std::mutex> lock(this->connections_mutex);
+		this->connections.erase(fd);
+		this->packed_clients.erase(fd);
+	};
+
 	// Returns and runs on a single thread.
 	this->server->run(true, 1);
-	
+
 	start_thread = std::thread(&DistributedNode::start, this);
-	
+
 	PRINT("DISTRIBUTED NODE INITIALIZED.")
 }
 
+/**
+ * @brief Adds a member to start gossiping with. One is enough; the rest are learned from it.
+ */
 void DistributedNode::add_client(const char* ip_address, uint16_t port){
-	std::string client = std::string(ip_address) + ':' + std::to_string(port);
-	this->clients_mutex.lock();
-	this->clients[client] = new SymmetricTcpClient(ip_address, port, this->keyfile);
-	this->clients_mutex.unlock();
+	std::lock_guard<std::mutex> lock(this->members_mutex);
+	this->add_member(std::string(ip_address) + ':' + std::to_string(port), MEMBER_ALIVE, 0);
+}
+
+/**
+ * @brief What the other members call this node, or empty until one of them has said.
+ */
+std::string DistributedNode::get_self(){
+	std::lock_guard<std::mutex> lock(this->members_mutex);
+	return this->self;
+}
+
+/**
+ * @brief Every member not declared dead, this node aside, sorted.
+ */
+std::vector<std::string> DistributedNode::get_members(){
+	std::lock_guard<std::mutex> lock(this->members_mutex);
+	std::vector<std::string> alive;
+	for(auto it = this->members.begin(); it != this->members.end(); ++it){
+		if(it->second.state != MEMBER_DEAD){
+			alive.push_back(it->first);
+		}
+	}
+	return alive;
+}
+
+/**
+ * @brief Sends request to a member over the connection gossip uses, for types handled by its on_request.
+ *
+ * @return false if the member didn't answer within timeout milliseconds.
+ */
+bool DistributedNode::request(const std::string& member, JsonObject* request, JsonObject* response, int timeout){
+	return this->communicate(member, request, response, timeout);
 }
 
+/**
+ * @brief The serial of the connection on fd, to answer it later with reply.
+ */
+uint64_t DistributedNode::get_connection(int fd){
+	std::lock_guard<std::mutex> lock(this->connections_mutex);
+	return this->connections.count(fd) ? this->connections[fd] : 0;
+}
+
+/**
+ * @brief Answers a request that was left unanswered, unless its connection has since closed.
+ *
+ * @return true if the connection is gone.
+ */
+bool DistributedNode::reply(int fd, uint64_t connection, JsonObject* response){
+	this->connections_mutex.lock();
+	bool same = connection != 0 && this->connections.count(fd) && this->connections[fd] == connection;
+	this->connections_mutex.unlock();
+	if(!same){
+		return true;
+	}
+	this->respond(fd, response);
+	return false;
+}
+
+/**
+ * @brief Replaces ddata with data. Only the keys that changed get a new version and are rehashed.
+ *
+ * @return true if data isn't a JSON object.
+ */
 bool DistributedNode::set_ddata(std::string data){
-	this->ddata.objectValues.clear();
-	this->ddata.parse(data.c_str());
-	this->status.objectValues["hash"] = new JsonObject(Util::sha256_hash(this->ddata.stringify(false)));
+	JsonObject new_ddata;
+	new_ddata.parse(data.c_str());
+	if(new_ddata.type != OBJECT){
+		return true;
+	}
+
+	std::lock_guard<std::mutex> lock(this->ddata_mutex);
+	uint64_t version = this->next_clock();
+	for(auto it = new_ddata.objectValues.begin(); it != new_ddata.objectValues.end(); ++it){
+		auto existing = this->ddata.objectValues.find(it->first);
+		if(existing == this->ddata.objectValues.end() || canonical(existing->second) != canonical(it->second)){
+			this->update_entry(it->first, it->second, version, this->id);
+		}
+	}
+	std::vector<std::string> removed;
+	for(auto it = this->ddata.objectValues.begin(); it != this->ddata.objectValues.end(); ++it){
+		if(new_ddata.objectValues.count(it->first) == 0){
+			removed.push_back(it->first);
+		}
+	}
+	for(const std::string& key : removed){
+		this->update_entry(key, 0, version, this->id);
+	}
+	this->update_tree();
+	return false;
+}
+
+/**
+ * @brief A version newer than any this node has seen, and no older than the wall clock in microseconds.
+ * Expects ddata_mutex to be held.
+ *
+ * A hybrid logical clock: the clock starts over at 0 on every start, so a node's write after a restart would
+ * otherwise lose to what it wrote before, whatever its random id.
+ */
+uint64_t DistributedNode::next_clock(){
+	uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count());
+	return std::max(now, this->clock + 1);
+}
+
+/**
+ * @brief Sets one key to value, or removes it if value is null, at the given version. Expects ddata_mutex to be held.
+ *
+ * Call update_tree afterwards.
+ */
+void DistributedNode::update_entry(const std::string& key, JsonObject* value, uint64_t entry_clock, const std::string& origin){
+	DistributedEntry& entry = this->entries[key];
+	entry.clock = entry_clock;
+	entry.origin = origin;
+	entry.deleted = value == 0;
+
+	auto existing = this->ddata.objectValues.find(key);
+	if(existing != this->ddata.objectValues.end()){
+		delete existing->second;
+		this->ddata.objectValues.erase(existing);
+	}
+	std::string text("-");
+	if(value != 0){
+		this->ddata.objectValues[key] = JsonPatch::copy(value);
+		text = '+' + canonical(value);
+	}
+	entry.digest = Util::sha256_hash(key + '\n' + version_string(entry_clock, origin) + '\n' + text);
+
+	size_t leaf = leaf_of(key);
+	this->leaves[leaf][key] = entry.digest;
+	this->dirty_leaves[leaf] = true;
+	this->clock = std::max(this->clock, entry_clock);
+}
+
+/**
+ * @brief Rehashes the leaves that changed, their branches and the root. Expects ddata_mutex to be held.
+ */
+void DistributedNode::update_tree(){
+	bool dirty_branches[DISTRIBUTED_MERKLE_FANOUT] = {false};
+	for(size_t i = 0; i < DISTRIBUTED_MERKLE_LEAVES; ++i){
+		if(!this->dirty_leaves[i]){
+			continue;
+		}
+		std::string joined;
+		for(auto it = this->leaves[i].begin(); it != this->leaves[i].end(); ++it){
+			joined += it->second;
+		}
+		this->leaf_digests[i] = joined.empty() ? std::string() : Util::sha256_hash(joined);
+		this->dirty_leaves[i] = false;
+		dirty_branches[i / DISTRIBUTED_MERKLE_FANOUT] = true;
+	}
+	for(size_t i = 0; i < DISTRIBUTED_MERKLE_FANOUT; ++i){
+		if(dirty_branches[i]){
+			this->branch_digests[i] = digest_of(this->leaf_digests + i * DISTRIBUTED_MERKLE_FANOUT, DISTRIBUTED_MERKLE_FANOUT);
+		}
+	}
+	this->status.objectValues["hash"]->stringValue = Util::sha256_hash(digest_of(this->branch_digests, DISTRIBUTED_MERKLE_FANOUT));
+	this->status.objectValues["version"]->stringValue = std::to_string(this->clock);
+}
+
+/**
+ * @brief Whether a version of key would replace what this node has. Expects ddata_mutex to be held.
+ */
+bool DistributedNode::newer(const std::string& key, uint64_t entry_clock, const std::string& origin){
+	auto found = this->entries.find(key);
+	return found == this->entries.end() || wins(entry_clock, origin, found->second.clock, found->second.origin);
+}
+
+/**
+ * @brief {"c":clock,"o":origin,"v":value} or {"c":clock,"o":origin,"d":"1"} for a removed key. Expects ddata_mutex to be held.
+ */
+JsonObject* DistributedNode::entry_json(const std::string& key){
+	const DistributedEntry& entry = this->entries[key];
+	JsonObject* result = new JsonObject(OBJECT);
+	result->objectValues["c"] = new JsonObject(std::to_string(entry.clock));
+	result->objectValues["o"] = new JsonObject(entry.origin);
+	if(entry.deleted){
+		result->objectValues["d"] = new JsonObject("1");
+	}else{
+		result->objectValues["v"] = JsonPatch::copy(this->ddata.objectValues[key]);
+	}
+	return result;
+}
+
+/**
+ * @brief Takes whichever of puts are newer than what this node has.
+ */
+void DistributedNode::apply_entries(JsonObject* puts){
+	std::lock_guard<std::mutex> lock(this->ddata_mutex);
+	for(auto it = puts->objectValues.begin(); it != puts->objectValues.end(); ++it){
+		JsonObject* put = it->second;
+		if(put->type != OBJECT || !put->HasObj("c", STRING) || !put->HasObj("o", STRING) ||
+		(!put->HasObj("d", STRING) && put->objectValues.count("v") == 0)){
+			continue;
+		}
+		uint64_t entry_clock = to_uint64(put->GetStr("c"));
+		if(this->newer(it->first, entry_clock, put->GetStr("o"))){
+			this->update_entry(it->first, put->HasObj("d", STRING) ? 0 : put->objectValues["v"], entry_clock, put->GetStr("o"));
+		}
+	}
+	this->update_tree();
+}
+
+/**
+ * @brief SWIM's rules for what overrides what. Expects members_mutex to be held.
+ */
+void DistributedNode::add_member(const std::string& address, enum DistributedMemberState state, uint64_t member_incarnation){
+	if(address.empty() || address == this->self){
+		return;
+	}
+	size_t transmissions = 3 * static_cast<size_t>(std::ceil(std::log2(static_cast<double>(this->members.size() + 2))));
+	auto found = this->members.find(address);
+	if(found == this->members.end()){
+		DistributedMember member;
+		member.state = state;
+		member.incarnation = member_incarnation;
+		member.suspected_at = std::chrono::steady_clock::now();
+		member.transmissions = transmissions;
+		this->members[address] = member;
+		PRINT("DistributedNode member " << address << ' ' << MEMBER_STATES[state])
+		return;
+	}
+
+	DistributedMember& member = found->second;
+	bool take;
+	switch(state){
+	case MEMBER_ALIVE:
+		// Including a dead member that has come back.
+		take = member_incarnation > member.incarnation;
+		break;
+	case MEMBER_SUSPECT:
+		take = (member.state == MEMBER_ALIVE && member_incarnation >= member.incarnation) ||
+			(member.state == MEMBER_SUSPECT && member_incarnation > member.incarnation);
+		break;
+	default:
+		take = member.state != MEMBER_DEAD || member_incarnation > member.incarnation;
+		break;
+	}
+	if(!take){
+		return;
+	}
+	if(state != member.state){
+		PRINT("DistributedNode member " << address << ' ' << MEMBER_STATES[state] << " at " << member_incarnation)
+	}
+	if(state == MEMBER_SUSPECT && member.state != MEMBER_SUSPECT){
+		member.suspected_at = std::chrono::steady_clock::now();
+	}
+	member.state = state;
+	member.incarnation = member_incarnation;
+	member.transmissions = transmissions;
+}
+
+/**
+ * @brief Takes in the membership updates piggybacked on message, which came from sender.
+ */
+void DistributedNode::merge_gossip(JsonObject* message, const std::string& sender){
+	std::lock_guard<std::mutex> lock(this->members_mutex);
+	// What the other side called this node, if it's news.
+	const char* names[] = {"to", "you"};
+	for(const char* name : names){
+		if(this->self.empty() && message->HasObj(name, STRING)){
+			this->self = message->GetStr(name);
+			this->members.erase(this->self);
+			PRINT("DistributedNode is " << this->self)
+		}
+	}
+	if(message->HasObj("incarnation", STRING)){
+		this->add_member(sender, MEMBER_ALIVE, to_uint64(message->GetStr("incarnation")));
+	}
+	if(!message->HasObj("gossip", ARRAY)){
+		return;
+	}
+	for(JsonObject* update : message->objectValues["gossip"]->arrayValues){
+		if(update->type != ARRAY || update->arrayValues.size() != 3){
+			continue;
+		}
+		const std::string& address = update->arrayValues[0]->stringValue;
+		const std::string& state_name = update->arrayValues[1]->stringValue;
+		uint64_t member_incarnation = to_uint64(update->arrayValues[2]->stringValue);
+		enum DistributedMemberState state = state_name == "s" ? MEMBER_SUSPECT : state_name == "d" ? MEMBER_DEAD : MEMBER_ALIVE;
+		if(address == this->self){
+			// Refute being suspected or declared dead by outliving it.
+			if(state != MEMBER_ALIVE && member_incarnation >= this->incarnation){
+				this->incarnation = member_incarnation + 1;
+				this->self_transmissions = 3 * static_cast<size_t>(std::ceil(std::log2(static_cast<double>(this->members.size() + 2))));
+				PRINT("DistributedNode refuting " << MEMBER_STATES[state] << " at " << this->incarnation)
+			}
+			continue;
+		}
+		this->add_member(address, state, member_incarnation);
+	}
+}
+
+/**
+ * @brief Piggybacks the freshest membership updates, and how to reach this node, on message.
+ * If the recipient is suspected or thought dead here, that goes first, so it can refute it.
+ */
+void DistributedNode::add_gossip(JsonObject* message, const std::string& recipient){
+	std::lock_guard<std::mutex> lock(this->members_mutex);
+	message->objectValues["port"] = new JsonObject(std::to_string(this->port));
+	message->objectValues["incarnation"] = new JsonObject(std::to_string(this->incarnation));
+
+	std::vector<std::pair<size_t, std::string>> fresh;
+	for(auto it = this->members.begin(); it != this->members.end(); ++it){
+		if(it->second.transmissions > 0){
+			fresh.push_back(std::make_pair(it->second.transmissions, it->first));
+		}
+	}
+	std::sort(fresh.rbegin(), fresh.rend());
+
+	JsonObject* gossip = new JsonObject(ARRAY);
+	// A member that's suspected or thought dead, yet is talking to this node, is told so it can refute it.
+	auto about = this->members.find(recipient);
+	if(about != this->members.end() && about->second.state != MEMBER_ALIVE){
+		JsonObject* update = new JsonObject(ARRAY);
+		update->arrayValues.push_back(new JsonObject(recipient));
+		update->arrayValues.push_back(new JsonObject(MEMBER_STATES[about->second.state]));
+		update->arrayValues.push_back(new JsonObject(std::to_string(about->second.incarnation)));
+		gossip->arrayValues.push_back(update);
+	}
+	if(this->self_transmissions > 0 && !this->self.empty()){
+		this->self_transmissions--;
+		JsonObject* update = new JsonObject(ARRAY);
+		update->arrayValues.push_back(new JsonObject(this->self));
+		update->arrayValues.push_back(new JsonObject(MEMBER_STATES[MEMBER_ALIVE]));
+		update->arrayValues.push_back(new JsonObject(std::to_string(this->incarnation)));
+		gossip->arrayValues.push_back(update);
+	}
+	for(size_t i = 0; i < fresh.size() && gossip->arrayValues.size() < DISTRIBUTED_GOSSIP_UPDATES; ++i){
+		DistributedMember& member = this->members[fresh[i].second];
+		member.transmissions--;
+		JsonObject* update = new JsonObject(ARRAY);
+		update->arrayValues.push_back(new JsonObject(fresh[i].second));
+		update->arrayValues.push_back(new JsonObject(MEMBER_STATES[member.state]));
+		update->arrayValues.push_back(new JsonObject(std::to_string(member.incarnation)));
+		gossip->arrayValues.push_back(update);
+	}
+	message->objectValues["gossip"] = gossip;
+}
+
+std::shared_ptr<DistributedPeer> DistributedNode::peer_client(const std::string& address){
+	std::lock_guard<std::mutex> lock(this->clients_mutex);
+	std::shared_ptr<DistributedPeer>& peer = this->clients[address];
+	if(peer == nullptr){
+		size_t colon = address.rfind(':');
+		peer = std::make_shared<DistributedPeer>();
+		peer->ip_address = address.substr(0, colon);
+		peer->port = static_cast<uint16_t>(std::atoi(address.substr(colon + 1).c_str()));
+		peer->opened = 0;
+	}
+	return peer;
+}
+
+/**
+ * @brief An idle connection to peer, or a new one if all of them are busy and there's room for another.
+ * Otherwise waits for one to be given back; each is busy for one request's timeout at most.
+ */
+std::unique_ptr<SymmetricTcpClient> DistributedNode::take_client(DistributedPeer* peer){
+	std::unique_lock<std::mutex> lock(peer->mutex);
+	peer->condition.wait(lock, [&](){
+		return !peer->idle.empty() || peer->opened < DISTRIBUTED_PEER_CONNECTIONS;
+	});
+	if(!peer->idle.empty()){
+		std::unique_ptr<SymmetricTcpClient> client = std::move(peer->idle.back());
+		peer->idle.pop_back();
+		return client;
+	}
+	peer->opened++;
+	lock.unlock();
+
+	std::unique_ptr<SymmetricTcpClient> client(new SymmetricTcpClient(peer->ip_address.c_str(), peer->port, this->keyfile));
+	client->set_compression(true, 128, NODE_DICTIONARY);
+	return client;
+}
+
+void DistributedNode::give_back(DistributedPeer* peer, std::unique_ptr<SymmetricTcpClient> client){
+	{
+		std::lock_guard<std::mutex> lock(peer->mutex);
+		peer->idle.push_back(std::move(client));
+	}
+	peer->condition.notify_one();
+}
+
+/**
+ * @brief Sends request to a member in whichever format it speaks, with gossip on top, and decodes the reply into response.
+ *
+ * @return false if the member didn't answer within timeout milliseconds.
+ */
+bool DistributedNode::communicate(const std::string& peer, JsonObject* request, JsonObject* response, int timeout){
+	std::string response_data;
+	this->add_gossip(request, peer);
+
+	this->peers_mutex.lock();
+	bool packed = this->packed_peers.count(peer) > 0;
+	this->peers_mutex.unlock();
+
+	std::shared_ptr<DistributedPeer> connection = this->peer_client(peer);
+	std::unique_ptr<SymmetricTcpClient> client = this->take_client(connection.get());
+	client->set_timeout(timeout);
+	if(packed){
+		response_data = client->communicate(MsgPack::pack(request));
+	}else{
+		// Offer msgpack until the peer answers in it.
+		request->objectValues["accept"] = new JsonObject("msgpack");
+		response_data = client->communicate(request->stringify(false));
+		delete request->objectValues["accept"];
+		request->objectValues.erase("accept");
+	}
+	this->give_back(connection.get(), std::move(client));
+
+	if(response_data.empty()){
+		std::lock_guard<std::mutex> lock(this->peers_mutex);
+		this->packed_peers.erase(peer);
+		return false;
+	}
+	if(MsgPack::is_packed(response_data.c_str(), response_data.length())){
+		this->peers_mutex.lock();
+		this->packed_peers[peer] = true;
+		this->peers_mutex.unlock();
+		MsgPack::unpack(response_data.c_str(), response_data.length(), response);
+	}else{
+		response->parse(response_data.c_str());
+	}
+	if(response->type != OBJECT){
+		return false;
+	}
+	this->merge_gossip(response, peer);
 	return true;
 }
 
+/**
+ * @return true if peer acknowledged, with its Merkle root in response.
+ */
+bool DistributedNode::ping(const std::string& peer, JsonObject* response, int timeout){
+	JsonObject request(OBJECT);
+	request.objectValues["type"] = new JsonObject("ping");
+	request.objectValues["to"] = new JsonObject(peer);
+	this->ddata_mutex.lock();
+	request.objectValues["root"] = new JsonObject(this->status.GetStr("hash"));
+	this->ddata_mutex.unlock();
+	return this->communicate(peer, &request, response, timeout) &&
+		response->HasObj("type", STRING) && response->GetStr("type") == "ack";
+}
+
+/**
+ * @brief One SWIM probe: directly, then through others, and suspicion if neither gets an answer.
+ *
+ * A member that answers and holds different data is synced with right away.
+ */
+void DistributedNode::probe(const std::string& peer){
+	JsonObject response(OBJECT);
+	if(this->ping(peer, &response, DISTRIBUTED_PROBE_TIMEOUT_MS)){
+		this->ddata_mutex.lock();
+		bool differs = response.HasObj("root", STRING) && response.GetStr("root") != this->status.GetStr("hash");
+		this->ddata_mutex.unlock();
+		if(differs){
+			this->anti_entropy(peer);
+		}
+		return;
+	}
+
+	std::vector<std::string> helpers;
+	this->members_mutex.lock();
+	for(auto it = this->members.begin(); it != this->members.end(); ++it){
+		if(it->first != peer && it->second.state == MEMBER_ALIVE){
+			helpers.push_back(it->first);
+		}
+	}
+	std::shuffle(helpers.begin(), helpers.end(), this->random);
+	this->members_mutex.unlock();
+	helpers.resize(std::min<size_t>(helpers.size(), DISTRIBUTED_INDIRECT_PROBES));
+
+	// Any one ack will do. The helpers run on the probers, and may still be asking after this stops waiting.
+	std::shared_ptr<DistributedIndirect> indirect = std::make_shared<DistributedIndirect>();
+	indirect->finished = 0;
+	indirect->acknowledged = false;
+	for(const std::string& helper : helpers){
+		this->probers.submit([this, indirect, helper, peer](){
+			JsonObject request(OBJECT);
+			JsonObject helper_response(OBJECT);
+			request.objectValues["type"] = new JsonObject("ping-req");
+			request.objectValues["target"] = new JsonObject(peer);
+			bool acknowledged = this->communicate(helper, &request, &helper_response, 2 * DISTRIBUTED_PROBE_TIMEOUT_MS + DISTRIBUTED_PROBE_TIMEOUT_MS / 2) &&
+				helper_response.HasObj("type", STRING) && helper_response.GetStr("type") == "ack";
+			std::lock_guard<std::mutex> lock(indirect->mutex);
+			indirect->finished++;
+			indirect->acknowledged = indirect->acknowledged || acknowledged;
+			indirect->condition.notify_all();
+		});
+	}
+	{
+		std::unique_lock<std::mutex> lock(indirect->mutex);
+		indirect->condition.wait_for(lock, std::chrono::milliseconds(3 * DISTRIBUTED_PROBE_TIMEOUT_MS), [&]{
+			return indirect->acknowledged || indirect->finished == helpers.size();
+		});
+		if(indirect->acknowledged){
+			return;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(this->members_mutex);
+	auto found = this->members.find(peer);
+	if(found != this->members.end()){
+		this->add_member(peer, MEMBER_SUSPECT, found->second.incarnation);
+	}
+}
+
+/**
+ * @brief Descends the Merkle tree with peer to the leaves that differ, and swaps the newer side of their keys.
+ *
+ * Whatever doesn't fit in one round's messages is left for the next round.
+ */
+void DistributedNode::anti_entropy(const std::string& peer){
+	const int timeout = 4 * DISTRIBUTED_PROBE_TIMEOUT_MS;
+
+	// The branches that differ.
+	JsonObject request(OBJECT);
+	JsonObject response(OBJECT);
+	request.objectValues["type"] = new JsonObject("tree");
+	if(!this->communicate(peer, &request, &response, timeout) || !response.HasObj("branches", ARRAY) ||
+	response["branches"]->arrayValues.size() != DISTRIBUTED_MERKLE_FANOUT){
+		return;
+	}
+	JsonObject* branches = new JsonObject(ARRAY);
+	this->ddata_mutex.lock();
+	for(size_t i = 0; i < DISTRIBUTED_MERKLE_FANOUT; ++i){
+		if(response["branches"]->arrayValues[i]->stringValue != this->branch_digests[i]){
+			branches->arrayValues.push_back(new JsonObject(std::to_string(i)));
+		}
+	}
+	this->ddata_mutex.unlock();
+	if(branches->arrayValues.empty()){
+		delete branches;
+		return;
+	}
+
+	// The leaves that differ, under them.
+	JsonObject leaves_request(OBJECT);
+	JsonObject leaves_response(OBJECT);
+	leaves_request.objectValues["type"] = new JsonObject("tree");
+	leaves_request.objectValues["branches"] = branches;
+	if(!this->communicate(peer, &leaves_request, &leaves_response, timeout) || !leaves_response.HasObj("leaves", OBJECT)){
+		return;
+	}
+	JsonObject* leaves = new JsonObject(ARRAY);
+	this->ddata_mutex.lock();
+	for(auto it = leaves_response["leaves"]->objectValues.begin(); it != leaves_response["leaves"]->objectValues.end(); ++it){
+		size_t branch = static_cast<size_t>(to_uint64(it->first));
+		if(branch >= DISTRIBUTED_MERKLE_FANOUT || it->second->arrayValues.size() != DISTRIBUTED_MERKLE_FANOUT){
+			continue;
+		}
+		for(size_t i = 0; i < DISTRIBUTED_MERKLE_FANOUT; ++i){
+			size_t leaf = branch * DISTRIBUTED_MERKLE_FANOUT + i;
+			if(it->second->arrayValues[i]->stringValue != this->leaf_digests[leaf]){
+				leaves->arrayValues.push_back(new JsonObject(std::to_string(leaf)));
+			}
+		}
+	}
+	this->ddata_mutex.unlock();
+	if(leaves->arrayValues.empty()){
+		delete leaves;
+		return;
+	}
+
+	// The versions of the keys in those leaves.
+	JsonObject keys_request(OBJECT);
+	JsonObject keys_response(OBJECT);
+	keys_request.objectValues["type"] = new JsonObject("keys");
+	keys_request.objectValues["leaves"] = leaves;
+	if(!this->communicate(peer, &keys_request, &keys_response, timeout) || !keys_response.HasObj("keys", OBJECT)){
+		return;
+	}
+
+	// Send what's newer here, ask for what's newer there.
+	JsonObject exchange(OBJECT);
+	JsonObject* puts = new JsonObject(OBJECT);
+	JsonObject* gets = new JsonObject(ARRAY);
+	exchange.objectValues["type"] = new JsonObject("exchange");
+	exchange.objectValues["put"] = puts;
+	exchange.objectValues["get"] = gets;
+	size_t put_size = 0, get_size = 0;
+	this->ddata_mutex.lock();
+	for(auto it = keys_response["keys"]->objectValues.begin(); it != keys_response["keys"]->objectValues.end(); ++it){
+		size_t leaf = static_cast<size_t>(to_uint64(it->first));
+		if(leaf >= DISTRIBUTED_MERKLE_LEAVES || it->second->type != OBJECT){
+			continue;
+		}
+		JsonObject* theirs = it->second;
+		for(auto key = theirs->objectValues.begin(); key != theirs->objectValues.end(); ++key){
+			const std::string& version = key->second->stringValue;
+			size_t colon = version.find(':');
+			if(colon == std::string::npos){
+				continue;
+			}
+			if(this->newer(key->first, to_uint64(version.substr(0, colon)), version.substr(colon + 1))){
+				if(get_size + key->first.length() < DISTRIBUTED_MESSAGE){
+					gets->arrayValues.push_back(new JsonObject(key->first));
+					get_size += key->first.length() + 3;
+				}
+			}
+		}
+		for(auto mine = this->leaves[leaf].begin(); mine != this->leaves[leaf].end(); ++mine){
+			const DistributedEntry& entry = this->entries[mine->first];
+			auto key = theirs->objectValues.find(mine->first);
+			if(key != theirs->objectValues.end()){
+				const std::string& version = key->second->stringValue;
+				size_t colon = version.find(':');
+				if(colon == std::string::npos ||
+				!wins(entry.clock, entry.origin, to_uint64(version.substr(0, colon)), version.substr(colon + 1))){
+					continue;
+				}
+			}
+			JsonObject* put = this->entry_json(mine->first);
+			size_t size = mine->first.length() + canonical(put).length();
+			if(put_size + size < DISTRIBUTED_MESSAGE){
+				puts->objectValues[mine->first] = put;
+				put_size += size;
+			}else{
+				delete put;
+			}
+		}
+	}
+	this->ddata_mutex.unlock();
+	if(puts->objectValues.empty() && gets->arrayValues.empty()){
+		return;
+	}
+	PRINT("DistributedNode syncing " << peer << ": " << puts->objectValues.size() << " out, " << gets->arrayValues.size() << " in")
+
+	JsonObject exchange_response(OBJECT);
+	if(this->communicate(peer, &exchange, &exchange_response, timeout) && exchange_response.HasObj("put", OBJECT)){
+		this->apply_entries(exchange_response["put"]);
+	}
+}
+
+/**
+ * @brief Sends response to the connection on fd, with gossip on top for members, in whichever format it speaks.
+ */
+void DistributedNode::respond(int fd, JsonObject* response){
+	// Only members gossip; anyone else, e.g. a client of a service on on_request, would just use the updates up.
+	if(response->HasObj("you", STRING)){
+		this->add_gossip(response, response->GetStr("you"));
+	}
+	this->connections_mutex.lock();
+	bool packed = this->packed_clients.count(fd) > 0;
+	this->connections_mutex.unlock();
+	if(packed){
+		if(this->server->send(fd, MsgPack::pack(response))){
+			ERROR("DistributedNode send")
+		}
+	}else if(this->server->send(fd, response->stringify(false))){
+		ERROR("DistributedNode send")
+	}
+}
+
+/**
+ * @brief Answers one request into response. A ping-req is answered later, leaving response empty,
+ * and so may be types handled by on_request.
+ */
+void DistributedNode::handle(int fd, JsonObject* request, JsonObject* response){
+	if(request->type != OBJECT){
+		response->objectValues["type"] = new JsonObject("nack");
+		return;
+	}
+	std::string sender;
+	if(request->HasObj("port", STRING)){
+		sender = this->server->fd_to_details_map[fd] + ':' + request->GetStr("port");
+	}
+	this->merge_gossip(request, sender);
+	std::string type = request->HasObj("type", STRING) ? request->GetStr("type") : std::string();
+
+	if(type == "ping"){
+		response->objectValues["type"] = new JsonObject("ack");
+		std::lock_guard<std::mutex> lock(this->ddata_mutex);
+		response->objectValues["root"] = new JsonObject(this->status.GetStr("hash"));
+	}else if(type == "ping-req" && request->HasObj("target", STRING)){
+		// Probing takes a while, so the answer is sent from a prober.
+		uint64_t connection = this->get_connection(fd);
+		std::string target = request->GetStr("target");
+		this->probers.submit([this, fd, connection, target, sender](){
+			JsonObject probe_response(OBJECT);
+			JsonObject answer(OBJECT);
+			answer.objectValues["you"] = new JsonObject(sender);
+			answer.objectValues["type"] = new JsonObject(this->ping(target, &probe_response, DISTRIBUTED_PROBE_TIMEOUT_MS) ? "ack" : "nack");
+			this->reply(fd, connection, &answer);
+		});
+	}else if(type == "tree"){
+		std::lock_guard<std::mutex> lock(this->ddata_mutex);
+		response->objectValues["type"] = new JsonObject("tree");
+		if(!request->HasObj("branches", ARRAY)){
+			JsonObject* branches = new JsonObject(ARRAY);
+			for(size_t i = 0; i < DISTRIBUTED_MERKLE_FANOUT; ++i){
+				branches->arrayValues.push_back(new JsonObject(this->branch_digests[i]));
+			}
+			response->objectValues["branches"] = branches;
+		}else{
+			JsonObject* leaves = new JsonObject(OBJECT);
+			for(JsonObject* item : (*request)["branches"]->arrayValues){
+				size_t branch = static_cast<size_t>(to_uint64(item->stringValue));
+				if(branch >= DISTRIBUTED_MERKLE_FANOUT){
+					continue;
+				}
+				JsonObject* digests = new JsonObject(ARRAY);
+				for(size_t i = 0; i < DISTRIBUTED_MERKLE_FANOUT; ++i){
+					digests->arrayValues.push_back(new JsonObject(this->leaf_digests[branch * DISTRIBUTED_MERKLE_FANOUT + i]));
+				}
+				delete leaves->objectValues[item->stringValue];
+				leaves->objectValues[item->stringValue] = digests;
+			}
+			response->objectValues["leaves"] = leaves;
+		}
+	}else if(type == "keys" && request->HasObj("leaves", ARRAY)){
+		std::lock_guard<std::mutex> lock(this->ddata_mutex);
+		JsonObject* keys = new JsonObject(OBJECT);
+		size_t size = 0;
+		for(JsonObject* item : (*request)["leaves"]->arrayValues){
+			size_t leaf = static_cast<size_t>(to_uint64(item->stringValue));
+			if(leaf >= DISTRIBUTED_MERKLE_LEAVES || keys->objectValues.count(item->stringValue)){
+				continue;
+			}
+			JsonObject* versions = new JsonObject(OBJECT);
+			for(auto it = this->leaves[leaf].begin(); it != this->leaves[leaf].end(); ++it){
+				const DistributedEntry& entry = this->entries[it->first];
+				versions->objectValues[it->first] = new JsonObject(version_string(entry.clock, entry.origin));
+				size += it->first.length() + entry.origin.length() + 32;
+			}
+			keys->objectValues[item->stringValue] = versions;
+			// The leaves left out are asked for again next round.
+			if(size > DISTRIBUTED_MESSAGE){
+				break;
+			}
+		}
+		response->objectValues["type"] = new JsonObject("keys");
+		response->objectValues["keys"] = keys;
+	}else if(type == "exchange"){
+		if(request->HasObj("put", OBJECT)){
+			this->apply_entries((*request)["put"]);
+		}
+		JsonObject* puts = new JsonObject(OBJECT);
+		if(request->HasObj("get", ARRAY)){
+			std::lock_guard<std::mutex> lock(this->ddata_mutex);
+			size_t size = 0;
+			for(JsonObject* item : (*request)["get"]->arrayValues){
+				if(this->entries.count(item->stringValue) == 0 || puts->objectValues.count(item->stringValue)){
+					continue;
+				}
+				JsonObject* put = this->entry_json(item->stringValue);
+				size += item->stringValue.length() + canonical(put).length();
+				if(size > DISTRIBUTED_MESSAGE){
+					delete put;
+					break;
+				}
+				puts->objectValues[item->stringValue] = put;
+			}
+		}
+		response->objectValues["type"] = new JsonObject("exchange");
+		response->objectValues["put"] = puts;
+	}else if(!type.empty() && this->on_request != nullptr){
+		this->on_request(fd, request, response);
+	}else{
+		// Nodes from before gossip only compare hashes.
+		std::lock_guard<std::mutex> lock(this->ddata_mutex);
+		if(request->HasObj("hash", STRING)){
+			response->objectValues["status"] = new JsonObject(request->GetStr("hash") == this->status.GetStr("hash") ? "Up to date." : "Out of date.");
+		}
+		response->objectValues["hash"] = new JsonObject(this->status.GetStr("hash"));
+		response->objectValues["version"] = new JsonObject(this->status.GetStr("version"));
+	}
+	// Tells the sender what it's called here, so add_gossip can tell it about itself.
+	if(!sender.empty() && !response->objectValues.empty()){
+		response->objectValues["you"] = new JsonObject(sender);
+	}
+}
+
 void DistributedNode::start(){
-	std::string response;
+	uint64_t period = 0;
 	while(true){
-		this->clients_mutex.lock();
-		for(auto iter = this->clients.begin(); iter != this->clients.end(); ++iter){
-			response = iter->second->communicate(status.stringify(false));
-			if(response.empty()){
-				PRINT(iter->first << " DISCONNECTED")
-			}else{
-				PRINT(iter->first << " -> " << response)
+		auto round_started = std::chrono::steady_clock::now();
+		std::string target;
+		std::string revive;
+
+		this->members_mutex.lock();
+		// Suspects that didn't refute in time are dead.
+		for(auto it = this->members.begin(); it != this->members.end(); ++it){
+			if(it->second.state == MEMBER_SUSPECT &&
+			round_started - it->second.suspected_at > std::chrono::milliseconds(DISTRIBUTED_SUSPICION_PERIODS * DISTRIBUTED_PERIOD_MS)){
+				this->add_member(it->first, MEMBER_DEAD, it->second.incarnation);
+			}
+		}
+		// Round robin over a shuffled order, so every member is probed within a bounded time.
+		while(target.empty()){
+			if(this->probe_next >= this->probe_order.size()){
+				this->probe_order.clear();
+				for(auto it = this->members.begin(); it != this->members.end(); ++it){
+					if(it->second.state != MEMBER_DEAD){
+						this->probe_order.push_back(it->first);
+					}
+				}
+				std::shuffle(this->probe_order.begin(), this->probe_order.end(), this->random);
+				this->probe_next = 0;
+				if(this->probe_order.empty()){
+					break;
+				}
 			}
+			const std::string& next = this->probe_order[this->probe_next++];
+			auto found = this->members.find(next);
+			if(found != this->members.end() && found->second.state != MEMBER_DEAD){
+				target = next;
+			}
+		}
+		// The dead are left out of the round robin, but one is pinged now and then in case it's reachable again.
+		if(++period % DISTRIBUTED_REVIVE_PERIODS == 0){
+			std::vector<std::string> dead;
+			for(auto it = this->members.begin(); it != this->members.end(); ++it){
+				if(it->second.state == MEMBER_DEAD){
+					dead.push_back(it->first);
+				}
+			}
+			if(!dead.empty()){
+				revive = dead[this->random() % dead.size()];
+			}
+		}
+		this->members_mutex.unlock();
+
+		if(!target.empty()){
+			this->probe(target);
+		}
+		if(!revive.empty()){
+			// Told it's thought dead, a live member refutes with a higher incarnation, which brings it back.
+			JsonObject response(OBJECT);
+			this->ping(revive, &response, DISTRIBUTED_PROBE_TIMEOUT_MS);
 		}
-		this->clients_mutex.unlock();
 
-		sleep(5);
+		std::this_thread::sleep_until(round_started + std::chrono::milliseconds(DISTRIBUTED_PERIOD_MS));
 	}
 }
@@ -1,25 +1,199 @@
 #pragma once
 
+#include <map>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
 #include "json.hpp"
 #include "symmetric-tcp-client.hpp"
 #include "symmetric-epoll-server.hpp"
 
+// How often each node probes one member, and syncs with it if they differ.
+#define DISTRIBUTED_PERIOD_MS 1000
+// How long a direct probe waits for its ack; an indirect one waits twice as long.
+#define DISTRIBUTED_PROBE_TIMEOUT_MS 400
+// How many other members are asked to probe a member that didn't answer.
+#define DISTRIBUTED_INDIRECT_PROBES 3
+// Protocol periods a suspect has to refute the suspicion before it's declared dead.
+#define DISTRIBUTED_SUSPICION_PERIODS 5
+// Every this many periods a member declared dead is pinged again, so nodes split by a partition find each other.
+#define DISTRIBUTED_REVIVE_PERIODS 10
+// Connections opened to each member at most, so that requests to one don't all wait on the one before.
+#define DISTRIBUTED_PEER_CONNECTIONS 4
+// Threads sending indirect probes and answering other members' ping-reqs.
+#define DISTRIBUTED_PROBERS 4
+// Membership updates piggybacked on each message.
+#define DISTRIBUTED_GOSSIP_UPDATES 8
+// Merkle tree shape: DISTRIBUTED_MERKLE_FANOUT children per node, DISTRIBUTED_MERKLE_FANOUT^2 leaves.
+#define DISTRIBUTED_MERKLE_FANOUT 16
+#define DISTRIBUTED_MERKLE_LEAVES 256
+// Key data sent per anti-entropy message, so each stays well within one symmetric frame (PACKET_LIMIT).
+#define DISTRIBUTED_MESSAGE 6000
+
+/// SWIM member states; a higher incarnation of a member overrides what was heard before.
+enum DistributedMemberState{
+	MEMBER_ALIVE,
+	MEMBER_SUSPECT,
+	MEMBER_DEAD
+};
+
+struct DistributedMember{
+	enum DistributedMemberState state;
+	uint64_t incarnation;
+	std::chrono::steady_clock::time_point suspected_at;
+	// Times this member's latest update is still to be piggybacked.
+	size_t transmissions;
+};
+
+/**
+ * @brief A fixed number of threads taking tasks in the order they're submitted.
+ * Tasks still queued when it's destroyed are dropped; the ones running are waited for.
+ */
+class DistributedWorkers{
+private:
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<std::function<void()>> tasks;
+	std::vector<std::thread> threads;
+	bool stopping;
+
+	void work();
+public:
+	DistributedWorkers(size_t count);
+	~DistributedWorkers();
+
+	void submit(std::function<void()> task);
+};
+
+/// The indirect probes of one member. They outlive the probe when it stops waiting for them.
+struct DistributedIndirect{
+	std::mutex mutex;
+	std::condition_variable condition;
+	size_t finished;
+	bool acknowledged;
+};
+
+/// Connections to a member, each carrying one request at a time. More are opened as requests overlap.
+struct DistributedPeer{
+	std::string ip_address;
+	uint16_t port;
+	std::mutex mutex;
+	std::condition_variable condition;
+	size_t opened;
+	std::vector<std::unique_ptr<SymmetricTcpClient>> idle;
+};
+
+/// The version and digest of one top-level key of ddata. Removed keys stay behind as tombstones.
+struct DistributedEntry{
+	uint64_t clock;
+	std::string origin;
+	bool deleted;
+	std::string digest;
+};
+
+/**
+ * @brief A node sharing one JSON document, ddata, with every other node it can find.
+ *
+ * Membership is SWIM: every period a node probes one member, round robin. A member that doesn't answer
+ * is probed indirectly through others, then suspected, and declared dead if it doesn't refute that
+ * with a higher incarnation in time. Membership changes ride along on every message, so they
+ * spread in O(log N) periods. Nodes learn each other from a single seed via add_client.
+ * Dead members (seeds included) are still pinged now and then, and rejoin when they answer.
+ *
+ * ddata is kept per top-level key, each with a hybrid logical clock version (last writer wins) and a digest,
+ * in a Merkle tree of DISTRIBUTED_MERKLE_LEAVES leaves. Probes carry the root; when two nodes'
+ * roots differ they descend the tree together and exchange only the keys in the leaves that differ.
+ *
+ * Request types it doesn't know go to on_request, so a service can share its members and connections.
+ */
 class DistributedNode{
 public:
-	DistributedNode(std::string keyfile);
+	DistributedNode(std::string keyfile, uint16_t first_port = 30000);
 	bool set_ddata(std::string data);
 	void add_client(const char* ip_address, uint16_t port);
-	
+
+	std::string get_self();
+	std::vector<std::string> get_members();
+	bool request(const std::string& member, JsonObject* request, JsonObject* response, int timeout);
+	uint64_t get_connection(int fd);
+	bool reply(int fd, uint64_t connection, JsonObject* response);
+
+	/**
+	 * Handles request types DistributedNode doesn't know, on the server's one thread: fill in the response,
+	 * or leave it empty and answer later with reply.
+	 */
+	std::function<void(int, JsonObject*, JsonObject*)> on_request;
+
 	JsonObject status;
 	JsonObject ddata;
 private:
 	SymmetricEpollServer* server;
 	std::string keyfile;
-	
+	uint16_t port;
+	std::string id;
+	std::mt19937 random;
+
+	// Membership, keyed by "ip:port". Also what this node is called, once a member has said.
+	std::mutex members_mutex;
+	std::string self;
+	uint64_t incarnation;
+	size_t self_transmissions;
+	std::map<std::string, DistributedMember> members;
+	std::vector<std::string> probe_order;
+	size_t probe_next;
+
 	std::mutex clients_mutex;
-	std::unordered_map<std::string, SymmetricTcpClient*> clients;
-	
+	std::unordered_map<std::string, std::shared_ptr<DistributedPeer>> clients;
+
+	// Peers that have agreed to talk MessagePack instead of JSON.
+	std::mutex peers_mutex;
+	std::unordered_map<std::string, bool> packed_peers;
+
+	// Each connection's serial, so an indirect probe's late answer can't go to a newer connection on the fd,
+	// and the connections that have agreed to talk MessagePack.
+	std::mutex connections_mutex;
+	std::unordered_map<int, uint64_t> connections;
+	std::unordered_map<int, bool> packed_clients;
+	uint64_t next_connection;
+
+	std::mutex ddata_mutex;
+	uint64_t clock;
+	std::unordered_map<std::string, DistributedEntry> entries;
+	std::map<std::string, std::string> leaves[DISTRIBUTED_MERKLE_LEAVES];
+	std::string leaf_digests[DISTRIBUTED_MERKLE_LEAVES];
+	std::string branch_digests[DISTRIBUTED_MERKLE_FANOUT];
+	bool dirty_leaves[DISTRIBUTED_MERKLE_LEAVES];
+
+	uint64_t next_clock();
+	void update_entry(const std::string& key, JsonObject* value, uint64_t entry_clock, const std::string& origin);
+	void update_tree();
+	bool newer(const std::string& key, uint64_t entry_clock, const std::string& origin);
+	JsonObject* entry_json(const std::string& key);
+	void apply_entries(JsonObject* puts);
+
+	void add_member(const std::string& address, enum DistributedMemberState state, uint64_t member_incarnation);
+	void merge_gossip(JsonObject* message, const std::string& sender);
+	void add_gossip(JsonObject* message, const std::string& recipient);
+
+	std::shared_ptr<DistributedPeer> peer_client(const std::string& address);
+	std::unique_ptr<SymmetricTcpClient> take_client(DistributedPeer* peer);
+	void give_back(DistributedPeer* peer, std::unique_ptr<SymmetricTcpClient> client);
+	bool communicate(const std::string& peer, JsonObject* request, JsonObject* response, int timeout);
+	bool ping(const std::string& peer, JsonObject* response, int timeout);
+	void probe(const std::string& peer);
+	void anti_entropy(const std::string& peer);
+	void respond(int fd, JsonObject* response);
+	void handle(int fd, JsonObject* request, JsonObject* response);
+
+	// Ahead of start_thread, so that it's destroyed first; its tasks use everything else.
+	DistributedWorkers probers;
+
 	std::thread start_thread;
-	
+
 	[[noreturn]] void start();
 };
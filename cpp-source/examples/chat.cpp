@@ -32,11 +32,39 @@ int main(int argc, char** argv){
 	std::unordered_map<int /* fd */, std::string /* logged in handle */> client_player;
 
 	EpollServer* server;
+	std::function<bool(int, const std::string&)> subscribe;
+	std::function<size_t(const std::string&, const std::string&)> publish;
+
+	WebsocketDeflateOptions deflate;
+	deflate.enabled = true;
 
 	if(http){
-		server = new WebsocketServer(static_cast<uint16_t>(port), 10);
+		WebsocketServer* websocket_server = new WebsocketServer(static_cast<uint16_t>(port), 10);
+		websocket_server->set_permessage_deflate(deflate);
+		// Everyone hears the lobby from the moment they connect, whether or not they ever talk.
+		websocket_server->on_open = [websocket_server](int fd){
+			websocket_server->subscribe(fd, "chat/lobby");
+		};
+		subscribe = [websocket_server](int fd, const std::string& topic){
+			return websocket_server->subscribe(fd, topic);
+		};
+		publish = [websocket_server](const std::string& topic, const std::string& data){
+			return websocket_server->publish(topic, data);
+		};
+		server = websocket_server;
 	}else{
-		server = new TlsWebsocketServer(ssl_certificate, ssl_private_key, static_cast<uint16_t>(port), 10);
+		TlsWebsocketServer* websocket_server = new TlsWebsocketServer(ssl_certificate, ssl_private_key, static_cast<uint16_t>(port), 10);
+		websocket_server->set_permessage_deflate(deflate);
+		websocket_server->on_open = [websocket_server](int fd){
+			websocket_server->subscribe(fd, "chat/lobby");
+		};
+		subscribe = [websocket_server](int fd, const std::string& topic){
+			return websocket_server->subscribe(fd, topic);
+		};
+		publish = [websocket_server](const std::string& topic, const std::string& data){
+			return websocket_server->publish(topic, data);
+		};
+		server = websocket_server;
 	}
 
 	server->on_read = [&](int fd, const char* data, ssize_t data_length)->ssize_t{
@@ -46,7 +74,13 @@ int main(int argc, char** argv){
 		JsonObject response(OBJECT);
 		PRINT("CHAT ONREAD")
 
-		if(msg.HasObj("handle", STRING) &&
+		// Every room is a topic, and talking in a room joins it.
+		std::string room = "chat/" + (msg.HasObj("room", STRING) ? msg.GetStr("room") : std::string("lobby"));
+
+		if(msg.HasObj("join", STRING)){
+			subscribe(fd, "chat/" + msg.GetStr("join"));
+			response.objectValues["status"] = new JsonObject("Joined.");
+		}else if(msg.HasObj("handle", STRING) &&
 		msg.HasObj("message", STRING)){
 			if(msg.GetStr("handle").length() < 5){
 				response.objectValues["status"] = new JsonObject("Handle too short.");
@@ -58,11 +92,8 @@ int main(int argc, char** argv){
 				response.objectValues["status"] = new JsonObject("Message too long.");
 			}else{
 				response.objectValues["status"] = new JsonObject("Sent.");
-				PRINT("TRY BROADCAST")
-				if(server->EpollServer::send(server->broadcast_fd(), data, static_cast<size_t>(data_length))){
-					PRINT("broadcast fail")
-					return -1;
-				}
+				subscribe(fd, room);
+				PRINT("PUBLISHED TO " << publish(room, std::string(data, static_cast<size_t>(data_length))) << " IN " << room)
 			}
 		}else{
 			response.objectValues["status"] = new JsonObject("Must provide handle and message.");
@@ -2,6 +2,7 @@
 #include <cstring>
 #include <iostream>
 #include <csignal>
+#include <memory>
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -21,6 +22,8 @@
 
 #include "util.hpp"
 #include "comd-util.hpp"
+#include "comd-transfer.hpp"
+#include "comd-sync.hpp"
 #include "symmetric-event-client.hpp"
 
 /*
@@ -119,6 +122,10 @@ int main(int argc, char** argv){
 	int port;
 	std::string keyfile;
 	std::string file_path;
+	std::string remote_path;
+	std::unique_ptr<ComdFileTransfer> transfer;
+	std::unique_ptr<ComdDirectorySync> sync;
+	int transfer_fd;
 
 	Util::define_argument("hostname", hostname, {"-hn"});
 	Util::define_argument("ip_address", ip_address, {"-ip"}, [&](){
@@ -129,9 +136,16 @@ int main(int argc, char** argv){
 		routine = SEND_FILE;});
 	Util::define_argument("recv-file", file_path, {"-rf"}, [&](){
 		routine = RECV_FILE;});
-	Util::parse_arguments(argc, argv, "This is a secure client for comd, supporting remote shell, send file, and receive file routines.");
+	Util::define_argument("sync-directory", file_path, {"-sd"}, [&](){
+		routine = SYNC_DIRECTORY;});
+	Util::define_argument("remote-file", remote_path, {"-r"});
+	Util::parse_arguments(argc, argv, "This is a secure client for comd, supporting remote shell, send file, receive file, and directory sync routines.");
+	if(remote_path.empty()){
+		remote_path = file_path;
+	}
 
 	SymmetricEventClient client(keyfile);
+	client.set_compression(true);
 
 	if(!use_ip){
 		client.add(new Connection(hostname, static_cast<uint16_t>(port)));
@@ -216,15 +230,46 @@ int main(int argc, char** argv){
 				};
 				break;
 			case SEND_FILE:
-				//TODO send file name
-				break;
 			case RECV_FILE:
-				//TODO write ok packet???
+				if(std::strcmp(data, START_ROUTINE.c_str()) != 0){
+					return -1;
+				}
+				// See the note above about fd.
+				transfer_fd = fd;
+				transfer.reset(new ComdFileTransfer([&](const char* message, size_t message_length){
+					return client.send(transfer_fd, message, message_length);
+				}));
+				if(routine == SEND_FILE ? transfer->send_file(file_path, remote_path) : transfer->get_file(remote_path, file_path)){
+					return -1;
+				}
+				client.on_event_loop = [&](){
+					return transfer->pump() || transfer->is_finished();
+				};
+				break;
+			case SYNC_DIRECTORY:
+				if(std::strcmp(data, START_ROUTINE.c_str()) != 0){
+					return -1;
+				}
+				transfer_fd = fd;
+				sync.reset(new ComdDirectorySync([&](const char* message, size_t message_length){
+					return client.send(transfer_fd, message, message_length);
+				}));
+				if(sync->sync(file_path, remote_path)){
+					return -1;
+				}
+				client.on_event_loop = [&](){
+					return sync->pump() || sync->is_finished();
+				};
 				break;
 			}
 			state = EXCHANGE_PACKETS;
 			break;
 		case EXCHANGE_PACKETS:
+			if(routine == SYNC_DIRECTORY){
+				return sync->on_message(data, static_cast<size_t>(data_length)) ? -1 : data_length;
+			}else if(routine != SHELL){
+				return transfer->on_message(data, static_cast<size_t>(data_length)) ? -1 : data_length;
+			}
 			std::cout << data;
 			std::cout << '\r' << hostname << " > " << std::flush;
 			break;
@@ -236,6 +281,20 @@ int main(int argc, char** argv){
 		if(ttyreset(STDIN_FILENO) < 0){
 			ERROR("ttyreset")
 		}
+	}else if(routine == SYNC_DIRECTORY){
+		if(sync == nullptr || !sync->is_finished() || !sync->is_intact()){
+			PRINT("Directory sync failed.")
+			return 1;
+		}
+		ComdSyncStats stats = sync->stats();
+		PRINT("Directory sync complete, " << stats.files << " files (" << stats.files_unchanged << " unchanged), "
+			<< stats.bytes_matched << " bytes matched and " << stats.bytes_literal << " bytes sent.")
+	}else{
+		if(transfer == nullptr || !transfer->is_intact()){
+			PRINT("File transfer failed.")
+			return 1;
+		}
+		PRINT("File transfer complete, " << transfer->progress() << " bytes.")
 	}
 
 	return 0;
@@ -4,6 +4,11 @@
 #include <map>
 #include <thread>
 #include <cstdlib>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
 
 #include <signal.h>
 #include <stdio.h>
@@ -14,6 +19,8 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -22,106 +29,337 @@
 #include "util.hpp"
 #include "shell.hpp"
 #include "comd-util.hpp"
+#include "comd-transfer.hpp"
+#include "comd-sync.hpp"
 #include "symmetric-epoll-server.hpp"
 
+// Shell output, transfers and syncs hold off on a client with this much still queued for it.
+#define COMD_QUEUED_LIMIT 1048576
+
+/**
+ * @brief Everything comd knows about one connection.
+ *
+ * The epoll thread handles what arrives, and the main thread sends shell output and keeps transfers going,
+ * so both lock mutex first. Sending never waits on the client: whatever it can't take yet is queued
+ * on the connection and written when it's writable, so one stalled client holds up no one else.
+ */
+struct ComdSession{
+	std::mutex mutex;
+	// Tells a session apart from a later one on the same fd, in events the main thread has yet to handle.
+	uint32_t serial;
+	enum ComdState state;
+	enum ComdRoutine routine;
+	Shell shell;
+	std::unique_ptr<ComdFileTransfer> transfer;
+	std::unique_ptr<ComdDirectorySync> sync;
+	// Set while shell output isn't read, because the client is too far behind.
+	bool shell_paused;
+	std::function<bool(const char*, size_t)> send;
+
+	ComdSession(uint32_t new_serial, std::function<bool(const char*, size_t)> new_send)
+	:serial(new_serial),
+	state(VERIFY_IDENTITY),
+	routine(SHELL),
+	shell_paused(false),
+	send(new_send){}
+
+	/// Expects mutex to be held.
+	bool queue(const char* data, size_t data_length){
+		return this->send(data, data_length);
+	}
+};
+
 int main(int argc, char** argv){
-	enum ComdState state = VERIFY_IDENTITY;
-	enum ComdRoutine routine = SHELL;
-	int shell_client_fd;
-	char packet[PACKET_LIMIT];
+	char packet[PACKET_LIMIT + 1];
 	ssize_t len;
 	int port;
+	int max_connections = 8;
 	std::string keyfile;
 
 	Util::define_argument("port", &port, {"-p"});
 	Util::define_argument("keyfile", keyfile, {"-k"});
-	Util::parse_arguments(argc, argv, "This is a secure server application for com, supporting a remote shell, receive file, and send file routines.");
+	Util::define_argument("max_connections", &max_connections, {"-c"});
+	Util::parse_arguments(argc, argv, "This is a secure server application for com, supporting a remote shell, receive file, send file, and directory sync routines.");
 
-	SymmetricEpollServer server(keyfile, static_cast<uint16_t>(port), 1);
+	SymmetricEpollServer server(keyfile, static_cast<uint16_t>(port), static_cast<size_t>(max_connections));
+	// Shell output compresses well; clients that don't compress are answered uncompressed.
+	server.set_compression(true);
 
-	Shell shell;
+	std::mutex sessions_mutex;
+	std::unordered_map<int /* client fd */, std::shared_ptr<ComdSession>> sessions;
+	uint32_t next_serial = 0;
 
-	// This "state" is not per-client, because comd is designed for a single connection.
-	server.on_connect = [&](int){
-		state = VERIFY_IDENTITY;
+	// Addresses that gave a bad identity, and until when they're turned away. Only the epoll thread uses this.
+	std::unordered_map<std::string /* address */, time_t> penalized;
+
+	/*
+	 * The main thread waits here for shell output and for wake_fd, which is written whenever a transfer or sync
+	 * may have something to send. Shell output events carry the session's serial and fd; wake_fd's carry 0.
+	 */
+	int pump_fd, wake_fd;
+	if((pump_fd = epoll_create1(0)) < 0 || (wake_fd = eventfd(0, EFD_NONBLOCK)) < 0){
+		perror("comd epoll/eventfd");
+		return 1;
+	}
+	struct epoll_event event;
+	std::memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = 0;
+	if(epoll_ctl(pump_fd, EPOLL_CTL_ADD, wake_fd, &event) < 0){
+		perror("comd epoll_ctl");
+		return 1;
+	}
+
+	auto wake = [&](){
+		uint64_t one = 1;
+		if(write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+			perror("comd wake");
+		}
 	};
 
-	server.on_read = [&](int fd, const char* data, ssize_t data_length)->ssize_t{
-		switch(state){
-		case VERIFY_IDENTITY:
-			PRINT(data)
-			if(std::strcmp(data, IDENTITY.c_str()) != 0){
-				PRINT("Client provided bad identity.")
+	auto find_session = [&](int fd)->std::shared_ptr<ComdSession>{
+		std::lock_guard<std::mutex> lock(sessions_mutex);
+		auto found = sessions.find(fd);
+		return found == sessions.end() ? nullptr : found->second;
+	};
+
+	auto close_shell = [&](ComdSession* session){
+		if(session->shell.opened){
+			epoll_ctl(pump_fd, EPOLL_CTL_DEL, session->shell.output, 0);
+			session->shell.sclose();
+		}
+	};
+
+	server.on_connect = [&](int fd){
+		std::lock_guard<std::mutex> lock(sessions_mutex);
+		sessions[fd] = std::make_shared<ComdSession>(++next_serial == 0 ? ++next_serial : next_serial,
+		[&server, fd](const char* data, size_t data_length){
+			if(server.send(fd, data, data_length)){
+				ERROR("comd send " << fd)
+				// The epoll thread sees the hang up and cleans up.
+				shutdown(fd, SHUT_RDWR);
+				return true;
+			}
+			return false;
+		});
+	};
+
+	// A client that has caught up may take more shell output, transfer or sync.
+	server.on_drained = [&](int){
+		wake();
+	};
+
+	auto handle = [&](int fd, ComdSession* session, const char* data, ssize_t data_length)->ssize_t{
+		std::lock_guard<std::mutex> lock(session->mutex);
+		switch(session->state){
+		case VERIFY_IDENTITY:{
+			// Easy brute force protection. (This used to hold up every client for 10 seconds.)
+			const std::string& address = server.fd_to_details_map[fd];
+			auto found = penalized.find(address);
+			if(found != penalized.end() && found->second > time(0)){
+				PRINT(address << " is still penalized.")
 				return -1;
 			}
-			if(server.send(fd, VERIFIED.c_str(), VERIFIED.length())){
+			if(std::strcmp(data, IDENTITY.c_str()) != 0){
+				PRINT("Client provided bad identity.")
+				penalized[address] = time(0) + 10;
 				return -1;
 			}
-			state = SELECT_ROUTINE;
+			penalized.erase(address);
+			session->queue(VERIFIED.c_str(), VERIFIED.length());
+			session->state = SELECT_ROUTINE;
 			break;
+		}
 		case SELECT_ROUTINE:
 			PRINT(data)
 			if(std::strcmp(data, ROUTINES[SHELL].c_str()) == 0){
-				if(server.send(fd, START_ROUTINE.c_str(), START_ROUTINE.length())){
-					return -1;
-				}
-				shell_client_fd = fd;
-				routine = SHELL;
-			}else if(std::strcmp(data, ROUTINES[SEND_FILE].c_str()) == 0){
-				server.send(fd, BAD_ROUTINE.c_str(), BAD_ROUTINE.length());
-				return -1;
-			}else if(std::strcmp(data, ROUTINES[RECV_FILE].c_str()) == 0){
-				server.send(fd, BAD_ROUTINE.c_str(), BAD_ROUTINE.length());
-				return -1;
+				session->routine = SHELL;
+			}else if(std::strcmp(data, ROUTINES[SEND_FILE].c_str()) == 0 ||
+			std::strcmp(data, ROUTINES[RECV_FILE].c_str()) == 0){
+				session->transfer.reset(new ComdFileTransfer([session](const char* message, size_t message_length){
+					return session->queue(message, message_length);
+				}));
+				session->transfer->on_ready = wake;
+				session->routine = std::strcmp(data, ROUTINES[SEND_FILE].c_str()) == 0 ? SEND_FILE : RECV_FILE;
+			}else if(std::strcmp(data, ROUTINES[SYNC_DIRECTORY].c_str()) == 0){
+				session->sync.reset(new ComdDirectorySync([session](const char* message, size_t message_length){
+					return session->queue(message, message_length);
+				}));
+				session->sync->on_ready = wake;
+				session->routine = SYNC_DIRECTORY;
 			}else{
-				server.send(fd, BAD_ROUTINE.c_str(), BAD_ROUTINE.length());
+				session->queue(BAD_ROUTINE.c_str(), BAD_ROUTINE.length());
 				return -1;
 			}
-			state = EXCHANGE_PACKETS;
+			session->queue(START_ROUTINE.c_str(), START_ROUTINE.length());
+			session->state = EXCHANGE_PACKETS;
 			break;
 		case EXCHANGE_PACKETS:
-			switch(routine){
+			switch(session->routine){
 			case SHELL:
-				if(shell.sopen()){
-					PRINT("Couldn't open shell!")
-					return -1;
+				if(!session->shell.opened){
+					if(session->shell.sopen()){
+						PRINT("Couldn't open shell!")
+						return -1;
+					}
+					Util::set_non_blocking(session->shell.output);
+					struct epoll_event shell_event;
+					std::memset(&shell_event, 0, sizeof(shell_event));
+					shell_event.events = EPOLLIN;
+					shell_event.data.u64 = static_cast<uint64_t>(session->serial) << 32 | static_cast<uint32_t>(fd);
+					if(epoll_ctl(pump_fd, EPOLL_CTL_ADD, session->shell.output, &shell_event) < 0){
+						perror("comd epoll_ctl shell");
+						session->shell.sclose();
+						return -1;
+					}
 				}
-				if((len = write(shell.input, data, static_cast<size_t>(data_length))) < 0){
+				if((len = write(session->shell.input, data, static_cast<size_t>(data_length))) < 0){
 					ERROR("shell input write")
 					return -1;
 				}
 				break;
 			case SEND_FILE:
 			case RECV_FILE:
-				return -1;
+				if(session->transfer == nullptr || session->transfer->on_message(data, static_cast<size_t>(data_length))){
+					return -1;
+				}
+				if(session->transfer->is_finished()){
+					PRINT("File transfer " << (session->transfer->is_intact() ? "complete." : "failed."))
+				}
+				// An acknowledgement opens the window.
+				wake();
+				break;
+			case SYNC_DIRECTORY:
+				if(session->sync == nullptr){
+					return -1;
+				}
+				if(session->sync->on_message(data, static_cast<size_t>(data_length))){
+					// Let com know why before hanging up.
+					session->sync->pump();
+					return -1;
+				}
+				break;
 			}
 		}
 		return data_length;
 	};
 
-	// Easy DDOS protection. (This is not a multi-user tool.)
-	server.on_disconnect = [&](int){
-		shell.sclose();
-		sleep(10);
+	server.on_read = [&](int fd, const char* data, ssize_t data_length)->ssize_t{
+		std::shared_ptr<ComdSession> session = find_session(fd);
+		if(session == nullptr){
+			return -1;
+		}
+		return handle(fd, session.get(), data, data_length);
+	};
+
+	server.on_disconnect = [&](int fd){
+		std::shared_ptr<ComdSession> session;
+		{
+			std::lock_guard<std::mutex> lock(sessions_mutex);
+			auto found = sessions.find(fd);
+			if(found == sessions.end()){
+				return;
+			}
+			session = found->second;
+			sessions.erase(found);
+		}
+		std::lock_guard<std::mutex> lock(session->mutex);
+		close_shell(session.get());
+		session->transfer.reset();
+		session->sync.reset();
 	};
 
-	// Returns and is single threaded.
+	// Returns. One epoll thread, so a closed fd's session is gone before the fd can be accepted again.
 	server.run(true, 1);
 
+	struct epoll_event events[16];
+	int num_events;
 	while(true){
-		if(!shell.opened){
+		if((num_events = epoll_wait(pump_fd, events, 16, -1)) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			perror("comd epoll_wait");
+			return 1;
+		}
+		bool pump = false;
+		for(int i = 0; i < num_events; ++i){
+			if(events[i].data.u64 == 0){
+				uint64_t count;
+				if(read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+					perror("comd wake read");
+				}
+				pump = true;
+				continue;
+			}
+
+			int fd = static_cast<int>(events[i].data.u64 & 0xffffffff);
+			std::shared_ptr<ComdSession> session = find_session(fd);
+			if(session == nullptr){
+				continue;
+			}
+			{
+				std::lock_guard<std::mutex> lock(session->mutex);
+				if(session->serial != events[i].data.u64 >> 32 || !session->shell.opened){
+					continue;
+				}
+				// Each read is one frame, which has to fit in com's buffer like a transfer's chunks.
+				if((len = read(session->shell.output, packet, COMD_CHUNK_SIZE)) < 0){
+					if(errno != EAGAIN && errno != EWOULDBLOCK){
+						ERROR("shell read")
+						close_shell(session.get());
+					}
+				}else if(len == 0){
+					PRINT("shell output read zero")
+					close_shell(session.get());
+				}else{
+					session->queue(packet, static_cast<size_t>(len));
+				}
+				// The shell waits for a client that's too far behind; draining wakes the pump to resume it.
+				if(session->shell.opened && server.queued(fd) > COMD_QUEUED_LIMIT){
+					struct epoll_event shell_event;
+					std::memset(&shell_event, 0, sizeof(shell_event));
+					shell_event.data.u64 = events[i].data.u64;
+					if(epoll_ctl(pump_fd, EPOLL_CTL_MOD, session->shell.output, &shell_event) < 0){
+						perror("comd epoll_ctl pause shell");
+					}
+					session->shell_paused = true;
+				}
+			}
+		}
+		if(!pump){
 			continue;
 		}
-		if((len = read(shell.output, packet, PACKET_LIMIT)) <= 0){
-			ERROR("shell read")
-			shell.sclose();
-		}else if(len == 0){
-			PRINT("shell output read zero")
-			shell.sclose();
-		}else{
-			packet[len] = 0;
-			if(server.send(shell_client_fd, packet, static_cast<size_t>(len))){
-				shell.sclose();
+
+		std::vector<std::pair<int, std::shared_ptr<ComdSession>>> pumping;
+		{
+			std::lock_guard<std::mutex> lock(sessions_mutex);
+			for(auto& entry : sessions){
+				pumping.push_back(entry);
+			}
+		}
+		for(auto& entry : pumping){
+			ComdSession* session = entry.second.get();
+			std::lock_guard<std::mutex> lock(session->mutex);
+			// on_drained wakes this loop again once the client catches up, so the sync's backpressure still holds.
+			if(server.queued(entry.first) > COMD_QUEUED_LIMIT){
+				continue;
+			}
+			if(session->shell_paused && session->shell.opened){
+				struct epoll_event shell_event;
+				std::memset(&shell_event, 0, sizeof(shell_event));
+				shell_event.events = EPOLLIN;
+				shell_event.data.u64 = static_cast<uint64_t>(session->serial) << 32 | static_cast<uint32_t>(entry.first);
+				if(epoll_ctl(pump_fd, EPOLL_CTL_MOD, session->shell.output, &shell_event) < 0){
+					perror("comd epoll_ctl resume shell");
+				}
+			}
+			session->shell_paused = false;
+			if(session->transfer != nullptr && session->transfer->pump()){
+				session->transfer.reset();
+			}
+			if(session->sync != nullptr && session->sync->pump()){
+				session->sync.reset();
 			}
 		}
 	}
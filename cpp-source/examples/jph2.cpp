@@ -3,6 +3,7 @@
 #include <signal.h>
 
 #include "http-api.hpp"
+#include "json-patch.hpp"
 #include "pgsql-model.hpp"
 #include "websocket-server.hpp"
 #include "tls-websocket-server.hpp"
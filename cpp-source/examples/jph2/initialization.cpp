@@ -22,6 +22,11 @@ Util::define_argument("postgresql_connection", connection_string, {"-pcs"});
 Util::parse_arguments(argc, argv, "This is a server application for jph2.net.");
 
 TlsEpollServer server(ssl_certificate, ssl_private_key, static_cast<uint16_t>(https_port), 10);
+if(!server.set_ktls(true)){
+	PRINT("This OpenSSL has no kTLS; static files go through SSL_write.")
+}
+// Renewed certificates are picked up as they're copied in (see scripts/letsencrypt-renew.sh).
+server.watch_certificates();
 SymmetricEncryptor encryptor;
 HttpApi api(public_directory, &server, &encryptor);
 api.set_file_cache_size(cache_megabytes);
@@ -4,6 +4,12 @@
 //WebsocketServer game_server(static_cast<uint16_t>(chat_port), 10);
 TlsWebsocketServer game_server(ssl_certificate, ssl_private_key, static_cast<uint16_t>(chat_port), 10);
 
+// Without context takeover every player gets the same compressed keyframe, so it is only compressed once.
+WebsocketDeflateOptions game_deflate;
+game_deflate.enabled = true;
+game_deflate.server_no_context_takeover = true;
+game_server.set_permessage_deflate(game_deflate);
+
 // Unlike the structure in TcpServer, this structure indicates "joined players".
 // Need to build out a larger UI and corresponding events for players.
 std::unordered_map<int, JsonObject*> client_details;
@@ -28,6 +34,9 @@ std::unordered_map<std::string, double> turnSpeeds;
 JsonObject game_state(OBJECT);
 game_state.objectValues["players"] = new JsonObject(OBJECT);
 
+// Players get JSON Patches of what changed each tick, and a full keyframe about once a second.
+JsonDelta game_delta(60);
+
 // Pixels per tick.
 static const double maxSpeed = 10.0;
 static const double acceleration = 0.05;
@@ -78,15 +87,12 @@ std::thread tick_thread([&]{
 				std::string bcast_msg = "{\"connect\":\"" + event->player + "\"}";
 				//if(client_details[event[fd]]->HasObj("color");
 				//DEBUG("BCAST: " << bcast_msg)
-				for(auto iter = client_details.begin(); iter != client_details.end(); ++iter){
-					game_server.send(iter->first, bcast_msg.c_str(), static_cast<size_t>(bcast_msg.length()));
-				}
+				game_server.publish("tanks", bcast_msg);
 			}else if(event->type == 1){
 				std::string bcast_msg = "{\"disconnect\":\"" + event->player + "\"}";
 				//DEBUG("BCAST: " << bcast_msg)
-				for(auto iter = client_details.begin(); iter != client_details.end(); ++iter){
-					game_server.send(iter->first, bcast_msg.c_str(), static_cast<size_t>(bcast_msg.length()));
-				}
+				game_server.publish("tanks", bcast_msg);
+				game_delta.remove(event->fd);
 				
 				locations.erase(event->player + "tank");
 				rotations.erase(event->player + "tank");
@@ -98,9 +104,7 @@ std::thread tick_thread([&]{
 				game_state["players"]->objectValues.erase(event->player + "tank");
 			}else if(event->type == 2){
 				std::string bcast_msg = "{\"explode\":\"" + event->player + "\"}";
-				for(auto iter = client_details.begin(); iter != client_details.end(); ++iter){
-					game_server.send(iter->first, bcast_msg.c_str(), static_cast<size_t>(bcast_msg.length()));
-				}
+				game_server.publish("tanks", bcast_msg);
 				
 				locations.erase(event->player);
 				rotations.erase(event->player);
@@ -255,13 +259,15 @@ std::thread tick_thread([&]{
 			iter->second->objectValues["ts"]->stringValue = std::to_string(turnSpeeds[name]);
 		}
 		
-		// Broadcast the game state.
-		std::string bcast_msg = game_state.stringify();
-		//DEBUG("bcast_msg" << bcast_msg)
+		// Broadcast what changed in the game state.
+		game_delta.next(&game_state);
 
 		for(auto iter = client_details.begin(); iter != client_details.end(); ++iter){
 			//DEBUG("BC: " << iter->first)
-			game_server.send(iter->first, bcast_msg.c_str(), static_cast<size_t>(bcast_msg.length()));
+			std::string bcast_msg = game_delta.message(iter->first);
+			if(!bcast_msg.empty()){
+				game_server.send(iter->first, bcast_msg.c_str(), static_cast<size_t>(bcast_msg.length()));
+			}
 		}
 		
 		// Time per tick minus the duration of the tick calculations, gives time to wait before next tick.
@@ -309,6 +315,7 @@ game_server.on_read = [&](int fd, const char* data, ssize_t data_length)->ssize_
 			if(msg->HasObj("color", STRING)){
 				client_details[fd]->objectValues["color"] = new JsonObject(msg->GetStr("color"));
 			}
+			game_server.subscribe(fd, "tanks");
 			game_event_queue.push(new Event(0, fd, client_details[fd]->GetStr("handle")));
 		}
 	}else if(msg->HasObj("handle", STRING) &&
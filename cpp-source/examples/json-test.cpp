@@ -1,6 +1,8 @@
 #include <iostream>
 
 #include "json.hpp"
+#include "json-view.hpp"
+#include "json-patch.hpp"
 #include "util.hpp"
 
 static void test(std::string str){
@@ -33,6 +35,41 @@ static void test(std::string str){
 	}
 }
 
+static void test_view(std::string str, const char* key){
+	JsonView view(str.c_str(), str.length());
+
+	std::cout << "----------------------------------------------\n";
+	std::cout << "Viewing:\n" << str << '\n';
+
+	if(!view.is_valid()){
+		std::cout << "Invalid JSON.\n";
+	}else if(view[key] == 0){
+		std::cout << "No " << key << ".\n";
+	}else{
+		std::cout << key << ": " << view[key]->stringify() << '\n';
+	}
+}
+
+static void test_patch(std::string from_str, std::string to_str){
+	JsonObject from;
+	JsonObject to;
+	JsonObject patch(ARRAY);
+	from.parse(from_str.c_str());
+	to.parse(to_str.c_str());
+
+	std::cout << "----------------------------------------------\n";
+	std::cout << "Patching:\n" << from_str << "\nTo:\n" << to_str << '\n';
+
+	JsonPatch::diff(&from, &to, &patch);
+	std::cout << "Patch: " << patch.stringify() << '\n';
+
+	if(JsonPatch::apply(&from, &patch) && JsonPatch::equal(&from, &to)){
+		std::cout << "Applied.\n";
+	}else{
+		std::cout << "Failed to apply.\n";
+	}
+}
+
 int main(){
 	test("   \"apple\"  ");
 	test(" {  \"best fruit\"   :    \"apple\"  } ");
@@ -59,6 +96,15 @@ Music video by Eminem performing ");
 	test("({\"b\":{\"items\":[{\"tags\":[\"Maps\"],\"thumbnail\":{\"hqDefault\":\"hault.jpg\"},\"player\":{\"default\":\"http:/5zh2c\"}}})");
 	test("({\"data\":{\"items\":[{\"tags\":[\"Maps\"],\"thumbnail\":{\"hqDefault\":\"http://i.ytimg.com\"},\"player\":{\"content\":{\"6\":\"rtsp://v1.cache1.c.youtube.com/CiILENy.../0/0/0/video.3gp\"},\"status\":{\"reason\":\"limitedSyndication\"},\"videoRespond\":\"moderated\"}}]}})");
 
+	test_view("{\"route\":\"/api/chat\",\"values\":{\"handle\":\"bwackwat\",\"message\":\"hi\"},\"big\":[\"a\",\"b\"]}", "values");
+	test_view("{\"escaped \\\"key\\\"\":\"found\"}", "escaped \"key\"");
+	test_view("{\"count\": 12, \"ok\": true}", "count");
+	test_view("{\"missing\":\"value\"", "missing");
+
+	test_patch("{\"players\":{\"atank\":{\"x\":\"1\",\"y\":\"2\"}}}", "{\"players\":{\"atank\":{\"x\":\"3\",\"y\":\"2\"},\"btank\":{\"x\":\"0\"}}}");
+	test_patch("{\"list\":[\"a\",\"b\",\"c\"],\"a/b~c\":\"gone\"}", "{\"list\":[\"a\",\"d\"]}");
+	test_patch("{\"object\":\"becomes\"}", "[\"an\",\"array\"]");
+
 	std::cout << "----------------------------------------------\n";
 	std::cout << "Done!\n";
 
@@ -2,6 +2,14 @@
 
 #include "http-api.hpp"
 
+struct MessageRequest{
+	std::string message;
+};
+
+JSON_SCHEMA(MessageRequest){
+	JSON_FIELD(message);
+}
+
 int main(int argc, char **argv){
 	std::string public_directory;
 	std::string ssl_certificate;
@@ -93,16 +101,16 @@ int main(int argc, char **argv){
 		return response.stringify(false);
 	}, {{"token", STRING}, {"data", OBJECT}});*/
 
-	api.route("POST", "/message", [&](JsonObject* json)->std::string{
+	api.route<MessageRequest>("POST", "/message", [&](MessageRequest* request)->std::string{
 		message_mutex.lock();
-		messages.push_front(json->objectValues["message"]->stringValue);
+		messages.push_front(request->message);
 		if(messages.size() > 100){
 			messages.pop_back();
 		}
 		message_mutex.unlock();
 
 		return "{\"result\":\"Message posted.\"}";
-	}, {{"message", STRING}});
+	});
 
 	api.route("GET", "/host-service", [&](JsonObject* json)->std::string{
 		if(json->GetStr("token") != password){
@@ -1,6 +1,13 @@
 #include <string>
 #include <iostream>
 #include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -14,9 +21,12 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "simple-tcp-client.hpp"
+#include "ponal-cluster.hpp"
+#include "ponal-protocol.hpp"
 #include "util.hpp"
 
 static int get_line(std::istream& is, std::string& result){
@@ -43,16 +53,184 @@ static int get_line(std::istream& is, std::string& result){
 	}
 }
 
+/**
+ * @brief Runs one command against a cluster, answering as ponald would.
+ */
+static std::string cluster_command(PonalClient* client, const std::string& request){
+	if(request.compare(0, 4, "get ") == 0){
+		std::string value;
+		return client->get(request.substr(4), &value) == PONAL_OK ? value : "failure";
+	}else if(request.compare(0, 4, "del ") == 0){
+		return client->remove(request.substr(4)) == PONAL_OK ? "success" : "failure";
+	}else if(request.compare(0, 4, "set ") == 0){
+		size_t space = request.find(' ', 4);
+		if(space == std::string::npos || space == 4 || space + 1 == request.length()){
+			return "failure";
+		}
+		return client->set(request.substr(4, space - 4), request.substr(space + 1)) == PONAL_OK ? "success" : "failure";
+	}
+	return "failure";
+}
+
+/// What each benchmark connection does; see the arguments in main.
+struct PonalBenchmark{
+	struct in_addr address;
+	uint16_t port;
+	int requests;
+	int pipeline;
+	int batch;
+	int keys;
+	std::string value;
+	std::atomic<unsigned long> operations;
+	std::atomic<unsigned long> errors;
+};
+
+static bool write_all(int fd, const std::string& data){
+	size_t written = 0;
+	while(written < data.length()){
+		ssize_t len = write(fd, data.data() + written, data.length() - written);
+		if(len < 0){
+			perror("write");
+			return true;
+		}
+		written += static_cast<size_t>(len);
+	}
+	return false;
+}
+
+/**
+ * @brief One connection's share of a benchmark: requests of batch keys each, pipeline of them in flight at a time,
+ * all sets or all gets of random keys.
+ */
+static void benchmark_connection(PonalBenchmark* benchmark, bool setting, unsigned int seed){
+	SimpleTcpClient client(benchmark->address, benchmark->port);
+	if(!client.connected){
+		benchmark->errors += static_cast<unsigned long>(benchmark->requests);
+		return;
+	}
+	int nodelay = 1;
+	if(setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0){
+		perror("setsockopt TCP_NODELAY");
+	}
+	std::mt19937 random(seed);
+	std::uniform_int_distribution<int> pick(0, benchmark->keys - 1);
+	std::string out;
+	PonalFrames frames;
+	char in[65536];
+	for(int sent = 0; sent < benchmark->requests;){
+		out.clear();
+		int in_flight = 0;
+		for(; in_flight < benchmark->pipeline && sent < benchmark->requests; ++in_flight, ++sent){
+			size_t start = PonalProtocol::begin(&out, benchmark->batch == 1 ? (setting ? PONAL_SET : PONAL_GET) : (setting ? PONAL_MSET : PONAL_MGET));
+			for(int i = 0; i < benchmark->batch; ++i){
+				PonalProtocol::put_key(&out, "key:" + std::to_string(pick(random)));
+				if(setting && benchmark->batch > 1){
+					PonalProtocol::put_uint32(&out, static_cast<uint32_t>(benchmark->value.length()));
+				}
+				if(setting){
+					out.append(benchmark->value);
+				}
+			}
+			PonalProtocol::end(&out, start);
+		}
+		if(write_all(client.fd, out)){
+			benchmark->errors += static_cast<unsigned long>(in_flight);
+			return;
+		}
+		int replies = 0;
+		while(replies < in_flight){
+			ssize_t len = read(client.fd, in, sizeof(in));
+			if(len <= 0){
+				benchmark->errors += static_cast<unsigned long>(in_flight - replies);
+				return;
+			}
+			frames.feed(in, static_cast<size_t>(len), [&](const char* frame, size_t frame_length){
+				replies++;
+				if(frame_length == 0 || frame[0] == PONAL_REPLY_ERROR){
+					benchmark->errors++;
+				}
+				return false;
+			});
+		}
+		benchmark->operations += static_cast<unsigned long>(in_flight * benchmark->batch);
+	}
+}
+
+/**
+ * @brief Runs a set then a get phase over connections at once, and prints how many keys per second each managed.
+ */
+static void run_benchmark(PonalBenchmark* benchmark, int connections){
+	const char* phases[] = {"set", "get"};
+	for(int phase = 0; phase < 2; ++phase){
+		benchmark->operations = 0;
+		benchmark->errors = 0;
+		auto started = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for(int i = 0; i < connections; ++i){
+			threads.push_back(std::thread(benchmark_connection, benchmark, phase == 0, static_cast<unsigned int>(i * 2 + phase)));
+		}
+		for(std::thread& thread : threads){
+			thread.join();
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+		PRINT(phases[phase] << ": " << benchmark->operations << " keys in " << seconds << "s, " <<
+			static_cast<unsigned long>(static_cast<double>(benchmark->operations) / seconds) << " keys/s, " << benchmark->errors << " errors")
+	}
+}
+
 int main(int argc, char** argv){
 	int terminal = isatty(fileno(stdin));
 	std::string hostname = "localhost";
 	int port;
+	std::string keyfile;
+	std::string seed;
+	int benchmark_requests = 0;
+	int connections = 4;
+	int pipeline = 64;
+	int batch = 1;
+	int keys = 100000;
+	int value_size = 16;
 
 	Util::define_argument("hostname", hostname, {"-hn"});
 	Util::define_argument("port", &port, {"-p"});
-	Util::parse_arguments(argc, argv, "This is a simple client to ponald for command-line communication.");
+	Util::define_argument("keyfile", keyfile, {"-k"});
+	Util::define_argument("seed", seed, {"-s"});
+	Util::define_argument("benchmark", &benchmark_requests, {"-b"});
+	Util::define_argument("connections", &connections, {"-c"});
+	Util::define_argument("pipeline", &pipeline, {"-pl"});
+	Util::define_argument("batch", &batch, {"-bt"});
+	Util::define_argument("keys", &keys, {"-ks"});
+	Util::define_argument("value_size", &value_size, {"-vs"});
+	Util::parse_arguments(argc, argv, "This is a simple client to ponald for command-line communication. "
+		"Given a keyfile and seed (ip:port of any node's cluster port), it talks to a ponald cluster, sending each key straight to a node that keeps it. "
+		"Given benchmark, it instead loads ponald over the binary protocol: that many requests per connection, pipeline of them in flight, "
+		"batch keys each (MSET/MGET past 1), sets then gets.");
 
-	SimpleTcpClient client(hostname, static_cast<uint16_t>(port));
+	if(benchmark_requests > 0){
+		struct hostent* host;
+		if((host = gethostbyname(hostname.c_str())) == 0){
+			ERROR("gethostbyname")
+			return 1;
+		}
+		PonalBenchmark benchmark;
+		benchmark.address = *reinterpret_cast<struct in_addr*>(host->h_addr);
+		benchmark.port = static_cast<uint16_t>(port);
+		benchmark.requests = benchmark_requests;
+		benchmark.pipeline = std::max(pipeline, 1);
+		benchmark.batch = std::max(batch, 1);
+		benchmark.keys = std::max(keys, 1);
+		benchmark.value.assign(static_cast<size_t>(std::max(value_size, 1)), 'v');
+		run_benchmark(&benchmark, std::max(connections, 1));
+		return 0;
+	}
+
+	std::unique_ptr<SimpleTcpClient> client;
+	std::unique_ptr<PonalClient> cluster;
+	if(keyfile.empty()){
+		client.reset(new SimpleTcpClient(hostname, static_cast<uint16_t>(port)));
+	}else{
+		cluster.reset(new PonalClient(seed, keyfile));
+	}
 
 	std::string request;
 	char response[PACKET_LIMIT];
@@ -64,9 +242,15 @@ int main(int argc, char** argv){
 			continue;
 		}
 
-		client.communicate(request.c_str(), request.length(), response);
-
-		std::cout << response;
+		if(cluster != nullptr){
+			if(request == "exit"){
+				break;
+			}
+			std::cout << cluster_command(cluster.get(), request);
+		}else{
+			client->communicate(request.c_str(), request.length(), response);
+			std::cout << response;
+		}
 		if(terminal)
 			std::cout << std::endl;
 		
@@ -0,0 +1,150 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <cstdlib>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ponal-log.hpp"
+#include "ponal-store.hpp"
+#include "util.hpp"
+
+static int failures = 0;
+
+static std::string read_file(const std::string& path){
+	std::ifstream in(path, std::ios::binary);
+	std::stringstream contents;
+	contents << in.rdbuf();
+	return contents.str();
+}
+
+static void write_file(const std::string& path, const std::string& contents){
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	out << contents;
+}
+
+static std::string set_record(const std::string& key, const std::string& value){
+	std::string out;
+	PonalLog::record(&out, PONAL_CHANGE_SET, key.data(), key.length(), value.data(), value.length(), 0, 0);
+	return out;
+}
+
+/**
+ * @brief Opens a new store over directory, and checks that each key has its value, or is missing if that's empty.
+ */
+static void verify(const std::string& directory, const std::vector<std::pair<std::string, std::string>>& expected){
+	PonalStore store;
+	PonalLog log(directory, PONAL_FSYNC_ALWAYS);
+	if(log.open(&store)){
+		std::cout << "Open Failure...\n";
+		failures++;
+		return;
+	}
+	for(const auto& entry : expected){
+		std::string value;
+		bool found = store.get(entry.first, &value);
+		std::cout << entry.first << ": " << (found ? value : "(missing)") << '\n';
+		if(found != !entry.second.empty() || value != entry.second){
+			std::cout << "Verification Failure...\n";
+			failures++;
+			return;
+		}
+	}
+	std::cout << "Verification Success!\n";
+}
+
+/**
+ * @brief Writes keys through a PonalLog, as ponald would.
+ */
+static void write_log(const std::string& directory, const std::vector<std::pair<std::string, std::string>>& entries){
+	PonalStore store;
+	PonalLog log(directory, PONAL_FSYNC_ALWAYS);
+	if(log.open(&store)){
+		std::cout << "Open Failure...\n";
+		failures++;
+		return;
+	}
+	for(const auto& entry : entries){
+		store.set(entry.first, entry.second);
+	}
+	if(log.sync()){
+		std::cout << "Sync Failure...\n";
+		failures++;
+	}
+}
+
+static std::string fresh_directory(const std::string& base, const char* name){
+	std::string directory = base + '/' + name;
+	if(mkdir(directory.c_str(), 0755) < 0){
+		perror("ponal-log-test mkdir");
+	}
+	return directory;
+}
+
+int main(){
+	char base[] = "/tmp/ponal-log-test.XXXXXX";
+	if(mkdtemp(base) == 0){
+		perror("ponal-log-test mkdtemp");
+		return 1;
+	}
+
+	std::cout << "----------------------------------------------\n";
+	std::cout << "Reloading a log:\n";
+	std::string directory = fresh_directory(base, "reload");
+	write_log(directory, {{"a", "1"}, {"b", "2"}, {"a", "3"}});
+	verify(directory, {{"a", "3"}, {"b", "2"}});
+
+	std::cout << "----------------------------------------------\n";
+	std::cout << "A corrupt record in the middle is skipped, and the ones after it still load:\n";
+	directory = fresh_directory(base, "corrupt");
+	write_log(directory, {{"a", "1"}, {"b", "2"}, {"c", "3"}});
+	std::string contents = read_file(directory + "/ponal.log");
+	size_t middle = set_record("a", "1").length();
+	// The last byte of b's value.
+	contents[middle + set_record("b", "2").length() - 1] ^= 0x55;
+	write_file(directory + "/ponal.log", contents);
+	verify(directory, {{"a", "1"}, {"b", ""}, {"c", "3"}});
+
+	std::cout << "----------------------------------------------\n";
+	std::cout << "A torn record at the end is cut off:\n";
+	directory = fresh_directory(base, "torn");
+	write_log(directory, {{"a", "1"}, {"b", "22222222"}});
+	contents = read_file(directory + "/ponal.log");
+	write_file(directory + "/ponal.log", contents.substr(0, contents.length() - 3));
+	verify(directory, {{"a", "1"}, {"b", ""}});
+	size_t length = read_file(directory + "/ponal.log").length();
+	std::cout << "Log length: " << length << '\n';
+	if(length != set_record("a", "1").length()){
+		std::cout << "Truncation Failure...\n";
+		failures++;
+	}
+
+	std::cout << "----------------------------------------------\n";
+	std::cout << "Killed mid-compaction, ponal.log.old is replayed over a newer snapshot, then the log:\n";
+	directory = fresh_directory(base, "compaction");
+	// b changed and c was removed after the log was moved aside; the snapshot had caught some of that.
+	write_file(directory + "/ponal.log.old", set_record("a", "1") + set_record("b", "old") + set_record("c", "3"));
+	write_file(directory + "/ponal.snapshot", set_record("a", "1") + set_record("b", "new"));
+	std::string removal;
+	PonalLog::record(&removal, PONAL_CHANGE_REMOVE, "c", 1, "", 0, 0, 0);
+	write_file(directory + "/ponal.log", set_record("b", "new") + removal + set_record("d", "4"));
+	verify(directory, {{"a", "1"}, {"b", "new"}, {"c", ""}, {"d", "4"}});
+	bool old_left = access((directory + "/ponal.log.old").c_str(), F_OK) == 0;
+	std::cout << "ponal.log.old " << (old_left ? "left behind" : "compacted away") << '\n';
+	if(old_left){
+		failures++;
+	}
+	// And again, from the snapshot the compaction on open wrote.
+	verify(directory, {{"a", "1"}, {"b", "new"}, {"c", ""}, {"d", "4"}});
+
+	std::cout << "----------------------------------------------\n";
+	std::cout << (failures == 0 ? "All passed.\n" : "Some failed.\n");
+	std::string command = std::string("rm -rf ") + base;
+	if(system(command.c_str()) != 0){
+		perror("ponal-log-test rm");
+	}
+	return failures == 0 ? 0 : 1;
+}
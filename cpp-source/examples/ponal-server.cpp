@@ -1,8 +1,12 @@
 #include <string>
 #include <cstring>
 #include <iostream>
+#include <sstream>
+#include <algorithm>
 #include <unordered_map>
 #include <thread>
+#include <mutex>
+#include <memory>
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -15,96 +19,438 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "util.hpp"
 #include "tcp-server.hpp"
+#include "ponal-store.hpp"
+#include "ponal-cluster.hpp"
+#include "ponal-protocol.hpp"
+#include "ponal-log.hpp"
 
-static std::unordered_map<std::string, std::string> values;
+static PonalStore values;
+// Only set when clustered, in which case values holds this node's share of the keys.
+static std::unique_ptr<PonalCluster> cluster;
+// Only set when given a data directory to keep values in.
+static std::unique_ptr<PonalLog> journal;
 
-static int set_value(const char* key_and_value){
-	int get_key = 1;
-	std::string key = "";
-	std::string value = "";
-	for(const char* it = key_and_value; *it; ++it){
-		if(*it == ' ' && get_key){
-			get_key = 0;
-			continue;
+/// A connection's protocol, known from its first byte, and the binary frame its last read left unfinished.
+struct PonalConnection{
+	bool started;
+	bool binary;
+	int transactions;
+	PonalFrames frames;
+
+	PonalConnection()
+	:started(false), binary(false), transactions(0){}
+};
+
+/**
+ * @brief Appends the value of key to out.
+ *
+ * @return false if there's no such key, or no quorum for it.
+ */
+static bool get_value(const char* key, size_t key_length, std::string* out){
+	if(cluster != nullptr){
+		std::string value;
+		if(cluster->get(std::string(key, key_length), &value) != PONAL_OK){
+			return false;
 		}
-		if(get_key){
-			key += *it;
-		}else{
-			value += *it;
+		out->append(value);
+		return true;
+	}
+	return values.get(key, key_length, out);
+}
+
+/**
+ * @brief Sets key, to expire at expires (milliseconds since the epoch) unless that's 0. Clusters don't keep expiry times.
+ *
+ * @return true on failure.
+ */
+static bool set_value(const char* key, size_t key_length, const char* value, size_t value_length, uint64_t expires = 0){
+	if(key_length == 0 || value_length == 0){
+		return true;
+	}
+	if(cluster != nullptr){
+		return expires != 0 || cluster->set(std::string(key, key_length), std::string(value, value_length)) != PONAL_OK;
+	}
+	values.set(key, key_length, value, value_length, 0, false, expires);
+	return false;
+}
+
+/**
+ * @return true if key was there to expire.
+ */
+static bool expire_value(const char* key, size_t key_length, uint64_t expires){
+	return cluster == nullptr && values.expire(key, key_length, expires);
+}
+
+/**
+ * @brief When something set to live for ttl_ms from now expires.
+ */
+static uint64_t expiry(uint64_t ttl_ms){
+	return PonalStore::now_ms() + ttl_ms;
+}
+
+static std::string stats_text(){
+	PonalStats stats = values.stats();
+	uint64_t reads = stats.hits + stats.misses;
+	std::stringstream text;
+	text << "keys " << stats.keys << "\n"
+		<< "memory " << stats.memory << "\n"
+		<< "max_memory " << stats.max_memory << "\n"
+		<< "hits " << stats.hits << "\n"
+		<< "misses " << stats.misses << "\n"
+		<< "hit_rate " << (reads == 0 ? 0.0 : static_cast<double>(stats.hits) / static_cast<double>(reads)) << "\n"
+		<< "expired " << stats.expired << "\n"
+		<< "evicted " << stats.evicted;
+	return text.str();
+}
+
+/**
+ * @return true if key was there to remove.
+ */
+static bool remove_value(const char* key, size_t key_length){
+	if(cluster != nullptr){
+		std::string value;
+		std::string name(key, key_length);
+		return cluster->get(name, &value) == PONAL_OK && cluster->remove(name) == PONAL_OK;
+	}
+	return values.remove(key, key_length);
+}
+
+/**
+ * @brief Waits for the changes made so far to be as durable as asked for, before they're acknowledged.
+ *
+ * @return true if they couldn't be kept.
+ */
+static bool durable(){
+	return journal != nullptr && journal->sync();
+}
+
+/**
+ * @brief Runs one binary request and appends its reply to out. A malformed request gets an error reply.
+ */
+static void execute(const char* frame, size_t frame_length, std::string* out){
+	const char* it = frame + 1;
+	const char* end = frame + frame_length;
+	const char* key;
+	size_t key_length;
+	uint32_t ttl_ms;
+	uint32_t count = 0;
+	bool failed = frame_length == 0;
+	size_t start = PonalProtocol::begin(out, PONAL_REPLY_OK);
+
+	switch(failed ? 0 : frame[0]){
+	case PONAL_GET:
+		if(PonalProtocol::next_key(&it, end, &key, &key_length) || it != end){
+			failed = true;
+		}else if(!get_value(key, key_length, out)){
+			(*out)[start + 4] = PONAL_REPLY_NOT_FOUND;
+		}
+		break;
+	case PONAL_SET:
+		failed = PonalProtocol::next_key(&it, end, &key, &key_length) ||
+			set_value(key, key_length, it, static_cast<size_t>(end - it));
+		break;
+	case PONAL_MGET:
+		while(!failed && it < end){
+			if(PonalProtocol::next_key(&it, end, &key, &key_length)){
+				failed = true;
+				break;
+			}
+			size_t item = out->length();
+			out->push_back(PONAL_REPLY_OK);
+			out->append(4, '\0');
+			if(get_value(key, key_length, out)){
+				// The value's length, filled in like a frame's.
+				PonalProtocol::end(out, item + 1);
+			}else{
+				(*out)[item] = PONAL_REPLY_NOT_FOUND;
+			}
+		}
+		break;
+	case PONAL_MSET:
+		while(!failed && it < end){
+			uint32_t value_length;
+			if(PonalProtocol::next_key(&it, end, &key, &key_length) || PonalProtocol::next_uint32(&it, end, &value_length) ||
+			static_cast<size_t>(end - it) < value_length || set_value(key, key_length, it, value_length)){
+				failed = true;
+				break;
+			}
+			it += value_length;
 		}
+		break;
+	case PONAL_DEL:
+		while(!failed && it < end){
+			if(PonalProtocol::next_key(&it, end, &key, &key_length)){
+				failed = true;
+				break;
+			}
+			if(remove_value(key, key_length)){
+				count++;
+			}
+		}
+		PonalProtocol::put_uint32(out, count);
+		break;
+	case PONAL_SETEX:
+		failed = PonalProtocol::next_uint32(&it, end, &ttl_ms) || ttl_ms == 0 || PonalProtocol::next_key(&it, end, &key, &key_length) ||
+			set_value(key, key_length, it, static_cast<size_t>(end - it), expiry(ttl_ms));
+		break;
+	case PONAL_EXPIRE:
+		failed = PonalProtocol::next_uint32(&it, end, &ttl_ms);
+		while(!failed && it < end){
+			if(PonalProtocol::next_key(&it, end, &key, &key_length)){
+				failed = true;
+				break;
+			}
+			if(expire_value(key, key_length, ttl_ms == 0 ? 0 : expiry(ttl_ms))){
+				count++;
+			}
+		}
+		PonalProtocol::put_uint32(out, count);
+		break;
+	case PONAL_STATS:
+		out->append(stats_text());
+		break;
+	default:
+		failed = true;
+		break;
 	}
-	if(key.length() == 0 || value.length() == 0){
-		return 1;
+
+	if(failed){
+		out->resize(start);
+		PonalProtocol::begin(out, PONAL_REPLY_ERROR);
 	}
-	values[key] = value;
-	return 0;
+	PonalProtocol::end(out, start);
+}
+
+/**
+ * @brief Reads a whole number of seconds, at least 1, as milliseconds.
+ *
+ * @return true if text isn't one.
+ */
+static bool parse_seconds(const char* text, size_t text_length, uint64_t* ms){
+	std::string seconds(text, text_length);
+	char* end;
+	long long value = std::strtoll(seconds.c_str(), &end, 10);
+	if(seconds.empty() || *end != '\0' || value <= 0 || value > 315360000000LL){
+		return true;
+	}
+	*ms = static_cast<uint64_t>(value) * 1000;
+	return false;
 }
 
-static std::string get_command_from_request(const char* request){
-	std::string command = "";
-	for(const char* it = request; *it; ++it){
-		if(*it == ' '){
-			return command;
+/**
+ * @brief Runs one text command, noting whether it changed anything.
+ *
+ * @return The reply, or empty for "exit".
+ */
+static std::string text_command(const char* packet, size_t packet_length, bool* changed){
+	std::string response = "success";
+	const char* end = packet + packet_length;
+	*changed = false;
+	if(packet_length >= 4 && std::strncmp(packet, "get ", 4) == 0){
+		response.clear();
+		if(!get_value(packet + 4, packet_length - 4, &response)){
+			response = "failure";
+		}
+	}else if(packet_length >= 4 && std::strncmp(packet, "set ", 4) == 0){
+		const char* key = packet + 4;
+		const char* space = static_cast<const char*>(std::memchr(key, ' ', packet_length - 4));
+		*changed = true;
+		if(space == nullptr || set_value(key, static_cast<size_t>(space - key), space + 1, static_cast<size_t>(end - space - 1))){
+			response = "failure";
+		}
+	}else if(packet_length >= 6 && std::strncmp(packet, "setex ", 6) == 0){
+		const char* key = packet + 6;
+		const char* space = static_cast<const char*>(std::memchr(key, ' ', packet_length - 6));
+		const char* second_space = space == nullptr ? nullptr : static_cast<const char*>(std::memchr(space + 1, ' ', static_cast<size_t>(end - space - 1)));
+		uint64_t ttl_ms;
+		*changed = true;
+		if(second_space == nullptr || parse_seconds(space + 1, static_cast<size_t>(second_space - space - 1), &ttl_ms) ||
+		set_value(key, static_cast<size_t>(space - key), second_space + 1, static_cast<size_t>(end - second_space - 1), expiry(ttl_ms))){
+			response = "failure";
+		}
+	}else if(packet_length >= 7 && std::strncmp(packet, "expire ", 7) == 0){
+		const char* key = packet + 7;
+		const char* space = static_cast<const char*>(std::memchr(key, ' ', packet_length - 7));
+		uint64_t ttl_ms;
+		*changed = true;
+		if(space == nullptr || parse_seconds(space + 1, static_cast<size_t>(end - space - 1), &ttl_ms) ||
+		!expire_value(key, static_cast<size_t>(space - key), expiry(ttl_ms))){
+			response = "failure";
+		}
+	}else if(packet_length >= 8 && std::strncmp(packet, "persist ", 8) == 0){
+		*changed = true;
+		if(!expire_value(packet + 8, packet_length - 8, 0)){
+			response = "failure";
+		}
+	}else if(packet_length >= 4 && std::strncmp(packet, "ttl ", 4) == 0){
+		std::string value;
+		bool deleted;
+		uint64_t expires = 0;
+		if(cluster != nullptr || !values.lookup(packet + 4, packet_length - 4, &value, nullptr, &deleted, &expires) || deleted){
+			response = "failure";
+		}else if(expires == 0){
+			response = "-1";
 		}else{
-			command += *it;
+			uint64_t now = PonalStore::now_ms();
+			// Whole seconds left, rounded up, so that a key about to go still reads as 1.
+			response = std::to_string(expires > now ? (expires - now + 999) / 1000 : 0);
+		}
+	}else if(packet_length >= 4 && std::strncmp(packet, "del ", 4) == 0){
+		*changed = true;
+		if(!remove_value(packet + 4, packet_length - 4)){
+			response = "failure";
+		}
+	}else if(packet_length == 5 && std::strncmp(packet, "stats", 5) == 0){
+		response = stats_text();
+	}else if(packet_length == 4 && std::strncmp(packet, "exit", 4) == 0){
+		response.clear();
+	}else{
+		if(Util::verbose){
+			const char* space = static_cast<const char*>(std::memchr(packet, ' ', packet_length));
+			std::cout << "Unknown command: " << std::string(packet, space == nullptr ? packet_length : static_cast<size_t>(space - packet)) << std::endl;
 		}
+		response = "failure";
 	}
-	return command;
+	return response;
 }
 
-static const char* get_command = "get ";
-static const char* set_command = "set ";
-static const char* exit_command = "exit";
-
 int main(int argc, char** argv){
 	int port;
+	int max_connections = 1024;
+	std::string keyfile;
+	std::string seed;
+	int cluster_port = 30000;
+	int replicas = 3;
+	int read_quorum = 0;
+	int write_quorum = 0;
+	std::string data_directory;
+	std::string fsync_policy = "1000";
+	int max_memory = 0;
+	std::string eviction = "lru";
 
 	Util::define_argument("port", &port, {"-p"});
-	Util::parse_arguments(argc, argv, "This is a simple key-value server.");
+	Util::define_argument("max_connections", &max_connections, {"-c"});
+	Util::define_argument("keyfile", keyfile, {"-k"});
+	Util::define_argument("cluster_port", &cluster_port, {"-cp"});
+	Util::define_argument("seed", seed, {"-s"});
+	Util::define_argument("replicas", &replicas, {"-r"});
+	Util::define_argument("read_quorum", &read_quorum, {"-rq"});
+	Util::define_argument("write_quorum", &write_quorum, {"-wq"});
+	Util::define_argument("data_directory", data_directory, {"-d"});
+	Util::define_argument("fsync", fsync_policy, {"-f"});
+	Util::define_argument("max_memory", &max_memory, {"-m"});
+	Util::define_argument("eviction", eviction, {"-e"});
+	Util::parse_arguments(argc, argv, "This is a simple key-value server. Given a keyfile, it joins the cluster of ponal servers at seed (ip:port), "
+		"keeping each key on replicas of them; reads and writes wait for a quorum, a majority of the replicas unless given. "
+		"Given a data directory, values survive restarts; changes are forced to disk before they're acknowledged (always), "
+		"every so many milliseconds, or never. Given a max memory in MiB, the least recently (lru) or frequently (lfu) read "
+		"keys are evicted to stay under it.");
 
-	EpollServer server(static_cast<uint16_t>(port), 10);
+	if(eviction != "lru" && eviction != "lfu"){
+		ERROR("eviction must be lru or lfu, not " << eviction << ",")
+		return 1;
+	}
+	values.limit(static_cast<size_t>(std::max(max_memory, 0)) * 1024 * 1024, eviction == "lfu" ? PONAL_EVICT_LFU : PONAL_EVICT_LRU);
 
-	std::string response;
-	std::unordered_map<int, int> transaction;
+	if(!data_directory.empty()){
+		PonalFsync policy;
+		int interval_ms = 0;
+		if(PonalLog::parse_policy(fsync_policy, &policy, &interval_ms)){
+			ERROR("fsync must be always, never or a number of milliseconds, not " << fsync_policy << ",")
+			return 1;
+		}
+		journal.reset(new PonalLog(data_directory, policy, interval_ms));
+		if(journal->open(&values)){
+			return 1;
+		}
+	}
+
+	if(!keyfile.empty()){
+		size_t majority = static_cast<size_t>(replicas) / 2 + 1;
+		cluster.reset(new PonalCluster(&values, keyfile, static_cast<uint16_t>(cluster_port), static_cast<size_t>(replicas),
+			read_quorum > 0 ? static_cast<size_t>(read_quorum) : majority, write_quorum > 0 ? static_cast<size_t>(write_quorum) : majority));
+		cluster->on_written = durable;
+		size_t colon = seed.rfind(':');
+		if(colon != std::string::npos){
+			cluster->add_seed(seed.substr(0, colon).c_str(), static_cast<uint16_t>(std::atoi(seed.substr(colon + 1).c_str())));
+		}
+	}
+
+	EpollServer server(static_cast<uint16_t>(port), static_cast<size_t>(max_connections));
+
+	std::mutex connections_mutex;
+	std::unordered_map<int, std::shared_ptr<PonalConnection>> connections;
 
 	server.on_connect = [&](int fd){
-		transaction[fd] = 0;
+		// Replies are already gathered per read, so holding back the last bit of them only adds latency.
+		int nodelay = 1;
+		if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0){
+			perror("setsockopt TCP_NODELAY");
+		}
+		std::lock_guard<std::mutex> lock(connections_mutex);
+		connections[fd] = std::make_shared<PonalConnection>();
 	};
 
-	server.on_read = [&](int fd, const char* packet, size_t){
-		if(Util::verbose)
-			std::cout << "Connection #" << fd << " transaction #" << transaction[fd] << ": " << packet << std::endl;
-		
-		response = "success";
-		if(Util::strict_compare_inequal(packet, get_command, 4) == 0){
-			if(values.count(packet + 4) > 0){
-				response = values[packet + 4];
-			}else{
-				response = "failure";
+	server.on_disconnect = [&](int fd){
+		std::lock_guard<std::mutex> lock(connections_mutex);
+		connections.erase(fd);
+	};
+
+	server.on_read = [&](int fd, const char* packet, size_t packet_length)->ssize_t{
+		// Only one thread at a time reads a given connection, so the connection itself needs no lock.
+		connections_mutex.lock();
+		std::shared_ptr<PonalConnection> connection = connections[fd];
+		connections_mutex.unlock();
+		if(connection == nullptr){
+			return -1;
+		}
+		if(!connection->started){
+			connection->started = true;
+			connection->binary = packet[0] == 0;
+		}
+
+		if(connection->binary){
+			// Every request that's complete is run, and the replies go out together.
+			std::string out;
+			bool changed = false;
+			if(connection->frames.feed(packet, packet_length, [&](const char* frame, size_t frame_length){
+				execute(frame, frame_length, &out);
+				changed = changed || (frame_length > 0 && (frame[0] == PONAL_SET || frame[0] == PONAL_MSET || frame[0] == PONAL_DEL ||
+					frame[0] == PONAL_SETEX || frame[0] == PONAL_EXPIRE));
+				connection->transactions++;
+				return false;
+			})){
+				ERROR("ponald bad frame from " << fd)
+				return -1;
 			}
-		}else if(Util::strict_compare_inequal(packet, set_command, 4) == 0){
-			if(set_value(packet + 4) != 0){
-				response = "failure";
+			// One wait covers the whole batch, however many changes it made.
+			if(changed && durable()){
+				return -1;
 			}
-		}else if(Util::strict_compare_inequal(packet, exit_command, 4) == 0){
-			return true;
-		}else{
-			if(Util::verbose)
-				std::cout << "Unknown command: " << get_command_from_request(packet) << std::endl;
-			response = "failure";
+			if(!out.empty() && server.send(fd, out)){
+				return -1;
+			}
+			return static_cast<ssize_t>(packet_length);
 		}
 
-		transaction[fd]++;
-
-		if(write(fd, response.c_str(), response.length()) < 0){
-			ERROR("write")
-			return true;
+		if(Util::verbose){
+			std::cout << "Connection #" << fd << " transaction #" << connection->transactions << ": " << packet << std::endl;
+		}
+		bool changed;
+		std::string response = text_command(packet, packet_length, &changed);
+		connection->transactions++;
+		if(changed && durable()){
+			return -1;
+		}
+		if(response.empty() || server.send(fd, response)){
+			return -1;
 		}
-		return false;
+		return static_cast<ssize_t>(packet_length);
 	};
 
 	server.run();
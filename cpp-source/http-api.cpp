@@ -52,6 +52,32 @@ bool requires_human){
 	this->routemap[method + " /api" + path] = new Route(function, requires, rate_limit, requires_human);
 }
 
+/**
+ * @brief Adds a route whose request body is parsed on demand.
+ *
+ * The body is validated, but only the keys the function (and requires) look at are indexed and
+ * materialized. Headers and URL parameters are still reachable through the view.
+ */
+void HttpApi::route(std::string method, std::string path, std::function<std::string(JsonView*)> function,
+std::unordered_map<std::string, JsonType> requires,
+std::chrono::milliseconds rate_limit,
+bool requires_human){
+	if(path[path.length() - 1] != '/'){
+		path += '/';
+	}
+	this->routemap[method + " /api" + path] = new Route(function, requires, rate_limit, requires_human);
+}
+
+void HttpApi::add_typed_route(std::string method, std::string path, std::function<std::string(const char*, size_t, JsonObject*)> function,
+std::unordered_map<std::string, JsonType> requires,
+std::chrono::milliseconds rate_limit,
+bool requires_human){
+	if(path[path.length() - 1] != '/'){
+		path += '/';
+	}
+	this->routemap[method + " /api" + path] = new Route(function, requires, rate_limit, requires_human);
+}
+
 struct Question{
 	std::string q;
 	std::vector<std::string> a;
@@ -98,32 +124,53 @@ void HttpApi::start(void){
 		client_questions[fd] = get_question();
 	};
 
+	this->server->on_disconnect = [&](int fd){
+		std::lock_guard<std::mutex> lock(this->partial_requests_mutex);
+		this->partial_requests.erase(fd);
+	};
+
 	this->server->on_read = [&](int fd, const char* data, ssize_t data_length)->ssize_t{
 		//DEBUG("RECV:" << data)
+
+		// The rest of a request whose body was still on its way.
+		std::string partial_request;
+		ssize_t read_length = data_length;
+		{
+			std::lock_guard<std::mutex> lock(this->partial_requests_mutex);
+			auto found = this->partial_requests.find(fd);
+			if(found != this->partial_requests.end()){
+				partial_request.swap(found->second);
+				this->partial_requests.erase(found);
+				partial_request.append(data, static_cast<size_t>(data_length));
+				data = partial_request.c_str();
+				data_length = static_cast<ssize_t>(partial_request.length());
+			}
+		}
 		
 		JsonObject r_obj(OBJECT);
-		enum RequestResult r_type = Util::parse_http_api_request(data, &r_obj);
+		const char* body = 0;
+		size_t body_length = 0;
+		enum RequestResult r_type = Util::parse_http_api_request(data, &r_obj, &body, static_cast<size_t>(data_length));
+		if(body != 0){
+			body_length = static_cast<size_t>(data_length) - static_cast<size_t>(body - data);
+		}
 
 		std::string response_header = default_header;
 		std::string response_body = std::string();
 		std::string response = std::string();
 		
 		if(r_type == JSON){
-			char json_data[PACKET_LIMIT + 32];
-			
-			auto get_body_callback = [&](int, const char*, size_t dl)->ssize_t{
-				DEBUG("GOT JSON:" << json_data);
-				return static_cast<ssize_t>(dl);
-			};
-			
-			if(this->server->recv(fd, json_data, PACKET_LIMIT, get_body_callback) <= 0){
+			// The body is still on its way. Keep what's here and go back to epoll rather than wait on the socket.
+			const char* header_end = std::strstr(data, "\r\n\r\n");
+			unsigned long content_length = std::strtoul(r_obj.GetStr("Content-Length").c_str(), 0, 10);
+			if(header_end == 0 || content_length > HTTP_BODY_LIMIT ||
+			static_cast<size_t>(data_length) - static_cast<size_t>(header_end + 4 - data) > content_length){
 				PRINT("FAILED TO GET JSON POST BODY");
 				return -1;
 			}
-			
-			r_obj.parse(json_data);
-			
-			r_type = HTTP_API;
+			std::lock_guard<std::mutex> lock(this->partial_requests_mutex);
+			this->partial_requests[fd].assign(data, static_cast<size_t>(data_length));
+			return read_length;
 		}
 		
 		//DEBUG("JSON: " << r_obj.stringify(true))
@@ -182,19 +229,10 @@ void HttpApi::start(void){
 						return -1;
 					}
 					//DEBUG("DELI:" << response)
-					if(r_obj.GetStr("method") != "HEAD"){
-						size_t buffer_size = BUFFER_LIMIT;
-						size_t offset = 0;
-						while(buffer_size == BUFFER_LIMIT){
-							if(offset + buffer_size > cached_file->data_length){
-								// Send final bytes.
-								buffer_size = cached_file->data_length % BUFFER_LIMIT;
-							}
-							if(this->server->send(fd, cached_file->data + offset, buffer_size)){
-								return -1;
-							}
-							offset += buffer_size;
-						}
+					// Whatever the socket doesn't take at once is queued, so the file can go in one piece.
+					if(r_obj.GetStr("method") != "HEAD" &&
+					this->server->send(fd, cached_file->data, cached_file->data_length)){
+						return -1;
 					}
 					PRINT("Cached file served: " << clean_route)
 				}else{
@@ -259,26 +297,15 @@ void HttpApi::start(void){
 							PRINT("File cached and served: " << clean_route)
 							this->file_cache_mutex.unlock();
 						}else{
-							// Send the file read-buffer style
+							// Send the file zero copy where possible (sendfile, or kTLS over HTTPS).
 							int file_fd;
-							ssize_t len;
-							char buffer[BUFFER_LIMIT + 32];
 							if((file_fd = open(clean_route.c_str(), O_RDONLY | O_NOFOLLOW)) < 0){
 								perror("open file");
 								return 0;
 							}
-							while(file_fd > 0){
-								if((len = read(file_fd, buffer, BUFFER_LIMIT)) < 0){
-									perror("read file");
-									return 0;
-								}
-								buffer[len] = 0;
-								if(this->server->send(fd, buffer, static_cast<size_t>(len))){
-									return -1;
-								}
-								if(len < BUFFER_LIMIT){
-									break;
-								}
+							if(this->server->send_file(fd, file_fd, 0, static_cast<size_t>(route_stat.st_size))){
+								close(file_fd);
+								return -1;
 							}
 							if(close(file_fd) < 0){
 								perror("close file");
@@ -304,6 +331,49 @@ void HttpApi::start(void){
 
 			PRINT((r_type == API ? "APIR: " : "HTTPAPIR: ") << route)
 
+			// A msgpack body goes straight into r_obj for plain routes.
+			// The view and typed routes read JSON text, so it is re-encoded for them.
+			std::string body_text;
+			if(body != 0 && body_length > 0 &&
+			r_obj.HasObj("Content-Type", STRING) &&
+			Util::startsWith(r_obj.GetStr("Content-Type"), MSGPACK_CONTENT_TYPE)){
+				if(this->routemap.count(route) &&
+				(this->routemap[route]->typed_function != nullptr || this->routemap[route]->view_function != nullptr)){
+					JsonObject packed_obj;
+					if(MsgPack::unpack(body, body_length, &packed_obj)){
+						body_text = packed_obj.stringify();
+						body = body_text.c_str();
+						body_length = body_text.length();
+					}else{
+						response_body = "{\"error\":\"The request body is not valid MessagePack.\"}";
+						body = 0;
+					}
+				}else{
+					if(!MsgPack::unpack(body, body_length, &r_obj)){
+						response_body = "{\"error\":\"The request body is not valid MessagePack.\"}";
+					}
+					body = 0;
+				}
+			}
+
+			// On-demand routes only look at the body through the view.
+			// Typed routes parse it themselves, so the view is only needed for the human question.
+			JsonView r_view(&r_obj);
+			if(body != 0){
+				if(this->routemap.count(route) && this->routemap[route]->typed_function != nullptr){
+					if(this->routemap[route]->requires_human &&
+					!r_view.set_data(body, body_length)){
+						response_body = "{\"error\":\"The request body is not valid JSON.\"}";
+					}
+				}else if(this->routemap.count(route) && this->routemap[route]->view_function != nullptr){
+					if(!r_view.set_data(body, body_length)){
+						response_body = "{\"error\":\"The request body is not valid JSON.\"}";
+					}
+				}else{
+					r_obj.parse(body);
+				}
+			}
+
 			if(this->routemap.count(route)){
 				if(this->routemap[route]->minimum_ms_between_call.count() > 0){
 					std::chrono::milliseconds now = std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -324,25 +394,32 @@ void HttpApi::start(void){
 					}
 				}
 
-				if(response_body.empty()){
+				if(response_body.empty() && this->routemap[route]->typed_function == nullptr){
 					for(auto iter = this->routemap[route]->requires.begin(); iter != this->routemap[route]->requires.end(); ++iter){
-						if(!r_obj.HasObj(iter->first, iter->second)){
+						if(!r_view.HasObj(iter->first, iter->second)){
 							response_body = "{\"error\":\"'" + iter->first + "' requires a " + JsonObject::typeString[iter->second] + ".\"}";
 							break;
 						}else{
-							DEBUG("\t" << iter->first << ": " << r_obj.objectValues[iter->first]->stringify(true))
+							DEBUG("\t" << iter->first << ": " << JsonObject::typeString[iter->second])
 						}
 					}
 				}
 
 				if(response_body.empty()){
 					if(this->routemap[route]->requires_human){
-						if(!r_obj.HasObj("answer", STRING)){
+						if(!r_view.HasObj("answer", STRING)){
 							response_body = "{\"error\":\"You need to answer the question: " + client_questions[fd]->q + "\"}";
 						}else{
 							for(auto sa : client_questions[fd]->a){
-								if(r_obj.GetStr("answer") == sa){
-									response_body = this->routemap[route]->function(&r_obj);
+								if(r_view.GetStr("answer") == sa){
+									if(this->routemap[route]->view_function != nullptr){
+										response_body = this->routemap[route]->view_function(&r_view);
+									}else if(this->routemap[route]->typed_function != nullptr){
+										response_body = this->routemap[route]->typed_function(
+											body == 0 ? "" : body, body == 0 ? 0 : body_length, &r_obj);
+									}else{
+										response_body = this->routemap[route]->function(&r_obj);
+									}
 									client_questions[fd] = get_question();
 									break;
 								}
@@ -354,6 +431,11 @@ void HttpApi::start(void){
 					}else{
 						if(this->routemap[route]->function != nullptr){
 							response_body = this->routemap[route]->function(&r_obj);
+						}else if(this->routemap[route]->view_function != nullptr){
+							response_body = this->routemap[route]->view_function(&r_view);
+						}else if(this->routemap[route]->typed_function != nullptr){
+							response_body = this->routemap[route]->typed_function(
+								body == 0 ? "" : body, body == 0 ? 0 : body_length, &r_obj);
 						}else if(this->routemap[route]->token_function != nullptr){
 							if(!r_obj.HasObj("token", STRING)){
 								response_body = "{\"error\":\"'token' requires a string.\"}";
@@ -388,6 +470,15 @@ void HttpApi::start(void){
 		}
 		
 		if(!response_body.empty() && r_type != JSON){
+			// API responses are JSON, so a client that accepts msgpack gets them packed.
+			bool packed = false;
+			if(r_type != HTTP && r_obj.HasObj("Accept", STRING) &&
+			r_obj.GetStr("Accept").find(MSGPACK_CONTENT_TYPE) != std::string::npos){
+				JsonObject response_obj;
+				response_obj.parse(response_body.c_str());
+				response_body = MsgPack::pack(&response_obj);
+				packed = true;
+			}
 			if(r_type == API){
 				if(this->server->send(fd, response_body.c_str(), response_body.length())){
 					return -1;
@@ -401,6 +492,8 @@ void HttpApi::start(void){
 					}else{
 						response = response_header + "Content-Type: text/html\n";
 					}
+				}else if(packed){
+					response = response_header + "Content-Type: " MSGPACK_CONTENT_TYPE "\n";
 				}else{
 					response = response_header + "Content-Type: application/json\n";
 				}
@@ -19,10 +19,15 @@
 
 #include "util.hpp"
 #include "json.hpp"
+#include "json-view.hpp"
+#include "json-schema.hpp"
+#include "msgpack.hpp"
 #include "tcp-server.hpp"
 #include "tls-epoll-server.hpp"
 
 #define BUFFER_LIMIT 8192
+// POST bodies larger than this are refused rather than buffered.
+#define HTTP_BODY_LIMIT (16 * 1024 * 1024)
 #define HTTP_404 "<h1>404 Not Found</h1>"
 #define INSUFFICIENT_ACCESS "{\"error\":\"Insufficient access.\"}"
 #define NO_SUCH_ITEM "{\"error\":\"That record doesn't exist.\"}"
@@ -32,6 +37,8 @@ public:
 	std::function<std::string(JsonObject*)> function;
 	std::function<std::string(JsonObject*, JsonObject*)> token_function;
 	std::function<ssize_t(JsonObject*, int)> raw_function;
+	std::function<std::string(JsonView*)> view_function;
+	std::function<std::string(const char*, size_t, JsonObject*)> typed_function;
 
 	std::unordered_map<std::string, JsonType> requires;
 	bool requires_human;
@@ -68,6 +75,26 @@ public:
 	requires_human(new_requires_human),
 	minimum_ms_between_call(new_rate_limit)
 	{}
+
+	Route(std::function<std::string(JsonView*)> new_view_function,
+		std::unordered_map<std::string, JsonType> new_requires,
+		std::chrono::milliseconds new_rate_limit,
+		bool new_requires_human)
+	:view_function(new_view_function),
+	requires(new_requires),
+	requires_human(new_requires_human),
+	minimum_ms_between_call(new_rate_limit)
+	{}
+
+	Route(std::function<std::string(const char*, size_t, JsonObject*)> new_typed_function,
+		std::unordered_map<std::string, JsonType> new_requires,
+		std::chrono::milliseconds new_rate_limit,
+		bool new_requires_human)
+	:typed_function(new_typed_function),
+	requires(new_requires),
+	requires_human(new_requires_human),
+	minimum_ms_between_call(new_rate_limit)
+	{}
 };
 
 class CachedFile{
@@ -110,9 +137,66 @@ public:
 		bool requires_human = false
 	);
 
+	void route(std::string method,
+		std::string path,
+		std::function<std::string(JsonView*)> function,
+		std::unordered_map<std::string, JsonType> requires = std::unordered_map<std::string, JsonType>(),
+		std::chrono::milliseconds rate_limit = std::chrono::milliseconds(0),
+		bool requires_human = false
+	);
+
+	/**
+	 * @brief Adds a route whose body is parsed straight into a JSON_SCHEMA struct.
+	 *
+	 * Required fields and types come from the schema. No JsonObject is built for the body.
+	 * e.g. api.route<ChatRequest>("POST", "/chat", create_chat);
+	 */
+	template<class Request>
+	void route(std::string method,
+		std::string path,
+		std::function<std::string(Request*)> function,
+		std::chrono::milliseconds rate_limit = std::chrono::milliseconds(0),
+		bool requires_human = false
+	){
+		this->add_typed_route(method, path, [function](const char* body, size_t body_length, JsonObject* request)->std::string{
+			Request value;
+			std::string error;
+			if(!JsonSchema<Request>::parse(body, body_length, &value, &error, request)){
+				return "{\"error\":" + JsonObject::escape(error) + "}";
+			}
+			return function(&value);
+		}, JsonSchema<Request>::requires(), rate_limit, requires_human);
+	}
+
+	/// As above, but the response struct is serialized by its schema too.
+	template<class Request, class Response>
+	void route(std::string method,
+		std::string path,
+		std::function<Response(Request*)> function,
+		std::chrono::milliseconds rate_limit = std::chrono::milliseconds(0),
+		bool requires_human = false
+	){
+		this->add_typed_route(method, path, [function](const char* body, size_t body_length, JsonObject* request)->std::string{
+			Request value;
+			std::string error;
+			if(!JsonSchema<Request>::parse(body, body_length, &value, &error, request)){
+				return "{\"error\":" + JsonObject::escape(error) + "}";
+			}
+			return JsonSchema<Response>::stringify(function(&value));
+		}, JsonSchema<Request>::requires(), rate_limit, requires_human);
+	}
+
 	void start(void);
 	void set_file_cache_size(int megabytes);
 private:
+	void add_typed_route(std::string method,
+		std::string path,
+		std::function<std::string(const char*, size_t, JsonObject*)> function,
+		std::unordered_map<std::string, JsonType> requires,
+		std::chrono::milliseconds rate_limit,
+		bool requires_human
+	);
+
 	std::unordered_map<std::string, CachedFile*> file_cache;
 	int file_cache_remaining_bytes = 30 * 1024 * 1024; // 30MB cache.
 	std::mutex file_cache_mutex;
@@ -121,4 +205,8 @@ private:
 	SymmetricEncryptor* encryptor;
 
 	std::unordered_map<std::string, Route*> routemap;
+
+	// Requests whose body hasn't all arrived yet, picked up again on the connection's next read.
+	std::mutex partial_requests_mutex;
+	std::unordered_map<int /* fd */, std::string> partial_requests;
 };
@@ -0,0 +1,355 @@
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstddef>
+
+#include "json-patch.hpp"
+
+/**
+ * @brief A deep copy; JsonObject owns its children, so it can't simply be copied.
+ */
+JsonObject* JsonPatch::copy(JsonObject* value){
+	JsonObject* result = new JsonObject(value->type);
+	result->stringValue = value->stringValue;
+	for(auto it = value->objectValues.begin(); it != value->objectValues.end(); ++it){
+		result->objectValues[it->first] = copy(it->second);
+	}
+	for(JsonObject* item : value->arrayValues){
+		result->arrayValues.push_back(copy(item));
+	}
+	return result;
+}
+
+/**
+ * @brief Replaces the contents of target with a deep copy of value, in place.
+ */
+void JsonPatch::assign(JsonObject* target, JsonObject* value){
+	JsonObject* replacement = copy(value);
+	for(auto it = target->objectValues.begin(); it != target->objectValues.end(); ++it){
+		delete it->second;
+	}
+	for(JsonObject* item : target->arrayValues){
+		delete item;
+	}
+	target->objectValues.clear();
+	target->arrayValues.clear();
+	target->type = replacement->type;
+	target->stringValue.swap(replacement->stringValue);
+	target->objectValues.swap(replacement->objectValues);
+	target->arrayValues.swap(replacement->arrayValues);
+	delete replacement;
+}
+
+bool JsonPatch::equal(JsonObject* a, JsonObject* b){
+	if(a->type != b->type){
+		return false;
+	}
+	switch(a->type){
+	case NOTYPE:
+		return true;
+	case STRING:
+		return a->stringValue == b->stringValue;
+	case OBJECT:
+		if(a->objectValues.size() != b->objectValues.size()){
+			return false;
+		}
+		for(auto it = a->objectValues.begin(); it != a->objectValues.end(); ++it){
+			if(!b->objectValues.count(it->first) || !equal(it->second, b->objectValues[it->first])){
+				return false;
+			}
+		}
+		return true;
+	case ARRAY:
+		if(a->arrayValues.size() != b->arrayValues.size()){
+			return false;
+		}
+		for(size_t i = 0; i < a->arrayValues.size(); ++i){
+			if(!equal(a->arrayValues[i], b->arrayValues[i])){
+				return false;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+std::string JsonPatch::escape_pointer(const std::string& token){
+	std::string escaped;
+	for(char c : token){
+		if(c == '~'){
+			escaped += "~0";
+		}else if(c == '/'){
+			escaped += "~1";
+		}else{
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+/**
+ * @brief Splits a JSON Pointer into unescaped reference tokens. "" is the whole document.
+ *
+ * @return false if the pointer is malformed.
+ */
+bool JsonPatch::split_pointer(const std::string& pointer, std::vector<std::string>* tokens){
+	tokens->clear();
+	if(pointer.empty()){
+		return true;
+	}
+	if(pointer[0] != '/'){
+		return false;
+	}
+	std::string token;
+	for(size_t i = 1; i <= pointer.length(); ++i){
+		if(i == pointer.length() || pointer[i] == '/'){
+			tokens->push_back(token);
+			token.clear();
+		}else if(pointer[i] == '~'){
+			if(i + 1 >= pointer.length() || (pointer[i + 1] != '0' && pointer[i + 1] != '1')){
+				return false;
+			}
+			token += pointer[++i] == '0' ? '~' : '/';
+		}else{
+			token += pointer[i];
+		}
+	}
+	return true;
+}
+
+static void add_operation(JsonObject* patch, const char* op, const std::string& path, JsonObject* value){
+	JsonObject* operation = new JsonObject(OBJECT);
+	operation->objectValues["op"] = new JsonObject(op);
+	operation->objectValues["path"] = new JsonObject(path);
+	if(value != 0){
+		operation->objectValues["value"] = JsonPatch::copy(value);
+	}
+	patch->arrayValues.push_back(operation);
+}
+
+/**
+ * @brief Appends the operations that turn from into to onto patch (an ARRAY).
+ *
+ * Objects are diffed key by key and arrays index by index, with the tail added or removed.
+ * Anything else that differs is replaced whole.
+ */
+void JsonPatch::diff(JsonObject* from, JsonObject* to, JsonObject* patch, const std::string& path){
+	if(from->type != to->type){
+		add_operation(patch, "replace", path, to);
+		return;
+	}
+	switch(to->type){
+	case NOTYPE:
+		break;
+	case STRING:
+		if(from->stringValue != to->stringValue){
+			add_operation(patch, "replace", path, to);
+		}
+		break;
+	case OBJECT:
+		for(auto it = from->objectValues.begin(); it != from->objectValues.end(); ++it){
+			if(!to->objectValues.count(it->first)){
+				add_operation(patch, "remove", path + '/' + escape_pointer(it->first), 0);
+			}
+		}
+		for(auto it = to->objectValues.begin(); it != to->objectValues.end(); ++it){
+			if(!from->objectValues.count(it->first)){
+				add_operation(patch, "add", path + '/' + escape_pointer(it->first), it->second);
+			}else{
+				diff(from->objectValues[it->first], it->second, patch, path + '/' + escape_pointer(it->first));
+			}
+		}
+		break;
+	case ARRAY:
+		for(size_t i = 0; i < from->arrayValues.size() && i < to->arrayValues.size(); ++i){
+			diff(from->arrayValues[i], to->arrayValues[i], patch, path + '/' + std::to_string(i));
+		}
+		// Remove from the back so earlier indexes stay put.
+		for(size_t i = from->arrayValues.size(); i > to->arrayValues.size(); --i){
+			add_operation(patch, "remove", path + '/' + std::to_string(i - 1), 0);
+		}
+		for(size_t i = from->arrayValues.size(); i < to->arrayValues.size(); ++i){
+			add_operation(patch, "add", path + '/' + std::to_string(i), to->arrayValues[i]);
+		}
+		break;
+	}
+}
+
+static bool array_index(const std::string& token, size_t size, bool allow_end, size_t* index){
+	if(allow_end && token == "-"){
+		*index = size;
+		return true;
+	}
+	if(token.empty() || token.find_first_not_of("0123456789") != std::string::npos ||
+	(token.length() > 1 && token[0] == '0')){
+		return false;
+	}
+	*index = static_cast<size_t>(std::strtoul(token.c_str(), 0, 10));
+	return allow_end ? *index <= size : *index < size;
+}
+
+/**
+ * @brief Applies patch (an ARRAY of operations) to target in order.
+ *
+ * Operations are applied one by one, so on failure target holds the operations before the bad one.
+ *
+ * @return false if an operation is malformed, its path doesn't exist, or a test fails.
+ */
+bool JsonPatch::apply(JsonObject* target, JsonObject* patch){
+	std::vector<std::string> tokens;
+	JsonObject* parent;
+	JsonObject* value;
+	size_t index;
+
+	if(patch->type != ARRAY){
+		return false;
+	}
+
+	for(JsonObject* operation : patch->arrayValues){
+		if(operation->type != OBJECT ||
+		!operation->HasObj("op", STRING) ||
+		!operation->HasObj("path", STRING) ||
+		!split_pointer(operation->GetStr("path"), &tokens)){
+			return false;
+		}
+		std::string op = operation->GetStr("op");
+		value = operation->objectValues.count("value") ? operation->objectValues["value"] : 0;
+		if((op == "add" || op == "replace" || op == "test") && value == 0){
+			return false;
+		}
+
+		if(tokens.empty()){
+			if(op == "test"){
+				if(!equal(target, value)){
+					return false;
+				}
+			}else if(op == "add" || op == "replace"){
+				assign(target, value);
+			}else{
+				return false;
+			}
+			continue;
+		}
+
+		parent = target;
+		for(size_t i = 0; i + 1 < tokens.size(); ++i){
+			if(parent->type == OBJECT && parent->objectValues.count(tokens[i])){
+				parent = parent->objectValues[tokens[i]];
+			}else if(parent->type == ARRAY && array_index(tokens[i], parent->arrayValues.size(), false, &index)){
+				parent = parent->arrayValues[index];
+			}else{
+				return false;
+			}
+		}
+
+		const std::string& last = tokens.back();
+		if(parent->type == OBJECT){
+			bool exists = parent->objectValues.count(last) > 0;
+			if(op == "add" || (op == "replace" && exists)){
+				if(exists){
+					delete parent->objectValues[last];
+				}
+				parent->objectValues[last] = copy(value);
+			}else if(op == "remove" && exists){
+				delete parent->objectValues[last];
+				parent->objectValues.erase(last);
+			}else if(op == "test" && exists){
+				if(!equal(parent->objectValues[last], value)){
+					return false;
+				}
+			}else{
+				return false;
+			}
+		}else if(parent->type == ARRAY){
+			if(!array_index(last, parent->arrayValues.size(), op == "add", &index)){
+				return false;
+			}
+			if(op == "add"){
+				parent->arrayValues.insert(parent->arrayValues.begin() + static_cast<std::ptrdiff_t>(index), copy(value));
+			}else if(op == "replace"){
+				delete parent->arrayValues[index];
+				parent->arrayValues[index] = copy(value);
+			}else if(op == "remove"){
+				delete parent->arrayValues[index];
+				parent->arrayValues.erase(parent->arrayValues.begin() + static_cast<std::ptrdiff_t>(index));
+			}else if(op == "test"){
+				if(!equal(parent->arrayValues[index], value)){
+					return false;
+				}
+			}else{
+				return false;
+			}
+		}else{
+			return false;
+		}
+	}
+	return true;
+}
+
+JsonDelta::JsonDelta(size_t new_keyframe_interval)
+:previous(0), version(0), keyframe_interval(new_keyframe_interval), has_keyframe_message(false){}
+
+JsonDelta::~JsonDelta(){
+	delete this->previous;
+}
+
+/**
+ * @brief Records the next version of the state and builds the patch from the last one.
+ */
+void JsonDelta::next(JsonObject* state){
+	this->version++;
+	this->has_keyframe_message = false;
+	this->patch_message.clear();
+
+	if(this->previous == 0){
+		this->previous = JsonPatch::copy(state);
+		return;
+	}
+
+	JsonObject patch(ARRAY);
+	JsonPatch::diff(this->previous, state, &patch);
+	if(!patch.arrayValues.empty()){
+		this->patch_message = "{\"patch\":" + patch.stringify() + '}';
+		// Bring the baseline forward with the patch rather than copying the whole state again.
+		if(!JsonPatch::apply(this->previous, &patch)){
+			JsonPatch::assign(this->previous, state);
+		}
+	}
+}
+
+/**
+ * @brief The message that brings subscriber up to the latest version, and marks it as sent.
+ *
+ * @return Empty if the subscriber is already up to date.
+ */
+std::string JsonDelta::message(int subscriber){
+	if(this->previous == 0){
+		return std::string();
+	}
+
+	bool keyframe = !this->subscriber_versions.count(subscriber) ||
+		this->subscriber_versions[subscriber] + 1 < this->version ||
+		(this->keyframe_interval > 0 && this->version % this->keyframe_interval == 0 &&
+		this->subscriber_versions[subscriber] != this->version);
+
+	if(!keyframe && this->subscriber_versions[subscriber] == this->version){
+		return std::string();
+	}
+	this->subscriber_versions[subscriber] = this->version;
+
+	if(keyframe){
+		if(!this->has_keyframe_message){
+			this->keyframe_message = "{\"keyframe\":" + this->previous->stringify() + '}';
+			this->has_keyframe_message = true;
+		}
+		return this->keyframe_message;
+	}
+	return this->patch_message;
+}
+
+/**
+ * @brief Forgets a subscriber; if it comes back it starts with a keyframe.
+ */
+void JsonDelta::remove(int subscriber){
+	this->subscriber_versions.erase(subscriber);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "json.hpp"
+
+/**
+ * @brief RFC 6902 JSON Patch between two JsonObject versions.
+ *
+ * diff produces add, remove and replace operations addressed with RFC 6901 JSON Pointers.
+ * apply understands add, remove, replace and test. Patches are plain JsonObject arrays,
+ * so they can be sent as JSON or packed with MsgPack.
+ */
+class JsonPatch{
+public:
+	static JsonObject* copy(JsonObject* value);
+	static void assign(JsonObject* target, JsonObject* value);
+	static bool equal(JsonObject* a, JsonObject* b);
+
+	static std::string escape_pointer(const std::string& token);
+	static bool split_pointer(const std::string& pointer, std::vector<std::string>* tokens);
+
+	static void diff(JsonObject* from, JsonObject* to, JsonObject* patch, const std::string& path = std::string());
+	static bool apply(JsonObject* target, JsonObject* patch);
+};
+
+/**
+ * @brief Turns successive versions of a state into per-subscriber messages.
+ *
+ * Each subscriber remembers which version it was last sent. A subscriber that is on the previous
+ * version gets {"patch":[...]}, and anyone else (new, or who missed a version) gets {"keyframe":state}.
+ * Every keyframe_interval versions everyone gets a keyframe, so a lost patch is never fatal.
+ * The patch and keyframe are each built at most once per version, however many subscribers there are.
+ */
+class JsonDelta{
+private:
+	JsonObject* previous;
+	size_t version;
+	size_t keyframe_interval;
+
+	std::string patch_message;
+	std::string keyframe_message;
+	bool has_keyframe_message;
+
+	std::unordered_map<int, size_t> subscriber_versions;
+public:
+	JsonDelta(size_t new_keyframe_interval = 0);
+	~JsonDelta();
+
+	void next(JsonObject* state);
+	std::string message(int subscriber);
+	void remove(int subscriber);
+};
@@ -0,0 +1,541 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <limits>
+#include <type_traits>
+
+#include "json.hpp"
+#include "json-view.hpp"
+#include "msgpack.hpp"
+
+/*
+	Typed JSON binding. Describe a struct once:
+
+	struct ChatRequest{
+		std::string handle;
+		std::string message;
+		std::string color;
+	};
+
+	JSON_SCHEMA(ChatRequest){
+		JSON_FIELD(handle);
+		JSON_FIELD(message);
+		JSON_OPTIONAL_FIELD(color);
+	}
+
+	JsonSchema<ChatRequest>::parse fills the struct straight from the text (no JsonObject is built),
+	checking required fields and types on the way. JsonSchema<ChatRequest>::stringify writes it back,
+	and JsonSchema<ChatRequest>::pack writes it as MessagePack.
+
+	Supported members: std::string, bool, int, long, unsigned, size_t, double, std::vector of any of
+	these, and structs that have their own JSON_SCHEMA. Like the rest of the library, numbers and
+	booleans are written as strings, and accepted either quoted or bare.
+*/
+
+#define JSON_SCHEMA(type) template<> inline void JsonSchema<type>::describe(JsonSchema<type>& schema)
+#define JSON_FIELD(name) schema.field(#name, &SchemaType::name, true)
+#define JSON_OPTIONAL_FIELD(name) schema.field(#name, &SchemaType::name, false)
+
+template<class T> class JsonSchema;
+
+/// Appends value to out as a JSON string, escaped the same way as JsonObject::escape.
+inline void json_append_escaped(std::string& out, const std::string& value){
+	out += '"';
+	for(size_t i = 0; i < value.length(); ++i){
+		switch(value[i]){
+		case '\n':
+			out += "\\n";
+			break;
+		case '\r':
+			out += "\\r";
+			break;
+		case '\t':
+			out += "\\t";
+			break;
+		case '"':
+			out += "\\\"";
+			break;
+		case '\\':
+			out += "\\\\";
+			break;
+		default:
+			out += value[i];
+		}
+	}
+	out += '"';
+}
+
+/**
+ * @brief Reads a string or bare scalar at it.
+ *
+ * @return Just past the scalar, or 0 if it is not a scalar.
+ */
+inline const char* json_read_scalar(const char* it, const char* end, std::string* value){
+	const char* scalar_end;
+	if(it >= end){
+		return 0;
+	}
+	if(*it == '"'){
+		if((scalar_end = JsonView::skip_string(it, end)) == 0){
+			return 0;
+		}
+		if(std::memchr(it, '\\', static_cast<size_t>(scalar_end - it)) == 0){
+			value->assign(it + 1, static_cast<size_t>(scalar_end - it - 2));
+			return scalar_end;
+		}
+		value->clear();
+		for(++it; it < scalar_end - 1; ++it){
+			if(*it == '\\'){
+				++it;
+				switch(*it){
+				case 'n':
+					*value += '\n';
+					break;
+				case 'r':
+					*value += '\r';
+					break;
+				case 't':
+					*value += '\t';
+					break;
+				default:
+					*value += *it;
+				}
+			}else{
+				*value += *it;
+			}
+		}
+		return scalar_end;
+	}
+	if(*it == '{' || *it == '['){
+		return 0;
+	}
+	if((scalar_end = JsonView::skip_value(it, end, 0)) == 0){
+		return 0;
+	}
+	value->assign(it, static_cast<size_t>(scalar_end - it));
+	return scalar_end;
+}
+
+/// Codecs for nested structs. Every other member type has a specialization below.
+template<class M> class JsonCodec{
+public:
+	static enum JsonType type(){
+		return OBJECT;
+	}
+	static const char* parse(const char* it, const char* end, M* value, std::string* error){
+		return JsonSchema<M>::parse_object(it, end, value, error);
+	}
+	static void stringify(const M& value, std::string& out){
+		JsonSchema<M>::stringify_object(value, out);
+	}
+	static void pack(const M& value, std::string& out){
+		JsonSchema<M>::pack_object(value, out);
+	}
+};
+
+template<> class JsonCodec<std::string>{
+public:
+	static enum JsonType type(){
+		return STRING;
+	}
+	static const char* parse(const char* it, const char* end, std::string* value, std::string*){
+		return json_read_scalar(it, end, value);
+	}
+	static void stringify(const std::string& value, std::string& out){
+		json_append_escaped(out, value);
+	}
+	static void pack(const std::string& value, std::string& out){
+		MsgPack::pack_string(out, value.c_str(), value.length());
+	}
+};
+
+template<> class JsonCodec<bool>{
+public:
+	static enum JsonType type(){
+		return STRING;
+	}
+	static const char* parse(const char* it, const char* end, bool* value, std::string*){
+		std::string scalar;
+		if((it = json_read_scalar(it, end, &scalar)) == 0){
+			return 0;
+		}
+		if(scalar == "true" || scalar == "1"){
+			*value = true;
+		}else if(scalar == "false" || scalar == "0"){
+			*value = false;
+		}else{
+			return 0;
+		}
+		return it;
+	}
+	static void stringify(const bool& value, std::string& out){
+		out += value ? "\"true\"" : "\"false\"";
+	}
+	static void pack(const bool& value, std::string& out){
+		MsgPack::pack_bool(out, value);
+	}
+};
+
+/// Integer and floating point members share one codec, converted with strtoll/strtoull/strtod; integers out of N's range fail the parse.
+template<class N> class JsonNumberCodec{
+private:
+	typedef std::integral_constant<int, std::is_floating_point<N>::value ? 0 : std::is_signed<N>::value ? 1 : 2> Kind;
+
+	/**
+	 * @return true if scalar isn't all a number or doesn't fit in N.
+	 */
+	static bool convert(const std::string& scalar, N* value, std::integral_constant<int, 0>){
+		char* number_end;
+		errno = 0;
+		*value = static_cast<N>(std::strtod(scalar.c_str(), &number_end));
+		return errno != 0 || *number_end != 0;
+	}
+	static bool convert(const std::string& scalar, N* value, std::integral_constant<int, 1>){
+		char* number_end;
+		errno = 0;
+		long long number = std::strtoll(scalar.c_str(), &number_end, 10);
+		if(errno != 0 || *number_end != 0 || number < static_cast<long long>(std::numeric_limits<N>::min()) ||
+		number > static_cast<long long>(std::numeric_limits<N>::max())){
+			return true;
+		}
+		*value = static_cast<N>(number);
+		return false;
+	}
+	static bool convert(const std::string& scalar, N* value, std::integral_constant<int, 2>){
+		char* number_end;
+		// strtoull would take a negative number and wrap it around.
+		if(scalar.find('-') != std::string::npos){
+			return true;
+		}
+		errno = 0;
+		unsigned long long number = std::strtoull(scalar.c_str(), &number_end, 10);
+		if(errno != 0 || *number_end != 0 || number > static_cast<unsigned long long>(std::numeric_limits<N>::max())){
+			return true;
+		}
+		*value = static_cast<N>(number);
+		return false;
+	}
+
+	/// Doubles get max_digits10 significant digits, so they parse back to the same value; to_string's %f would round them.
+	static std::string format(const N& value, std::integral_constant<int, 0>){
+		char number[32];
+		std::snprintf(number, sizeof(number), "%.*g", std::numeric_limits<double>::max_digits10, static_cast<double>(value));
+		return number;
+	}
+	template<int K> static std::string format(const N& value, std::integral_constant<int, K>){
+		return std::to_string(value);
+	}
+public:
+	static enum JsonType type(){
+		return STRING;
+	}
+	static const char* parse(const char* it, const char* end, N* value, std::string*){
+		std::string scalar;
+		if((it = json_read_scalar(it, end, &scalar)) == 0 || scalar.empty() || convert(scalar, value, Kind())){
+			return 0;
+		}
+		return it;
+	}
+	static void stringify(const N& value, std::string& out){
+		out += '"' + format(value, Kind()) + '"';
+	}
+	static void pack(const N& value, std::string& out){
+		if(std::is_floating_point<N>::value){
+			MsgPack::pack_double(out, static_cast<double>(value));
+		}else if(std::is_signed<N>::value){
+			MsgPack::pack_integer(out, static_cast<int64_t>(value));
+		}else{
+			MsgPack::pack_unsigned(out, static_cast<uint64_t>(value));
+		}
+	}
+};
+
+template<> class JsonCodec<int> : public JsonNumberCodec<int>{};
+template<> class JsonCodec<long> : public JsonNumberCodec<long>{};
+template<> class JsonCodec<unsigned int> : public JsonNumberCodec<unsigned int>{};
+template<> class JsonCodec<unsigned long> : public JsonNumberCodec<unsigned long>{};
+template<> class JsonCodec<double> : public JsonNumberCodec<double>{};
+
+template<class V> class JsonCodec<std::vector<V>>{
+public:
+	static enum JsonType type(){
+		return ARRAY;
+	}
+	static const char* parse(const char* it, const char* end, std::vector<V>* value, std::string* error){
+		if(it >= end || *it != '['){
+			return 0;
+		}
+		value->clear();
+		it = JsonView::skip_whitespace(it + 1, end);
+		if(it < end && *it == ']'){
+			return ++it;
+		}
+		while(it < end){
+			value->push_back(V());
+			if((it = JsonCodec<V>::parse(it, end, &value->back(), error)) == 0){
+				return 0;
+			}
+			it = JsonView::skip_whitespace(it, end);
+			if(it >= end){
+				return 0;
+			}else if(*it == ']'){
+				return ++it;
+			}else if(*it != ','){
+				return 0;
+			}
+			it = JsonView::skip_whitespace(it + 1, end);
+		}
+		return 0;
+	}
+	static void stringify(const std::vector<V>& value, std::string& out){
+		out += '[';
+		for(size_t i = 0; i < value.size(); ++i){
+			if(i > 0){
+				out += ',';
+			}
+			JsonCodec<V>::stringify(value[i], out);
+		}
+		out += ']';
+	}
+	static void pack(const std::vector<V>& value, std::string& out){
+		MsgPack::pack_array_header(out, value.size());
+		for(size_t i = 0; i < value.size(); ++i){
+			JsonCodec<V>::pack(value[i], out);
+		}
+	}
+};
+
+template<class T> class JsonField{
+public:
+	std::string name;
+	std::string escaped_name;
+	bool required;
+
+	JsonField(const char* new_name, bool new_required)
+	:name(new_name), required(new_required){
+		json_append_escaped(this->escaped_name, this->name);
+	}
+	virtual ~JsonField(){}
+
+	virtual enum JsonType type() const = 0;
+	virtual const char* parse(const char* it, const char* end, T* value, std::string* error) const = 0;
+	virtual void stringify(const T& value, std::string& out) const = 0;
+	virtual void pack(const T& value, std::string& out) const = 0;
+};
+
+template<class T, class M> class JsonMemberField : public JsonField<T>{
+private:
+	M T::* member;
+public:
+	JsonMemberField(const char* new_name, M T::* new_member, bool new_required)
+	:JsonField<T>(new_name, new_required), member(new_member){}
+
+	enum JsonType type() const{
+		return JsonCodec<M>::type();
+	}
+	const char* parse(const char* it, const char* end, T* value, std::string* error) const{
+		return JsonCodec<M>::parse(it, end, &(value->*this->member), error);
+	}
+	void stringify(const T& value, std::string& out) const{
+		JsonCodec<M>::stringify(value.*this->member, out);
+	}
+	void pack(const T& value, std::string& out) const{
+		JsonCodec<M>::pack(value.*this->member, out);
+	}
+};
+
+/**
+ * @brief The generated parser, validator and serializer for a struct described by JSON_SCHEMA.
+ *
+ * The field table is built once per type, on first use.
+ */
+template<class T> class JsonSchema{
+private:
+	std::vector<JsonField<T>*> fields;
+
+	JsonSchema(){
+		describe(*this);
+	}
+
+	static JsonSchema<T>& instance(){
+		static JsonSchema<T> schema;
+		return schema;
+	}
+
+	static std::string type_error(const JsonField<T>* field){
+		return "'" + field->name + "' requires a " + JsonObject::typeString[field->type()] + ".";
+	}
+public:
+	typedef T SchemaType;
+
+	~JsonSchema(){
+		for(auto it = this->fields.begin(); it != this->fields.end(); ++it){
+			delete *it;
+		}
+	}
+
+	/// Specialized by JSON_SCHEMA.
+	static void describe(JsonSchema<T>& schema);
+
+	template<class M> void field(const char* name, M T::* member, bool required){
+		this->fields.push_back(new JsonMemberField<T, M>(name, member, required));
+	}
+
+	/**
+	 * @brief Parses the object at it into value.
+	 *
+	 * @param fallback Fields missing from the object are looked up here (e.g. URL parameters).
+	 *
+	 * @return Just past the object, or 0 with *error set.
+	 */
+	static const char* parse_object(const char* it, const char* end, T* value, std::string* error, JsonObject* fallback = 0){
+		const std::vector<JsonField<T>*>& fields = instance().fields;
+		std::vector<bool> seen(fields.size(), false);
+		const char* key_end;
+		size_t key_length, i;
+
+		if(it >= end || *it != '{'){
+			*error = "Expected an object.";
+			return 0;
+		}
+		it = JsonView::skip_whitespace(it + 1, end);
+		if(it < end && *it == '}'){
+			++it;
+		}else{
+			while(true){
+				if(it >= end || *it != '"' || (key_end = JsonView::skip_string(it, end)) == 0){
+					*error = "Expected a key.";
+					return 0;
+				}
+				key_length = static_cast<size_t>(key_end - it - 2);
+				for(i = 0; i < fields.size(); ++i){
+					if(fields[i]->name.length() == key_length &&
+					std::memcmp(fields[i]->name.c_str(), it + 1, key_length) == 0){
+						break;
+					}
+				}
+				it = JsonView::skip_whitespace(key_end, end);
+				if(it >= end || *it != ':'){
+					*error = "Expected a ':'.";
+					return 0;
+				}
+				it = JsonView::skip_whitespace(it + 1, end);
+				if(i < fields.size()){
+					if((it = fields[i]->parse(it, end, value, error)) == 0){
+						if(error->empty()){
+							*error = type_error(fields[i]);
+						}
+						return 0;
+					}
+					seen[i] = true;
+				}else if((it = JsonView::skip_value(it, end, 0)) == 0){
+					*error = "Malformed value.";
+					return 0;
+				}
+				it = JsonView::skip_whitespace(it, end);
+				if(it < end && *it == '}'){
+					++it;
+					break;
+				}else if(it >= end || *it != ','){
+					*error = "Expected a ',' or '}'.";
+					return 0;
+				}
+				it = JsonView::skip_whitespace(it + 1, end);
+			}
+		}
+
+		for(i = 0; i < fields.size(); ++i){
+			if(seen[i]){
+				continue;
+			}
+			if(fallback != 0 && fallback->objectValues.count(fields[i]->name)){
+				std::string text = fallback->objectValues[fields[i]->name]->stringify();
+				if(fields[i]->parse(text.c_str(), text.c_str() + text.length(), value, error) == 0){
+					if(error->empty()){
+						*error = type_error(fields[i]);
+					}
+					return 0;
+				}
+			}else if(fields[i]->required){
+				*error = type_error(fields[i]);
+				return 0;
+			}
+		}
+		return it;
+	}
+
+	/**
+	 * @brief Parses a whole document. Empty (or whitespace) data is treated as an empty object.
+	 *
+	 * @return true on success, otherwise *error describes the problem.
+	 */
+	static bool parse(const char* data, size_t length, T* value, std::string* error, JsonObject* fallback = 0){
+		const char* end = data + length;
+		const char* it = JsonView::skip_whitespace(data, end);
+		error->clear();
+		if(it >= end){
+			it = "{}";
+			end = it + 2;
+		}
+		if((it = parse_object(it, end, value, error, fallback)) == 0){
+			return false;
+		}
+		if(JsonView::skip_whitespace(it, end) < end){
+			*error = "Unexpected data after the object.";
+			return false;
+		}
+		return true;
+	}
+
+	static void stringify_object(const T& value, std::string& out){
+		const std::vector<JsonField<T>*>& fields = instance().fields;
+		out += '{';
+		for(size_t i = 0; i < fields.size(); ++i){
+			if(i > 0){
+				out += ',';
+			}
+			out += fields[i]->escaped_name;
+			out += ':';
+			fields[i]->stringify(value, out);
+		}
+		out += '}';
+	}
+
+	static std::string stringify(const T& value){
+		std::string out;
+		stringify_object(value, out);
+		return out;
+	}
+
+	static void pack_object(const T& value, std::string& out){
+		const std::vector<JsonField<T>*>& fields = instance().fields;
+		MsgPack::pack_map_header(out, fields.size());
+		for(size_t i = 0; i < fields.size(); ++i){
+			MsgPack::pack_string(out, fields[i]->name.c_str(), fields[i]->name.length());
+			fields[i]->pack(value, out);
+		}
+	}
+
+	static std::string pack(const T& value){
+		std::string out;
+		pack_object(value, out);
+		return out;
+	}
+
+	/// The required fields, in the form HttpApi lists route parameters.
+	static std::unordered_map<std::string, JsonType> requires(){
+		std::unordered_map<std::string, JsonType> result;
+		for(auto it = instance().fields.begin(); it != instance().fields.end(); ++it){
+			if((*it)->required){
+				result[(*it)->name] = (*it)->type();
+			}
+		}
+		return result;
+	}
+};
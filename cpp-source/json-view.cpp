@@ -0,0 +1,286 @@
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <iostream>
+
+#include "json-view.hpp"
+
+#define PRINT(msg) std::cout << msg << std::endl;
+
+// Deeper documents are rejected rather than risking the stack.
+static const size_t depth_limit = 256;
+
+JsonView::JsonView(JsonObject* new_fallback)
+:data(0), end(0), index_position(0), valid(true), fallback(new_fallback){}
+
+JsonView::JsonView(const char* new_data, size_t new_length, JsonObject* new_fallback)
+:data(0), end(0), index_position(0), valid(true), fallback(new_fallback){
+	this->set_data(new_data, new_length);
+}
+
+JsonView::~JsonView(){
+	this->clear();
+}
+
+void JsonView::clear(){
+	for(auto it = this->materialized.begin(); it != this->materialized.end(); ++it){
+		delete it->second;
+	}
+	this->materialized.clear();
+	this->spans.clear();
+}
+
+const char* JsonView::skip_whitespace(const char* it, const char* end){
+	while(it < end && (*it == ' ' || *it == '\t' || *it == '\n' || *it == '\r')){
+		++it;
+	}
+	return it;
+}
+
+/**
+ * @brief Expects *it to be an opening quote.
+ *
+ * @return Just past the closing quote, or 0 if the string never closes.
+ */
+const char* JsonView::skip_string(const char* it, const char* end){
+	for(++it; it < end; ++it){
+		if(*it == '\\'){
+			++it;
+		}else if(*it == '"'){
+			return ++it;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief The structural validation pass. Nothing is allocated.
+ *
+ * Bare tokens (numbers, true, false, null) are accepted as scalars.
+ *
+ * @return Just past the value, or 0 if the value is malformed.
+ */
+const char* JsonView::skip_value(const char* it, const char* end, size_t depth){
+	if(depth > depth_limit){
+		return 0;
+	}
+	it = skip_whitespace(it, end);
+	if(it >= end){
+		return 0;
+	}
+	switch(*it){
+	case '"':
+		return skip_string(it, end);
+	case '{':
+		it = skip_whitespace(it + 1, end);
+		if(it < end && *it == '}'){
+			return ++it;
+		}
+		while(it < end){
+			if(*it != '"' || (it = skip_string(it, end)) == 0){
+				return 0;
+			}
+			it = skip_whitespace(it, end);
+			if(it >= end || *it != ':'){
+				return 0;
+			}
+			if((it = skip_value(it + 1, end, depth + 1)) == 0){
+				return 0;
+			}
+			it = skip_whitespace(it, end);
+			if(it >= end){
+				return 0;
+			}else if(*it == '}'){
+				return ++it;
+			}else if(*it != ','){
+				return 0;
+			}
+			it = skip_whitespace(it + 1, end);
+		}
+		return 0;
+	case '[':
+		it = skip_whitespace(it + 1, end);
+		if(it < end && *it == ']'){
+			return ++it;
+		}
+		while(it < end){
+			if((it = skip_value(it, end, depth + 1)) == 0){
+				return 0;
+			}
+			it = skip_whitespace(it, end);
+			if(it >= end){
+				return 0;
+			}else if(*it == ']'){
+				return ++it;
+			}else if(*it != ','){
+				return 0;
+			}
+			++it;
+		}
+		return 0;
+	case '}':
+	case ']':
+	case ',':
+	case ':':
+		return 0;
+	default:
+		while(it < end && *it != ',' && *it != '}' && *it != ']' && *it != ':' &&
+		*it != '"' && *it != ' ' && *it != '\t' && *it != '\n' && *it != '\r'){
+			++it;
+		}
+		return it;
+	}
+}
+
+enum JsonType JsonView::type_at(const char* it){
+	if(*it == '{'){
+		return OBJECT;
+	}else if(*it == '['){
+		return ARRAY;
+	}
+	return STRING;
+}
+
+/**
+ * @brief Validates new_data and resets the index. Any previously materialized values are freed.
+ *
+ * Whitespace-only data is valid and has no keys.
+ *
+ * @return true if the data is valid JSON.
+ */
+bool JsonView::set_data(const char* new_data, size_t new_length){
+	const char* it;
+
+	this->clear();
+	this->data = new_data;
+	this->end = new_data + new_length;
+	this->index_position = 0;
+
+	it = skip_whitespace(this->data, this->end);
+	if(it >= this->end){
+		this->valid = true;
+		return this->valid;
+	}
+
+	const char* value_end = skip_value(it, this->end, 0);
+	this->valid = value_end != 0 && skip_whitespace(value_end, this->end) >= this->end;
+
+	if(this->valid && *it == '{'){
+		this->index_position = it + 1;
+	}
+	return this->valid;
+}
+
+bool JsonView::is_valid(){
+	return this->valid;
+}
+
+bool JsonView::is_empty(){
+	return this->data == 0 || skip_whitespace(this->data, this->end) >= this->end;
+}
+
+/**
+ * @brief Looks a top-level key up, indexing further into the object only if it hasn't been seen yet.
+ */
+bool JsonView::find(const std::string& key, std::pair<const char*, const char*>* span){
+	const char* it;
+	const char* key_end;
+	const char* value_end;
+	std::string next_key;
+
+	if(this->spans.count(key)){
+		*span = this->spans[key];
+		return true;
+	}
+
+	while(this->index_position != 0){
+		it = skip_whitespace(this->index_position, this->end);
+		if(*it == ','){
+			it = skip_whitespace(it + 1, this->end);
+		}
+		if(*it == '}'){
+			this->index_position = 0;
+			break;
+		}
+
+		// The data has been validated, so every key is a closed string.
+		key_end = skip_string(it, this->end);
+		if(std::memchr(it, '\\', static_cast<size_t>(key_end - it)) == 0){
+			next_key = std::string(it + 1, static_cast<size_t>(key_end - it - 2));
+		}else{
+			JsonObject escaped_key;
+			escaped_key.parse(it);
+			next_key = escaped_key.stringValue;
+		}
+
+		it = skip_whitespace(key_end, this->end);
+		it = skip_whitespace(it + 1, this->end);
+		value_end = skip_value(it, this->end, 0);
+
+		this->spans[next_key] = std::make_pair(it, value_end);
+		this->index_position = value_end;
+
+		if(next_key == key){
+			*span = this->spans[key];
+			return true;
+		}
+	}
+	return false;
+}
+
+bool JsonView::HasObj(const std::string& key, enum JsonType t){
+	std::pair<const char*, const char*> span;
+	if(this->valid && this->find(key, &span)){
+		return type_at(span.first) == t;
+	}
+	return this->fallback != 0 && this->fallback->HasObj(key, t);
+}
+
+std::string JsonView::GetStr(const char* key){
+	std::pair<const char*, const char*> span;
+	if(this->valid && this->find(key, &span)){
+		// Unescaped strings are copied straight out of the text.
+		if(*span.first == '"' &&
+		std::memchr(span.first, '\\', static_cast<size_t>(span.second - span.first)) == 0){
+			return std::string(span.first + 1, static_cast<size_t>(span.second - span.first - 2));
+		}
+		return (*this)[key]->stringValue;
+	}
+	if(this->fallback != 0){
+		return this->fallback->GetStr(key);
+	}
+	PRINT("Missing key: " << key)
+	throw std::runtime_error(std::string("Missing key: ") + key);
+}
+
+JsonObject* JsonView::operator[](const char* key){
+	return (*this)[std::string(key)];
+}
+
+/**
+ * @brief Materializes a value into a JsonObject owned by the view.
+ *
+ * @return 0 if neither the view nor the fallback has the key.
+ */
+JsonObject* JsonView::operator[](const std::string& key){
+	std::pair<const char*, const char*> span;
+	JsonObject* value;
+
+	if(this->materialized.count(key)){
+		return this->materialized[key];
+	}
+	if(this->valid && this->find(key, &span)){
+		if(*span.first == '"' || *span.first == '{' || *span.first == '['){
+			value = new JsonObject();
+			value->parse(span.first);
+		}else{
+			value = new JsonObject(std::string(span.first, static_cast<size_t>(span.second - span.first)));
+		}
+		this->materialized[key] = value;
+		return value;
+	}
+	if(this->fallback != 0 && this->fallback->objectValues.count(key)){
+		return this->fallback->objectValues[key];
+	}
+	return 0;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <unordered_map>
+
+#include "json.hpp"
+
+/**
+ * @brief An on-demand view over JSON text.
+ *
+ * The text is validated once without allocating, top-level keys of an object are indexed
+ * only as far as a lookup needs, and a value becomes a JsonObject only when it is requested.
+ * Lookups that miss fall through to an optional JsonObject (e.g. headers and URL parameters).
+ *
+ * The text must outlive the view.
+ */
+class JsonView{
+private:
+	const char* data;
+	const char* end;
+	const char* index_position;
+	bool valid;
+	JsonObject* fallback;
+
+	std::unordered_map<std::string, std::pair<const char*, const char*>> spans;
+	std::unordered_map<std::string, JsonObject*> materialized;
+
+	bool find(const std::string& key, std::pair<const char*, const char*>* span);
+	void clear();
+public:
+	static const char* skip_whitespace(const char* it, const char* end);
+	static const char* skip_string(const char* it, const char* end);
+	static const char* skip_value(const char* it, const char* end, size_t depth);
+	static enum JsonType type_at(const char* it);
+
+	JsonView(JsonObject* new_fallback = 0);
+	JsonView(const char* new_data, size_t new_length, JsonObject* new_fallback = 0);
+	~JsonView();
+
+	bool set_data(const char* new_data, size_t new_length);
+	bool is_valid();
+	bool is_empty();
+
+	bool HasObj(const std::string& key, enum JsonType t);
+	std::string GetStr(const char* key);
+	JsonObject* operator[](const char* key);
+	JsonObject* operator[](const std::string& key);
+};
@@ -0,0 +1,323 @@
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstddef>
+
+#include "msgpack.hpp"
+
+// Deeper documents are rejected rather than risking the stack.
+static const size_t depth_limit = 256;
+
+static void write_big_endian(std::string& out, uint64_t value, size_t bytes){
+	for(size_t i = bytes; i > 0; --i){
+		out += static_cast<char>((value >> ((i - 1) * 8)) & 0xFF);
+	}
+}
+
+static uint64_t read_big_endian(const char* it, size_t bytes){
+	uint64_t value = 0;
+	for(size_t i = 0; i < bytes; ++i){
+		value = (value << 8) | static_cast<unsigned char>(it[i]);
+	}
+	return value;
+}
+
+/**
+ * @brief JSON text never starts with a msgpack map or array marker, so the first byte tells them apart.
+ */
+bool MsgPack::is_packed(const char* data, size_t data_length){
+	if(data_length == 0){
+		return false;
+	}
+	unsigned char first = static_cast<unsigned char>(data[0]);
+	return (first >= 0x80 && first <= 0x9f) ||
+		first == 0xdc || first == 0xdd ||
+		first == 0xde || first == 0xdf;
+}
+
+void MsgPack::pack_nil(std::string& out){
+	out += static_cast<char>(0xc0);
+}
+
+void MsgPack::pack_bool(std::string& out, bool value){
+	out += static_cast<char>(value ? 0xc3 : 0xc2);
+}
+
+void MsgPack::pack_integer(std::string& out, int64_t value){
+	if(value >= 0){
+		pack_unsigned(out, static_cast<uint64_t>(value));
+	}else if(value >= -32){
+		out += static_cast<char>(value);
+	}else if(value >= INT8_MIN){
+		out += static_cast<char>(0xd0);
+		write_big_endian(out, static_cast<uint64_t>(value), 1);
+	}else if(value >= INT16_MIN){
+		out += static_cast<char>(0xd1);
+		write_big_endian(out, static_cast<uint64_t>(value), 2);
+	}else if(value >= INT32_MIN){
+		out += static_cast<char>(0xd2);
+		write_big_endian(out, static_cast<uint64_t>(value), 4);
+	}else{
+		out += static_cast<char>(0xd3);
+		write_big_endian(out, static_cast<uint64_t>(value), 8);
+	}
+}
+
+void MsgPack::pack_unsigned(std::string& out, uint64_t value){
+	if(value <= 0x7f){
+		out += static_cast<char>(value);
+	}else if(value <= UINT8_MAX){
+		out += static_cast<char>(0xcc);
+		write_big_endian(out, value, 1);
+	}else if(value <= UINT16_MAX){
+		out += static_cast<char>(0xcd);
+		write_big_endian(out, value, 2);
+	}else if(value <= UINT32_MAX){
+		out += static_cast<char>(0xce);
+		write_big_endian(out, value, 4);
+	}else{
+		out += static_cast<char>(0xcf);
+		write_big_endian(out, value, 8);
+	}
+}
+
+void MsgPack::pack_double(std::string& out, double value){
+	uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	out += static_cast<char>(0xcb);
+	write_big_endian(out, bits, 8);
+}
+
+void MsgPack::pack_string(std::string& out, const char* data, size_t data_length){
+	if(data_length <= 31){
+		out += static_cast<char>(0xa0 | data_length);
+	}else if(data_length <= UINT8_MAX){
+		out += static_cast<char>(0xd9);
+		write_big_endian(out, data_length, 1);
+	}else if(data_length <= UINT16_MAX){
+		out += static_cast<char>(0xda);
+		write_big_endian(out, data_length, 2);
+	}else{
+		out += static_cast<char>(0xdb);
+		write_big_endian(out, data_length, 4);
+	}
+	out.append(data, data_length);
+}
+
+void MsgPack::pack_array_header(std::string& out, size_t size){
+	if(size <= 15){
+		out += static_cast<char>(0x90 | size);
+	}else if(size <= UINT16_MAX){
+		out += static_cast<char>(0xdc);
+		write_big_endian(out, size, 2);
+	}else{
+		out += static_cast<char>(0xdd);
+		write_big_endian(out, size, 4);
+	}
+}
+
+void MsgPack::pack_map_header(std::string& out, size_t size){
+	if(size <= 15){
+		out += static_cast<char>(0x80 | size);
+	}else if(size <= UINT16_MAX){
+		out += static_cast<char>(0xde);
+		write_big_endian(out, size, 2);
+	}else{
+		out += static_cast<char>(0xdf);
+		write_big_endian(out, size, 4);
+	}
+}
+
+std::string MsgPack::pack(JsonObject* object){
+	std::string out;
+	pack(object, out);
+	return out;
+}
+
+void MsgPack::pack(JsonObject* object, std::string& out){
+	switch(object->type){
+	case NOTYPE:
+		pack_nil(out);
+		break;
+	case STRING:
+		pack_string(out, object->stringValue.c_str(), object->stringValue.length());
+		break;
+	case OBJECT:
+		pack_map_header(out, object->objectValues.size());
+		for(auto it = object->objectValues.begin(); it != object->objectValues.end(); ++it){
+			pack_string(out, it->first.c_str(), it->first.length());
+			pack(it->second, out);
+		}
+		break;
+	case ARRAY:
+		pack_array_header(out, object->arrayValues.size());
+		for(JsonObject* item : object->arrayValues){
+			pack(item, out);
+		}
+		break;
+	}
+}
+
+/**
+ * @brief Unpacks a whole document into object.
+ *
+ * If object is already an OBJECT and the document is a map, the keys are merged in,
+ * the same way JsonObject::parse merges into an existing object.
+ *
+ * @return false if the data is not exactly one msgpack value.
+ */
+bool MsgPack::unpack(const char* data, size_t data_length, JsonObject* object){
+	const char* end = data + data_length;
+	const char* it = unpack(data, end, object, 0);
+	return it == end;
+}
+
+/**
+ * @return Just past the value, or 0 if it is malformed or truncated.
+ */
+const char* MsgPack::unpack(const char* it, const char* end, JsonObject* object, size_t depth){
+	unsigned char marker;
+	size_t length = 0, count = 0, header = 0;
+	char number[32];
+
+	if(it >= end || depth > depth_limit){
+		return 0;
+	}
+	marker = static_cast<unsigned char>(*it++);
+
+	if(marker <= 0x7f){
+		object->type = STRING;
+		object->stringValue = std::to_string(marker);
+		return it;
+	}else if(marker >= 0xe0){
+		object->type = STRING;
+		object->stringValue = std::to_string(static_cast<int>(static_cast<signed char>(marker)));
+		return it;
+	}else if(marker >= 0xa0 && marker <= 0xbf){
+		length = marker & 0x1f;
+	}else if(marker >= 0x90 && marker <= 0x9f){
+		count = marker & 0x0f;
+	}else if(marker >= 0x80 && marker <= 0x8f){
+		count = marker & 0x0f;
+	}else{
+		switch(marker){
+		case 0xc0:
+			object->type = NOTYPE;
+			return it;
+		case 0xc2:
+		case 0xc3:
+			object->type = STRING;
+			object->stringValue = marker == 0xc3 ? "true" : "false";
+			return it;
+		case 0xcc: case 0xcd: case 0xce: case 0xcf:
+			header = static_cast<size_t>(1) << (marker - 0xcc);
+			if(end - it < static_cast<ptrdiff_t>(header)){
+				return 0;
+			}
+			object->type = STRING;
+			object->stringValue = std::to_string(read_big_endian(it, header));
+			return it + header;
+		case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+			header = static_cast<size_t>(1) << (marker - 0xd0);
+			if(end - it < static_cast<ptrdiff_t>(header)){
+				return 0;
+			}else{
+				uint64_t raw = read_big_endian(it, header);
+				// Sign extend.
+				if(header < 8 && (raw >> (header * 8 - 1)) & 1){
+					raw |= ~((static_cast<uint64_t>(1) << (header * 8)) - 1);
+				}
+				object->type = STRING;
+				object->stringValue = std::to_string(static_cast<int64_t>(raw));
+			}
+			return it + header;
+		case 0xca:
+		case 0xcb:
+			header = marker == 0xca ? 4 : 8;
+			if(end - it < static_cast<ptrdiff_t>(header)){
+				return 0;
+			}else{
+				double value;
+				if(header == 4){
+					uint32_t bits = static_cast<uint32_t>(read_big_endian(it, 4));
+					float single;
+					std::memcpy(&single, &bits, sizeof(single));
+					value = static_cast<double>(single);
+				}else{
+					uint64_t bits = read_big_endian(it, 8);
+					std::memcpy(&value, &bits, sizeof(value));
+				}
+				std::snprintf(number, sizeof(number), "%.17g", value);
+				object->type = STRING;
+				object->stringValue = number;
+			}
+			return it + header;
+		case 0xd9: case 0xc4:
+			header = 1;
+			break;
+		case 0xda: case 0xc5:
+			header = 2;
+			break;
+		case 0xdb: case 0xc6:
+			header = 4;
+			break;
+		case 0xdc: case 0xde:
+			header = 2;
+			break;
+		case 0xdd: case 0xdf:
+			header = 4;
+			break;
+		default:
+			// Extension types have no JsonObject equivalent.
+			return 0;
+		}
+		if(end - it < static_cast<ptrdiff_t>(header)){
+			return 0;
+		}
+		if(marker == 0xdc || marker == 0xdd || marker == 0xde || marker == 0xdf){
+			count = static_cast<size_t>(read_big_endian(it, header));
+		}else{
+			length = static_cast<size_t>(read_big_endian(it, header));
+		}
+		it += header;
+	}
+
+	if((marker >= 0xa0 && marker <= 0xbf) || marker == 0xd9 || marker == 0xda || marker == 0xdb ||
+	marker == 0xc4 || marker == 0xc5 || marker == 0xc6){
+		if(static_cast<size_t>(end - it) < length){
+			return 0;
+		}
+		object->type = STRING;
+		object->stringValue.assign(it, length);
+		return it + length;
+	}
+
+	if((marker >= 0x90 && marker <= 0x9f) || marker == 0xdc || marker == 0xdd){
+		object->type = ARRAY;
+		for(size_t i = 0; i < count; ++i){
+			JsonObject* item = new JsonObject();
+			object->arrayValues.push_back(item);
+			if((it = unpack(it, end, item, depth + 1)) == 0){
+				return 0;
+			}
+		}
+		return it;
+	}
+
+	object->type = OBJECT;
+	for(size_t i = 0; i < count; ++i){
+		JsonObject key;
+		if((it = unpack(it, end, &key, depth + 1)) == 0 || key.type != STRING){
+			return 0;
+		}
+		JsonObject* value = new JsonObject();
+		if(object->objectValues.count(key.stringValue)){
+			delete object->objectValues[key.stringValue];
+		}
+		object->objectValues[key.stringValue] = value;
+		if((it = unpack(it, end, value, depth + 1)) == 0){
+			return 0;
+		}
+	}
+	return it;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "json.hpp"
+
+#define MSGPACK_CONTENT_TYPE "application/msgpack"
+
+/**
+ * @brief MessagePack encoding of the JsonObject data model.
+ *
+ * Strings, objects and arrays map onto msgpack str, map and array. Since JsonObject only holds
+ * strings, msgpack numbers, booleans and binary are unpacked as their string forms, and nil as NOTYPE.
+ *
+ * The pack_* writers are shared with JsonSchema so typed structs can be packed directly.
+ */
+class MsgPack{
+public:
+	static bool is_packed(const char* data, size_t data_length);
+
+	static std::string pack(JsonObject* object);
+	static void pack(JsonObject* object, std::string& out);
+
+	static bool unpack(const char* data, size_t data_length, JsonObject* object);
+	static const char* unpack(const char* it, const char* end, JsonObject* object, size_t depth);
+
+	static void pack_nil(std::string& out);
+	static void pack_bool(std::string& out, bool value);
+	static void pack_integer(std::string& out, int64_t value);
+	static void pack_unsigned(std::string& out, uint64_t value);
+	static void pack_double(std::string& out, double value);
+	static void pack_string(std::string& out, const char* data, size_t data_length);
+	static void pack_array_header(std::string& out, size_t size);
+	static void pack_map_header(std::string& out, size_t size);
+};
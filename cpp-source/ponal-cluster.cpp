@@ -0,0 +1,509 @@
+#include <random>
+#include <cstdlib>
+#include <algorithm>
+
+#include "util.hpp"
+#include "ponal-cluster.hpp"
+
+static uint64_t to_uint64(const std::string& value){
+	return std::strtoull(value.c_str(), 0, 10);
+}
+
+/**
+ * @brief The string at key in object, or empty if there's none.
+ */
+static std::string field(JsonObject* object, const char* key){
+	return object->HasObj(key, STRING) ? object->GetStr(key) : std::string();
+}
+
+static void write_request(JsonObject* request, const std::string& key, const std::string& value, uint64_t version, bool deleted){
+	request->objectValues["type"] = new JsonObject("ponal-write");
+	request->objectValues["key"] = new JsonObject(key);
+	request->objectValues["value"] = new JsonObject(value);
+	request->objectValues["version"] = new JsonObject(std::to_string(version));
+	if(deleted){
+		request->objectValues["deleted"] = new JsonObject("1");
+	}
+}
+
+PonalRing::PonalRing(size_t new_virtual_nodes)
+:virtual_nodes(new_virtual_nodes){}
+
+/**
+ * @brief PonalStore's hash, which is mixed well enough that similar names, like ports in a row, land far apart.
+ */
+uint64_t PonalRing::hash(const std::string& data){
+	return PonalStore::hash(data.data(), data.length());
+}
+
+/**
+ * @brief Puts exactly new_nodes on the ring; nothing is done if they're the ones already there.
+ */
+void PonalRing::assign(std::vector<std::string> new_nodes){
+	std::sort(new_nodes.begin(), new_nodes.end());
+	new_nodes.erase(std::unique(new_nodes.begin(), new_nodes.end()), new_nodes.end());
+	if(new_nodes == this->nodes){
+		return;
+	}
+	this->nodes = new_nodes;
+	this->points.clear();
+	for(const std::string& node : this->nodes){
+		for(size_t i = 0; i < this->virtual_nodes; ++i){
+			this->points[PonalRing::hash(node + '#' + std::to_string(i))] = node;
+		}
+	}
+}
+
+/**
+ * @brief The first count distinct nodes clockwise from key, or all of them if there are fewer.
+ */
+std::vector<std::string> PonalRing::owners(const std::string& key, size_t count) const{
+	std::vector<std::string> found;
+	count = std::min(count, this->nodes.size());
+	auto it = this->points.lower_bound(PonalRing::hash(key));
+	while(found.size() < count){
+		if(it == this->points.end()){
+			it = this->points.begin();
+		}
+		if(std::find(found.begin(), found.end(), it->second) == found.end()){
+			found.push_back(it->second);
+		}
+		++it;
+	}
+	return found;
+}
+
+const std::vector<std::string>& PonalRing::get_nodes() const{
+	return this->nodes;
+}
+
+PonalCluster::PonalCluster(PonalStore* new_store, std::string keyfile, uint16_t port,
+size_t new_replicas, size_t new_read_quorum, size_t new_write_quorum)
+:store(new_store),
+node(keyfile, port),
+replicas(std::max(new_replicas, static_cast<size_t>(1))),
+read_quorum(std::max(new_read_quorum, static_cast<size_t>(1))),
+write_quorum(std::max(new_write_quorum, static_cast<size_t>(1))),
+last_version(0),
+requesters(PONAL_REQUESTERS),
+coordinators(PONAL_COORDINATORS),
+writers(PONAL_WRITERS){
+	// The low bits of every version this node hands out, so two coordinators never write the same one.
+	std::random_device random;
+	this->node_bits = random() & 1023;
+
+	this->node.on_request = [&](int fd, JsonObject* request, JsonObject* response){
+		this->handle(fd, request, response);
+	};
+}
+
+/**
+ * @brief Adds a node of the cluster to join through; the others are learned from it.
+ */
+void PonalCluster::add_seed(const char* ip_address, uint16_t port){
+	this->node.add_client(ip_address, port);
+}
+
+/**
+ * @brief Puts every live member on the ring, this node included. Expects ring_mutex to be held.
+ *
+ * @return What this node is called on the ring: empty until another member has said, and until then it's only on the ring alone.
+ */
+std::string PonalCluster::refresh(){
+	std::vector<std::string> nodes = this->node.get_members();
+	std::string self = this->node.get_self();
+	if(!self.empty() || nodes.empty()){
+		nodes.push_back(self);
+	}
+	this->ring.assign(nodes);
+	return self;
+}
+
+std::vector<std::string> PonalCluster::get_nodes(){
+	std::lock_guard<std::mutex> lock(this->ring_mutex);
+	this->refresh();
+	return this->ring.get_nodes();
+}
+
+/**
+ * @brief The nodes that keep key, and in local what this node is called among them.
+ */
+std::vector<std::string> PonalCluster::owners(const std::string& key, std::string* local){
+	std::lock_guard<std::mutex> lock(this->ring_mutex);
+	*local = this->refresh();
+	return this->ring.owners(key, this->replicas);
+}
+
+/**
+ * @brief A version newer than any this node has handed out: microseconds, then node_bits.
+ */
+uint64_t PonalCluster::next_version(){
+	uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count()) << 10;
+	std::lock_guard<std::mutex> lock(this->version_mutex);
+	this->last_version = std::max(now, this->last_version + 1024) & ~static_cast<uint64_t>(1023);
+	return this->last_version | this->node_bits;
+}
+
+/**
+ * @brief Sends the request made by build to every one of owners at once, handling it here for local,
+ * and waits until quorum of them have answered or all have answered or timed out. The rest carry on in the background,
+ * on the requesters.
+ *
+ * @return The answers so far; lock their mutex to read them.
+ */
+std::shared_ptr<PonalAnswers> PonalCluster::ask(const std::vector<std::string>& owners, const std::string& local,
+std::function<void(JsonObject*)> build, size_t quorum){
+	std::shared_ptr<PonalAnswers> answers = std::make_shared<PonalAnswers>();
+	answers->answered = 0;
+	answers->finished = 0;
+	answers->responses.resize(owners.size());
+
+	for(size_t i = 0; i < owners.size(); ++i){
+		if(owners[i] == local){
+			continue;
+		}
+		std::string owner = owners[i];
+		this->requesters.submit([this, answers, build, owner, i](){
+			JsonObject request(OBJECT);
+			build(&request);
+			std::unique_ptr<JsonObject> response(new JsonObject(OBJECT));
+			bool answered = this->node.request(owner, &request, response.get(), PONAL_TIMEOUT_MS) && !response->HasObj("error", STRING);
+			std::lock_guard<std::mutex> lock(answers->mutex);
+			if(answered){
+				answers->responses[i] = std::move(response);
+				answers->answered++;
+			}
+			answers->finished++;
+			answers->condition.notify_all();
+		});
+	}
+
+	// This node's own copy, while the others are on their way.
+	for(size_t i = 0; i < owners.size(); ++i){
+		if(owners[i] != local){
+			continue;
+		}
+		JsonObject request(OBJECT);
+		build(&request);
+		std::unique_ptr<JsonObject> response(new JsonObject(OBJECT));
+		this->replica(&request, response.get());
+		bool answered = !response->HasObj("error", STRING);
+		std::lock_guard<std::mutex> lock(answers->mutex);
+		if(answered){
+			answers->responses[i] = std::move(response);
+			answers->answered++;
+		}
+		answers->finished++;
+	}
+
+	std::unique_lock<std::mutex> lock(answers->mutex);
+	answers->condition.wait(lock, [&](){
+		return answers->answered >= quorum || answers->finished == owners.size();
+	});
+	return answers;
+}
+
+/**
+ * @brief Reads key from read_quorum of its owners and takes the newest copy, which may be its removal.
+ * Owners that had an older one, or none, are sent the newest.
+ */
+enum PonalStatus PonalCluster::get(const std::string& key, std::string* value){
+	std::string local;
+	std::vector<std::string> owners = this->owners(key, &local);
+	size_t quorum = std::min(this->read_quorum, owners.size());
+	std::shared_ptr<PonalAnswers> answers = this->ask(owners, local, [key](JsonObject* request){
+		request->objectValues["type"] = new JsonObject("ponal-read");
+		request->objectValues["key"] = new JsonObject(key);
+	}, quorum);
+
+	bool found = false;
+	bool deleted = false;
+	uint64_t newest = 0;
+	std::vector<std::string> stale;
+	{
+		std::lock_guard<std::mutex> lock(answers->mutex);
+		if(answers->answered < quorum){
+			return PONAL_NO_QUORUM;
+		}
+		for(size_t i = 0; i < owners.size(); ++i){
+			JsonObject* response = answers->responses[i].get();
+			if(response != nullptr && field(response, "found") == "1"){
+				uint64_t version = to_uint64(field(response, "version"));
+				if(!found || version > newest){
+					found = true;
+					newest = version;
+					deleted = field(response, "deleted") == "1";
+					*value = field(response, "value");
+				}
+			}
+		}
+		for(size_t i = 0; i < owners.size(); ++i){
+			JsonObject* response = answers->responses[i].get();
+			if(response != nullptr && (field(response, "found") != "1" || to_uint64(field(response, "version")) < newest)){
+				stale.push_back(owners[i]);
+			}
+		}
+	}
+	if(!found){
+		return PONAL_NOT_FOUND;
+	}
+	if(!stale.empty()){
+		std::string newest_value = *value;
+		this->ask(stale, local, [key, newest_value, newest, deleted](JsonObject* request){
+			write_request(request, key, newest_value, newest, deleted);
+		}, 0);
+	}
+	return deleted ? PONAL_NOT_FOUND : PONAL_OK;
+}
+
+/**
+ * @brief Writes value under key, or its removal, at a new version to every owner of key, and waits for write_quorum of them.
+ */
+enum PonalStatus PonalCluster::write(const std::string& key, const std::string& value, bool deleted){
+	std::string local;
+	std::vector<std::string> owners = this->owners(key, &local);
+	size_t quorum = std::min(this->write_quorum, owners.size());
+	uint64_t version = this->next_version();
+	std::shared_ptr<PonalAnswers> answers = this->ask(owners, local, [key, value, version, deleted](JsonObject* request){
+		write_request(request, key, value, version, deleted);
+	}, quorum);
+
+	std::lock_guard<std::mutex> lock(answers->mutex);
+	return answers->answered >= quorum ? PONAL_OK : PONAL_NO_QUORUM;
+}
+
+enum PonalStatus PonalCluster::set(const std::string& key, const std::string& value){
+	return this->write(key, value, false);
+}
+
+/**
+ * @brief Removes key, leaving a versioned removal on its owners so that older copies can't come back.
+ */
+enum PonalStatus PonalCluster::remove(const std::string& key){
+	return this->write(key, std::string(), true);
+}
+
+/**
+ * @brief Reads or writes this node's own copy of a key, for a coordinator.
+ */
+void PonalCluster::replica(JsonObject* request, JsonObject* response){
+	if(!request->HasObj("key", STRING)){
+		response->objectValues["error"] = new JsonObject("No key.");
+		return;
+	}
+	std::string key = request->GetStr("key");
+	if(field(request, "type") == "ponal-read"){
+		std::string value;
+		uint64_t version;
+		bool deleted;
+		response->objectValues["type"] = new JsonObject("ponal-read");
+		if(this->store->lookup(key.data(), key.length(), &value, &version, &deleted)){
+			response->objectValues["found"] = new JsonObject("1");
+			response->objectValues["value"] = new JsonObject(value);
+			response->objectValues["version"] = new JsonObject(std::to_string(version));
+			if(deleted){
+				response->objectValues["deleted"] = new JsonObject("1");
+			}
+		}else{
+			response->objectValues["found"] = new JsonObject("0");
+		}
+	}else if(request->HasObj("value", STRING) && request->HasObj("version", STRING)){
+		// A stale write is still acknowledged: this copy is at least as new.
+		this->store->merge(key, request->GetStr("value"), to_uint64(request->GetStr("version")), field(request, "deleted") == "1");
+		if(this->on_written && this->on_written()){
+			response->objectValues["error"] = new JsonObject("Not durable.");
+			return;
+		}
+		response->objectValues["type"] = new JsonObject("ponal-written");
+	}else{
+		response->objectValues["error"] = new JsonObject("No value.");
+	}
+}
+
+/**
+ * @brief Answers the requests of other nodes and of clients, on the DistributedNode's server thread.
+ */
+void PonalCluster::handle(int fd, JsonObject* request, JsonObject* response){
+	std::string type = field(request, "type");
+	if(type == "ponal-read"){
+		this->replica(request, response);
+	}else if(type == "ponal-write"){
+		// on_written may wait on an fsync, so the write is made, and answered, on a writer.
+		uint64_t connection = this->node.get_connection(fd);
+		std::shared_ptr<JsonObject> write = std::make_shared<JsonObject>(OBJECT);
+		for(const char* name : {"type", "key", "value", "version", "deleted"}){
+			if(request->HasObj(name, STRING)){
+				write->objectValues[name] = new JsonObject(request->GetStr(name));
+			}
+		}
+		this->writers.submit([this, fd, connection, write](){
+			JsonObject answer(OBJECT);
+			this->replica(write.get(), &answer);
+			this->node.reply(fd, connection, &answer);
+		});
+	}else if(type == "ponal-ring"){
+		JsonObject* nodes = new JsonObject(ARRAY);
+		for(const std::string& node : this->get_nodes()){
+			nodes->arrayValues.push_back(new JsonObject(node));
+		}
+		response->objectValues["type"] = new JsonObject("ponal-ring");
+		response->objectValues["nodes"] = nodes;
+	}else if((type == "ponal-get" || type == "ponal-del" || (type == "ponal-set" && request->HasObj("value", STRING))) && request->HasObj("key", STRING)){
+		// Coordinating waits on other nodes, and the server has only the one thread, so it's answered from a coordinator.
+		uint64_t connection = this->node.get_connection(fd);
+		std::string key = request->GetStr("key");
+		std::string value = field(request, "value");
+		this->coordinators.submit([this, fd, connection, type, key, value](){
+			JsonObject answer(OBJECT);
+			std::string found;
+			enum PonalStatus status = type == "ponal-set" ? this->set(key, value) :
+				type == "ponal-del" ? this->remove(key) : this->get(key, &found);
+			answer.objectValues["type"] = new JsonObject(type);
+			if(status == PONAL_OK){
+				if(type == "ponal-get"){
+					answer.objectValues["value"] = new JsonObject(found);
+				}
+			}else{
+				answer.objectValues["error"] = new JsonObject(status == PONAL_NOT_FOUND ? "Not found." : "No quorum.");
+			}
+			this->node.reply(fd, connection, &answer);
+		});
+	}else{
+		response->objectValues["error"] = new JsonObject("Unknown request.");
+	}
+}
+
+PonalClient::PonalClient(const std::string& seed, std::string new_keyfile)
+:keyfile(new_keyfile){
+	this->seeds.push_back(seed);
+	this->refresh();
+}
+
+SymmetricTcpClient* PonalClient::connection(const std::string& address){
+	size_t colon = address.rfind(':');
+	if(colon == std::string::npos){
+		return nullptr;
+	}
+	std::unique_ptr<SymmetricTcpClient>& client = this->connections[address];
+	if(client == nullptr){
+		client.reset(new SymmetricTcpClient(address.substr(0, colon).c_str(),
+			static_cast<uint16_t>(std::atoi(address.substr(colon + 1).c_str())), this->keyfile));
+		// Enough for the node to wait on the other owners first.
+		client->set_timeout(PONAL_TIMEOUT_MS * 2);
+	}
+	return client.get();
+}
+
+/**
+ * @return true if the node at address didn't answer.
+ */
+bool PonalClient::call(const std::string& address, const std::string& request, std::string* response){
+	SymmetricTcpClient* client = this->connection(address);
+	if(client == nullptr){
+		return true;
+	}
+	*response = client->communicate(request);
+	return response->empty();
+}
+
+/**
+ * @brief Asks the nodes it knows of, then the seeds, for the ring.
+ *
+ * @return true if none answered.
+ */
+bool PonalClient::refresh(){
+	std::vector<std::string> candidates = this->ring.get_nodes();
+	candidates.insert(candidates.end(), this->seeds.begin(), this->seeds.end());
+
+	JsonObject request(OBJECT);
+	request.objectValues["type"] = new JsonObject("ponal-ring");
+	std::string request_data = request.stringify(false);
+	for(const std::string& address : candidates){
+		std::string response_data;
+		if(this->call(address, request_data, &response_data)){
+			continue;
+		}
+		JsonObject response;
+		response.parse(response_data.c_str());
+		if(response.type != OBJECT || !response.HasObj("nodes", ARRAY)){
+			continue;
+		}
+		std::vector<std::string> nodes;
+		for(JsonObject* item : response["nodes"]->arrayValues){
+			// A node that's alone doesn't know what it's called yet.
+			nodes.push_back(item->stringValue.empty() ? address : item->stringValue);
+		}
+		this->ring.assign(nodes);
+		this->refreshed = std::chrono::steady_clock::now();
+		return false;
+	}
+	ERROR("PonalClient no node answered for the ring")
+	return true;
+}
+
+/**
+ * @brief Sends request to the first owner of key that answers, then to the seeds.
+ *
+ * @return true if no node answered.
+ */
+bool PonalClient::route(const std::string& key, const std::string& request, std::string* response){
+	if(std::chrono::steady_clock::now() - this->refreshed > std::chrono::milliseconds(PONAL_RING_REFRESH_MS)){
+		this->refresh();
+	}
+	std::vector<std::string> order = this->ring.owners(key, this->ring.get_nodes().size());
+	order.insert(order.end(), this->seeds.begin(), this->seeds.end());
+	for(const std::string& address : order){
+		if(!this->call(address, request, response)){
+			return false;
+		}
+		// The ring has likely changed.
+		this->refreshed = std::chrono::steady_clock::time_point();
+	}
+	return true;
+}
+
+enum PonalStatus PonalClient::get(const std::string& key, std::string* value){
+	JsonObject request(OBJECT);
+	request.objectValues["type"] = new JsonObject("ponal-get");
+	request.objectValues["key"] = new JsonObject(key);
+	std::string response_data;
+	if(this->route(key, request.stringify(false), &response_data)){
+		return PONAL_NO_QUORUM;
+	}
+	JsonObject response;
+	response.parse(response_data.c_str());
+	if(response.type == OBJECT && response.HasObj("value", STRING)){
+		*value = response.GetStr("value");
+		return PONAL_OK;
+	}
+	return response.type == OBJECT && field(&response, "error") == "Not found." ? PONAL_NOT_FOUND : PONAL_NO_QUORUM;
+}
+
+/**
+ * @brief Sends a request with no answer but whether it worked, routed by key.
+ */
+enum PonalStatus PonalClient::command(JsonObject* request, const std::string& key){
+	std::string response_data;
+	if(this->route(key, request->stringify(false), &response_data)){
+		return PONAL_NO_QUORUM;
+	}
+	JsonObject response;
+	response.parse(response_data.c_str());
+	return response.type == OBJECT && field(&response, "type") == field(request, "type") && !response.HasObj("error", STRING) ? PONAL_OK : PONAL_NO_QUORUM;
+}
+
+enum PonalStatus PonalClient::set(const std::string& key, const std::string& value){
+	JsonObject request(OBJECT);
+	request.objectValues["type"] = new JsonObject("ponal-set");
+	request.objectValues["key"] = new JsonObject(key);
+	request.objectValues["value"] = new JsonObject(value);
+	return this->command(&request, key);
+}
+
+enum PonalStatus PonalClient::remove(const std::string& key){
+	JsonObject request(OBJECT);
+	request.objectValues["type"] = new JsonObject("ponal-del");
+	request.objectValues["key"] = new JsonObject(key);
+	return this->command(&request, key);
+}
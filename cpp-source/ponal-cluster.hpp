@@ -0,0 +1,148 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "json.hpp"
+#include "ponal-store.hpp"
+#include "distributed-node.hpp"
+#include "symmetric-tcp-client.hpp"
+
+// Points each node gets on the ring, so that keys spread evenly and a leaving node's keys spread over the rest.
+#define PONAL_VIRTUAL_NODES 128
+// How long a coordinator waits on the other owners of a key, and a client on a node.
+#define PONAL_TIMEOUT_MS 500
+// How often a client asks for the ring again, besides whenever a node fails it.
+#define PONAL_RING_REFRESH_MS 5000
+// Threads coordinating the reads and writes of clients, which each wait on the owners of a key.
+#define PONAL_COORDINATORS 8
+// Threads sending requests to the owners of keys, for the coordinators and for repairs.
+#define PONAL_REQUESTERS 16
+// Threads writing this node's copies for other coordinators, which each wait for the write to be durable.
+#define PONAL_WRITERS 4
+
+/// What a clustered read or write came to.
+enum PonalStatus{
+	PONAL_OK,
+	PONAL_NOT_FOUND,
+	PONAL_NO_QUORUM
+};
+
+/**
+ * @brief A consistent hash ring: each node is hashed onto it PONAL_VIRTUAL_NODES times, and a key is owned
+ * by the first distinct nodes clockwise from its own hash. Nodes joining or leaving only move the keys next to their points.
+ */
+class PonalRing{
+private:
+	size_t virtual_nodes;
+	std::map<uint64_t, std::string> points;
+	std::vector<std::string> nodes;
+public:
+	PonalRing(size_t new_virtual_nodes = PONAL_VIRTUAL_NODES);
+
+	void assign(std::vector<std::string> new_nodes);
+	std::vector<std::string> owners(const std::string& key, size_t count) const;
+	const std::vector<std::string>& get_nodes() const;
+
+	static uint64_t hash(const std::string& data);
+};
+
+/// The answers to one request sent to all the owners of a key, as they come in.
+struct PonalAnswers{
+	std::mutex mutex;
+	std::condition_variable condition;
+	size_t answered;
+	size_t finished;
+	std::vector<std::unique_ptr<JsonObject>> responses;
+};
+
+/**
+ * @brief ponald's clustered mode: keys are spread over the members of a DistributedNode by a PonalRing,
+ * and kept on the first replicas nodes clockwise from each key.
+ *
+ * Any node coordinates a read or write: it asks every owner at once and answers once read_quorum
+ * (or write_quorum) of them have. Writes are versioned by their coordinator's clock, and the newest version
+ * wins, both when a read gathers the owners' copies and on the owners themselves. Owners found stale
+ * by a read are repaired in the background. Membership, connections and encryption are the DistributedNode's;
+ * requests it doesn't know come here through on_request.
+ *
+ * Requests to the owners run on PONAL_REQUESTERS threads, and clients' requests are coordinated on
+ * PONAL_COORDINATORS others, so that a coordinator never waits on a request queued behind it.
+ * Other coordinators' writes are made on PONAL_WRITERS more, since waiting for one to be durable
+ * would hold up the node's server thread, and its gossip with it.
+ */
+class PonalCluster{
+private:
+	PonalStore* store;
+	DistributedNode node;
+	size_t replicas;
+	size_t read_quorum;
+	size_t write_quorum;
+
+	std::mutex ring_mutex;
+	PonalRing ring;
+
+	std::mutex version_mutex;
+	uint64_t last_version;
+	uint64_t node_bits;
+
+	// Destroyed before the node, coordinators first, since they wait on the requesters.
+	DistributedWorkers requesters;
+	DistributedWorkers coordinators;
+	DistributedWorkers writers;
+
+	std::string refresh();
+	std::vector<std::string> owners(const std::string& key, std::string* local);
+	uint64_t next_version();
+	std::shared_ptr<PonalAnswers> ask(const std::vector<std::string>& owners, const std::string& local,
+		std::function<void(JsonObject*)> build, size_t quorum);
+	enum PonalStatus write(const std::string& key, const std::string& value, bool deleted);
+	void replica(JsonObject* request, JsonObject* response);
+	void handle(int fd, JsonObject* request, JsonObject* response);
+public:
+	/// Called after this node's copy of a key is written and before that's acknowledged; returning true fails the write.
+	std::function<bool()> on_written;
+
+	PonalCluster(PonalStore* new_store, std::string keyfile, uint16_t port,
+		size_t new_replicas = 3, size_t new_read_quorum = 2, size_t new_write_quorum = 2);
+
+	void add_seed(const char* ip_address, uint16_t port);
+	std::vector<std::string> get_nodes();
+
+	enum PonalStatus get(const std::string& key, std::string* value);
+	enum PonalStatus set(const std::string& key, const std::string& value);
+	enum PonalStatus remove(const std::string& key);
+};
+
+/**
+ * @brief A client for a ponald cluster that routes each key straight to the first of its owners,
+ * going on to the next ones (any node can coordinate) if that one doesn't answer.
+ */
+class PonalClient{
+private:
+	std::string keyfile;
+	std::vector<std::string> seeds;
+	PonalRing ring;
+	std::chrono::steady_clock::time_point refreshed;
+	std::unordered_map<std::string, std::unique_ptr<SymmetricTcpClient>> connections;
+
+	SymmetricTcpClient* connection(const std::string& address);
+	bool call(const std::string& address, const std::string& request, std::string* response);
+	bool refresh();
+	bool route(const std::string& key, const std::string& request, std::string* response);
+	enum PonalStatus command(JsonObject* request, const std::string& key);
+public:
+	PonalClient(const std::string& seed, std::string new_keyfile);
+
+	enum PonalStatus get(const std::string& key, std::string* value);
+	enum PonalStatus set(const std::string& key, const std::string& value);
+	enum PonalStatus remove(const std::string& key);
+};
@@ -0,0 +1,531 @@
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.hpp"
+#include "ponal-log.hpp"
+#include "ponal-protocol.hpp"
+
+// Record length and checksum.
+#define PONAL_RECORD_HEADER 8
+
+/**
+ * @return true if fd couldn't take all of data.
+ */
+static bool write_all(int fd, const std::string& data){
+	size_t done = 0;
+	while(done < data.length()){
+		ssize_t written = write(fd, data.data() + done, data.length() - done);
+		if(written < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return true;
+		}
+		done += static_cast<size_t>(written);
+	}
+	return false;
+}
+
+/**
+ * @brief Makes files created in, renamed in, or removed from directory stick.
+ *
+ * @return true on failure.
+ */
+static bool sync_directory(const std::string& directory){
+	int fd = open(directory.c_str(), O_RDONLY);
+	if(fd < 0){
+		return true;
+	}
+	bool failed = fsync(fd) < 0;
+	close(fd);
+	return failed;
+}
+
+static uint32_t checksum(const char* data, size_t data_length){
+	return static_cast<uint32_t>(PonalStore::hash(data, data_length));
+}
+
+PonalLog::PonalLog(const std::string& new_directory, PonalFsync new_policy, int new_interval_ms)
+:directory(new_directory),
+policy(new_policy),
+interval_ms(new_interval_ms),
+store(nullptr),
+fd(-1),
+appended(0),
+durable(0),
+stopping(false),
+failed(false),
+unsynced(false),
+log_bytes(0),
+snapshot_bytes(0),
+rotated(false){}
+
+PonalLog::~PonalLog(){
+	if(this->store != nullptr){
+		this->store->on_change = nullptr;
+	}
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->wake.notify_all();
+	this->compact_wake.notify_all();
+	this->synced.notify_all();
+	// The writer flushes what's left on its way out.
+	if(this->writer.joinable()){
+		this->writer.join();
+	}
+	if(this->compactor.joinable()){
+		this->compactor.join();
+	}
+	if(this->fd >= 0){
+		close(this->fd);
+	}
+}
+
+std::string PonalLog::path(const char* name){
+	return this->directory + "/ponal." + name;
+}
+
+/**
+ * @brief Reads "always", "never", or a number of milliseconds between fsyncs.
+ *
+ * @return true if text is none of those.
+ */
+bool PonalLog::parse_policy(const std::string& text, PonalFsync* policy, int* interval_ms){
+	if(text == "always"){
+		*policy = PONAL_FSYNC_ALWAYS;
+		return false;
+	}
+	if(text == "never"){
+		*policy = PONAL_FSYNC_NEVER;
+		return false;
+	}
+	char* end;
+	long milliseconds = std::strtol(text.c_str(), &end, 10);
+	if(text.empty() || *end != '\0' || milliseconds <= 0 || milliseconds > INT_MAX){
+		return true;
+	}
+	*policy = PONAL_FSYNC_INTERVAL;
+	*interval_ms = static_cast<int>(milliseconds);
+	return false;
+}
+
+/**
+ * @brief Appends one change to out, as it's kept in both the log and the snapshot.
+ */
+void PonalLog::record(std::string* out, PonalChange change, const char* key, size_t key_length,
+const char* value, size_t value_length, uint64_t version, uint64_t expires){
+	size_t start = out->length();
+	out->append(PONAL_RECORD_HEADER, '\0');
+	out->push_back(static_cast<char>(change));
+	PonalProtocol::put_uint32(out, static_cast<uint32_t>(version >> 32));
+	PonalProtocol::put_uint32(out, static_cast<uint32_t>(version));
+	if(change == PONAL_CHANGE_EXPIRING){
+		PonalProtocol::put_uint32(out, static_cast<uint32_t>(expires >> 32));
+		PonalProtocol::put_uint32(out, static_cast<uint32_t>(expires));
+	}
+	PonalProtocol::put_key(out, key, key_length);
+	out->append(value, value_length);
+
+	const char* body = out->data() + start + PONAL_RECORD_HEADER;
+	size_t body_length = out->length() - start - PONAL_RECORD_HEADER;
+	std::string header;
+	PonalProtocol::put_uint32(&header, static_cast<uint32_t>(body_length));
+	PonalProtocol::put_uint32(&header, checksum(body, body_length));
+	out->replace(start, PONAL_RECORD_HEADER, header);
+}
+
+/**
+ * @brief Buffers a change for the writer; called by the store with the key's shard locked.
+ */
+void PonalLog::append(PonalChange change, const char* key, size_t key_length, const char* value, size_t value_length,
+uint64_t version, uint64_t expires){
+	std::lock_guard<std::mutex> lock(this->mutex);
+	if(this->failed){
+		return;
+	}
+	size_t before = this->buffer.length();
+	PonalLog::record(&this->buffer, change, key, key_length, value, value_length, version, expires);
+	this->appended += this->buffer.length() - before;
+	if((this->policy == PONAL_FSYNC_ALWAYS && before == 0) ||
+	(before < PONAL_LOG_BUFFER && this->buffer.length() >= PONAL_LOG_BUFFER)){
+		this->wake.notify_one();
+	}
+}
+
+/**
+ * @brief Writes out whatever is buffered, and fsyncs if asked to. Expects file_mutex to be held.
+ *
+ * @return true if the log couldn't be written, after which it stops taking changes.
+ */
+bool PonalLog::flush(bool sync_now){
+	uint64_t through;
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->writing.swap(this->buffer);
+		through = this->appended;
+	}
+	bool error = !this->writing.empty() && write_all(this->fd, this->writing);
+	this->log_bytes += this->writing.length();
+	this->unsynced = this->unsynced || !this->writing.empty();
+	if(this->writing.capacity() > PONAL_LOG_BUFFER * 4){
+		std::string().swap(this->writing);
+	}else{
+		this->writing.clear();
+	}
+	if(!error && sync_now && this->unsynced){
+		error = fsync(this->fd) < 0;
+		this->unsynced = false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if(error){
+			if(!this->failed){
+				perror("ponal log write");
+				ERROR("ponal log write, changes from now on are not kept,")
+			}
+			this->failed = true;
+			this->buffer.clear();
+		}else{
+			this->durable = through;
+		}
+	}
+	this->synced.notify_all();
+	return error;
+}
+
+/**
+ * @brief With PONAL_FSYNC_ALWAYS, waits until every change made so far is on disk; otherwise returns at once.
+ *
+ * @return true if the log couldn't be written, so changes may be lost.
+ */
+bool PonalLog::sync(){
+	std::unique_lock<std::mutex> lock(this->mutex);
+	if(this->policy == PONAL_FSYNC_ALWAYS){
+		uint64_t target = this->appended;
+		this->synced.wait(lock, [&](){
+			return this->durable >= target || this->failed || this->stopping;
+		});
+	}
+	return this->failed;
+}
+
+void PonalLog::write_loop(){
+	std::chrono::steady_clock::time_point synced_at = std::chrono::steady_clock::now();
+	bool stop = false;
+	while(!stop){
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			if(this->policy == PONAL_FSYNC_ALWAYS){
+				// Whatever piles up during one fsync goes in the next, together.
+				this->wake.wait(lock, [&](){
+					return !this->buffer.empty() || this->stopping;
+				});
+			}else{
+				int wait_ms = this->policy == PONAL_FSYNC_INTERVAL ? this->interval_ms : PONAL_LOG_WRITE_MS;
+				this->wake.wait_for(lock, std::chrono::milliseconds(wait_ms), [&](){
+					return this->buffer.length() >= PONAL_LOG_BUFFER || this->stopping;
+				});
+			}
+			stop = this->stopping;
+		}
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		bool due = this->policy == PONAL_FSYNC_INTERVAL && now - synced_at >= std::chrono::milliseconds(this->interval_ms);
+		if(due){
+			synced_at = now;
+		}
+		std::lock_guard<std::mutex> lock(this->file_mutex);
+		this->flush(this->policy == PONAL_FSYNC_ALWAYS || due || (stop && this->policy != PONAL_FSYNC_NEVER));
+	}
+}
+
+void PonalLog::compact_loop(){
+	std::unique_lock<std::mutex> lock(this->mutex);
+	while(!this->stopping){
+		this->compact_wake.wait_for(lock, std::chrono::milliseconds(PONAL_LOG_COMPACT_CHECK_MS));
+		uint64_t length = this->log_bytes;
+		if(this->stopping || (!this->rotated && (length < PONAL_LOG_COMPACT_MIN || length < this->snapshot_bytes))){
+			continue;
+		}
+		lock.unlock();
+		if(this->compact()){
+			ERROR("ponal log compaction")
+		}
+		lock.lock();
+	}
+}
+
+/**
+ * @brief Moves the log aside as ponal.log.old, for the next snapshot to cover, and starts a new one.
+ *
+ * @return true on failure, leaving the log as it was.
+ */
+bool PonalLog::rotate(){
+	std::lock_guard<std::mutex> lock(this->file_mutex);
+	if(this->flush(true)){
+		return true;
+	}
+	std::string current = this->path("log");
+	std::string old = this->path("log.old");
+	if(rename(current.c_str(), old.c_str()) < 0){
+		perror("ponal log rename");
+		return true;
+	}
+	int next = ::open(current.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(next < 0 || sync_directory(this->directory)){
+		perror("ponal log open");
+		if(next >= 0){
+			close(next);
+		}
+		rename(old.c_str(), current.c_str());
+		return true;
+	}
+	close(this->fd);
+	this->fd = next;
+	this->log_bytes = 0;
+	this->rotated = true;
+	return false;
+}
+
+/**
+ * @brief Writes every entry of the store to ponal.snapshot.tmp, then puts it in place of ponal.snapshot.
+ *
+ * @return true on failure, leaving the last snapshot as it was.
+ */
+bool PonalLog::write_snapshot(){
+	std::string temporary = this->path("snapshot.tmp");
+	int out = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(out < 0){
+		perror("ponal snapshot open");
+		return true;
+	}
+	std::string chunk;
+	uint64_t bytes = 0;
+	bool error = false;
+	this->store->each([&](const char* key, size_t key_length, const char* value, size_t value_length, uint64_t version, bool deleted, uint64_t expires){
+		PonalChange change = deleted ? PONAL_CHANGE_TOMBSTONE : expires != 0 ? PONAL_CHANGE_EXPIRING : PONAL_CHANGE_SET;
+		PonalLog::record(&chunk, change, key, key_length, value, value_length, version, expires);
+		if(chunk.length() >= PONAL_LOG_BUFFER){
+			error = error || write_all(out, chunk);
+			bytes += chunk.length();
+			chunk.clear();
+		}
+	});
+	error = error || write_all(out, chunk) || fsync(out) < 0;
+	bytes += chunk.length();
+	close(out);
+	if(error || rename(temporary.c_str(), this->path("snapshot").c_str()) < 0 || sync_directory(this->directory)){
+		perror("ponal snapshot write");
+		unlink(temporary.c_str());
+		return true;
+	}
+	this->snapshot_bytes = bytes;
+	return false;
+}
+
+/**
+ * @brief Replaces the log with a snapshot of the store. Changes made meanwhile go to the new log as well as
+ * maybe the snapshot; replaying them over it again on load leaves the same result.
+ *
+ * @return true on failure; the old log is then kept, and the next try writes just the snapshot.
+ */
+bool PonalLog::compact(){
+	if(!this->rotated && this->rotate()){
+		return true;
+	}
+	if(this->write_snapshot()){
+		return true;
+	}
+	if(unlink(this->path("log.old").c_str()) < 0 && errno != ENOENT){
+		perror("ponal log unlink");
+	}
+	this->rotated = false;
+	if(Util::verbose){
+		PRINT("ponal log compacted into a " << this->snapshot_bytes << " byte snapshot")
+	}
+	return false;
+}
+
+/**
+ * @return The end of the record at it, or 0 if there isn't a whole one there with a good checksum.
+ */
+static const char* record_end(const char* it, const char* end){
+	if(end - it < PONAL_RECORD_HEADER){
+		return 0;
+	}
+	uint32_t record_length = PonalProtocol::get_uint32(it);
+	const char* body = it + PONAL_RECORD_HEADER;
+	if(static_cast<size_t>(end - body) < record_length || record_length == 0 ||
+	checksum(body, record_length) != PonalProtocol::get_uint32(it + 4)){
+		return 0;
+	}
+	return body + record_length;
+}
+
+/**
+ * @brief Applies one record's body to the store.
+ *
+ * @return true if it doesn't make sense.
+ */
+bool PonalLog::apply(const char* body, const char* body_end, uint64_t now){
+	const char* field = body + 1;
+	uint32_t high, low, expires_high = 0, expires_low = 0;
+	const char* key;
+	size_t key_length;
+	if(PonalProtocol::next_uint32(&field, body_end, &high) || PonalProtocol::next_uint32(&field, body_end, &low) ||
+	(body[0] == PONAL_CHANGE_EXPIRING && (PonalProtocol::next_uint32(&field, body_end, &expires_high) ||
+	PonalProtocol::next_uint32(&field, body_end, &expires_low))) ||
+	PonalProtocol::next_key(&field, body_end, &key, &key_length)){
+		return true;
+	}
+	uint64_t version = static_cast<uint64_t>(high) << 32 | low;
+	uint64_t expires = static_cast<uint64_t>(expires_high) << 32 | expires_low;
+	size_t value_length = static_cast<size_t>(body_end - field);
+	if(body[0] == PONAL_CHANGE_EXPIRING && expires <= now){
+		// Expired while ponald was down; whatever came before it is gone too.
+		this->store->remove(key, key_length);
+	}else if(body[0] == PONAL_CHANGE_SET || body[0] == PONAL_CHANGE_TOMBSTONE || body[0] == PONAL_CHANGE_EXPIRING){
+		this->store->set(key, key_length, field, value_length, version, body[0] == PONAL_CHANGE_TOMBSTONE, expires);
+	}else if(body[0] == PONAL_CHANGE_REMOVE){
+		this->store->remove(key, key_length);
+	}else{
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Maps file in and applies its records to the store. A bad record with a good one somewhere after it
+ * is corrupt, and is reported and skipped up to that one; without, it's a torn tail, and loading stops there.
+ * A missing file is simply empty.
+ *
+ * @return true if file couldn't be read; otherwise valid is where its torn tail starts (its length if none),
+ * and skipped how many bytes before that were corrupt.
+ */
+bool PonalLog::load(const std::string& file, size_t* valid, size_t* length, size_t* skipped){
+	*valid = 0;
+	*length = 0;
+	*skipped = 0;
+	int in = ::open(file.c_str(), O_RDONLY);
+	if(in < 0){
+		if(errno == ENOENT){
+			return false;
+		}
+		perror("ponal log open");
+		return true;
+	}
+	struct stat file_stat;
+	if(fstat(in, &file_stat) < 0){
+		perror("ponal log stat");
+		close(in);
+		return true;
+	}
+	*length = static_cast<size_t>(file_stat.st_size);
+	if(*length == 0){
+		close(in);
+		return false;
+	}
+	void* mapped = mmap(0, *length, PROT_READ, MAP_PRIVATE, in, 0);
+	close(in);
+	if(mapped == MAP_FAILED){
+		perror("ponal log mmap");
+		return true;
+	}
+	madvise(mapped, *length, MADV_SEQUENTIAL);
+
+	const char* data = static_cast<const char*>(mapped);
+	const char* it = data;
+	uint64_t now = PonalStore::now_ms();
+	const char* end = data + *length;
+	while(end - it >= PONAL_RECORD_HEADER){
+		const char* body_end = record_end(it, end);
+		if(body_end != 0 && !this->apply(it + PONAL_RECORD_HEADER, body_end, now)){
+			it = body_end;
+			continue;
+		}
+		// A crash only ever tears the last record, so a good one further on means this one's corrupt.
+		const char* next = it + 1;
+		while(end - next >= PONAL_RECORD_HEADER && record_end(next, end) == 0){
+			next++;
+		}
+		if(end - next < PONAL_RECORD_HEADER){
+			break;
+		}
+		ERROR("ponal log: skipping " << next - it << " corrupt bytes at byte " << it - data << " of " << file << ",")
+		*skipped += static_cast<size_t>(next - it);
+		it = next;
+	}
+	*valid = static_cast<size_t>(it - data);
+	munmap(mapped, *length);
+	return false;
+}
+
+/**
+ * @brief Loads the store from the snapshot and log in directory, creating it if need be, then keeps
+ * every change to the store from then on.
+ *
+ * @return true if they couldn't be loaded; ponald shouldn't start over a corrupt snapshot.
+ */
+bool PonalLog::open(PonalStore* new_store){
+	this->store = new_store;
+	if(mkdir(this->directory.c_str(), 0755) < 0 && errno != EEXIST){
+		perror("ponal log directory");
+		return true;
+	}
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	size_t valid, length, skipped;
+
+	if(this->load(this->path("snapshot"), &valid, &length, &skipped)){
+		return true;
+	}
+	if(valid != length || skipped > 0){
+		ERROR("ponal snapshot " << this->path("snapshot") << " is corrupt after byte " << valid << ",")
+		return true;
+	}
+	this->snapshot_bytes = length;
+
+	// Left over from a compaction that didn't finish; the snapshot may not cover it yet.
+	this->rotated = access(this->path("log.old").c_str(), F_OK) == 0;
+	if(this->rotated && this->load(this->path("log.old"), &valid, &length, &skipped)){
+		return true;
+	}
+
+	if(this->load(this->path("log"), &valid, &length, &skipped)){
+		return true;
+	}
+	this->fd = ::open(this->path("log").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(this->fd < 0){
+		perror("ponal log open");
+		return true;
+	}
+	if(valid < length){
+		// A crash in the middle of a write; nothing after it was acknowledged as durable.
+		PRINT("ponal log: dropping " << length - valid << " bytes of a torn record")
+		if(ftruncate(this->fd, static_cast<off_t>(valid)) < 0){
+			perror("ponal log truncate");
+			return true;
+		}
+	}
+	this->log_bytes = valid;
+
+	PRINT("ponald loaded " << this->store->size() << " keys from " << this->directory << " in " <<
+		std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count() << "ms")
+
+	this->store->on_change = [this](PonalChange change, const char* key, size_t key_length, const char* value, size_t value_length,
+	uint64_t version, uint64_t expires){
+		this->append(change, key, key_length, value, value_length, version, expires);
+	};
+	if(this->rotated && this->compact()){
+		ERROR("ponal log compaction")
+	}
+	this->writer = std::thread(&PonalLog::write_loop, this);
+	this->compactor = std::thread(&PonalLog::compact_loop, this);
+	return false;
+}
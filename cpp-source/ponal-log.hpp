@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+
+#include "ponal-store.hpp"
+
+// Bytes logged before the writer is woken early, and snapshot bytes gathered before they're written out.
+#define PONAL_LOG_BUFFER 1048576
+// The log is compacted once it's at least this long, and longer than the snapshot.
+#define PONAL_LOG_COMPACT_MIN 16777216
+// How often the compactor checks the log's length.
+#define PONAL_LOG_COMPACT_CHECK_MS 1000
+// How often the log is written out when nothing forces it to disk.
+#define PONAL_LOG_WRITE_MS 1000
+
+/**
+ * @brief When the log is forced to disk: before a change is acknowledged, every so many milliseconds, or never (left to the OS).
+ */
+enum PonalFsync{
+	PONAL_FSYNC_ALWAYS,
+	PONAL_FSYNC_INTERVAL,
+	PONAL_FSYNC_NEVER
+};
+
+/**
+ * @brief Keeps a PonalStore on disk, as a snapshot of it plus a log of every change since.
+ *
+ * Changes come from the store's on_change, and are only buffered there; a writer thread writes
+ * them out. With PONAL_FSYNC_ALWAYS it also fsyncs each batch, and sync waits for that, so all
+ * the changes made while one fsync runs are committed together by the next.
+ *
+ * Once the log outgrows the snapshot, a compactor thread starts a new log and writes a new
+ * snapshot from the store, then drops the old log. Snapshot and log share one record format:
+ * u32 length, u32 checksum, then a PonalChange, u64 version, the u64 expiry for PONAL_CHANGE_EXPIRING
+ * only, key (u16 length) and the value.
+ * A torn record at the end of the log, from a crash mid-write, is cut off when it's loaded; a corrupt one
+ * further in is reported and skipped, and the records after it are still loaded.
+ */
+class PonalLog{
+private:
+	std::string directory;
+	PonalFsync policy;
+	int interval_ms;
+	PonalStore* store;
+	int fd;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable synced;
+	std::condition_variable compact_wake;
+	std::string buffer;
+	// Bytes ever appended, and how many of those are on disk.
+	uint64_t appended;
+	uint64_t durable;
+	bool stopping;
+	bool failed;
+
+	// Held while the log file is written or swapped for a new one.
+	std::mutex file_mutex;
+	std::string writing;
+	bool unsynced;
+	std::atomic<uint64_t> log_bytes;
+	uint64_t snapshot_bytes;
+	// The last log is still waiting for a snapshot to cover it.
+	bool rotated;
+
+	std::thread writer;
+	std::thread compactor;
+
+	std::string path(const char* name);
+	void append(PonalChange change, const char* key, size_t key_length, const char* value, size_t value_length,
+		uint64_t version, uint64_t expires);
+	bool flush(bool sync_now);
+	void write_loop();
+	void compact_loop();
+	bool rotate();
+	bool write_snapshot();
+	bool compact();
+	bool apply(const char* body, const char* body_end, uint64_t now);
+	bool load(const std::string& file, size_t* valid, size_t* length, size_t* skipped);
+public:
+	PonalLog(const std::string& new_directory, PonalFsync new_policy = PONAL_FSYNC_INTERVAL, int new_interval_ms = 1000);
+	~PonalLog();
+
+	bool open(PonalStore* new_store);
+	bool sync();
+
+	static bool parse_policy(const std::string& text, PonalFsync* policy, int* interval_ms);
+	static void record(std::string* out, PonalChange change, const char* key, size_t key_length,
+		const char* value, size_t value_length, uint64_t version, uint64_t expires);
+};
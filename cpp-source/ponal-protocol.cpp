@@ -0,0 +1,125 @@
+#include <algorithm>
+
+#include "util.hpp"
+#include "ponal-protocol.hpp"
+
+/**
+ * @brief Starts a frame of type on out, its length to be filled in by end.
+ *
+ * @return Where the frame starts.
+ */
+size_t PonalProtocol::begin(std::string* out, char type){
+	size_t start = out->length();
+	out->append(4, '\0');
+	out->push_back(type);
+	return start;
+}
+
+void PonalProtocol::end(std::string* out, size_t start){
+	uint32_t length = static_cast<uint32_t>(out->length() - start - 4);
+	for(size_t i = 0; i < 4; ++i){
+		(*out)[start + i] = static_cast<char>((length >> (24 - 8 * i)) & 0xff);
+	}
+}
+
+void PonalProtocol::put_uint32(std::string* out, uint32_t value){
+	for(int shift = 24; shift >= 0; shift -= 8){
+		out->push_back(static_cast<char>((value >> shift) & 0xff));
+	}
+}
+
+void PonalProtocol::put_key(std::string* out, const char* key, size_t key_length){
+	out->push_back(static_cast<char>((key_length >> 8) & 0xff));
+	out->push_back(static_cast<char>(key_length & 0xff));
+	out->append(key, key_length);
+}
+
+void PonalProtocol::put_key(std::string* out, const std::string& key){
+	PonalProtocol::put_key(out, key.data(), key.length());
+}
+
+uint32_t PonalProtocol::get_uint32(const char* in){
+	return static_cast<uint32_t>(static_cast<unsigned char>(in[0])) << 24 |
+		static_cast<uint32_t>(static_cast<unsigned char>(in[1])) << 16 |
+		static_cast<uint32_t>(static_cast<unsigned char>(in[2])) << 8 |
+		static_cast<uint32_t>(static_cast<unsigned char>(in[3]));
+}
+
+/**
+ * @return true if there isn't a whole u32 left before end.
+ */
+bool PonalProtocol::next_uint32(const char** it, const char* end, uint32_t* value){
+	if(end - *it < 4){
+		return true;
+	}
+	*value = PonalProtocol::get_uint32(*it);
+	*it += 4;
+	return false;
+}
+
+/**
+ * @brief Points key at the next key, without copying it, and moves it past.
+ *
+ * @return true if there isn't a whole key left before end.
+ */
+bool PonalProtocol::next_key(const char** it, const char* end, const char** key, size_t* key_length){
+	if(end - *it < 2){
+		return true;
+	}
+	*key_length = static_cast<size_t>(static_cast<unsigned char>((*it)[0])) << 8 | static_cast<unsigned char>((*it)[1]);
+	if(static_cast<size_t>(end - *it - 2) < *key_length){
+		return true;
+	}
+	*key = *it + 2;
+	*it += 2 + *key_length;
+	return false;
+}
+
+/**
+ * @brief Calls on_frame with each frame data completes, without its length, in order.
+ *
+ * @return true if a frame was too long or on_frame returned true, after which the stream can't be trusted.
+ */
+bool PonalFrames::feed(const char* data, size_t data_length, std::function<bool(const char*, size_t)> on_frame){
+	size_t offset = 0;
+	if(!this->pending.empty()){
+		// Finish the frame the last read left off in; first its length, then the rest of it.
+		if(this->pending.length() < 4){
+			size_t take = std::min(4 - this->pending.length(), data_length);
+			this->pending.append(data, take);
+			offset += take;
+			if(this->pending.length() < 4){
+				return false;
+			}
+		}
+		uint32_t frame_length = PonalProtocol::get_uint32(this->pending.data());
+		if(frame_length > PONAL_FRAME_LIMIT){
+			return true;
+		}
+		size_t take = std::min(4 + frame_length - this->pending.length(), data_length - offset);
+		this->pending.append(data + offset, take);
+		offset += take;
+		if(this->pending.length() < 4 + frame_length){
+			return false;
+		}
+		if(on_frame(this->pending.data() + 4, frame_length)){
+			return true;
+		}
+		this->pending.clear();
+	}
+	while(data_length - offset >= 4){
+		uint32_t frame_length = PonalProtocol::get_uint32(data + offset);
+		if(frame_length > PONAL_FRAME_LIMIT){
+			return true;
+		}
+		if(data_length - offset - 4 < frame_length){
+			break;
+		}
+		if(on_frame(data + offset + 4, frame_length)){
+			return true;
+		}
+		offset += 4 + frame_length;
+	}
+	this->pending.assign(data + offset, data_length - offset);
+	return false;
+}
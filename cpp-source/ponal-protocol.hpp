@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <functional>
+
+// A frame is a big endian u32 length, then that many bytes, at most this many. Its first byte is always 0 then,
+// which no text command starts with, so ponald tells the protocols apart by a connection's first byte.
+#define PONAL_FRAME_LIMIT 16777215
+
+/**
+ * @brief The requests of ponald's binary protocol. A request frame is one of these, then as below.
+ * Keys are a u16 length, then the key.
+ */
+enum PonalOpcode{
+	PONAL_GET = 'G', // key
+	PONAL_SET = 'S', // key, value (the rest of the frame)
+	PONAL_MGET = 'g', // key...
+	PONAL_MSET = 's', // (key, u32 value length, value)...
+	PONAL_DEL = 'D', // key...
+	PONAL_SETEX = 'X', // u32 milliseconds to live, key, value (the rest of the frame)
+	PONAL_EXPIRE = 'E', // u32 milliseconds to live (0 for ever), key...
+	PONAL_STATS = 'I' // nothing
+};
+
+/**
+ * @brief Replies come back in the order requests were sent, each frame one of these, then:
+ * GET the value, MGET (u8 PonalReply, u32 value length, value) per key, DEL and EXPIRE a u32 count of the keys
+ * they found, STATS the same text as the "stats" command.
+ */
+enum PonalReply{
+	PONAL_REPLY_OK = 0,
+	PONAL_REPLY_NOT_FOUND = 1,
+	PONAL_REPLY_ERROR = 2
+};
+
+class PonalProtocol{
+public:
+	static size_t begin(std::string* out, char type);
+	static void end(std::string* out, size_t start);
+	static void put_uint32(std::string* out, uint32_t value);
+	static void put_key(std::string* out, const char* key, size_t key_length);
+	static void put_key(std::string* out, const std::string& key);
+
+	static uint32_t get_uint32(const char* in);
+	static bool next_uint32(const char** it, const char* end, uint32_t* value);
+	static bool next_key(const char** it, const char* end, const char** key, size_t* key_length);
+};
+
+/**
+ * @brief Cuts a stream into frames. Complete frames are handed out straight from the buffer that was read into;
+ * only a frame split between two reads is copied, to be finished by the next.
+ */
+class PonalFrames{
+private:
+	std::string pending;
+public:
+	bool feed(const char* data, size_t data_length, std::function<bool(const char*, size_t)> on_frame);
+};
@@ -0,0 +1,652 @@
+#include <cstring>
+#include <algorithm>
+
+#include "ponal-store.hpp"
+
+// Slot hashes below this mean free (0) or removed (1).
+#define PONAL_FIRST_HASH 2
+
+static const size_t NOT_FOUND = static_cast<size_t>(-1);
+
+/**
+ * @brief The hash a slot is filed under, clear of the free and removed markers.
+ */
+static uint64_t slot_hash(const char* key, size_t key_length){
+	uint64_t hash = PonalStore::hash(key, key_length);
+	return hash < PONAL_FIRST_HASH ? hash + PONAL_FIRST_HASH : hash;
+}
+
+/**
+ * @brief What an entry counts for against the memory limit.
+ */
+static size_t entry_bytes(size_t key_length, size_t value_length){
+	return sizeof(PonalSlot) + key_length + value_length;
+}
+
+/**
+ * @brief How many more bytes the store will count once slot index (NOT_FOUND for a new entry) holds a value of value_length.
+ */
+static size_t growth(PonalShard* shard, size_t index, size_t key_length, size_t value_length){
+	if(index == NOT_FOUND){
+		return entry_bytes(key_length, value_length);
+	}
+	size_t old_length = shard->slots[index].value_length;
+	return value_length > old_length ? value_length - old_length : 0;
+}
+
+/**
+ * @brief xorshift64*; plenty to sample with.
+ */
+static uint64_t next_random(uint64_t* state){
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+PonalStore::PonalStore()
+:memory(0),
+max_memory(0),
+eviction(PONAL_EVICT_LRU),
+clock(0),
+started(std::chrono::steady_clock::now()),
+wheel_tick(PonalStore::now_ms() / PONAL_WHEEL_TICK_MS),
+stopping(false){
+	for(size_t i = 0; i < PONAL_SHARDS; ++i){
+		this->shards[i].slots.resize(PONAL_SHARD_SLOTS, PonalSlot());
+		this->shards[i].used = 0;
+		this->shards[i].count = 0;
+		this->shards[i].garbage = 0;
+		this->shards[i].random = 0x9e3779b97f4a7c15ULL * (i + 1);
+		this->shards[i].hits = 0;
+		this->shards[i].misses = 0;
+		this->shards[i].expired = 0;
+		this->shards[i].evicted = 0;
+	}
+	this->expirer = std::thread(&PonalStore::expire_loop, this);
+}
+
+PonalStore::~PonalStore(){
+	{
+		std::lock_guard<std::mutex> lock(this->expirer_mutex);
+		this->stopping = true;
+	}
+	this->expirer_wake.notify_all();
+	this->expirer.join();
+}
+
+/**
+ * @brief FNV-1a, then mixed (the SplitMix64 finalizer) so that both the top bits (the shard)
+ * and the bottom bits (the slot) are spread well.
+ */
+uint64_t PonalStore::hash(const char* data, size_t data_length){
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < data_length; ++i){
+		hash ^= static_cast<unsigned char>(data[i]);
+		hash *= 1099511628211ULL;
+	}
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
+
+/**
+ * @brief Milliseconds since the epoch, which expiry times are given in so that they mean the same after a restart.
+ */
+uint64_t PonalStore::now_ms(){
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+/**
+ * @brief Caps the memory entries may take, in bytes (0 for no cap), and picks which go first past it.
+ * Meant to be called before the store is used.
+ */
+void PonalStore::limit(size_t new_max_memory, PonalEviction new_eviction){
+	this->max_memory = new_max_memory;
+	this->eviction = new_eviction;
+}
+
+/**
+ * @brief Which shard a hash belongs to, by its top bits; the bottom ones pick the slot.
+ */
+PonalShard* PonalStore::shard_of(uint64_t hash){
+	return &this->shards[hash >> 58 & (PONAL_SHARDS - 1)];
+}
+
+/**
+ * @brief Expects the shard's mutex to be held.
+ *
+ * @return The slot holding key, or NOT_FOUND.
+ */
+size_t PonalStore::find(PonalShard* shard, uint64_t hash, const char* key, size_t key_length){
+	size_t mask = shard->slots.size() - 1;
+	for(size_t i = hash & mask; ; i = (i + 1) & mask){
+		const PonalSlot& slot = shard->slots[i];
+		if(slot.hash == 0){
+			return NOT_FOUND;
+		}
+		if(slot.hash == hash && slot.key_length == key_length &&
+		std::memcmp(shard->arena.data() + slot.offset, key, key_length) == 0){
+			return i;
+		}
+	}
+}
+
+/**
+ * @brief Takes a slot for a key that isn't there yet, and room in the arena for it and a value of value_length.
+ * Expects the shard's mutex to be held.
+ *
+ * @return The slot; its value is left for write to fill in.
+ */
+size_t PonalStore::insert(PonalShard* shard, uint64_t hash, const char* key, size_t key_length, size_t value_length){
+	// At most three quarters full, counting removed slots, so probes stay short and always end.
+	if((shard->used + 1) * 4 > shard->slots.size() * 3){
+		this->grow(shard);
+	}
+	size_t mask = shard->slots.size() - 1;
+	size_t i = hash & mask;
+	while(shard->slots[i].hash >= PONAL_FIRST_HASH){
+		i = (i + 1) & mask;
+	}
+	PonalSlot& slot = shard->slots[i];
+	if(slot.hash == 0){
+		shard->used++;
+	}
+	shard->count++;
+	slot.hash = hash;
+	slot.offset = shard->arena.size();
+	slot.key_length = static_cast<uint32_t>(key_length);
+	slot.value_length = static_cast<uint32_t>(value_length);
+	slot.version = 0;
+	slot.expires = 0;
+	slot.touched = this->clock;
+	slot.frequency = PONAL_LFU_INIT;
+	slot.deleted = false;
+	shard->arena.append(key, key_length);
+	shard->arena.append(value_length, '\0');
+	this->memory += entry_bytes(key_length, value_length);
+	return i;
+}
+
+/**
+ * @brief Puts value in slot index, in place if it fits, else at the end of the arena, and clears its expiry.
+ * Expects the shard's mutex to be held.
+ */
+void PonalStore::write(PonalShard* shard, size_t index, const char* value, size_t value_length, uint64_t version, bool deleted){
+	PonalSlot& slot = shard->slots[index];
+	this->memory += value_length;
+	this->memory -= slot.value_length;
+	if(value_length <= slot.value_length){
+		std::memcpy(&shard->arena[slot.offset + slot.key_length], value, value_length);
+		shard->garbage += slot.value_length - value_length;
+	}else{
+		shard->garbage += slot.key_length + slot.value_length;
+		// Reserved first, so that the key being copied can't move.
+		shard->arena.reserve(shard->arena.size() + slot.key_length + value_length);
+		size_t offset = shard->arena.size();
+		shard->arena.append(shard->arena.data() + slot.offset, slot.key_length);
+		shard->arena.append(value, value_length);
+		slot.offset = offset;
+	}
+	slot.value_length = static_cast<uint32_t>(value_length);
+	slot.version = version;
+	slot.deleted = deleted;
+	slot.expires = 0;
+	slot.touched = this->clock;
+	if(shard->garbage > PONAL_ARENA_SLACK && shard->garbage * 2 > shard->arena.size()){
+		this->compact(shard);
+	}
+}
+
+/**
+ * @brief Removes the entry in slot index, telling on_change. Expects the shard's mutex to be held.
+ */
+void PonalStore::drop(PonalShard* shard, size_t index){
+	PonalSlot& slot = shard->slots[index];
+	slot.hash = 1;
+	shard->count--;
+	shard->garbage += slot.key_length + slot.value_length;
+	this->memory -= entry_bytes(slot.key_length, slot.value_length);
+	if(this->on_change){
+		this->on_change(PONAL_CHANGE_REMOVE, shard->arena.data() + slot.offset, slot.key_length, "", 0, 0, 0);
+	}
+	if(shard->garbage > PONAL_ARENA_SLACK && shard->garbage * 2 > shard->arena.size()){
+		this->compact(shard);
+	}
+}
+
+/**
+ * @brief Rehashes into a table twice as big as the entries need, dropping removed slots. Expects the shard's mutex to be held.
+ */
+void PonalStore::grow(PonalShard* shard){
+	size_t size = PONAL_SHARD_SLOTS;
+	while(size < (shard->count + 1) * 2){
+		size *= 2;
+	}
+	std::vector<PonalSlot> slots(size, PonalSlot());
+	size_t mask = size - 1;
+	for(const PonalSlot& slot : shard->slots){
+		if(slot.hash < PONAL_FIRST_HASH){
+			continue;
+		}
+		size_t i = slot.hash & mask;
+		while(slots[i].hash != 0){
+			i = (i + 1) & mask;
+		}
+		slots[i] = slot;
+	}
+	shard->slots.swap(slots);
+	shard->used = shard->count;
+}
+
+/**
+ * @brief Copies the entries still in use into a new arena. Expects the shard's mutex to be held.
+ */
+void PonalStore::compact(PonalShard* shard){
+	std::string arena;
+	arena.reserve(shard->arena.size() - shard->garbage);
+	for(PonalSlot& slot : shard->slots){
+		if(slot.hash < PONAL_FIRST_HASH){
+			continue;
+		}
+		size_t offset = arena.size();
+		arena.append(shard->arena.data() + slot.offset, slot.key_length + slot.value_length);
+		slot.offset = offset;
+	}
+	shard->arena.swap(arena);
+	shard->garbage = 0;
+}
+
+/**
+ * @brief An entry's LFU counter, less one for every PONAL_LFU_DECAY_TICKS it's gone unread.
+ */
+uint32_t PonalStore::frequency(const PonalSlot& slot){
+	uint32_t periods = (this->clock - slot.touched) / PONAL_LFU_DECAY_TICKS;
+	return periods >= slot.frequency ? 0 : slot.frequency - periods;
+}
+
+/**
+ * @brief Marks an entry as just read. Expects the shard's mutex to be held.
+ */
+void PonalStore::touch(PonalShard* shard, PonalSlot* slot){
+	if(this->eviction == PONAL_EVICT_LFU){
+		uint32_t counter = this->frequency(*slot);
+		// Each step up is less likely than the last, so the counter's byte covers millions of reads.
+		uint64_t odds = static_cast<uint64_t>(counter > PONAL_LFU_INIT ? counter - PONAL_LFU_INIT : 0) * PONAL_LFU_LOG_FACTOR + 1;
+		if(counter < 255 && next_random(&shard->random) % odds == 0){
+			counter++;
+		}
+		slot->frequency = static_cast<uint8_t>(counter);
+	}
+	slot->touched = this->clock;
+}
+
+/**
+ * @brief The worst of PONAL_EVICTION_SAMPLES entries of shard sampled at random: any that has expired, else the
+ * least recently (LRU) or least frequently (LFU) read. The entry in slot keep, if any, and removals
+ * younger than PONAL_TOMBSTONE_GRACE_TICKS are never picked. Expects the shard's mutex to be held.
+ *
+ * @return The victim's slot, or NOT_FOUND if nothing in shard may go.
+ */
+size_t PonalStore::victim(PonalShard* shard, size_t keep, bool* expired){
+	uint64_t now = 0;
+	uint32_t clock = this->clock;
+	auto spared = [&](size_t index){
+		const PonalSlot& slot = shard->slots[index];
+		return slot.hash < PONAL_FIRST_HASH || index == keep ||
+			(slot.deleted && clock - slot.touched < PONAL_TOMBSTONE_GRACE_TICKS);
+	};
+	size_t mask = shard->slots.size() - 1;
+	size_t chosen = NOT_FOUND;
+	uint64_t worst = 0;
+	*expired = false;
+	for(size_t i = 0; i < PONAL_EVICTION_SAMPLES; ++i){
+		size_t index = next_random(&shard->random) & mask;
+		size_t steps = 0;
+		while(steps < shard->slots.size() && spared(index)){
+			index = (index + 1) & mask;
+			steps++;
+		}
+		if(steps == shard->slots.size()){
+			return NOT_FOUND;
+		}
+		const PonalSlot& slot = shard->slots[index];
+		if(slot.expires != 0){
+			if(now == 0){
+				now = PonalStore::now_ms();
+			}
+			if(slot.expires <= now){
+				*expired = true;
+				return index;
+			}
+		}
+		// Higher goes first: under LFU the least read, the longest unread among those.
+		uint64_t idle = clock - slot.touched;
+		uint64_t score = this->eviction == PONAL_EVICT_LFU ? static_cast<uint64_t>(255 - this->frequency(slot)) << 32 | idle : idle;
+		if(chosen == NOT_FOUND || score > worst){
+			chosen = index;
+			worst = score;
+		}
+	}
+	return chosen;
+}
+
+/**
+ * @brief Drops entries until the store has room for incoming more bytes, or none is left to drop, each picked by victim.
+ *
+ * They come from shard, the writer's, until it's down to the entry in slot keep; then from the other shards
+ * in turn, starting from a random one, skipping any another thread holds so that two writers never wait
+ * on each other. Expects shard's mutex to be held.
+ */
+void PonalStore::evict(PonalShard* shard, size_t incoming, size_t keep){
+	if(this->max_memory == 0){
+		return;
+	}
+	bool expired;
+	size_t index;
+	auto drop_victim = [&](PonalShard* from){
+		this->drop(from, index);
+		if(expired){
+			from->expired++;
+		}else{
+			from->evicted++;
+		}
+	};
+
+	size_t least = keep == NOT_FOUND ? 0 : 1;
+	while(this->memory + incoming > this->max_memory && shard->count > least &&
+	(index = this->victim(shard, keep, &expired)) != NOT_FOUND){
+		drop_victim(shard);
+	}
+
+	size_t first = static_cast<size_t>(next_random(&shard->random));
+	for(size_t i = 0; i < PONAL_SHARDS && this->memory + incoming > this->max_memory; ++i){
+		PonalShard* other = &this->shards[(first + i) % PONAL_SHARDS];
+		if(other == shard || !other->mutex.try_lock()){
+			continue;
+		}
+		while(this->memory + incoming > this->max_memory && other->count > 0 &&
+		(index = this->victim(other, NOT_FOUND, &expired)) != NOT_FOUND){
+			drop_victim(other);
+		}
+		other->mutex.unlock();
+	}
+}
+
+/**
+ * @brief Files a timer for the entries with hash at expires, on the wheel.
+ */
+void PonalStore::schedule(uint64_t hash, uint64_t expires){
+	std::lock_guard<std::mutex> lock(this->wheel_mutex);
+	// Due once its tick is over, and never on a tick the wheel has already passed.
+	uint64_t tick = std::max(expires / PONAL_WHEEL_TICK_MS + 1, this->wheel_tick + 1);
+	this->wheel[tick % PONAL_WHEEL_SLOTS].push_back(PonalTimer{hash, expires});
+}
+
+/**
+ * @brief Every tick, moves the clock on and turns the wheel, expiring what's due. Timers whose entries
+ * were removed, overwritten or given a new expiry since find nothing to do, and are simply dropped.
+ */
+void PonalStore::expire_loop(){
+	std::unique_lock<std::mutex> lock(this->expirer_mutex);
+	while(!this->stopping){
+		this->expirer_wake.wait_for(lock, std::chrono::milliseconds(PONAL_WHEEL_TICK_MS));
+		this->clock = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - this->started).count() / PONAL_WHEEL_TICK_MS);
+
+		uint64_t now = PonalStore::now_ms();
+		uint64_t now_tick = now / PONAL_WHEEL_TICK_MS;
+		std::vector<PonalTimer> due;
+		{
+			std::lock_guard<std::mutex> wheel_lock(this->wheel_mutex);
+			// However long it's been, one turn covers every bucket.
+			uint64_t first = std::max(this->wheel_tick + 1, now_tick >= PONAL_WHEEL_SLOTS ? now_tick - PONAL_WHEEL_SLOTS + 1 : 0);
+			for(uint64_t tick = first; tick <= now_tick; ++tick){
+				std::vector<PonalTimer>& bucket = this->wheel[tick % PONAL_WHEEL_SLOTS];
+				// Timers a turn or more away stay put.
+				size_t kept = 0;
+				for(size_t i = 0; i < bucket.size(); ++i){
+					if(bucket[i].expires / PONAL_WHEEL_TICK_MS + 1 <= now_tick){
+						due.push_back(bucket[i]);
+					}else{
+						bucket[kept++] = bucket[i];
+					}
+				}
+				bucket.resize(kept);
+			}
+			this->wheel_tick = std::max(this->wheel_tick, now_tick);
+		}
+
+		lock.unlock();
+		for(const PonalTimer& timer : due){
+			this->expire_due(timer, now);
+		}
+		lock.lock();
+	}
+}
+
+/**
+ * @brief Drops the entries a timer was for, if they have indeed expired by now.
+ */
+void PonalStore::expire_due(const PonalTimer& timer, uint64_t now){
+	PonalShard* shard = this->shard_of(timer.hash);
+	std::lock_guard<std::mutex> lock(shard->mutex);
+	size_t mask = shard->slots.size() - 1;
+	for(size_t i = timer.hash & mask; shard->slots[i].hash != 0; i = (i + 1) & mask){
+		const PonalSlot& slot = shard->slots[i];
+		if(slot.hash == timer.hash && slot.expires != 0 && slot.expires <= now){
+			this->drop(shard, i);
+			shard->expired++;
+		}
+	}
+}
+
+/**
+ * @brief Appends the value of key to value, and gives its version and expiry if asked for. Keys removed
+ * in a cluster are still found, with deleted set.
+ *
+ * @return false if there's no such key.
+ */
+bool PonalStore::lookup(const char* key, size_t key_length, std::string* value, uint64_t* version, bool* deleted, uint64_t* expires){
+	uint64_t hash = slot_hash(key, key_length);
+	PonalShard* shard = this->shard_of(hash);
+	std::lock_guard<std::mutex> lock(shard->mutex);
+	size_t index = this->find(shard, hash, key, key_length);
+	if(index != NOT_FOUND && shard->slots[index].expires != 0 && shard->slots[index].expires <= PonalStore::now_ms()){
+		this->drop(shard, index);
+		shard->expired++;
+		index = NOT_FOUND;
+	}
+	if(index == NOT_FOUND){
+		shard->misses++;
+		return false;
+	}
+	PonalSlot& slot = shard->slots[index];
+	this->touch(shard, &slot);
+	if(version != nullptr){
+		*version = slot.version;
+	}
+	if(expires != nullptr){
+		*expires = slot.expires;
+	}
+	*deleted = slot.deleted;
+	if(slot.deleted){
+		shard->misses++;
+	}else{
+		shard->hits++;
+		value->append(shard->arena.data() + slot.offset + slot.key_length, slot.value_length);
+	}
+	return true;
+}
+
+/**
+ * @brief Appends the value of key to value, and gives its version if asked for.
+ *
+ * @return false if there's no such key.
+ */
+bool PonalStore::get(const char* key, size_t key_length, std::string* value, uint64_t* version){
+	bool deleted;
+	return this->lookup(key, key_length, value, version, &deleted) && !deleted;
+}
+
+bool PonalStore::get(const std::string& key, std::string* value, uint64_t* version){
+	return this->get(key.data(), key.length(), value, version);
+}
+
+/**
+ * @brief Stores value under key, or marks it deleted, whatever was there before. It expires at expires
+ * (milliseconds since the epoch), unless that's 0.
+ */
+void PonalStore::set(const char* key, size_t key_length, const char* value, size_t value_length, uint64_t version,
+bool deleted, uint64_t expires){
+	uint64_t hash = slot_hash(key, key_length);
+	PonalShard* shard = this->shard_of(hash);
+	std::lock_guard<std::mutex> lock(shard->mutex);
+	if(deleted){
+		value_length = 0;
+		expires = 0;
+	}
+	size_t index = this->find(shard, hash, key, key_length);
+	this->evict(shard, growth(shard, index, key_length, value_length), index);
+	if(index == NOT_FOUND){
+		index = this->insert(shard, hash, key, key_length, value_length);
+	}
+	this->write(shard, index, value, value_length, version, deleted);
+	if(expires != 0){
+		shard->slots[index].expires = expires;
+		this->schedule(hash, expires);
+	}
+	if(this->on_change){
+		this->on_change(deleted ? PONAL_CHANGE_TOMBSTONE : expires != 0 ? PONAL_CHANGE_EXPIRING : PONAL_CHANGE_SET,
+			key, key_length, value, value_length, version, expires);
+	}
+}
+
+void PonalStore::set(const std::string& key, const std::string& value, uint64_t version){
+	this->set(key.data(), key.length(), value.data(), value.length(), version);
+}
+
+/**
+ * @brief Stores value under key, or marks it deleted, unless what's there has the same or a newer version.
+ *
+ * @return true if value was stale and dropped.
+ */
+bool PonalStore::merge(const std::string& key, const std::string& value, uint64_t version, bool deleted){
+	uint64_t hash = slot_hash(key.data(), key.length());
+	PonalShard* shard = this->shard_of(hash);
+	std::lock_guard<std::mutex> lock(shard->mutex);
+	size_t index = this->find(shard, hash, key.data(), key.length());
+	if(index != NOT_FOUND && shard->slots[index].version >= version){
+		return true;
+	}
+	size_t value_length = deleted ? 0 : value.length();
+	this->evict(shard, growth(shard, index, key.length(), value_length), index);
+	if(index == NOT_FOUND){
+		index = this->insert(shard, hash, key.data(), key.length(), value_length);
+	}
+	this->write(shard, index, value.data(), value_length, version, deleted);
+	if(this->on_change){
+		this->on_change(deleted ? PONAL_CHANGE_TOMBSTONE : PONAL_CHANGE_SET, key.data(), key.length(), value.data(), value_length, version, 0);
+	}
+	return false;
+}
+
+/**
+ * @brief Sets when key expires, in milliseconds since the epoch, or with 0 that it never does.
+ *
+ * @return false if there's no such key.
+ */
+bool PonalStore::expire(const char* key, size_t key_length, uint64_t expires){
+	uint64_t hash = slot_hash(key, key_length);
+	PonalShard* shard = this->shard_of(hash);
+	std::lock_guard<std::mutex> lock(shard->mutex);
+	size_t index = this->find(shard, hash, key, key_length);
+	if(index == NOT_FOUND || shard->slots[index].deleted){
+		return false;
+	}
+	PonalSlot& slot = shard->slots[index];
+	if(slot.expires != 0 && slot.expires <= PonalStore::now_ms()){
+		this->drop(shard, index);
+		shard->expired++;
+		return false;
+	}
+	slot.expires = expires;
+	if(expires != 0){
+		this->schedule(hash, expires);
+	}
+	if(this->on_change){
+		this->on_change(expires != 0 ? PONAL_CHANGE_EXPIRING : PONAL_CHANGE_SET, key, key_length,
+			shard->arena.data() + slot.offset + slot.key_length, slot.value_length, slot.version, expires);
+	}
+	return true;
+}
+
+/**
+ * @brief Removes key outright.
+ *
+ * @return false if there was no such key.
+ */
+bool PonalStore::remove(const char* key, size_t key_length){
+	uint64_t hash = slot_hash(key, key_length);
+	PonalShard* shard = this->shard_of(hash);
+	std::lock_guard<std::mutex> lock(shard->mutex);
+	size_t index = this->find(shard, hash, key, key_length);
+	if(index == NOT_FOUND){
+		return false;
+	}
+	const PonalSlot& slot = shard->slots[index];
+	bool existed = !slot.deleted && (slot.expires == 0 || slot.expires > PonalStore::now_ms());
+	this->drop(shard, index);
+	return existed;
+}
+
+/**
+ * @brief Entries in the store, keys removed in a cluster included.
+ */
+size_t PonalStore::size(){
+	size_t count = 0;
+	for(size_t i = 0; i < PONAL_SHARDS; ++i){
+		std::lock_guard<std::mutex> lock(this->shards[i].mutex);
+		count += this->shards[i].count;
+	}
+	return count;
+}
+
+/**
+ * @brief The entries and memory in the store, and how reads have gone since it started.
+ */
+PonalStats PonalStore::stats(){
+	PonalStats stats = PonalStats();
+	for(size_t i = 0; i < PONAL_SHARDS; ++i){
+		PonalShard& shard = this->shards[i];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		stats.keys += shard.count;
+		stats.hits += shard.hits;
+		stats.misses += shard.misses;
+		stats.expired += shard.expired;
+		stats.evicted += shard.evicted;
+	}
+	stats.memory = this->memory;
+	stats.max_memory = this->max_memory;
+	return stats;
+}
+
+/**
+ * @brief Calls callback with every entry's key, value, version, whether it's deleted, and expiry, one shard
+ * at a time. Each shard is locked only while its own entries are visited, so the store stays usable
+ * meanwhile, but callback mustn't use it.
+ */
+void PonalStore::each(std::function<void(const char*, size_t, const char*, size_t, uint64_t, bool, uint64_t)> callback){
+	for(size_t i = 0; i < PONAL_SHARDS; ++i){
+		PonalShard& shard = this->shards[i];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for(const PonalSlot& slot : shard.slots){
+			if(slot.hash < PONAL_FIRST_HASH){
+				continue;
+			}
+			const char* key = shard.arena.data() + slot.offset;
+			callback(key, slot.key_length, key + slot.key_length, slot.value_length, slot.version, slot.deleted, slot.expires);
+		}
+	}
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+// Shards, each with its own lock, table and arena; a power of two, picked by the top bits of a key's hash.
+#define PONAL_SHARDS 64
+// Slots a shard's table starts with.
+#define PONAL_SHARD_SLOTS 64
+// Arena bytes a shard lets go to waste before it compacts, once they're also half of it.
+#define PONAL_ARENA_SLACK 65536
+// The timing wheel's buckets, and how long each covers; one turn is about 100 seconds.
+#define PONAL_WHEEL_SLOTS 1024
+#define PONAL_WHEEL_TICK_MS 100
+// Entries looked at to pick each one to evict.
+#define PONAL_EVICTION_SAMPLES 5
+// Ticks (an hour's worth) a removal in a cluster is kept from eviction since last written or read,
+// so that older writes still on their way lose to it.
+#define PONAL_TOMBSTONE_GRACE_TICKS 36000
+// Where a new entry's LFU counter starts, so that it isn't the first to go; how slowly counters climb,
+// and how many ticks (a minute's worth) take one off an entry left alone.
+#define PONAL_LFU_INIT 5
+#define PONAL_LFU_LOG_FACTOR 10
+#define PONAL_LFU_DECAY_TICKS 600
+
+/**
+ * @brief What happened to a key, as told to PonalStore::on_change.
+ */
+enum PonalChange{
+	PONAL_CHANGE_SET = 'S',
+	// Set, to expire at a time.
+	PONAL_CHANGE_EXPIRING = 'X',
+	// Marked deleted at a version, in a cluster.
+	PONAL_CHANGE_TOMBSTONE = 'T',
+	// Removed, expired or evicted.
+	PONAL_CHANGE_REMOVE = 'D'
+};
+
+/**
+ * @brief Which entries go first once the store is over its memory limit: the least recently used,
+ * or the least frequently used lately.
+ */
+enum PonalEviction{
+	PONAL_EVICT_LRU,
+	PONAL_EVICT_LFU
+};
+
+/**
+ * @brief Where an entry is: its hash (0 for a free slot, 1 for a removed one), version,
+ * and its key then value in the shard's arena.
+ */
+struct PonalSlot{
+	uint64_t hash;
+	uint64_t version;
+	size_t offset;
+	// Milliseconds since the epoch, or 0 to never expire.
+	uint64_t expires;
+	uint32_t key_length;
+	uint32_t value_length;
+	// The store's clock when last read or written.
+	uint32_t touched;
+	// A logarithmic count of reads, for LFU.
+	uint8_t frequency;
+	// Removed at version, kept so that older writes arriving later lose to it.
+	bool deleted;
+};
+
+struct PonalShard{
+	std::mutex mutex;
+	// Open addressing with linear probing; a power of two long.
+	std::vector<PonalSlot> slots;
+	// Slots not free, removed ones included.
+	size_t used;
+	size_t count;
+	std::string arena;
+	size_t garbage;
+	// For sampling entries to evict.
+	uint64_t random;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t expired;
+	uint64_t evicted;
+};
+
+/**
+ * @brief When the entries with hash might expire, on the timing wheel.
+ */
+struct PonalTimer{
+	uint64_t hash;
+	uint64_t expires;
+};
+
+struct PonalStats{
+	size_t keys;
+	size_t memory;
+	size_t max_memory;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t expired;
+	uint64_t evicted;
+};
+
+/**
+ * @brief The key-value store behind ponald, safe to use from every server thread.
+ *
+ * Keys are spread over PONAL_SHARDS shards by hash, so threads only wait on each other for keys
+ * in the same shard. A shard keeps its keys and values back to back in one arena, with a table
+ * of slots pointing into it, so an entry costs no allocations of its own; the arena is compacted
+ * once enough of it has been overwritten or removed.
+ *
+ * Standalone, set and remove simply overwrite. Clustered, replicas are written with merge, so that
+ * whichever write has the highest version wins everywhere regardless of arrival order.
+ *
+ * An entry can be set to expire. Reads drop it once it has, and the store's own thread drops the
+ * ones nobody reads, from a timing wheel. Given a memory limit, writes evict entries from their own
+ * shard, then from any other shard not in use, until the store is back under it, each the worst of a few sampled;
+ * removals in a cluster are spared for PONAL_TOMBSTONE_GRACE_TICKS. Memory is counted per
+ * entry, as its slot, key and value; arena slack comes on top of that.
+ *
+ * on_change is told of every change while its shard is still locked, so it sees the changes to
+ * any one key in the order they were made (PonalLog relies on this).
+ */
+class PonalStore{
+private:
+	PonalShard shards[PONAL_SHARDS];
+	std::atomic<size_t> memory;
+	size_t max_memory;
+	PonalEviction eviction;
+	// Wheel ticks since the store started, for LRU and LFU.
+	std::atomic<uint32_t> clock;
+	std::chrono::steady_clock::time_point started;
+
+	std::mutex wheel_mutex;
+	std::vector<PonalTimer> wheel[PONAL_WHEEL_SLOTS];
+	// The last tick the wheel was turned to.
+	uint64_t wheel_tick;
+	std::mutex expirer_mutex;
+	std::condition_variable expirer_wake;
+	bool stopping;
+	std::thread expirer;
+
+	PonalShard* shard_of(uint64_t hash);
+	size_t find(PonalShard* shard, uint64_t hash, const char* key, size_t key_length);
+	size_t insert(PonalShard* shard, uint64_t hash, const char* key, size_t key_length, size_t value_length);
+	void write(PonalShard* shard, size_t index, const char* value, size_t value_length, uint64_t version, bool deleted);
+	void drop(PonalShard* shard, size_t index);
+	void grow(PonalShard* shard);
+	void compact(PonalShard* shard);
+
+	void touch(PonalShard* shard, PonalSlot* slot);
+	uint32_t frequency(const PonalSlot& slot);
+	size_t victim(PonalShard* shard, size_t keep, bool* expired);
+	void evict(PonalShard* shard, size_t incoming, size_t keep);
+	void schedule(uint64_t hash, uint64_t expires);
+	void expire_loop();
+	void expire_due(const PonalTimer& timer, uint64_t now);
+public:
+	/// The value is empty for PONAL_CHANGE_TOMBSTONE and PONAL_CHANGE_REMOVE; the expiry is 0 unless PONAL_CHANGE_EXPIRING.
+	std::function<void(PonalChange, const char*, size_t, const char*, size_t, uint64_t, uint64_t)> on_change;
+
+	PonalStore();
+	~PonalStore();
+
+	void limit(size_t new_max_memory, PonalEviction new_eviction = PONAL_EVICT_LRU);
+
+	bool get(const char* key, size_t key_length, std::string* value, uint64_t* version = nullptr);
+	bool get(const std::string& key, std::string* value, uint64_t* version = nullptr);
+	bool lookup(const char* key, size_t key_length, std::string* value, uint64_t* version, bool* deleted, uint64_t* expires = nullptr);
+
+	void set(const char* key, size_t key_length, const char* value, size_t value_length, uint64_t version = 0,
+		bool deleted = false, uint64_t expires = 0);
+	void set(const std::string& key, const std::string& value, uint64_t version = 0);
+	bool merge(const std::string& key, const std::string& value, uint64_t version, bool deleted = false);
+	bool expire(const char* key, size_t key_length, uint64_t expires);
+	bool remove(const char* key, size_t key_length);
+
+	size_t size();
+	PonalStats stats();
+	void each(std::function<void(const char*, size_t, const char*, size_t, uint64_t, bool, uint64_t)> callback);
+
+	static uint64_t hash(const char* data, size_t data_length);
+	static uint64_t now_ms();
+};
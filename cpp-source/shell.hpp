@@ -2,6 +2,9 @@
 
 #include <atomic>
 
+#include <fcntl.h>
+#include <sys/wait.h>
+
 #include "util.hpp"
 
 class Shell{
@@ -22,12 +25,13 @@ public:
 
 		int shell_pipe[2][2];
 
-		if(pipe(shell_pipe[0]) < 0){
+		// Close on exec, so one session's shell doesn't hold another's pipes open.
+		if(pipe2(shell_pipe[0], O_CLOEXEC) < 0){
 			ERROR("pipe 0")
 			return true;
 		}
 	
-		if(pipe(shell_pipe[1]) < 0){
+		if(pipe2(shell_pipe[1], O_CLOEXEC) < 0){
 			ERROR("pipe 1")
 			return true;
 		}
@@ -75,6 +79,9 @@ public:
 		if(close(this->output) < 0){
 			ERROR("close shell output")
 		}
+		if(waitpid(this->pid, 0, 0) < 0){
+			ERROR("wait shell")
+		}
 		this->opened = false;
 	}
 };
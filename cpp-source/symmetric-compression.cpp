@@ -0,0 +1,98 @@
+#include <cstring>
+
+#include "symmetric-compression.hpp"
+
+SymmetricCompression::SymmetricCompression(const std::string& dictionary)
+:deflater_ready(false),
+inflater_ready(false){
+	std::memset(&this->deflater, 0, sizeof(this->deflater));
+	std::memset(&this->inflater, 0, sizeof(this->inflater));
+
+	// Negative window bits mean raw deflate, without the zlib header and checksum.
+	this->deflater_ready = deflateInit2(&this->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	this->inflater_ready = inflateInit2(&this->inflater, -15) == Z_OK;
+
+	if(!dictionary.empty()){
+		const Bytef* words = reinterpret_cast<const Bytef*>(dictionary.data());
+		uInt words_length = static_cast<uInt>(dictionary.length());
+		this->deflater_ready = this->deflater_ready && deflateSetDictionary(&this->deflater, words, words_length) == Z_OK;
+		this->inflater_ready = this->inflater_ready && inflateSetDictionary(&this->inflater, words, words_length) == Z_OK;
+	}
+}
+
+SymmetricCompression::~SymmetricCompression(){
+	deflateEnd(&this->deflater);
+	inflateEnd(&this->inflater);
+}
+
+/**
+ * @brief Compresses one frame, without the 00 00 FF FF tail the receiver puts back.
+ *
+ * The stream can't be rewound, so whatever this produces has to be sent.
+ *
+ * @return false if zlib failed, after which the connection can't compress any more.
+ */
+bool SymmetricCompression::compress(const char* data, size_t data_length, std::string* compressed){
+	std::lock_guard<std::mutex> lock(this->deflate_mutex);
+	if(!this->deflater_ready){
+		return false;
+	}
+
+	compressed->resize(deflateBound(&this->deflater, static_cast<uLong>(data_length)) + 16);
+	this->deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	this->deflater.avail_in = static_cast<uInt>(data_length);
+	size_t produced = 0;
+	do{
+		if(produced == compressed->length()){
+			compressed->resize(compressed->length() * 2);
+		}
+		this->deflater.next_out = reinterpret_cast<Bytef*>(&(*compressed)[produced]);
+		this->deflater.avail_out = static_cast<uInt>(compressed->length() - produced);
+		if(deflate(&this->deflater, Z_SYNC_FLUSH) == Z_STREAM_ERROR){
+			this->deflater_ready = false;
+			return false;
+		}
+		produced = compressed->length() - this->deflater.avail_out;
+	}while(this->deflater.avail_out == 0);
+	compressed->resize(produced);
+
+	if(compressed->length() >= 4 && compressed->compare(compressed->length() - 4, 4, "\x00\x00\xff\xff", 4) == 0){
+		compressed->resize(compressed->length() - 4);
+	}
+	return true;
+}
+
+/**
+ * @brief Inflates one whole frame. Frames are only ever inflated by the thread reading the connection.
+ *
+ * @return false if the data is corrupt or inflates past limit bytes.
+ */
+bool SymmetricCompression::decompress(const char* data, size_t data_length, std::string* decompressed, size_t limit){
+	static const char tail[4] = {0x00, 0x00, static_cast<char>(0xff), static_cast<char>(0xff)};
+	char chunk[16384];
+
+	decompressed->clear();
+	if(!this->inflater_ready){
+		return false;
+	}
+
+	for(int part = 0; part < 2; ++part){
+		this->inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(part == 0 ? data : tail));
+		this->inflater.avail_in = static_cast<uInt>(part == 0 ? data_length : 4);
+		do{
+			this->inflater.next_out = reinterpret_cast<Bytef*>(chunk);
+			this->inflater.avail_out = sizeof(chunk);
+			int result = inflate(&this->inflater, Z_SYNC_FLUSH);
+			if(result != Z_OK && result != Z_BUF_ERROR){
+				this->inflater_ready = false;
+				return false;
+			}
+			decompressed->append(chunk, sizeof(chunk) - this->inflater.avail_out);
+			if(decompressed->length() > limit){
+				this->inflater_ready = false;
+				return false;
+			}
+		}while(this->inflater.avail_out == 0);
+	}
+	return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+
+#include <zlib.h>
+
+/// Compression counters for a SymmetricEncryptor.
+struct SymmetricCompressionStats{
+	unsigned long frames_compressed;
+	unsigned long frames_uncompressed;
+	unsigned long frames_inflated;
+	unsigned long bytes_before;
+	unsigned long bytes_after;
+	unsigned long compress_microseconds;
+	unsigned long inflate_microseconds;
+};
+
+/**
+ * @brief The compression state of one symmetric connection, compressed before it's encrypted.
+ *
+ * Both directions are raw deflate streams that keep their context from frame to frame, so repetitive
+ * traffic (JSON with the same keys, shell output) compresses far better than frame by frame.
+ * Each frame ends in a sync flush so the peer can inflate it whole.
+ *
+ * A preset dictionary of typical messages helps the first frames too; both ends must have the same one.
+ */
+class SymmetricCompression{
+private:
+	z_stream deflater;
+	z_stream inflater;
+	bool deflater_ready;
+	bool inflater_ready;
+
+	std::mutex deflate_mutex;
+public:
+	SymmetricCompression(const std::string& dictionary);
+	~SymmetricCompression();
+
+	bool compress(const char* data, size_t data_length, std::string* compressed);
+	bool decompress(const char* data, size_t data_length, std::string* decompressed, size_t limit);
+};
@@ -1,15 +1,31 @@
 #include <fcntl.h>
+#include <poll.h>
+#include <climits>
+#include <cstring>
+#include <chrono>
 
 #include "util.hpp"
 #include "symmetric-encryptor.hpp"
 
-SymmetricEncryptor::SymmetricEncryptor(std::string keyfile){
+SymmetricEncryptor::SymmetricEncryptor(std::string keyfile)
+:compression(false),
+compression_threshold(256),
+dictionary_id(0),
+frames_compressed(0),
+frames_uncompressed(0),
+frames_inflated(0),
+bytes_before(0),
+bytes_after(0),
+compress_microseconds(0),
+inflate_microseconds(0){
 	if(keyfile.empty()){
 		this->random_pool.GenerateBlock(this->key, CryptoPP::AES::MAX_KEYLENGTH);
 		this->random_pool.GenerateBlock(this->iv, CryptoPP::AES::BLOCKSIZE);
 		this->random_pool.GenerateBlock(this->hmac_key, CryptoPP::AES::MAX_KEYLENGTH);
 		
 		this->hmac = CryptoPP::HMAC<CryptoPP::SHA256>(hmac_key, CryptoPP::AES::MAX_KEYLENGTH);
+		CryptoPP::HMAC<CryptoPP::SHA256>(this->key, CryptoPP::AES::MAX_KEYLENGTH).CalculateDigest(this->aead_key,
+			reinterpret_cast<const byte*>("libjaypea aead"), 14);
 		
 		/*
 		std::string keystr;
@@ -66,6 +82,9 @@ SymmetricEncryptor::SymmetricEncryptor(std::string keyfile){
 	*/
 	
 	this->hmac = CryptoPP::HMAC<CryptoPP::SHA256>(this->key, CryptoPP::AES::MAX_KEYLENGTH);
+	// The AEAD format gets its own key, so nothing it seals can be mistaken for the legacy format's.
+	CryptoPP::HMAC<CryptoPP::SHA256>(this->key, CryptoPP::AES::MAX_KEYLENGTH).CalculateDigest(this->aead_key,
+		reinterpret_cast<const byte*>("libjaypea aead"), 14);
 
 	// Another random number tool.
 	// srand(static_cast<unsigned int>(time(0)));
@@ -155,9 +174,12 @@ std::string SymmetricEncryptor::decrypt(std::string data, int transaction){
 	return new_data;
 }
 
-bool SymmetricEncryptor::send(int fd, const char* data, size_t /* data_length */, int* transaction){
-	ssize_t len;
-	std::string send_data = this->encrypt(data, *transaction);
+/**
+ * @brief A legacy frame: the 89 byte encrypted size block, then the encrypted data.
+ */
+std::string SymmetricEncryptor::legacy_frame(const char* data, size_t data_length, int* transaction){
+	// Binary payloads (e.g. MsgPack) may contain zeros, so respect data_length.
+	std::string send_data = this->encrypt(std::string(data, data_length), *transaction);
 
 	char block_size[4] = {0, 0, 0, 0};
 	*(reinterpret_cast<uint32_t*>(block_size)) = static_cast<uint32_t>(send_data.length());
@@ -169,25 +191,26 @@ bool SymmetricEncryptor::send(int fd, const char* data, size_t /* data_length */
 	*transaction += 1;
 
 	DEBUG("SDATA|" << send_data_size << '|' << send_data_size.length())
-	if((len = write(fd, send_data_size.c_str(), 89)) < 0){
+	DEBUG("SDATA|" << send_data << '|' << send_data.length())
+	return send_data_size + send_data;
+}
+
+bool SymmetricEncryptor::send(int fd, const char* data, size_t data_length, int* transaction){
+	ssize_t len;
+	std::string frame = this->legacy_frame(data, data_length, transaction);
+	if((len = write(fd, frame.c_str(), frame.length())) < 0){
 		ERROR("encryptor write")
 		return true;
-	}else if(len != 89){
+	}else if(len != static_cast<ssize_t>(frame.length())){
 		ERROR("encryptor didn't write all")
 		return true;
 	}
-
-	DEBUG("SDATA|" << send_data << '|' << send_data.length())
-	if((len = write(fd, send_data.c_str(), send_data.length())) < 0){
-		ERROR("encryptor write block")
-		return true;
-	}else if(len != static_cast<ssize_t>(send_data.length())){
-		ERROR("encryptor didn't write all block")
-		return true;
-	}
 	return false;
 }
 
+/**
+ * @brief Receives one legacy frame that has fully arrived; without a session there's nowhere to keep a partial one.
+ */
 ssize_t SymmetricEncryptor::recv(int fd, char* data, size_t data_length,
 std::function<ssize_t(int, const char*, ssize_t)> callback, int* transaction){
 	ssize_t len;
@@ -256,3 +279,565 @@ std::function<ssize_t(int, const char*, ssize_t)> callback, int* transaction){
 		return callback(fd, recv_data.c_str(), static_cast<ssize_t>(recv_data.length()));
 	}
 }
+
+/**
+ * @brief How a session without a writer (a client's) writes, waiting for the fd to take all of it.
+ *
+ * @return true on error, or if the fd stayed unwritable for 10 seconds.
+ */
+static bool write_exactly(int fd, const char* data, size_t length){
+	size_t sent = 0;
+	int waits = 0;
+	ssize_t len;
+	while(sent < length){
+		if((len = write(fd, data + sent, length - sent)) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			if(errno != EWOULDBLOCK && errno != EAGAIN){
+				perror("encryptor write");
+				ERROR("encryptor write " << fd)
+				return true;
+			}
+			struct pollfd writable = {fd, POLLOUT, 0};
+			if(poll(&writable, 1, 1000) <= 0 && ++waits >= 10){
+				ERROR("encryptor timed out writing " << fd)
+				return true;
+			}
+			continue;
+		}
+		sent += static_cast<size_t>(len);
+		waits = 0;
+	}
+	return false;
+}
+
+/**
+ * @brief Hands bytes to the session's writer, or writes them straight out if it has none.
+ *
+ * @return true on error.
+ */
+bool SymmetricEncryptor::write_out(int fd, const char* data, size_t length, SymmetricSession* session){
+	if(session->write != nullptr){
+		return session->write(fd, data, length);
+	}
+	return write_exactly(fd, data, length);
+}
+
+std::string SymmetricEncryptor::random_bytes(size_t length){
+	std::string bytes(length, 0);
+	std::lock_guard<std::mutex> lock(this->random_mutex);
+	this->random_pool.GenerateBlock(reinterpret_cast<byte*>(&bytes[0]), length);
+	return bytes;
+}
+
+/**
+ * @brief Keys a session's ciphers with a key of its own, HKDF of the AEAD key salted with both ends' randoms;
+ * every frame after only changes the nonce.
+ */
+void SymmetricEncryptor::key_session(SymmetricSession* session, const char* client_random, const char* server_random){
+	byte salt[SYMMETRIC_RANDOM_LENGTH * 2];
+	std::memcpy(salt, client_random, SYMMETRIC_RANDOM_LENGTH);
+	std::memcpy(salt + SYMMETRIC_RANDOM_LENGTH, server_random, SYMMETRIC_RANDOM_LENGTH);
+	byte session_key[CryptoPP::AES::MAX_KEYLENGTH];
+	CryptoPP::HKDF<CryptoPP::SHA256>().DeriveKey(session_key, sizeof(session_key), this->aead_key, sizeof(this->aead_key),
+		salt, sizeof(salt), reinterpret_cast<const byte*>("libjaypea session"), 17);
+
+	byte iv[SYMMETRIC_NONCE_LENGTH] = {0};
+	session->encryption.SetKeyWithIV(session_key, sizeof(session_key), iv, SYMMETRIC_NONCE_LENGTH);
+	session->decryption.SetKeyWithIV(session_key, sizeof(session_key), iv, SYMMETRIC_NONCE_LENGTH);
+	session->random.clear();
+	session->keyed = true;
+}
+
+/**
+ * @brief On the server, answers a client's hello with a random of its own, and keys the session.
+ *
+ * @return true on error.
+ */
+bool SymmetricEncryptor::answer_hello(int fd, SymmetricSession* session, const char* client_random){
+	std::lock_guard<std::mutex> lock(session->send_mutex);
+	std::string server_random = this->random_bytes(SYMMETRIC_RANDOM_LENGTH);
+	this->key_session(session, client_random, server_random.data());
+	return this->write_out(fd, server_random.data(), server_random.length(), session);
+}
+
+/**
+ * @brief On the client, keys the session with the server's answer, then sends what was waiting for it.
+ *
+ * @return true on error.
+ */
+bool SymmetricEncryptor::take_answer(int fd, SymmetricSession* session, const char* server_random){
+	std::lock_guard<std::mutex> lock(session->send_mutex);
+	this->key_session(session, session->random.data(), server_random);
+	for(const auto& waiting : session->unkeyed){
+		const std::string& plain = waiting.second;
+		if(this->write_frame(fd, plain.length(), waiting.first, [&](byte* out){
+			std::memcpy(out, plain.data(), plain.length());
+		}, session)){
+			return true;
+		}
+	}
+	session->unkeyed.clear();
+	return false;
+}
+
+/**
+ * @brief 4 bytes of direction (1 from the server, 0 from the client) then the transaction as 8 big endian bytes.
+ */
+void SymmetricEncryptor::nonce(byte* iv, bool from_server, int transaction){
+	std::memset(iv, 0, SYMMETRIC_NONCE_LENGTH);
+	iv[3] = from_server ? 1 : 0;
+	uint64_t counter = static_cast<uint64_t>(transaction);
+	for(int i = SYMMETRIC_NONCE_LENGTH - 1; i >= 4; --i){
+		iv[i] = static_cast<byte>(counter & 0xff);
+		counter >>= 8;
+	}
+}
+
+// The request a callback on this thread is being handed, so a reply sent from it can carry the same id.
+static thread_local SymmetricSession* delivering_session = nullptr;
+static thread_local uint32_t delivering_id = 0;
+
+static void put_uint32(byte* out, uint32_t value){
+	out[0] = static_cast<byte>(value >> 24);
+	out[1] = static_cast<byte>(value >> 16);
+	out[2] = static_cast<byte>(value >> 8);
+	out[3] = static_cast<byte>(value);
+}
+
+static uint32_t get_uint32(const byte* in){
+	return static_cast<uint32_t>(in[0]) << 24 | static_cast<uint32_t>(in[1]) << 16 |
+		static_cast<uint32_t>(in[2]) << 8 | static_cast<uint32_t>(in[3]);
+}
+
+/**
+ * @return The id of the request being handed to the callback on this thread, or 0 if it didn't have one.
+ */
+uint32_t SymmetricEncryptor::request_id(){
+	return delivering_id;
+}
+
+/**
+ * @brief Seals messages into one AEAD frame and writes it, in one write when the socket takes it.
+ *
+ * An untagged frame is a single message as it is. A tagged frame is any number of messages,
+ * each a 4 byte id, a 4 byte length and the message; the messages are laid out straight into
+ * the buffer that's written and encrypted in place. Either is deflated first if the session compresses.
+ * A client's first frame is preceded by its hello, and kept back until the server has answered it.
+ *
+ * @return true on error.
+ */
+bool SymmetricEncryptor::seal(int fd, const std::vector<SymmetricMessage>& messages, bool tagged, SymmetricSession* session){
+	size_t data_length = 0;
+	for(const SymmetricMessage& message : messages){
+		data_length += message.length + (tagged ? 8 : 0);
+	}
+	auto lay_out = [&](byte* out){
+		for(const SymmetricMessage& message : messages){
+			if(tagged){
+				put_uint32(out, message.id);
+				put_uint32(out + 4, static_cast<uint32_t>(message.length));
+				out += 8;
+			}
+			std::memcpy(out, message.data, message.length);
+			out += message.length;
+		}
+	};
+
+	std::lock_guard<std::mutex> lock(session->send_mutex);
+
+	if(data_length >= SYMMETRIC_FRAME_LENGTH - SYMMETRIC_TAG_LENGTH){
+		ERROR("encryptor frame too large " << data_length)
+		return true;
+	}
+
+	if(!session->server && !session->hello_sent){
+		std::string hello;
+		if(this->compression){
+			byte dictionary[4];
+			put_uint32(dictionary, this->dictionary_id);
+			hello = std::string(SYMMETRIC_DEFLATE_HELLO, SYMMETRIC_AEAD_HELLO_LENGTH) +
+				std::string(reinterpret_cast<const char*>(dictionary), 4);
+			if(session->compression == nullptr){
+				session->compression.reset(new SymmetricCompression(this->compression_dictionary));
+			}
+		}else{
+			hello = std::string(SYMMETRIC_AEAD_HELLO, SYMMETRIC_AEAD_HELLO_LENGTH);
+		}
+		session->random = this->random_bytes(SYMMETRIC_RANDOM_LENGTH);
+		hello += session->random;
+		if(this->write_out(fd, hello.data(), hello.length(), session)){
+			return true;
+		}
+		session->hello_sent = true;
+	}
+
+	if(!session->keyed){
+		std::string plain(data_length, 0);
+		lay_out(reinterpret_cast<byte*>(&plain[0]));
+		session->unkeyed.push_back(std::make_pair(tagged, plain));
+		return false;
+	}
+	return this->write_frame(fd, data_length, tagged, lay_out, session);
+}
+
+/**
+ * @brief Seals data_length bytes, put in place by lay_out, into a frame and writes it.
+ * Expects the session to be keyed and its send_mutex to be held.
+ *
+ * @return true on error.
+ */
+bool SymmetricEncryptor::write_frame(int fd, size_t data_length, bool tagged, std::function<void(byte*)> lay_out,
+SymmetricSession* session){
+	// The nonce must never repeat under one key.
+	if(session->writes == INT_MAX){
+		ERROR("encryptor ran out of transactions " << fd)
+		return true;
+	}
+
+	// Compressed before it's encrypted; ciphertext doesn't compress. Small frames aren't worth it.
+	std::string compressed;
+	bool compress = this->compression && session->compression != nullptr && data_length >= this->compression_threshold;
+	if(compress){
+		std::string plain(data_length, 0);
+		lay_out(reinterpret_cast<byte*>(&plain[0]));
+		auto start = std::chrono::steady_clock::now();
+		if(!session->compression->compress(plain.data(), plain.length(), &compressed)){
+			ERROR("encryptor compress " << fd)
+			return true;
+		}
+		this->compress_microseconds += static_cast<unsigned long>(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count());
+		this->frames_compressed++;
+		this->bytes_before += data_length;
+		this->bytes_after += compressed.length();
+	}else if(this->compression){
+		this->frames_uncompressed++;
+	}
+	size_t payload_length = compress ? compressed.length() : data_length;
+
+	std::string frame(4 + payload_length + SYMMETRIC_TAG_LENGTH, 0);
+	byte* header = reinterpret_cast<byte*>(&frame[0]);
+	byte* ciphertext = header + 4;
+	put_uint32(header, static_cast<uint32_t>(payload_length) |
+		(tagged ? SYMMETRIC_TAGGED_FRAME : 0) | (compress ? SYMMETRIC_COMPRESSED_FRAME : 0));
+	if(compress){
+		std::memcpy(ciphertext, compressed.data(), payload_length);
+	}else{
+		lay_out(ciphertext);
+	}
+
+	byte iv[SYMMETRIC_NONCE_LENGTH];
+	this->nonce(iv, session->server, session->writes);
+	session->encryption.EncryptAndAuthenticate(ciphertext, ciphertext + payload_length, SYMMETRIC_TAG_LENGTH,
+		iv, SYMMETRIC_NONCE_LENGTH, header, 4, ciphertext, payload_length);
+	session->writes += 1;
+
+	return this->write_out(fd, frame.data(), frame.length(), session);
+}
+
+/**
+ * @brief Sends one message in whichever format the session speaks.
+ *
+ * Sent from a callback handling a request with an id, the message goes back tagged with that id.
+ * A server session that hasn't heard from its client yet answers in the legacy format;
+ * none of the protocols here have the server speak first.
+ *
+ * @return true on error.
+ */
+bool SymmetricEncryptor::send(int fd, const char* data, size_t data_length, SymmetricSession* session){
+	if(session->wire != SYMMETRIC_AEAD){
+		std::lock_guard<std::mutex> lock(session->send_mutex);
+		std::string frame = this->legacy_frame(data, data_length, &session->writes);
+		return this->write_out(fd, frame.data(), frame.length(), session);
+	}
+	uint32_t id = delivering_session == session ? delivering_id : 0;
+	return this->seal(fd, std::vector<SymmetricMessage>(1, SymmetricMessage(data, data_length, id)), id != 0, session);
+}
+
+/**
+ * @brief Sends several messages as one encrypted frame and one write.
+ *
+ * A legacy peer gets them one frame at a time, and without their ids.
+ *
+ * @return true on error.
+ */
+bool SymmetricEncryptor::send_batch(int fd, const std::vector<SymmetricMessage>& messages, SymmetricSession* session){
+	if(session->wire != SYMMETRIC_AEAD){
+		std::lock_guard<std::mutex> lock(session->send_mutex);
+		std::string frames;
+		for(const SymmetricMessage& message : messages){
+			frames += this->legacy_frame(message.data, message.length, &session->writes);
+		}
+		return this->write_out(fd, frames.data(), frames.length(), session);
+	}
+	return messages.empty() ? false : this->seal(fd, messages, true, session);
+}
+
+/**
+ * @brief Hands every whole frame in session->inbound to callback, in order, and keeps the rest.
+ *
+ * A new server session works out which format its client speaks from the first byte, consuming the AEAD hello
+ * and answering it; a new client session takes the server's answer before any frame.
+ * AEAD frames are opened straight into data, and callback only ever sees authenticated plaintext.
+ * A legacy frame's size block is only decrypted once, however many reads its body takes.
+ *
+ * @return The last callback's return, 0 if there was no whole frame, or the same negatives as recv.
+ */
+ssize_t SymmetricEncryptor::frames(int fd, char* data, size_t data_length,
+std::function<ssize_t(int, const char*, ssize_t)> callback, SymmetricSession* session){
+	ssize_t result = 0;
+	size_t used = 0;
+	byte iv[SYMMETRIC_NONCE_LENGTH];
+
+	while(true){
+		const char* frame = session->inbound.data() + used;
+		size_t available = session->inbound.length() - used;
+
+		if(session->wire == SYMMETRIC_UNKNOWN){
+			if(available == 0){
+				break;
+			}
+			if(frame[0] != 0){
+				session->wire = SYMMETRIC_LEGACY;
+				continue;
+			}
+			if(available < SYMMETRIC_AEAD_HELLO_LENGTH){
+				break;
+			}
+			if(std::memcmp(frame, SYMMETRIC_AEAD_HELLO, SYMMETRIC_AEAD_HELLO_LENGTH) == 0){
+				if(available < SYMMETRIC_AEAD_HELLO_LENGTH + SYMMETRIC_RANDOM_LENGTH){
+					break;
+				}
+				session->wire = SYMMETRIC_AEAD;
+				if(this->answer_hello(fd, session, frame + SYMMETRIC_AEAD_HELLO_LENGTH)){
+					return -1;
+				}
+				used += SYMMETRIC_AEAD_HELLO_LENGTH + SYMMETRIC_RANDOM_LENGTH;
+				continue;
+			}
+			if(std::memcmp(frame, SYMMETRIC_DEFLATE_HELLO, SYMMETRIC_AEAD_HELLO_LENGTH) != 0){
+				ERROR("Bad hello.\nImplied hacker, closing!")
+				return -4;
+			}
+			if(available < SYMMETRIC_AEAD_HELLO_LENGTH + 4 + SYMMETRIC_RANDOM_LENGTH){
+				break;
+			}
+			// The client compresses. Its frames can always be inflated, given the same dictionary.
+			if(get_uint32(reinterpret_cast<const byte*>(frame + SYMMETRIC_AEAD_HELLO_LENGTH)) != this->dictionary_id){
+				ERROR("The client's compression dictionary isn't this one, closing!")
+				return -4;
+			}
+			session->compression.reset(new SymmetricCompression(this->compression_dictionary));
+			session->wire = SYMMETRIC_AEAD;
+			if(this->answer_hello(fd, session, frame + SYMMETRIC_AEAD_HELLO_LENGTH + 4)){
+				return -1;
+			}
+			used += SYMMETRIC_AEAD_HELLO_LENGTH + 4 + SYMMETRIC_RANDOM_LENGTH;
+		}else if(session->wire == SYMMETRIC_LEGACY){
+			if(session->legacy_block == 0){
+				if(available < 89){
+					break;
+				}
+				std::string recv_size_data;
+				try{
+					recv_size_data = this->decrypt(std::string(frame, 89), session->reads);
+				}catch(const std::exception& e){
+					ERROR(e.what() << "\nImplied hacker, closing!")
+					return -4;
+				}
+				if(recv_size_data.length() != 4){
+					PRINT("Did not receive 4 bytes or decrypted length...")
+					return -5;
+				}
+				uint32_t block_size;
+				std::memcpy(&block_size, recv_size_data.data(), 4);
+				if(block_size == 0 || block_size >= data_length){
+					PRINT("Received too large of a packet!")
+					return -1;
+				}
+				session->legacy_block = block_size;
+			}
+			if(available < 89 + session->legacy_block){
+				break;
+			}
+
+			std::string recv_data;
+			try{
+				recv_data = this->decrypt(std::string(frame + 89, session->legacy_block), session->reads);
+			}catch(const std::exception& e){
+				ERROR(e.what() << "\nImplied hacker, closing!")
+				return -4;
+			}
+			session->reads += 1;
+			used += 89 + session->legacy_block;
+			session->legacy_block = 0;
+
+			if((result = callback(fd, recv_data.c_str(), static_cast<ssize_t>(recv_data.length()))) < 0){
+				return result;
+			}
+		}else if(!session->keyed){
+			// The server's answer to this client's hello.
+			if(available < SYMMETRIC_RANDOM_LENGTH){
+				break;
+			}
+			if(session->server || !session->hello_sent){
+				ERROR("Unexpected answer.\nImplied hacker, closing!")
+				return -4;
+			}
+			if(this->take_answer(fd, session, frame)){
+				return -1;
+			}
+			used += SYMMETRIC_RANDOM_LENGTH;
+		}else{
+			if(available < 4){
+				break;
+			}
+			const byte* header = reinterpret_cast<const byte*>(frame);
+			bool tagged = (get_uint32(header) & SYMMETRIC_TAGGED_FRAME) != 0;
+			bool compressed = (get_uint32(header) & SYMMETRIC_COMPRESSED_FRAME) != 0;
+			size_t length = get_uint32(header) & SYMMETRIC_FRAME_LENGTH;
+			if(length + SYMMETRIC_TAG_LENGTH >= data_length){
+				PRINT("Received too large of a packet!")
+				return -1;
+			}
+			if(available < 4 + length + SYMMETRIC_TAG_LENGTH){
+				break;
+			}
+
+			this->nonce(iv, !session->server, session->reads);
+			if(!session->decryption.DecryptAndVerify(reinterpret_cast<byte*>(data), header + 4 + length,
+			SYMMETRIC_TAG_LENGTH, iv, SYMMETRIC_NONCE_LENGTH, header, 4, header + 4, length)){
+				ERROR("Bad tag.\nImplied hacker, closing!")
+				return -4;
+			}
+			session->reads += 1;
+			used += 4 + length + SYMMETRIC_TAG_LENGTH;
+
+			if(compressed){
+				if(session->compression == nullptr){
+					ERROR("Unexpected compressed frame.\nImplied hacker, closing!")
+					return -4;
+				}
+				std::string inflated;
+				auto start = std::chrono::steady_clock::now();
+				if(!session->compression->decompress(data, length, &inflated, data_length - 1)){
+					ERROR("Bad compressed frame.\nImplied hacker, closing!")
+					return -4;
+				}
+				this->inflate_microseconds += static_cast<unsigned long>(std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() - start).count());
+				this->frames_inflated++;
+				length = inflated.length();
+				std::memcpy(data, inflated.data(), length);
+			}
+
+			if(!tagged){
+				data[length] = 0;
+				if((result = callback(fd, data, static_cast<ssize_t>(length))) < 0){
+					return result;
+				}
+				continue;
+			}
+
+			// Each message is followed by the next one's id, so the terminator has to be put back afterwards.
+			size_t offset = 0;
+			while(offset < length){
+				const byte* entry = reinterpret_cast<const byte*>(data + offset);
+				size_t entry_length;
+				if(length - offset < 8 || (entry_length = get_uint32(entry + 4)) > length - offset - 8){
+					ERROR("Bad batch.\nImplied hacker, closing!")
+					return -4;
+				}
+				char* message = data + offset + 8;
+				char after = message[entry_length];
+				message[entry_length] = 0;
+
+				delivering_session = session;
+				delivering_id = get_uint32(entry);
+				result = callback(fd, message, static_cast<ssize_t>(entry_length));
+				delivering_session = nullptr;
+				delivering_id = 0;
+				if(result < 0){
+					return result;
+				}
+				message[entry_length] = after;
+				offset += 8 + entry_length;
+			}
+		}
+	}
+
+	session->inbound.erase(0, used);
+	return result;
+}
+
+/**
+ * @brief Reads everything fd has and delivers each whole frame, in whichever format the session speaks.
+ *
+ * Never blocks or waits: a frame split across reads is finished by a later call, once fd is readable again.
+ * Frames are parsed after every read, so at most one partial frame is ever held.
+ *
+ * @param data Scratch space for reads and plaintext; a frame must fit in it.
+ *
+ * @return The last callback's return, 0 if no whole frame arrived, or negative on error.
+ */
+ssize_t SymmetricEncryptor::recv(int fd, char* data, size_t data_length,
+std::function<ssize_t(int, const char*, ssize_t)> callback, SymmetricSession* session){
+	ssize_t len;
+	ssize_t result = 0;
+	ssize_t delivered;
+
+	while(true){
+		if((len = read(fd, data, data_length)) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			if(errno != EWOULDBLOCK && errno != EAGAIN){
+				perror("encryptor read");
+				ERROR("encryptor read " << fd)
+				return -1;
+			}
+			return result;
+		}else if(len == 0){
+			ERROR("encryptor read zero")
+			return -2;
+		}
+		session->inbound.append(data, static_cast<size_t>(len));
+		if((delivered = this->frames(fd, data, data_length, callback, session)) < 0){
+			return delivered;
+		}else if(delivered > 0){
+			result = delivered;
+		}
+	}
+}
+
+/**
+ * @brief Compresses frames before they're encrypted, for connections whose peer agrees.
+ *
+ * A client that compresses says so in its hello, along with which dictionary it has;
+ * a server then compresses its replies to that client too, if it has compression on itself.
+ * Set this before any connections are made, and give both ends the same dictionary.
+ *
+ * @param threshold Frames smaller than this many bytes go uncompressed.
+ * @param dictionary Typical message content (e.g. a few representative JSON messages) to prime each stream with.
+ */
+void SymmetricEncryptor::set_compression(bool enabled, size_t threshold, const std::string& dictionary){
+	this->compression = enabled;
+	this->compression_threshold = threshold;
+	this->compression_dictionary = dictionary;
+	this->dictionary_id = dictionary.empty() ? 0 : static_cast<uint32_t>(adler32(adler32(0, Z_NULL, 0),
+		reinterpret_cast<const Bytef*>(dictionary.data()), static_cast<uInt>(dictionary.length())));
+}
+
+SymmetricCompressionStats SymmetricEncryptor::compression_stats(){
+	SymmetricCompressionStats stats;
+	stats.frames_compressed = this->frames_compressed;
+	stats.frames_uncompressed = this->frames_uncompressed;
+	stats.frames_inflated = this->frames_inflated;
+	stats.bytes_before = this->bytes_before;
+	stats.bytes_after = this->bytes_after;
+	stats.compress_microseconds = this->compress_microseconds;
+	stats.inflate_microseconds = this->inflate_microseconds;
+	return stats;
+}
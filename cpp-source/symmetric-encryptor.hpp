@@ -1,26 +1,150 @@
 #pragma once
 
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string>
+#include <utility>
+#include <functional>
+
 #include "cryptopp/aes.h"
+#include "cryptopp/gcm.h"
+#include "cryptopp/sha.h"
 #include "cryptopp/osrng.h"
 #include "cryptopp/hmac.h"
+#include "cryptopp/hkdf.h"
 #include "cryptopp/modes.h"
 #include "cryptopp/base64.h"
 #include "cryptopp/hex.h"
 #include "cryptopp/filters.h"
 #include "cryptopp/cryptlib.h"
 
+#include "symmetric-compression.hpp"
+
 union Size{
 	size_t size;
 	char chars[4];
 };
 
+#define SYMMETRIC_TAG_LENGTH 16
+#define SYMMETRIC_NONCE_LENGTH 12
+/// What a client sends before its first AEAD frame, then its random. Legacy frames are base64, which never starts with a zero.
+#define SYMMETRIC_AEAD_HELLO "\x00JP\x01"
+/// The hello of a client that compresses, followed by the 4 byte Adler-32 of its dictionary (0 for none), then its random.
+#define SYMMETRIC_DEFLATE_HELLO "\x00JP\x02"
+#define SYMMETRIC_AEAD_HELLO_LENGTH 4
+/// Random bytes each end puts into a connection's session key: the client's after its hello, the server's as its answer.
+#define SYMMETRIC_RANDOM_LENGTH 16
+/// Set in an AEAD frame's length when it holds messages with request ids.
+#define SYMMETRIC_TAGGED_FRAME 0x80000000u
+/// Set in an AEAD frame's length when its plaintext was deflated.
+#define SYMMETRIC_COMPRESSED_FRAME 0x40000000u
+#define SYMMETRIC_FRAME_LENGTH 0x3fffffffu
+
+enum SymmetricWire{
+	SYMMETRIC_UNKNOWN,
+	SYMMETRIC_LEGACY,
+	SYMMETRIC_AEAD
+};
+
+/**
+ * @brief One connection's state for SymmetricEncryptor's AEAD wire format.
+ *
+ * A frame is a 4 byte big endian length, then the AES-GCM ciphertext and its 16 byte tag, with the length
+ * authenticated as associated data. Each connection has its own key, derived (HKDF) from the shared key and
+ * a random from each end, so no two connections ever seal under the same key and nonce, and nothing recorded
+ * from one connection opens on another. The nonce is the direction followed by the transaction counter,
+ * so within a connection a frame can't be replayed, reordered or reflected back at its sender.
+ *
+ * A client only has the session key once the server has answered its hello with the server's random;
+ * until then what it sends waits in unkeyed, and goes out as soon as the answer arrives.
+ *
+ * Clients start out speaking AEAD (or legacy, if told the peer is old).
+ * Servers start out SYMMETRIC_UNKNOWN and take whatever the client's first bytes turn out to be.
+ *
+ * Bytes of a frame that hasn't fully arrived wait in inbound until the next read completes it.
+ * compression is only set once both ends have agreed to it, see SymmetricEncryptor::set_compression.
+ * The transaction counters live here too, so that finding the session is all a send or recv has to look up;
+ * writes is only touched under send_mutex, and reads only by the one thread reading the connection.
+ *
+ * write is where the session's bytes go. Unset, they're written straight to the fd, waiting for it to take them;
+ * a server sets it to queue whatever its client can't take yet, so a slow client never holds up a worker.
+ */
+struct SymmetricSession{
+	bool server;
+	SymmetricWire wire;
+	bool hello_sent;
+	bool keyed;
+	// A client's random, until the server's arrives.
+	std::string random;
+	std::vector<std::pair<bool /* tagged */, std::string /* plaintext */>> unkeyed;
+	std::string inbound;
+	size_t legacy_block;
+	std::unique_ptr<SymmetricCompression> compression;
+	CryptoPP::GCM<CryptoPP::AES>::Encryption encryption;
+	CryptoPP::GCM<CryptoPP::AES>::Decryption decryption;
+	std::mutex send_mutex;
+	std::function<bool(int /* fd */, const char* /* data */, size_t /* length */)> write;
+	int reads;
+	int writes;
+
+	SymmetricSession(bool new_server, bool legacy = false)
+	:server(new_server),
+	wire(new_server ? SYMMETRIC_UNKNOWN : legacy ? SYMMETRIC_LEGACY : SYMMETRIC_AEAD),
+	hello_sent(false),
+	keyed(false),
+	legacy_block(0),
+	reads(0),
+	writes(0){}
+};
+
+/**
+ * @brief One message of a batch. id is 0 for messages that don't expect a matched reply.
+ */
+struct SymmetricMessage{
+	const char* data;
+	size_t length;
+	uint32_t id;
+
+	SymmetricMessage(const char* new_data, size_t new_length, uint32_t new_id = 0)
+	:data(new_data), length(new_length), id(new_id){}
+};
+
 class SymmetricEncryptor{
 private:
+	std::mutex random_mutex;
 	CryptoPP::AutoSeededRandomPool random_pool;
 	byte key[CryptoPP::AES::MAX_KEYLENGTH];
 	byte iv[CryptoPP::AES::BLOCKSIZE];
 	byte hmac_key[CryptoPP::AES::MAX_KEYLENGTH];
 	CryptoPP::HMAC<CryptoPP::SHA256> hmac;
+	byte aead_key[CryptoPP::AES::MAX_KEYLENGTH];
+
+	bool compression;
+	size_t compression_threshold;
+	std::string compression_dictionary;
+	uint32_t dictionary_id;
+
+	std::atomic<unsigned long> frames_compressed;
+	std::atomic<unsigned long> frames_uncompressed;
+	std::atomic<unsigned long> frames_inflated;
+	std::atomic<unsigned long> bytes_before;
+	std::atomic<unsigned long> bytes_after;
+	std::atomic<unsigned long> compress_microseconds;
+	std::atomic<unsigned long> inflate_microseconds;
+
+	std::string random_bytes(size_t length);
+	void key_session(SymmetricSession* session, const char* client_random, const char* server_random);
+	bool answer_hello(int fd, SymmetricSession* session, const char* client_random);
+	bool take_answer(int fd, SymmetricSession* session, const char* server_random);
+	void nonce(byte* iv, bool from_server, int transaction);
+	bool seal(int fd, const std::vector<SymmetricMessage>& messages, bool tagged, SymmetricSession* session);
+	std::string legacy_frame(const char* data, size_t data_length, int* transaction);
+	bool write_out(int fd, const char* data, size_t length, SymmetricSession* session);
+	bool write_frame(int fd, size_t data_length, bool tagged, std::function<void(byte*)> lay_out, SymmetricSession* session);
+	ssize_t frames(int fd, char* data, size_t data_length,
+	std::function<ssize_t(int, const char*, ssize_t)> callback, SymmetricSession* session);
 public:
 	SymmetricEncryptor(std::string keyfile = std::string());
 
@@ -32,4 +156,14 @@ public:
 	bool send(int fd, const char* data, size_t data_length, int* transaction);
 	ssize_t recv(int fd, char* data, size_t data_length,
 	std::function<ssize_t(int, const char*, ssize_t)> callback, int* transaction);
+
+	bool send(int fd, const char* data, size_t data_length, SymmetricSession* session);
+	ssize_t recv(int fd, char* data, size_t data_length,
+	std::function<ssize_t(int, const char*, ssize_t)> callback, SymmetricSession* session);
+	bool send_batch(int fd, const std::vector<SymmetricMessage>& messages, SymmetricSession* session);
+
+	static uint32_t request_id();
+
+	void set_compression(bool enabled, size_t threshold = 256, const std::string& dictionary = std::string());
+	SymmetricCompressionStats compression_stats();
 };
@@ -1,33 +1,82 @@
-#include <sys/types.h>
-#include <fcntl.h>
-
-#include "util.hpp"
-#include "symmetric-epoll-server.hpp"
-
-/**
- * /implements EpollServer
- *
- * @brief This class has the same characteristics of EpollServer, yet uses symmetric key encryption.
- *
- * @param keyfile The path to the keyfile made standard by @see SymmetricEncryptor.
- *
- * See EpollServer::EpollServer.
- *
- * This class encrypts written data and decrypts read data via @see SymmetricEpollServer::encryptor,
- * and keeps track of the number of writes and reads for transaction-based security.
- */
-SymmetricEpollServer::SymmetricEpollServer(std::string keyfile, uint16_t port, size_t new_max_connections)
-:EpollServer(port, new_max_connections, "SymmetricEpollServer"),
-encryptor(keyfile){}
-
-bool SymmetricEpollServer::send(int fd, std::string msg){
-	return this->encryptor.send(fd, msg.c_str(), msg.length(), &this->write_counter[fd]);
-}
-
-bool SymmetricEpollServer::send(int fd, const char* data, size_t data_length){
-	return this->encryptor.send(fd, data, data_length, &this->write_counter[fd]);
-}
-
-ssize_t SymmetricEpollServer::recv(int fd, char* data, size_t data_length){
-	return this->encryptor.recv(fd, data, data_length, this->on_read, &this->read_counter[fd]);
-}
+#include <sys/types.h>
+#include <fcntl.h>
+
+#include "util.hpp"
+#include "symmetric-epoll-server.hpp"
+
+/**
+ * /implements EpollServer
+ *
+ * @brief This class has the same characteristics of EpollServer, yet uses symmetric key encryption.
+ *
+ * @param keyfile The path to the keyfile made standard by @see SymmetricEncryptor.
+ *
+ * See EpollServer::EpollServer.
+ *
+ * This class encrypts written data and decrypts read data via @see SymmetricEpollServer::encryptor,
+ * and keeps track of the number of writes and reads for transaction-based security, in each client's session.
+ * Each client is answered in the format it speaks: AEAD frames for new clients, base64 for old ones.
+ */
+SymmetricEpollServer::SymmetricEpollServer(std::string keyfile, uint16_t port, size_t new_max_connections)
+:EpollServer(port, new_max_connections, "SymmetricEpollServer"),
+encryptor(keyfile){}
+
+std::shared_ptr<SymmetricSession> SymmetricEpollServer::session(int fd){
+	std::lock_guard<std::mutex> lock(this->sessions_mutex);
+	std::shared_ptr<SymmetricSession>& found = this->sessions[fd];
+	if(found == nullptr){
+		found = std::make_shared<SymmetricSession>(true);
+		// Whatever the client can't take yet waits in its outbound queue for EPOLLOUT, not in a worker.
+		found->write = [this](int client_fd, const char* data, size_t length){
+			return EpollServer::send(client_fd, data, length);
+		};
+	}
+	return found;
+}
+
+/**
+ * See EpollServer::close_client
+ */
+void SymmetricEpollServer::close_client(int* fd, std::function<void(int*)> callback){
+	{
+		std::lock_guard<std::mutex> lock(this->sessions_mutex);
+		this->sessions.erase(*fd);
+	}
+	EpollServer::close_client(fd, callback);
+}
+
+bool SymmetricEpollServer::send(int fd, std::string msg){
+	return this->encryptor.send(fd, msg.c_str(), msg.length(), this->session(fd).get());
+}
+
+bool SymmetricEpollServer::send(int fd, const char* data, size_t data_length){
+	return this->encryptor.send(fd, data, data_length, this->session(fd).get());
+}
+
+/**
+ * @brief Sends several messages to fd in one encrypted frame and one write.
+ *
+ * @return true on error.
+ */
+bool SymmetricEpollServer::send_batch(int fd, const std::vector<std::string>& messages){
+	std::vector<SymmetricMessage> batch;
+	for(const std::string& message : messages){
+		batch.push_back(SymmetricMessage(message.c_str(), message.length()));
+	}
+	return this->encryptor.send_batch(fd, batch, this->session(fd).get());
+}
+
+/**
+ * See SymmetricEncryptor::set_compression
+ */
+void SymmetricEpollServer::set_compression(bool enabled, size_t threshold, const std::string& dictionary){
+	this->encryptor.set_compression(enabled, threshold, dictionary);
+}
+
+SymmetricCompressionStats SymmetricEpollServer::compression_stats(){
+	return this->encryptor.compression_stats();
+}
+
+ssize_t SymmetricEpollServer::recv(int fd, char* data, size_t data_length){
+	return this->encryptor.recv(fd, data, data_length, this->on_read, this->session(fd).get());
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
 #include "cryptopp/aes.h"
 #include "cryptopp/osrng.h"
 #include "cryptopp/modes.h"
@@ -13,10 +17,21 @@
 class SymmetricEpollServer : public EpollServer {
 private:
 	SymmetricEncryptor encryptor;
+
+	std::mutex sessions_mutex;
+	std::unordered_map<int /* fd */, std::shared_ptr<SymmetricSession>> sessions;
+
+	std::shared_ptr<SymmetricSession> session(int fd);
+protected:
+	void close_client(int* fd, std::function<void(int*)> callback);
 public:
 	SymmetricEpollServer(std::string keyfile, uint16_t port, size_t new_max_connections);
 
 	bool send(int fd, std::string msg);
 	bool send(int fd, const char* data, size_t data_length);
+	bool send_batch(int fd, const std::vector<std::string>& messages);
+
+	void set_compression(bool enabled, size_t threshold = 256, const std::string& dictionary = std::string());
+	SymmetricCompressionStats compression_stats();
 	ssize_t recv(int fd, char* data, size_t data_length);
 };
@@ -1,12 +1,42 @@
 #include "symmetric-event-client.hpp"
 
-SymmetricEventClient::SymmetricEventClient(std::string keyfile)
-:encryptor(keyfile){}
+/**
+ * @param legacy_peers Speak the legacy base64 format, for servers from before the AEAD format.
+ * This is never fallen back to on its own, since anyone able to drop a connection could force it.
+ */
+SymmetricEventClient::SymmetricEventClient(std::string keyfile, bool legacy_peers)
+:encryptor(keyfile), legacy(legacy_peers){}
+
+/**
+ * @brief The session of fd's current connection.
+ */
+SymmetricSession* SymmetricEventClient::session(int fd){
+	std::shared_ptr<SymmetricSession>& found = this->sessions[fd];
+	if(found == nullptr){
+		found = std::make_shared<SymmetricSession>(false, this->legacy);
+	}
+	return found.get();
+}
+
+/**
+ * @brief A reconnect starts a new session, counters and all.
+ */
+void SymmetricEventClient::connected(int fd){
+	EventClient::connected(fd);
+	this->sessions.erase(fd);
+}
+
+/**
+ * See SymmetricEncryptor::set_compression
+ */
+void SymmetricEventClient::set_compression(bool enabled, size_t threshold, const std::string& dictionary){
+	this->encryptor.set_compression(enabled, threshold, dictionary);
+}
 
 bool SymmetricEventClient::send(int fd, const char* data, size_t data_length){
-	return this->encryptor.send(fd, data, data_length, &this->write_counter[fd]);
+	return this->encryptor.send(fd, data, data_length, this->session(fd));
 }
 
 ssize_t SymmetricEventClient::recv(int fd, char* data, size_t data_length){
-	return this->encryptor.recv(fd, data, data_length, this->on_read, &this->read_counter[fd]);
+	return this->encryptor.recv(fd, data, data_length, this->on_read, this->session(fd));
 }
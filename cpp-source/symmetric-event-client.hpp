@@ -1,3 +1,6 @@
+#include <memory>
+#include <unordered_map>
+
 #include "util.hpp"
 #include "tcp-event-client.hpp"
 #include "symmetric-encryptor.hpp"
@@ -5,8 +8,16 @@
 class SymmetricEventClient : public EventClient{
 private:
 	SymmetricEncryptor encryptor;
+	std::unordered_map<int /* fd */, std::shared_ptr<SymmetricSession>> sessions;
+	bool legacy;
+
+	SymmetricSession* session(int fd);
+protected:
+	void connected(int fd);
 public:
-	SymmetricEventClient(std::string keyfile);
+	SymmetricEventClient(std::string keyfile, bool legacy_peers = false);
+
+	void set_compression(bool enabled, size_t threshold = 256, const std::string& dictionary = std::string());
 
 	bool send(int fd, const char* data, size_t data_length);
 	ssize_t recv(int fd, char* data, size_t data_length);
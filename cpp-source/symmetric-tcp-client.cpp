@@ -1,21 +1,80 @@
+#include <poll.h>
+
+#include <chrono>
+#include <algorithm>
+
 #include "util.hpp"
 #include "symmetric-tcp-client.hpp"
 
-SymmetricTcpClient::SymmetricTcpClient(std::string hostname, uint16_t port, std::string keyfile)
+/**
+ * @param legacy_server Speak the legacy base64 format, for a server from before the AEAD format.
+ * This is never fallen back to on its own, since anyone able to drop a connection could force it.
+ */
+SymmetricTcpClient::SymmetricTcpClient(std::string hostname, uint16_t port, std::string keyfile, bool legacy_server)
 :SimpleTcpClient(hostname, port),
-encryptor(keyfile), writes(0), reads(0){}
+encryptor(keyfile), session(new SymmetricSession(false, legacy_server)), legacy(legacy_server),
+next_request_id(1), timeout(-1){}
 
-SymmetricTcpClient::SymmetricTcpClient(const char* ip_address, uint16_t port, std::string keyfile)
+SymmetricTcpClient::SymmetricTcpClient(const char* ip_address, uint16_t port, std::string keyfile, bool legacy_server)
 :SimpleTcpClient(ip_address, port),
-encryptor(keyfile), writes(0), reads(0){}
+encryptor(keyfile), session(new SymmetricSession(false, legacy_server)), legacy(legacy_server),
+next_request_id(1), timeout(-1){}
 
 void SymmetricTcpClient::close_client(){
 	this->connected = false;
 	if(close(this->fd) < 0){
 		perror("symmetric tcp client reconnect closing socket");
 	}
-	this->writes = 0;
-	this->reads = 0;
+	this->session.reset(new SymmetricSession(false, this->legacy));
+}
+
+/**
+ * @brief Connects if need be. The socket is made non-blocking, since recv reads until there's nothing left.
+ *
+ * @return false if there's no connection.
+ */
+bool SymmetricTcpClient::ensure_connected(){
+	if(!this->connected && !(this->connected = this->reconnect())){
+		return false;
+	}
+	Util::set_non_blocking(this->fd);
+	return true;
+}
+
+/**
+ * @brief Gives up on a response after milliseconds, closing the connection so a late reply can't be taken
+ * for the next one. Negative waits forever, the default.
+ */
+void SymmetricTcpClient::set_timeout(int milliseconds){
+	this->timeout = milliseconds;
+}
+
+/**
+ * @brief Waits up to a second for the response to go on, or until the timeout.
+ *
+ * @return true if the timeout has passed, after which the connection is closed.
+ */
+bool SymmetricTcpClient::wait_readable(std::chrono::steady_clock::time_point started){
+	int wait = 1000;
+	if(this->timeout >= 0){
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+		if(elapsed >= this->timeout){
+			DEBUG("SymmetricTcpClient timed out " << this->fd)
+			this->close_client();
+			return true;
+		}
+		wait = std::min(wait, this->timeout - static_cast<int>(elapsed));
+	}
+	struct pollfd readable = {this->fd, POLLIN, 0};
+	poll(&readable, 1, wait);
+	return false;
+}
+
+/**
+ * See SymmetricEncryptor::set_compression
+ */
+void SymmetricTcpClient::set_compression(bool enabled, size_t threshold, const std::string& dictionary){
+	this->encryptor.set_compression(enabled, threshold, dictionary);
 }
 
 std::string SymmetricTcpClient::communicate(std::string request){
@@ -27,31 +86,100 @@ std::string SymmetricTcpClient::communicate(const char* request, size_t length){
 	std::string response_string = std::string();
 	ssize_t len;
 	
-	if(!this->connected){
-		if(!(this->connected = this->reconnect())){
-			return response_string;
-		}
+	if(!this->ensure_connected()){
+		return response_string;
 	}
 	
-	DEBUG("WRITES:" << this->writes)
-	if(this->encryptor.send(this->fd, request, length, &this->writes)){
+	DEBUG("WRITES:" << this->session->writes)
+	if(this->encryptor.send(this->fd, request, length, this->session.get())){
 		this->close_client();
 		ERROR("SymmetricTcpClient send")
 		return this->communicate(request, length);
 	}
 
+	auto started = std::chrono::steady_clock::now();
 	std::function<ssize_t(int, const char*, size_t)> set_response_callback = [&](int, const char* data, size_t data_length)->ssize_t{
-		response_string = std::string(data);
+		response_string = std::string(data, data_length);
 		return static_cast<ssize_t>(data_length);
 	};
 
 	do{
-		if((len = this->encryptor.recv(this->fd, response, PACKET_LIMIT, set_response_callback, &this->reads)) < 0){
+		if((len = this->encryptor.recv(this->fd, response, PACKET_LIMIT, set_response_callback, this->session.get())) < 0){
 			this->close_client();
 			DEBUG("SymmetricTcpClient recv " << this->fd)
 			return response_string;
 		}
+		if(len == 0){
+			// Wait for the rest of the response rather than spinning on the socket.
+			if(this->wait_readable(started)){
+				return response_string;
+			}
+		}
 	}while(len == 0);
 
 	return response_string;
 }
+
+/**
+ * @brief Sends every request at once and waits for all the replies, which the server may answer in any order.
+ *
+ * The requests go out in one encrypted frame, each with an id its reply is matched by,
+ * so N requests cost one round trip. A legacy server is asked one request at a time.
+ *
+ * @return The replies in the order of requests; empty for any that didn't come back.
+ */
+std::vector<std::string> SymmetricTcpClient::communicate(const std::vector<std::string>& requests){
+	std::vector<std::string> responses(requests.size());
+	char response[PACKET_LIMIT];
+	ssize_t len;
+
+	if(this->legacy){
+		for(size_t i = 0; i < requests.size(); ++i){
+			responses[i] = this->communicate(requests[i]);
+		}
+		return responses;
+	}
+
+	if(!this->ensure_connected()){
+		return responses;
+	}
+
+	std::vector<SymmetricMessage> batch;
+	std::unordered_map<uint32_t /* id */, size_t /* index */> pending;
+	for(size_t i = 0; i < requests.size(); ++i){
+		if(this->next_request_id == 0){
+			this->next_request_id = 1;
+		}
+		batch.push_back(SymmetricMessage(requests[i].c_str(), requests[i].length(), this->next_request_id));
+		pending[this->next_request_id++] = i;
+	}
+
+	if(this->encryptor.send_batch(this->fd, batch, this->session.get())){
+		this->close_client();
+		ERROR("SymmetricTcpClient send batch")
+		return responses;
+	}
+
+	auto started = std::chrono::steady_clock::now();
+	std::function<ssize_t(int, const char*, size_t)> set_response_callback = [&](int, const char* data, size_t data_length)->ssize_t{
+		auto found = pending.find(SymmetricEncryptor::request_id());
+		if(found != pending.end()){
+			responses[found->second] = std::string(data, data_length);
+			pending.erase(found);
+		}
+		return static_cast<ssize_t>(data_length);
+	};
+
+	while(!pending.empty()){
+		if((len = this->encryptor.recv(this->fd, response, PACKET_LIMIT, set_response_callback, this->session.get())) < 0){
+			this->close_client();
+			DEBUG("SymmetricTcpClient recv batch " << this->fd)
+			return responses;
+		}
+		if(!pending.empty() && this->wait_readable(started)){
+			return responses;
+		}
+	}
+
+	return responses;
+}
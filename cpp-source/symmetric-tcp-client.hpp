@@ -1,23 +1,34 @@
 #pragma once
 
 #include <mutex>
+#include <chrono>
+#include <memory>
+#include <vector>
 
 #include "simple-tcp-client.hpp"
 #include "symmetric-encryptor.hpp"
 
 class SymmetricTcpClient : public SimpleTcpClient{
 public:
-	SymmetricTcpClient(std::string hostname, uint16_t port, std::string keyfile);
-	SymmetricTcpClient(const char* ip_address, uint16_t port, std::string keyfile);
+	SymmetricTcpClient(std::string hostname, uint16_t port, std::string keyfile, bool legacy_server = false);
+	SymmetricTcpClient(const char* ip_address, uint16_t port, std::string keyfile, bool legacy_server = false);
 
 	std::string communicate(std::string request);
 	std::string communicate(const char* request, size_t length);
+	std::vector<std::string> communicate(const std::vector<std::string>& requests);
+
+	void set_compression(bool enabled, size_t threshold = 256, const std::string& dictionary = std::string());
+	void set_timeout(int milliseconds);
 private:
 	SymmetricEncryptor encryptor;
-	int writes;
-	int reads;
+	std::unique_ptr<SymmetricSession> session;
+	bool legacy;
+	uint32_t next_request_id;
+	int timeout;
 	
 	std::mutex comm_mutex;
 	
 	void close_client();
+	bool ensure_connected();
+	bool wait_readable(std::chrono::steady_clock::time_point started);
 };
@@ -100,8 +100,7 @@ void EventClient::run(std::function<ssize_t(int, const char*, size_t)> new_on_re
 					// Still connecting, cooooool.
 				}else{
 					connection->state = CONNECTED;
-					this->read_counter[connection->fd] = 0;
-					this->write_counter[connection->fd] = 0;
+					this->connected(connection->fd);
 					if(this->on_connect != nullptr){
 						if(this->on_connect(connection->fd)){
 							this->close_client(connection);
@@ -126,6 +125,14 @@ void EventClient::run(std::function<ssize_t(int, const char*, size_t)> new_on_re
 	}
 }
 
+/**
+ * @brief Starts the counters of a connection that was just made over.
+ */
+void EventClient::connected(int fd){
+	this->read_counter[fd] = 0;
+	this->write_counter[fd] = 0;
+}
+
 bool EventClient::send(int fd, const char* data, size_t data_length){
 	if(write(fd, data, data_length) < 0){
 		perror("write");
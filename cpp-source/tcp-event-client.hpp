@@ -38,6 +38,7 @@ protected:
 	std::function<ssize_t(int, const char*, ssize_t)> on_read;
 
 	void close_client(Connection* conn);
+	virtual void connected(int fd);
 	virtual bool send(int fd, const char* data, size_t data_length);
 	virtual ssize_t recv(int fd, char* data, size_t data_length);
 public:
@@ -1,3 +1,7 @@
+#include <algorithm>
+
+#include <sys/sendfile.h>
+
 #include "util.hpp"
 #include "stack.hpp"
 #include "tcp-server.hpp"
@@ -28,6 +32,7 @@ EpollServer::EpollServer(uint16_t new_port, size_t new_max_connections, std::str
 :name(new_name), port(new_port),
 max_connections(new_max_connections),
 timeout(10),
+handshake_timeout(10),
 sockaddr_length(sizeof(this->accept_client)),
 running(true){
 	if((this->server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
@@ -86,23 +91,324 @@ bool EpollServer::send(int fd, std::string data){
  * @param data the data to write.
  * @param data_length the length of the data that *should* be written.
  *
+ * Whatever the client can't take right now is queued and written when epoll says it's writable,
+ * so a slow client never holds up the calling thread. Data already queued for fd goes first.
+ *
  * @return true on error.
  */
 bool EpollServer::send(int fd, const char* data, size_t data_length){
 	ssize_t len;
-	//PRINT("SEND ON TCP")
+	std::shared_ptr<OutboundQueue> queue = this->find_outbound(fd);
+	if(queue == nullptr){
+		// Not a client, e.g. the broadcast pipe.
+		if((len = write(fd, data, data_length)) < 0){
+			perror("write");
+			ERROR("send")
+			return true;
+		}
+		if(static_cast<size_t>(len) != data_length){
+			ERROR("NOT ALL THE DATA WAS SENT TO " << fd)
+		}
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(queue->mutex);
+	if(queue->closed){
+		return true;
+	}
+	if(queue->pending()){
+		if(queue->data.length() - queue->offset + data_length > OUTBOUND_LIMIT){
+			ERROR(this->name << ": " << fd << " is too far behind, dropping it")
+			// The owning thread sees the hang up and closes it.
+			shutdown(fd, SHUT_RDWR);
+			return true;
+		}
+		queue->data.append(data, data_length);
+	}else if(data_length > 0){
+		if((len = this->write_some(fd, data, data_length)) < 0){
+			ERROR("send")
+			return true;
+		}
+		if(static_cast<size_t>(len) < data_length){
+			queue->data.assign(data + len, data_length - static_cast<size_t>(len));
+			queue->offset = 0;
+			struct epoll_event event;
+			memset(&event, 0, sizeof(event));
+			event.events = EVENTS | EPOLLOUT;
+			event.data.fd = fd;
+			if(epoll_ctl(queue->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0){
+				perror("epoll_ctl mod send");
+			}
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Writes as much as the fd takes without blocking.
+ *
+ * @return The number of bytes written, 0 if the fd can't take any now, or negative on error.
+ */
+ssize_t EpollServer::write_some(int fd, const char* data, size_t data_length){
+	ssize_t len;
 	if((len = write(fd, data, data_length)) < 0){
+		if(errno == EWOULDBLOCK || errno == EAGAIN){
+			return 0;
+		}
 		perror("write");
-		ERROR("send")
+		return -1;
+	}
+	return len;
+}
+
+/**
+ * @brief Sends length bytes of file_fd, from offset, to fd.
+ *
+ * As much as the socket takes goes straight from the page cache (sendfile, or kTLS with TlsEpollServer).
+ * If the client can't take it all now, the rest is sent on from where it stopped when the client is writable,
+ * so a file never has to fit in memory. Without zero copy it is read in a packet at a time as it goes.
+ * The caller may close file_fd as soon as this returns.
+ *
+ * @return true on error.
+ */
+bool EpollServer::send_file(int fd, int file_fd, off_t offset, size_t length){
+	ssize_t len;
+	std::shared_ptr<OutboundQueue> queue = this->find_outbound(fd);
+	if(queue == nullptr){
+		// Not a client, e.g. the broadcast pipe.
+		char buffer[PACKET_LIMIT];
+		while(length > 0){
+			if((len = pread(file_fd, buffer, std::min(length, sizeof(buffer)), offset)) <= 0){
+				perror("pread send_file");
+				return true;
+			}
+			if(EpollServer::send(fd, buffer, static_cast<size_t>(len))){
+				return true;
+			}
+			offset += len;
+			length -= static_cast<size_t>(len);
+		}
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(queue->mutex);
+	if(queue->closed){
 		return true;
 	}
-	if(static_cast<size_t>(len) != data_length){
-		ERROR("NOT ALL THE DATA WAS SENT TO " << fd)
+	if(length == 0){
+		return false;
+	}
+	bool was_pending = queue->pending();
+	if(!was_pending){
+		queue->data.clear();
+		queue->offset = 0;
+	}
+
+	OutboundFile file;
+	if((file.fd = dup(file_fd)) < 0){
+		perror("dup send_file");
+		return true;
+	}
+	file.offset = offset;
+	file.remaining = length;
+	file.after = queue->data.length();
+	file.chunk_offset = 0;
+	queue->files.push_back(file);
+
+	// Queued data has to go first, so an idle connection is the only one written to here.
+	if(!was_pending && this->flush_queue(fd, queue.get())){
+		ERROR("send_file")
+		return true;
+	}
+	if(queue->pending()){
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EVENTS | EPOLLOUT;
+		event.data.fd = fd;
+		if(epoll_ctl(queue->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0){
+			perror("epoll_ctl mod send_file");
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Sends part of a file without copying it through user space, as far as the fd takes it without blocking.
+ *
+ * @return The number of bytes sent, 0 if the fd can't take any now, WRITE_FILE_UNSUPPORTED if zero copy
+ * isn't available, or -1 on error.
+ */
+ssize_t EpollServer::write_file(int fd, int file_fd, off_t offset, size_t length){
+	ssize_t len;
+	if((len = sendfile(fd, file_fd, &offset, length)) < 0){
+		if(errno == EWOULDBLOCK || errno == EAGAIN){
+			return 0;
+		}else if(errno == EINVAL || errno == ENOSYS){
+			return WRITE_FILE_UNSUPPORTED;
+		}
+		perror("sendfile");
+		return -1;
+	}
+	return len;
+}
+
+/// @return The client's outbound queue, or nullptr if fd isn't a connected client.
+std::shared_ptr<OutboundQueue> EpollServer::find_outbound(int fd){
+	std::lock_guard<std::mutex> lock(this->outbound_mutex);
+	auto found = this->outbound.find(fd);
+	if(found == this->outbound.end()){
+		return nullptr;
+	}
+	return found->second;
+}
+
+/**
+ * @brief Writes out what's queued for fd, as far as it will take it, and calls on_drained if that was all of it.
+ *
+ * @return true on error.
+ */
+bool EpollServer::flush(int fd){
+	std::shared_ptr<OutboundQueue> queue = this->find_outbound(fd);
+	if(queue == nullptr){
+		return false;
+	}
+	bool drained;
+	{
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		bool was_pending = queue->pending();
+		if(this->flush_queue(fd, queue.get())){
+			return true;
+		}
+		drained = was_pending && !queue->pending();
+	}
+	if(drained && this->on_drained != nullptr){
+		this->on_drained(fd);
 	}
-	this->write_counter[fd]++;
 	return false;
 }
 
+/**
+ * @brief How far behind a client is, so whoever produces for it can hold off; see EpollServer::on_drained.
+ *
+ * @return The number of bytes queued for fd and not yet written, files included.
+ */
+size_t EpollServer::queued(int fd){
+	std::shared_ptr<OutboundQueue> queue = this->find_outbound(fd);
+	if(queue == nullptr){
+		return 0;
+	}
+	std::lock_guard<std::mutex> lock(queue->mutex);
+	size_t total = queue->data.length() - queue->offset;
+	for(const OutboundFile& file : queue->files){
+		total += file.remaining + file.chunk.length() - file.chunk_offset;
+	}
+	return total;
+}
+
+/**
+ * @brief EpollServer::flush with the queue's mutex already held. Data and files go out in the order they were queued.
+ *
+ * @return true on error.
+ */
+bool EpollServer::flush_queue(int fd, OutboundQueue* queue){
+	ssize_t len;
+	while(true){
+		size_t end = queue->files.empty() ? queue->data.length() : queue->files.front().after;
+		while(queue->offset < end){
+			if((len = this->write_some(fd, queue->data.data() + queue->offset, end - queue->offset)) < 0){
+				return true;
+			}else if(len == 0){
+				return false;
+			}
+			queue->offset += static_cast<size_t>(len);
+		}
+		if(queue->files.empty()){
+			queue->data.clear();
+			queue->offset = 0;
+			return false;
+		}
+
+		// Everything before the file is out.
+		queue->data.erase(0, queue->offset);
+		for(auto& file : queue->files){
+			file.after -= queue->offset;
+		}
+		queue->offset = 0;
+
+		OutboundFile& file = queue->files.front();
+		if(this->flush_file(fd, &file)){
+			return true;
+		}else if(file.remaining > 0 || file.chunk_offset < file.chunk.length()){
+			return false;
+		}
+		if(close(file.fd) < 0){
+			perror("close send_file");
+		}
+		queue->files.pop_front();
+	}
+}
+
+/**
+ * @brief Sends on a queued file, as far as fd takes it.
+ *
+ * @return true on error.
+ */
+bool EpollServer::flush_file(int fd, OutboundFile* file){
+	ssize_t len;
+	char buffer[PACKET_LIMIT];
+	while(true){
+		if(file->chunk_offset < file->chunk.length()){
+			if((len = this->write_some(fd, file->chunk.data() + file->chunk_offset, file->chunk.length() - file->chunk_offset)) < 0){
+				return true;
+			}else if(len == 0){
+				return false;
+			}
+			file->chunk_offset += static_cast<size_t>(len);
+			continue;
+		}
+		if(file->remaining == 0){
+			return false;
+		}
+		if((len = this->write_file(fd, file->fd, file->offset, file->remaining)) == WRITE_FILE_UNSUPPORTED){
+			if((len = pread(file->fd, buffer, std::min(file->remaining, sizeof(buffer)), file->offset)) <= 0){
+				perror("pread send_file");
+				return true;
+			}
+			file->chunk.assign(buffer, static_cast<size_t>(len));
+			file->chunk_offset = 0;
+		}else if(len < 0){
+			return true;
+		}else if(len == 0){
+			return false;
+		}
+		file->offset += len;
+		file->remaining -= static_cast<size_t>(len);
+	}
+}
+
+/**
+ * @brief Rearms a client's one-shot epoll event, asking for EPOLLOUT too if it has something to write.
+ *
+ * This is done under the queue's mutex, so a send from another thread can't slip between the check and the rearm.
+ */
+void EpollServer::rearm(int fd){
+	std::shared_ptr<OutboundQueue> queue = this->find_outbound(fd);
+	if(queue == nullptr){
+		return;
+	}
+	std::lock_guard<std::mutex> lock(queue->mutex);
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EVENTS;
+	if(queue->pending() || queue->read_wants_write){
+		event.events |= EPOLLOUT;
+	}
+	event.data.fd = fd;
+	if(epoll_ctl(queue->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0){
+		perror("epoll_ctl mod client");
+	}
+}
+
 /**
  * @brief The base receive function that @see EpollServer::run_thread calls.
  *
@@ -145,6 +451,18 @@ bool EpollServer::accept_continuation(int*){
 	return false;
 }
 
+/**
+ * @brief Advances a connection's handshake; @see EpollServer::run_thread calls this on accept and then on
+ * every readiness event until it is done, failed, or the handshake timeout passes.
+ *
+ * on_connect is only called once this returns HANDSHAKE_DONE. Plain TCP has no handshake.
+ *
+ * @return HANDSHAKE_WANT_READ or HANDSHAKE_WANT_WRITE to be called again when the fd is ready for that.
+ */
+HandshakeResult EpollServer::handshake(int){
+	return HANDSHAKE_DONE;
+}
+
 /**
  * Protects any messing with the broadcasting pipe.
  * Use this to broadcast some data to all connected fds!
@@ -160,6 +478,11 @@ void EpollServer::set_timeout(time_t seconds){
 	this->timeout = seconds;
 }
 
+/// Sets how long a new connection has to finish its handshake, before the regular timeout takes over.
+void EpollServer::set_handshake_timeout(time_t seconds){
+	this->handshake_timeout = seconds;
+}
+
 /**
  * @brief The essential threaded epoll server function. Starts via std::thread.
  *
@@ -167,6 +490,7 @@ void EpollServer::set_timeout(time_t seconds){
  */
 void EpollServer::run_thread(unsigned int thread_id){
 	int num_fds, num_timeouts, new_fd, the_fd, timer_fd, i, j, epoll_fd, timeout_epoll_fd;
+	HandshakeResult handshake_result;
 	unsigned long num_connections = 0;
 	char packet[PACKET_LIMIT + 32];
 	ssize_t len;
@@ -184,6 +508,8 @@ void EpollServer::run_thread(unsigned int thread_id){
 	
 	std::unordered_map<int /* timer fd */, int /* client fd */> timer_to_client_map;
 	std::unordered_map<int /* client fd */, int /* timer fd */> client_to_timer_map;
+	// Clients that are connected, but haven't finished their handshake (so on_connect hasn't been called).
+	std::unordered_set<int /* client fd */> handshaking;
 	char client_detail[INET_ADDRSTRLEN];
 
 	// Broken pipes will make SSL_write (or any write, actually) return with an error instead of interrupting the program.
@@ -227,11 +553,19 @@ void EpollServer::run_thread(unsigned int thread_id){
 	}
 
 	std::function<void(int*)> close_client_callback = [&](int* fd){
+		std::shared_ptr<OutboundQueue> queue = this->find_outbound(*fd);
+		if(queue != nullptr){
+			std::lock_guard<std::mutex> lock(queue->mutex);
+			queue->closed = true;
+			this->outbound_mutex.lock();
+			this->outbound.erase(*fd);
+			this->outbound_mutex.unlock();
+		}
 		if(close(*fd) < 0){
 			perror("close");
 		}
 		DEBUG(this->name << ": " << *fd << " done on thread " << thread_id)
-		if(this->on_disconnect != nullptr){
+		if(handshaking.erase(*fd) == 0 && this->on_disconnect != nullptr){
 			this->on_disconnect(*fd);
 		}
 		if(num_connections >= this->max_connections){
@@ -264,12 +598,12 @@ void EpollServer::run_thread(unsigned int thread_id){
 				PRINT("EPOLLERR: " << the_fd)
 			}else if(client_events[i].events & EPOLLHUP){
 				PRINT("EPOLLHUP: " << the_fd)
-			}else if(!(client_events[i].events & EPOLLIN)){
+			}else if(!(client_events[i].events & (EPOLLIN | EPOLLOUT))){
 				PRINT("EPOLLIN: " << the_fd)
 			}
 			if((client_events[i].events & EPOLLERR) || 
 			(client_events[i].events & EPOLLHUP) || 
-			(!(client_events[i].events & EPOLLIN))){
+			(!(client_events[i].events & (EPOLLIN | EPOLLOUT)))){
 				timer_fd = client_to_timer_map[the_fd];
 				client_to_timer_map.erase(the_fd);
 				timer_to_client_map.erase(timer_fd);
@@ -320,6 +654,9 @@ void EpollServer::run_thread(unsigned int thread_id){
 				}
 				packet[len] = 0;
 				for(auto iter = client_to_timer_map.begin(); iter != client_to_timer_map.end(); ++iter){
+					if(handshaking.count(iter->first)){
+						continue;
+					}
 					// Throw away send errors?
 					if(this->send(iter->first, packet, static_cast<size_t>(len))){
 						ERROR("failed to broadcast to " << iter->first)
@@ -359,7 +696,15 @@ void EpollServer::run_thread(unsigned int thread_id){
 								});
 								break;
 							}
-							new_event.events = EVENTS;
+							// Whatever part of the handshake the client already sent is done here, the rest on epoll events.
+							if((handshake_result = this->handshake(new_fd)) == HANDSHAKE_FAILED){
+								DEBUG("handshake failed " << new_fd)
+								this->close_client(&new_fd, [&](int* fd){
+									close(*fd);
+								});
+								continue;
+							}
+							new_event.events = handshake_result == HANDSHAKE_WANT_WRITE ? WRITE_EVENTS : EVENTS;
 							new_event.data.fd = new_fd;
 							if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &new_event) < 0){
 								perror("epoll_ctl add client");
@@ -368,12 +713,15 @@ void EpollServer::run_thread(unsigned int thread_id){
 								});
 								break;
 							}else{
+								this->outbound_mutex.lock();
+								this->outbound[new_fd] = std::make_shared<OutboundQueue>(epoll_fd);
+								this->outbound_mutex.unlock();
 								if((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0){
 									perror("timerfd_create");
 								}else{
 									timer_spec.it_interval.tv_sec = 0;
 									timer_spec.it_interval.tv_nsec = 0;
-									timer_spec.it_value.tv_sec = this->timeout;
+									timer_spec.it_value.tv_sec = handshake_result == HANDSHAKE_DONE ? this->timeout : this->handshake_timeout;
 									timer_spec.it_value.tv_nsec = 0;
 									if(timerfd_settime(timer_fd, 0, &timer_spec, 0) < 0){
 										perror("timerfd_settime");
@@ -397,9 +745,9 @@ void EpollServer::run_thread(unsigned int thread_id){
 									perror("setsockopt new connection timeout");
 								}
 								*/
-								this->read_counter[new_fd] = 0;
-								this->write_counter[new_fd] = 0;
-								if(this->on_connect != nullptr){
+								if(handshake_result != HANDSHAKE_DONE){
+									handshaking.insert(new_fd);
+								}else if(this->on_connect != nullptr){
 									this->on_connect(new_fd);
 								}
 								num_connections++;
@@ -419,6 +767,39 @@ void EpollServer::run_thread(unsigned int thread_id){
 					}
 					this->accept_mutex.unlock();
 				}
+			}else if(handshaking.count(the_fd)){
+				// The handshake timer keeps running until the handshake is done, so a slow client can't stretch it.
+				timer_fd = client_to_timer_map[the_fd];
+				if((handshake_result = this->handshake(the_fd)) == HANDSHAKE_FAILED){
+					timer_to_client_map.erase(timer_fd);
+					client_to_timer_map.erase(the_fd);
+					PRINT(this->name << ": " << the_fd << " and timer " << timer_fd << " handshake failed.")
+					if(close(timer_fd) < 0){
+						perror("close timer_fd");
+					}
+					this->close_client(&the_fd, close_client_callback);
+					continue;
+				}
+				if(handshake_result == HANDSHAKE_DONE){
+					handshaking.erase(the_fd);
+					timer_spec.it_interval.tv_sec = 0;
+					timer_spec.it_interval.tv_nsec = 0;
+					timer_spec.it_value.tv_sec = this->timeout;
+					timer_spec.it_value.tv_nsec = 0;
+					if(timerfd_settime(timer_fd, 0, &timer_spec, 0) < 0){
+						perror("timerfd_settime handshake done");
+					}
+					if(this->on_connect != nullptr){
+						this->on_connect(the_fd);
+					}
+					this->rearm(the_fd);
+					continue;
+				}
+				client_events[i].events = handshake_result == HANDSHAKE_WANT_WRITE ? WRITE_EVENTS : EVENTS;
+				client_events[i].data.fd = the_fd;
+				if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, the_fd, &client_events[i]) < 0){
+					perror("epoll_ctl mod handshake");
+				}
 			}else{
 				timer_fd = client_to_timer_map[the_fd];
 				timer_spec.it_interval.tv_sec = 0;
@@ -428,7 +809,8 @@ void EpollServer::run_thread(unsigned int thread_id){
 				if(timerfd_settime(timer_fd, 0, &timer_spec, 0) < 0){
 					PRINT("timerfd_setting error " << the_fd << " and timer " << timer_fd)
 					perror("timerfd_settime reset");
-				}else if((len = this->recv(the_fd, packet, PACKET_LIMIT)) < 0){
+				}else if(this->flush(the_fd) || (len = this->recv(the_fd, packet, PACKET_LIMIT)) < 0){
+					// Queued data goes out first; the read runs on writable events too, for TLS reads that wanted to write.
 					timer_to_client_map.erase(timer_fd);
 					client_to_timer_map.erase(the_fd);
 					PRINT(this->name << ": " << the_fd << " and timer " << timer_fd << " done.")
@@ -436,16 +818,9 @@ void EpollServer::run_thread(unsigned int thread_id){
 						perror("close timer_fd");
 					}
 					this->close_client(&the_fd, close_client_callback);
-				}else if(len >= PACKET_LIMIT){
-					ERROR("OVERFLOAT more to read uh oh!")
-				}else if(len == 0){
-					PRINT("RECEIVE ZERO?!")
 				}else{
-					client_events[i].events = EVENTS;
-					client_events[i].data.fd = the_fd;
-					if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, the_fd, &client_events[i]) < 0){
-						perror("epoll_ctl mod client");
-					}
+					// Zero is fine: nothing to read yet, or only a write was waiting.
+					this->rearm(the_fd);
 				}
 			}
 		}
@@ -1,26 +1,94 @@
 #pragma once
 
 #include <stack>
+#include <deque>
 #include <vector>
 #include <mutex>
 #include <ctime>
 #include <functional>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <atomic>
+#include <memory>
+#include <string>
 
 #include "signal.h"
 #include "sys/timerfd.h"
 #include "sys/epoll.h"
 #include <arpa/inet.h>
+#include <unistd.h>
 
 #define EVENTS EPOLLIN | EPOLLET | EPOLLONESHOT | EPOLLERR | EPOLLHUP
+#define WRITE_EVENTS EPOLLOUT | EPOLLET | EPOLLONESHOT | EPOLLERR | EPOLLHUP
+
+// A client that falls this far behind is dropped rather than buffered forever.
+#define OUTBOUND_LIMIT 16777216
+
+// What EpollServer::write_file returns when it can't send the file zero copy at all.
+#define WRITE_FILE_UNSUPPORTED -2
+
+/// What EpollServer::handshake needs before it can go on.
+enum HandshakeResult{
+	HANDSHAKE_DONE,
+	HANDSHAKE_WANT_READ,
+	HANDSHAKE_WANT_WRITE,
+	HANDSHAKE_FAILED
+};
 
 struct ClientDetails{
 	std::chrono::milliseconds ms_at_recv;
 	std::chrono::milliseconds ms_diff_at_last;
 };
 
+/**
+ * @brief The rest of a file being sent to a client, sent on from where it stopped when the client is writable.
+ */
+struct OutboundFile{
+	// Its own (dup'd) fd, closed once the file is sent or the client is gone.
+	int fd;
+	off_t offset;
+	size_t remaining;
+	// Where in OutboundQueue::data the file goes; data queued before it is sent first.
+	size_t after;
+	// A piece read in (when zero copy isn't available) that the client hasn't taken all of yet.
+	std::string chunk;
+	size_t chunk_offset;
+};
+
+/**
+ * @brief Whatever a client couldn't take yet, written out when epoll says its fd is writable.
+ *
+ * The mutex also serializes everything else done to the connection's stream (e.g. SSL_read against SSL_write),
+ * since any thread may send to any client.
+ */
+struct OutboundQueue{
+	std::mutex mutex;
+	std::string data;
+	size_t offset;
+	std::deque<OutboundFile> files;
+	int epoll_fd;
+	bool closed;
+	// A TLS read that needs the socket writable before it can go on.
+	bool read_wants_write;
+
+	OutboundQueue(int new_epoll_fd)
+	:offset(0),
+	epoll_fd(new_epoll_fd),
+	closed(false),
+	read_wants_write(false){}
+
+	~OutboundQueue(){
+		for(auto& file : this->files){
+			close(file.fd);
+		}
+	}
+
+	bool pending() const{
+		return this->offset < this->data.length() || !this->files.empty();
+	}
+};
+
 class EpollServer{
 protected:
 	std::string name;
@@ -28,12 +96,11 @@ protected:
 	unsigned long max_connections;
 	unsigned int num_threads;
 	time_t timeout;
+	time_t handshake_timeout;
 	socklen_t sockaddr_length;
 
 	std::vector<std::thread*> threads;
 
-	std::unordered_map<int /* fd */, int> read_counter;
-	std::unordered_map<int /* fd */, int> write_counter;
 	//uint64_t represents millseconds since last recv
 	std::mutex client_time_mutex;
 
@@ -44,8 +111,20 @@ protected:
 	// Read from 0, write to 1.
 	int broadcast_pipe[2];
 
+	std::mutex outbound_mutex;
+	std::unordered_map<int /* client fd */, std::shared_ptr<OutboundQueue>> outbound;
+
+	std::shared_ptr<OutboundQueue> find_outbound(int fd);
+	virtual ssize_t write_some(int fd, const char* data, size_t data_length);
+	virtual ssize_t write_file(int fd, int file_fd, off_t offset, size_t length);
+	bool flush(int fd);
+	bool flush_queue(int fd, OutboundQueue* queue);
+	bool flush_file(int fd, OutboundFile* file);
+	void rearm(int fd);
+
 	virtual void run_thread(unsigned int id);
 	virtual bool accept_continuation(int* new_client_fd);
+	virtual HandshakeResult handshake(int fd);
 	virtual void close_client(int* fd, std::function<void(int*)> callback);
 public:
 	EpollServer(uint16_t port, size_t new_max_connections, std::string new_name = "EpollServer");
@@ -55,16 +134,19 @@ public:
 	std::atomic<bool> running;
 
 	void set_timeout(time_t seconds);
+	void set_handshake_timeout(time_t seconds);
 	int broadcast_fd();
 
 	bool send(int fd, std::string data);
 	virtual bool send(int fd, const char* data, size_t data_length);
+	bool send_file(int fd, int file_fd, off_t offset, size_t length);
+	size_t queued(int fd);
 	virtual ssize_t recv(int fd, char* data, size_t data_length);
 	virtual ssize_t recv(int fd, char* data, size_t data_length, std::function<ssize_t(int, char*, size_t)> callback);
 
 	virtual void run(bool returning = false, unsigned int new_num_threads = std::thread::hardware_concurrency());
 
-	/// When a connection has successfully been made, this is called.
+	/// When a connection has successfully been made (and its handshake, if any, is done), this is called.
 	std::function<void(int)> on_connect;
 
 	/// When a connection has read some data, this is called.
@@ -72,4 +154,7 @@ public:
 
 	/// When a previously successfully made connection has been closed, this is called.
 	std::function<void(int)> on_disconnect;
+
+	/// When everything queued for a connection has been written, this is called, from the thread that wrote it.
+	std::function<void(int)> on_drained;
 };
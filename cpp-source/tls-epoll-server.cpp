@@ -1,8 +1,19 @@
 #include <csignal>
+#include <climits>
+#include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <vector>
+
+#include <sys/inotify.h>
 
 #include "util.hpp"
 #include "tls-epoll-server.hpp"
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	#include "openssl/core_names.h"
+#endif
+
 /**
  * /implements EpollServer
  *
@@ -15,48 +26,110 @@
  *
  * Disables OpenSSL SSLv3.
  * Users the cipher list: "ECDH+AESGCM:DH+AESGCM:ECDH+AES256:DH+AES256:ECDH+AES128:DH+AES:RSA+AESGCM:RSA+AES:!aNULL:!MD5:!DSS"
+ *
+ * Sessions resume from a sharded cache (by session id) or from tickets sealed with rotating keys,
+ * so returning clients skip the key exchange. See TlsEpollServer::session_stats.
+ *
+ * certificate is the default; more hostnames can be served with TlsEpollServer::add_certificate.
  */
 TlsEpollServer::TlsEpollServer(std::string certificate, std::string private_key, uint16_t port, size_t max_connections, std::string name)
-:EpollServer(port, max_connections, name){
+:EpollServer(port, max_connections, name),
+session_timeout(3600),
+ktls(false),
+watching(false),
+certificate_watcher(0),
+full_handshakes(0),
+resumed_handshakes(0),
+cache_hits(0),
+cache_misses(0),
+ticket_hits(0),
+ticket_misses(0){
 	SSL_library_init();
 	SSL_load_error_strings();
 
-	if((this->ctx = SSL_CTX_new(SSLv23_server_method())) == 0){
-		ERR_print_errors_fp(stdout);
-		throw std::runtime_error(this->name + "SSL_CTX_new");
+	this->default_certificate.certificate = certificate;
+	this->default_certificate.private_key = private_key;
+	if((this->default_certificate.ctx = this->create_context(certificate, private_key)) == 0){
+		throw std::runtime_error(this->name + " SSL context for " + certificate);
 	}
-	
-	if(SSL_CTX_set_ecdh_auto(this->ctx, 1) == 0){
+}
+
+/**
+ * @brief Builds a context serving one certificate, with everything else shared by the server.
+ *
+ * @return 0 if the certificate or key couldn't be loaded (or don't match).
+ */
+SSL_CTX* TlsEpollServer::create_context(const std::string& certificate, const std::string& private_key){
+	SSL_CTX* ctx;
+	if((ctx = SSL_CTX_new(SSLv23_server_method())) == 0){
 		ERR_print_errors_fp(stdout);
-		throw std::runtime_error(this->name + "SSL_CTX_set_ecdh_auto");
+		ERROR(this->name << " SSL_CTX_new")
+		return 0;
 	}
 
-	if(SSL_CTX_use_certificate_chain_file(this->ctx, certificate.c_str()) != 1){
+	if(SSL_CTX_use_certificate_chain_file(ctx, certificate.c_str()) != 1){
 		ERR_print_errors_fp(stdout);
-		throw std::runtime_error(this->name + "SSL_CTX_use_certificate_file");
+		ERROR(this->name << " SSL_CTX_use_certificate_file " << certificate)
+		SSL_CTX_free(ctx);
+		return 0;
 	}
 
-	if(SSL_CTX_use_PrivateKey_file(this->ctx, private_key.c_str(), SSL_FILETYPE_PEM) != 1){
+	if(SSL_CTX_use_PrivateKey_file(ctx, private_key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+	SSL_CTX_check_private_key(ctx) != 1){
 		ERR_print_errors_fp(stdout);
-		throw std::runtime_error(this->name + "SSL_CTX_use_PrivateKey_file");
+		ERROR(this->name << " SSL_CTX_use_PrivateKey_file " << private_key)
+		SSL_CTX_free(ctx);
+		return 0;
 	}
 
 	// Hell yeah, use ECDH.
-	if(!SSL_CTX_set_ecdh_auto(this->ctx, 1)){
+	if(!SSL_CTX_set_ecdh_auto(ctx, 1)){
 		ERR_print_errors_fp(stdout);
-		throw std::runtime_error(this->name + "SSL_CTX_set_ecdh_auto");
+		ERROR(this->name << " SSL_CTX_set_ecdh_auto")
+		SSL_CTX_free(ctx);
+		return 0;
 	}
 
 	// SSLv3 is insecure via poodles.
-	SSL_CTX_set_options(this->ctx, SSL_OP_NO_TLSv1 | SSL_OP_NO_SSLv3 | SSL_OP_NO_SSLv2);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1 | SSL_OP_NO_SSLv3 | SSL_OP_NO_SSLv2);
 
 	// "Good" cipher list from the interweb.
-	if(!SSL_CTX_set_cipher_list(this->ctx, "ECDH+AESGCM:DH+AESGCM:ECDH+AES256:DH+AES256:ECDH+AES128:DH+AES:RSA+AESGCM:RSA+AES:!aNULL:!MD5:!DSS")){
+	if(!SSL_CTX_set_cipher_list(ctx, "ECDH+AESGCM:DH+AESGCM:ECDH+AES256:DH+AES256:ECDH+AES128:DH+AES:RSA+AESGCM:RSA+AES:!aNULL:!MD5:!DSS")){
 		ERR_print_errors_fp(stdout);
-		throw std::runtime_error(this->name + "SSL_CTX_set_cipher_list");
+		ERROR(this->name << " SSL_CTX_set_cipher_list")
+		SSL_CTX_free(ctx);
+		return 0;
 	}
 
-//	PRINT("SSL Mode: " << SSL_CTX_set_mode(this->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE))
+	SSL_CTX_set_app_data(ctx, this);
+	SSL_CTX_set_tlsext_servername_callback(ctx, TlsEpollServer::select_certificate);
+	// Every context shares one session id context, cache and ticket keys, so sessions resume across hosts and reloads.
+	SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char*>(this->name.c_str()),
+		static_cast<unsigned int>(std::min(this->name.length(), static_cast<size_t>(SSL_MAX_SID_CTX_LENGTH))));
+	// OpenSSL's own cache is a single locked list; ours is sharded.
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_sess_set_new_cb(ctx, TlsEpollServer::new_session);
+	SSL_CTX_sess_set_get_cb(ctx, TlsEpollServer::get_session);
+	SSL_CTX_sess_set_remove_cb(ctx, TlsEpollServer::remove_session);
+	SSL_CTX_set_timeout(ctx, this->session_timeout);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, TlsEpollServer::ticket_key);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, TlsEpollServer::ticket_key);
+#endif
+#if defined(TLS1_3_VERSION)
+	// TLS 1.3 resumes with PSKs carried in these tickets; one per handshake is all a browser uses.
+	SSL_CTX_set_num_tickets(ctx, 1);
+#endif
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	if(this->ktls){
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	}
+#endif
+
+	// Unsent data stays in the outbound queue, which may reallocate before SSL_write is retried.
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	return ctx;
 }
 
 /**
@@ -66,7 +139,19 @@ TlsEpollServer::TlsEpollServer(std::string certificate, std::string private_key,
  */
 void TlsEpollServer::close_client(int* fd, std::function<void(int*)> callback){
 	DEBUG(this->name << ": SSL_free on " << *fd)
-	SSL_free(this->client_ssl[*fd]);
+	std::shared_ptr<OutboundQueue> queue = this->find_outbound(*fd);
+	if(queue != nullptr){
+		// Another thread may be half way through an SSL_write.
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		queue->closed = true;
+		// A close_notify (best effort, never waited on); OpenSSL forgets the session of a connection that ends without one.
+		if(SSL_is_init_finished(this->client_ssl[*fd])){
+			SSL_shutdown(this->client_ssl[*fd]);
+		}
+		SSL_free(this->client_ssl[*fd]);
+	}else{
+		SSL_free(this->client_ssl[*fd]);
+	}
 	//delete this->client_ssl[*fd];
 	this->client_ssl.erase(*fd);
 	callback(fd);
@@ -75,53 +160,64 @@ void TlsEpollServer::close_client(int* fd, std::function<void(int*)> callback){
 /**
  * @brief Uses SSL_write instead of a regular write.
  *
- * See EpollServer::send
- */ 
-bool TlsEpollServer::send(int fd, const char* data, size_t data_length){
-	int len = 0, err = SSL_ERROR_WANT_WRITE;
-	std::chrono::milliseconds send_start = std::chrono::duration_cast<std::chrono::milliseconds>(
-		std::chrono::system_clock::now().time_since_epoch());
-	std::chrono::milliseconds diff = std::chrono::milliseconds(0);
-	std::chrono::milliseconds timeout = std::chrono::milliseconds(10000);
-
-	while(err == SSL_ERROR_WANT_WRITE){
-		if(diff > timeout){
-			PRINT("SSL_write timeout...")
-			return true;
-		}
-
-		len = SSL_write(this->client_ssl[fd], data, static_cast<int>(data_length));
-		err = SSL_get_error(this->client_ssl[fd], len);
-
-		diff = std::chrono::duration_cast<std::chrono::milliseconds>(
-			std::chrono::system_clock::now().time_since_epoch()) - send_start;
+ * See EpollServer::write_some
+ *
+ * Partial writes are enabled, and the queue may move between retries, so this never has to wait on the client.
+ * A write that wants to read (renegotiation) is retried on the next event, since EPOLLIN is always armed.
+ */
+ssize_t TlsEpollServer::write_some(int fd, const char* data, size_t data_length){
+	SSL* ssl = this->client_ssl[fd];
+	int len = SSL_write(ssl, data, static_cast<int>(std::min(data_length, static_cast<size_t>(INT_MAX))));
+	if(len > 0){
+		return len;
 	}
+	int err = SSL_get_error(ssl, len);
 	switch(err){
-		case SSL_ERROR_NONE:
-			break;
 		case SSL_ERROR_WANT_WRITE:
-			PRINT("WANT WRITE " << fd)
-			// Nothing to read, nonblocking mode.
+		case SSL_ERROR_WANT_READ:
 			return 0;
 		case SSL_ERROR_ZERO_RETURN:
 			ERROR("server write zero " << fd)
-			return true;
+			return -1;
 		case SSL_ERROR_SYSCALL:
 			PRINT(this->name << ": write SSL_ERROR_SYSCALL")
 			ERR_print_errors_fp(stdout);
-			return true;
+			return -1;
 		default:
 			ERROR("other SSL_write " << err << " from " << fd)
 			ERR_print_errors_fp(stdout);
-			return true;
+			return -1;
 	}
-	
-	//DEBUG("SSL_write took milliseconds: " << diff.count())
-	if(len != static_cast<int>(data_length)){
-		ERROR("Invalid number of bytes written...")
+}
+
+/**
+ * @brief With kTLS sending, SSL_sendfile hands the file to the kernel, which encrypts it on the way out.
+ *
+ * See EpollServer::write_file
+ *
+ * Without it (not enabled, no tls kernel module, or a cipher the kernel can't do) nothing is sent,
+ * and EpollServer::send_file falls back to SSL_write.
+ */
+ssize_t TlsEpollServer::write_file(int fd, int file_fd, off_t offset, size_t length){
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL* ssl = this->client_ssl[fd];
+	if(!BIO_get_ktls_send(SSL_get_wbio(ssl))){
+		return WRITE_FILE_UNSUPPORTED;
 	}
-	this->write_counter[fd]++;
-	return false;
+	ossl_ssize_t len = SSL_sendfile(ssl, file_fd, offset, length, 0);
+	if(len > 0){
+		return len;
+	}
+	int err = SSL_get_error(ssl, static_cast<int>(len));
+	if(err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ){
+		return 0;
+	}
+	ERROR("SSL_sendfile " << err << " from " << fd)
+	ERR_print_errors_fp(stdout);
+	return -1;
+#else
+	return WRITE_FILE_UNSUPPORTED;
+#endif
 }
 
 ssize_t TlsEpollServer::recv(int fd, char* data, size_t data_length){
@@ -133,50 +229,55 @@ ssize_t TlsEpollServer::recv(int fd, char* data, size_t data_length){
  * Google chrome requires this funtionality to piece together POST headers and body.
  *
  * See EpollServer::recv
+ *
+ * Reads until OpenSSL has nothing more, calling back once per read, so records OpenSSL already holds
+ * (which epoll can't know about) aren't left behind. At most TLS_READ_BATCH reads come off the socket per call;
+ * anything left there wakes epoll again when the client is rearmed.
+ *
+ * @return The last callback's result, 0 if there was nothing to read, or negative on error.
  */
 ssize_t TlsEpollServer::recv(int fd, char* data, size_t data_length,
 std::function<ssize_t(int, char*, size_t)> callback){
-	int len = 0, err = SSL_ERROR_WANT_READ;
-	std::chrono::milliseconds recv_start = std::chrono::duration_cast<std::chrono::milliseconds>(
-		std::chrono::system_clock::now().time_since_epoch());
-	std::chrono::milliseconds diff = std::chrono::milliseconds(0);
-	std::chrono::milliseconds timeout = std::chrono::milliseconds(10000);
+	int len, err;
+	ssize_t result = 0;
+	SSL* ssl = this->client_ssl[fd];
+	std::shared_ptr<OutboundQueue> queue = this->find_outbound(fd);
 
-	while(err == SSL_ERROR_WANT_READ){
-		if(diff > timeout){
-			PRINT("SSL_read timeout...")
-			return true;
+	for(int reads = 0; reads < TLS_READ_BATCH || SSL_pending(ssl) > 0; ++reads){
+		if(queue != nullptr){
+			std::lock_guard<std::mutex> lock(queue->mutex);
+			len = SSL_read(ssl, data, static_cast<int>(data_length));
+			err = SSL_get_error(ssl, len);
+			queue->read_wants_write = err == SSL_ERROR_WANT_WRITE;
+		}else{
+			len = SSL_read(ssl, data, static_cast<int>(data_length));
+			err = SSL_get_error(ssl, len);
+		}
+		switch(err){
+			case SSL_ERROR_NONE:
+				break;
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				// Nothing (more) to read, nonblocking mode.
+				return result;
+			case SSL_ERROR_ZERO_RETURN:
+				ERROR("server read zero " << fd)
+				return -2;
+			case SSL_ERROR_SYSCALL:
+				PRINT(this->name << ": read SSL_ERROR_SYSCALL")
+				ERR_print_errors_fp(stdout);
+				return -3;
+			default:
+				ERROR("other SSL_read " << err << " from " << fd)
+				ERR_print_errors_fp(stdout);
+				return -1;
+		}
+		data[len] = 0;
+		if((result = callback(fd, data, static_cast<size_t>(len))) < 0){
+			return result;
 		}
-
-		len = SSL_read(this->client_ssl[fd], data, static_cast<int>(data_length));
-		err = SSL_get_error(this->client_ssl[fd], len);
-
-		diff = std::chrono::duration_cast<std::chrono::milliseconds>(
-			std::chrono::system_clock::now().time_since_epoch()) - recv_start;
-	}
-	switch(err){
-		case SSL_ERROR_NONE:
-			break;
-		case SSL_ERROR_WANT_READ:
-			PRINT("WANT READ " << fd)
-			// Nothing to read, nonblocking mode.
-			return 0;
-		case SSL_ERROR_ZERO_RETURN:
-			ERROR("server read zero " << fd)
-			return -2;
-		case SSL_ERROR_SYSCALL:
-			PRINT(this->name << ": read SSL_ERROR_SYSCALL")
-			ERR_print_errors_fp(stdout);
-			return -3;
-		default:
-			ERROR("other SSL_read " << err << " from " << fd)
-			ERR_print_errors_fp(stdout);
-			return -1;
 	}
-	
-	//DEBUG("SSL_read took milliseconds: " << diff.count())
-	data[len] = 0;
-	return callback(fd, data, static_cast<size_t>(len));
+	return result;
 }
 
 /**
@@ -184,11 +285,14 @@ std::function<ssize_t(int, char*, size_t)> callback){
  *
  * See EpollServer::accept_continuation
  *
- * Completed the SSL handshake as defined by the SSL context.
- * If the SSL handshake fails, the the client did *not* successfully connect and is dumped.
+ * Only sets up the SSL object; the handshake itself is driven by epoll through TlsEpollServer::handshake,
+ * so a slow client never holds up the accepting thread.
  */
 bool TlsEpollServer::accept_continuation(int* new_client_fd){
-	if((this->client_ssl[*new_client_fd] = SSL_new(this->ctx)) == 0){
+	this->contexts_mutex.lock();
+	this->client_ssl[*new_client_fd] = SSL_new(this->default_certificate.ctx);
+	this->contexts_mutex.unlock();
+	if(this->client_ssl[*new_client_fd] == 0){
 		ERROR("SSL_new " << *new_client_fd)
 		ERR_print_errors_fp(stdout);
 		return true;
@@ -199,45 +303,412 @@ bool TlsEpollServer::accept_continuation(int* new_client_fd){
 		ERR_print_errors_fp(stdout);
 		return true;
 	}
+	SSL_set_accept_state(this->client_ssl[*new_client_fd]);
 	
 	DEBUG(this->name << ": SSL_new, done on " << *new_client_fd)
 
-	int res, err = SSL_ERROR_WANT_READ;
-	std::chrono::milliseconds accept_start = std::chrono::duration_cast<std::chrono::milliseconds>(
-		std::chrono::system_clock::now().time_since_epoch());
-	std::chrono::milliseconds diff = std::chrono::milliseconds(0);
-	std::chrono::milliseconds timeout = std::chrono::milliseconds(10000);
+	return false;
+}
+
+/**
+ * @brief Runs SSL_accept as far as the data that has arrived allows.
+ *
+ * See EpollServer::handshake
+ *
+ * If the SSL handshake fails, or doesn't finish within the handshake timeout,
+ * the client did *not* successfully connect and is dumped.
+ */
+HandshakeResult TlsEpollServer::handshake(int fd){
+	SSL* ssl = this->client_ssl[fd];
+	int err = SSL_get_error(ssl, SSL_accept(ssl));
+	switch(err){
+		case SSL_ERROR_NONE:
+			DEBUG(this->name << ": SSL_accept done on " << fd << (SSL_session_reused(ssl) ? " (resumed)" : "") <<
+				(BIO_get_ktls_send(SSL_get_wbio(ssl)) ? " (kTLS send)" : "") <<
+				(BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? " (kTLS receive)" : ""))
+			if(SSL_session_reused(ssl)){
+				this->resumed_handshakes++;
+			}else{
+				this->full_handshakes++;
+			}
+			return HANDSHAKE_DONE;
+		case SSL_ERROR_WANT_READ:
+			return HANDSHAKE_WANT_READ;
+		case SSL_ERROR_WANT_WRITE:
+			return HANDSHAKE_WANT_WRITE;
+		default:
+			ERROR("SSL_accept " << fd << ';' << err)
+			ERR_print_errors_fp(stdout);
+			return HANDSHAKE_FAILED;
+	}
+}
+
+/**
+ * @param capacity How many sessions the id cache holds, across all shards.
+ * @param timeout_seconds How long a session (cached or in a ticket) can be resumed for.
+ */
+void TlsEpollServer::set_session_cache(size_t capacity, long timeout_seconds){
+	this->session_cache.set_capacity(capacity);
+	std::lock_guard<std::mutex> lock(this->contexts_mutex);
+	this->session_timeout = timeout_seconds;
+	SSL_CTX_set_timeout(this->default_certificate.ctx, timeout_seconds);
+	for(auto it = this->host_certificates.begin(); it != this->host_certificates.end(); ++it){
+		SSL_CTX_set_timeout(it->second.ctx, timeout_seconds);
+	}
+}
+
+/// Sets how often the ticket key rotates. Tickets stay valid for a few rotations.
+void TlsEpollServer::set_ticket_key_lifetime(time_t seconds){
+	this->ticket_keys.set_lifetime(seconds);
+}
+
+/**
+ * @brief Lets OpenSSL hand record encryption to the kernel (TLS_TX, and TLS_RX where it can) once a handshake is done.
+ *
+ * Connections whose kernel or cipher can't do kTLS quietly stay in user space; see TlsEpollServer::ktls_send.
+ * Only new connections are affected.
+ *
+ * @return false if this OpenSSL was built without kTLS.
+ */
+bool TlsEpollServer::set_ktls(bool enabled){
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	std::lock_guard<std::mutex> lock(this->contexts_mutex);
+	this->ktls = enabled;
+	std::vector<SSL_CTX*> contexts(1, this->default_certificate.ctx);
+	for(auto it = this->host_certificates.begin(); it != this->host_certificates.end(); ++it){
+		contexts.push_back(it->second.ctx);
+	}
+	for(SSL_CTX* ctx : contexts){
+		if(enabled){
+			SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+		}else{
+			SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+		}
+	}
+	return true;
+#else
+	return !enabled;
+#endif
+}
+
+/// @return true if fd's records are being encrypted by the kernel.
+bool TlsEpollServer::ktls_send(int fd){
+	std::shared_ptr<OutboundQueue> queue = this->find_outbound(fd);
+	if(queue == nullptr){
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(queue->mutex);
+	return !queue->closed && BIO_get_ktls_send(SSL_get_wbio(this->client_ssl[fd]));
+}
+
+TlsSessionStats TlsEpollServer::session_stats(){
+	TlsSessionStats stats;
+	stats.full_handshakes = this->full_handshakes;
+	stats.resumed_handshakes = this->resumed_handshakes;
+	stats.cache_hits = this->cache_hits;
+	stats.cache_misses = this->cache_misses;
+	stats.ticket_hits = this->ticket_hits;
+	stats.ticket_misses = this->ticket_misses;
+	stats.ticket_key_rotations = this->ticket_keys.rotation_count();
+	return stats;
+}
+
+TlsEpollServer* TlsEpollServer::from_ssl(SSL* ssl){
+	return static_cast<TlsEpollServer*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+}
+
+/**
+ * @brief OpenSSL's new session callback; keeps OpenSSL's reference.
+ *
+ * TLS 1.3 sessions live entirely in their tickets, so there's nothing to cache.
+ */
+int TlsEpollServer::new_session(SSL* ssl, SSL_SESSION* session){
+	if(SSL_version(ssl) >= TLS1_3_VERSION && !(SSL_get_options(ssl) & SSL_OP_NO_TICKET)){
+		return 0;
+	}
+	from_ssl(ssl)->session_cache.add(session);
+	return 1;
+}
+
+SSL_SESSION* TlsEpollServer::get_session(SSL* ssl, const unsigned char* id, int id_length, int* copy){
+	TlsEpollServer* server = from_ssl(ssl);
+	SSL_SESSION* session = server->session_cache.get(id, static_cast<unsigned int>(id_length));
+	if(session == 0){
+		server->cache_misses++;
+	}else{
+		server->cache_hits++;
+	}
+	// The cache already took a reference for OpenSSL.
+	*copy = 0;
+	return session;
+}
+
+void TlsEpollServer::remove_session(SSL_CTX* ctx, SSL_SESSION* session){
+	static_cast<TlsEpollServer*>(SSL_CTX_get_app_data(ctx))->session_cache.remove(session);
+}
+
+/**
+ * @brief OpenSSL's session ticket callback; seals new tickets with the current key and opens old ones with whichever
+ * key they name.
+ *
+ * @return 1 to use the ticket, 2 to use it and issue a fresh one, 0 to fall back to a full handshake, negative on error.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int TlsEpollServer::ticket_key(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt){
+#else
+int TlsEpollServer::ticket_key(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher, HMAC_CTX* mac, int encrypt){
+#endif
+	TlsEpollServer* server = from_ssl(ssl);
+	TlsTicketKey key;
+	int result = 1;
+
+	if(encrypt){
+		if(!server->ticket_keys.current(&key) || RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1){
+			return -1;
+		}
+		std::memcpy(key_name, key.name, sizeof(key.name));
+		if(EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), 0, key.aes_key, iv) != 1){
+			result = -1;
+		}
+	}else{
+		if((result = server->ticket_keys.find(key_name, &key)) == 0){
+			server->ticket_misses++;
+			return 0;
+		}
+		server->ticket_hits++;
+		if(EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), 0, key.aes_key, iv) != 1){
+			result = -1;
+		}
+	}
 
-	while(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE){
-		if(diff > timeout){
-			PRINT("SSL_accept timeout...")
-			return true;
+	if(result > 0){
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		OSSL_PARAM parameters[2];
+		parameters[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0);
+		parameters[1] = OSSL_PARAM_construct_end();
+		if(EVP_MAC_init(mac, key.hmac_key, sizeof(key.hmac_key), parameters) != 1){
+			result = -1;
 		}
+#else
+		if(HMAC_Init_ex(mac, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), 0) != 1){
+			result = -1;
+		}
+#endif
+	}
+	OPENSSL_cleanse(&key, sizeof(key));
+	return result;
+}
 
-		res = SSL_accept(this->client_ssl[*new_client_fd]);
-		err = SSL_get_error(this->client_ssl[*new_client_fd], res);
+/**
+ * @brief Serves another hostname from this server, picked by the client's SNI.
+ *
+ * @param hostname e.g. "example.com", or "*.example.com" for any single-label subdomain.
+ *
+ * Clients that send no name, or a name without a certificate, get the default one.
+ *
+ * @return false if the certificate or key couldn't be loaded.
+ */
+bool TlsEpollServer::add_certificate(std::string hostname, std::string certificate, std::string private_key){
+	SSL_CTX* ctx;
+	if((ctx = this->create_context(certificate, private_key)) == 0){
+		return false;
+	}
+	std::transform(hostname.begin(), hostname.end(), hostname.begin(), ::tolower);
 
-		diff = std::chrono::duration_cast<std::chrono::milliseconds>(
-			std::chrono::system_clock::now().time_since_epoch()) - accept_start;
+	std::lock_guard<std::mutex> lock(this->contexts_mutex);
+	TlsCertificate& entry = this->host_certificates[hostname];
+	if(entry.ctx != 0){
+		SSL_CTX_free(entry.ctx);
 	}
-	if(err != SSL_ERROR_NONE){
-		ERROR("SSL_accept " << *new_client_fd << ';' << err)
-		return true;
+	entry.certificate = certificate;
+	entry.private_key = private_key;
+	entry.ctx = ctx;
+	return true;
+}
+
+/**
+ * @brief OpenSSL's servername callback; moves the connection onto the context for the name the client asked for.
+ */
+int TlsEpollServer::select_certificate(SSL* ssl, int*, void*){
+	const char* servername = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+	if(servername == 0){
+		return SSL_TLSEXT_ERR_OK;
 	}
-	DEBUG(this->name << ": SSL_accept took milliseconds: " << diff.count())
+	std::string hostname(servername);
+	std::transform(hostname.begin(), hostname.end(), hostname.begin(), ::tolower);
 
-	return false;
+	TlsEpollServer* server = from_ssl(ssl);
+	std::lock_guard<std::mutex> lock(server->contexts_mutex);
+	auto found = server->host_certificates.find(hostname);
+	if(found == server->host_certificates.end() && hostname.find('.') != std::string::npos){
+		found = server->host_certificates.find('*' + hostname.substr(hostname.find('.')));
+	}
+	// SSL_set_SSL_CTX takes its own reference, so a reload can free the old context under a live connection.
+	if(found != server->host_certificates.end() && found->second.ctx != SSL_get_SSL_CTX(ssl)){
+		SSL_set_SSL_CTX(ssl, found->second.ctx);
+	}
+	return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * @brief Reloads every certificate and key from disk, swapping each context in whole.
+ *
+ * Connections keep the context they started with, and sessions stay resumable. A certificate that fails to load
+ * (e.g. the key was replaced but the chain not yet) keeps serving its old context.
+ *
+ * @return false if any certificate failed to reload.
+ */
+bool TlsEpollServer::reload_certificates(){
+	std::vector<std::pair<std::string, TlsCertificate>> entries;
+	this->contexts_mutex.lock();
+	entries.push_back(std::make_pair(std::string(), this->default_certificate));
+	for(auto it = this->host_certificates.begin(); it != this->host_certificates.end(); ++it){
+		entries.push_back(*it);
+	}
+	this->contexts_mutex.unlock();
+
+	bool reloaded = true;
+	for(auto& entry : entries){
+		// Contexts are built outside the lock; handshakes only wait for the swap.
+		if((entry.second.ctx = this->create_context(entry.second.certificate, entry.second.private_key)) == 0){
+			ERROR(this->name << ": keeping the old certificate for " << (entry.first.empty() ? "the default" : entry.first))
+			reloaded = false;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(this->contexts_mutex);
+	for(auto& entry : entries){
+		if(entry.second.ctx == 0){
+			continue;
+		}
+		TlsCertificate* current = entry.first.empty() ? &this->default_certificate :
+			this->host_certificates.count(entry.first) ? &this->host_certificates[entry.first] : 0;
+		if(current == 0 || current->certificate != entry.second.certificate){
+			// Replaced or removed while this was loading.
+			SSL_CTX_free(entry.second.ctx);
+			continue;
+		}
+		SSL_CTX_free(current->ctx);
+		current->ctx = entry.second.ctx;
+	}
+	PRINT(this->name << ": certificates reloaded" << (reloaded ? "." : ", with errors."))
+	return reloaded;
+}
+
+static std::atomic<unsigned long> hangups(0);
+
+static void on_hangup(int){
+	hangups++;
+}
+
+static std::string directory_of(const std::string& path){
+	size_t slash = path.find_last_of('/');
+	return slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+}
+
+static std::string file_of(const std::string& path){
+	size_t slash = path.find_last_of('/');
+	return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+/**
+ * @brief Starts a thread that calls TlsEpollServer::reload_certificates on SIGHUP,
+ * or when a certificate or key file is written or moved into place.
+ */
+void TlsEpollServer::watch_certificates(){
+	if(this->certificate_watcher != 0){
+		return;
+	}
+	signal(SIGHUP, on_hangup);
+	this->watching = true;
+	this->certificate_watcher = new std::thread(&TlsEpollServer::run_certificate_watcher, this);
+}
+
+void TlsEpollServer::run_certificate_watcher(){
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	std::unordered_map<std::string /* directory */, int /* watch */> watches;
+	std::vector<std::string> files;
+	unsigned long seen_hangups = hangups;
+	ssize_t len;
+	int inotify_fd;
+
+	if((inotify_fd = inotify_init1(IN_NONBLOCK)) < 0){
+		perror("inotify_init1");
+	}
+
+	while(this->watching){
+		// Certificates may have been added since last time around.
+		files.clear();
+		this->contexts_mutex.lock();
+		files.push_back(this->default_certificate.certificate);
+		files.push_back(this->default_certificate.private_key);
+		for(auto it = this->host_certificates.begin(); it != this->host_certificates.end(); ++it){
+			files.push_back(it->second.certificate);
+			files.push_back(it->second.private_key);
+		}
+		this->contexts_mutex.unlock();
+		for(const std::string& file : files){
+			std::string directory = directory_of(file);
+			if(inotify_fd >= 0 && !watches.count(directory)){
+				if((watches[directory] = inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)) < 0){
+					perror("inotify_add_watch");
+				}
+			}
+		}
+
+		bool changed = false;
+		struct pollfd watch_poll;
+		watch_poll.fd = inotify_fd;
+		watch_poll.events = POLLIN;
+		if(poll(&watch_poll, inotify_fd >= 0 ? 1 : 0, 1000) > 0){
+			while((len = read(inotify_fd, events, sizeof(events))) > 0){
+				for(char* event_data = events; event_data < events + len;){
+					struct inotify_event* event = reinterpret_cast<struct inotify_event*>(event_data);
+					for(const std::string& file : files){
+						if(event->len > 0 && file_of(file) == event->name){
+							changed = true;
+						}
+					}
+					event_data += sizeof(struct inotify_event) + event->len;
+				}
+			}
+			if(changed){
+				// The certificate and key are usually copied one after the other; let both land.
+				std::this_thread::sleep_for(std::chrono::milliseconds(500));
+				while(read(inotify_fd, events, sizeof(events)) > 0);
+			}
+		}
+		if(hangups != seen_hangups){
+			seen_hangups = hangups;
+			changed = true;
+		}
+		if(changed){
+			this->reload_certificates();
+		}
+	}
+
+	if(inotify_fd >= 0 && close(inotify_fd) < 0){
+		perror("close inotify");
+	}
 }
 
 /// Simply cleans up the OpenSSL context.
 TlsEpollServer::~TlsEpollServer(){
 	DEBUG("DELETE TLS EPOLL SERVER")
+	if(this->certificate_watcher != 0){
+		this->watching = false;
+		this->certificate_watcher->join();
+		delete this->certificate_watcher;
+	}
 	for(auto iter = this->client_ssl.begin(); iter != this->client_ssl.end(); ++iter){
 		SSL_free(iter->second);
 		//delete iter->second;
 		//this->client_ssl.erase(iter->first);
 	}
-	SSL_CTX_free(this->ctx);
+	SSL_CTX_free(this->default_certificate.ctx);
+	for(auto it = this->host_certificates.begin(); it != this->host_certificates.end(); ++it){
+		SSL_CTX_free(it->second.ctx);
+	}
 	ERR_remove_state(0);
 	ERR_free_strings();
 	EVP_cleanup();
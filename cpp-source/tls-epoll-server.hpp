@@ -1,24 +1,86 @@
 #pragma once
 
 #include <unordered_map>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <mutex>
 
 #include "openssl/ssl.h"
 #include "openssl/err.h"
+#include "openssl/hmac.h"
+#include "openssl/rand.h"
 
 #include "tcp-server.hpp"
+#include "tls-session.hpp"
+
+// Socket reads per TlsEpollServer::recv, so one busy client can't keep a thread to itself.
+#define TLS_READ_BATCH 16
+
+/// A certificate served by a TlsEpollServer, and the files it's reloaded from.
+struct TlsCertificate{
+	std::string certificate;
+	std::string private_key;
+	SSL_CTX* ctx;
+
+	TlsCertificate():ctx(0){}
+};
 
 class TlsEpollServer : public EpollServer{
 private:
-	SSL_CTX* ctx;
+	std::mutex contexts_mutex;
+	TlsCertificate default_certificate;
+	std::unordered_map<std::string /* hostname */, TlsCertificate> host_certificates;
+	long session_timeout;
+	bool ktls;
+
+	std::atomic<bool> watching;
+	std::thread* certificate_watcher;
+
 	std::unordered_map<int, SSL*> client_ssl;
 
+	TlsSessionCache session_cache;
+	TlsTicketKeys ticket_keys;
+	std::atomic<unsigned long> full_handshakes;
+	std::atomic<unsigned long> resumed_handshakes;
+	std::atomic<unsigned long> cache_hits;
+	std::atomic<unsigned long> cache_misses;
+	std::atomic<unsigned long> ticket_hits;
+	std::atomic<unsigned long> ticket_misses;
+
+	SSL_CTX* create_context(const std::string& certificate, const std::string& private_key);
+	void run_certificate_watcher();
+
+	static TlsEpollServer* from_ssl(SSL* ssl);
+	static int select_certificate(SSL* ssl, int* alert, void* arg);
+	static int new_session(SSL* ssl, SSL_SESSION* session);
+	static SSL_SESSION* get_session(SSL* ssl, const unsigned char* id, int id_length, int* copy);
+	static void remove_session(SSL_CTX* ctx, SSL_SESSION* session);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	static int ticket_key(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt);
+#else
+	static int ticket_key(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher, HMAC_CTX* mac, int encrypt);
+#endif
+protected:
 	void close_client(int* fd, std::function<void(int*)> callback);
+	ssize_t write_some(int fd, const char* data, size_t data_length);
+	ssize_t write_file(int fd, int file_fd, off_t offset, size_t length);
 public:
 	TlsEpollServer(std::string certificate, std::string private_key, uint16_t port, size_t max_connections, std::string new_name = "TlsEpollServer");
 	~TlsEpollServer();
 
+	bool add_certificate(std::string hostname, std::string certificate, std::string private_key);
+	bool reload_certificates();
+	void watch_certificates();
+
+	void set_session_cache(size_t capacity, long timeout_seconds);
+	void set_ticket_key_lifetime(time_t seconds);
+	bool set_ktls(bool enabled);
+	bool ktls_send(int fd);
+	TlsSessionStats session_stats();
+
 	virtual bool accept_continuation(int* new_client_fd);
-	virtual bool send(int fd, const char* data, size_t data_length);
+	virtual HandshakeResult handshake(int fd);
 	virtual ssize_t recv(int fd, char* data, size_t data_length);
 	virtual ssize_t recv(int fd, char* data, size_t data_length, std::function<ssize_t(int, char*, size_t)> callback);
 };
@@ -0,0 +1,174 @@
+#include <functional>
+#include <cstring>
+
+#include "openssl/rand.h"
+#include "openssl/crypto.h"
+
+#include "tls-session.hpp"
+
+TlsSessionCache::TlsSessionCache(size_t capacity)
+:shard_capacity(capacity / TLS_SESSION_SHARDS + 1){}
+
+TlsSessionCache::~TlsSessionCache(){
+	for(Shard& s : this->shards){
+		for(auto it = s.sessions.begin(); it != s.sessions.end(); ++it){
+			SSL_SESSION_free(it->second);
+		}
+	}
+}
+
+void TlsSessionCache::set_capacity(size_t capacity){
+	this->shard_capacity = capacity / TLS_SESSION_SHARDS + 1;
+}
+
+TlsSessionCache::Shard& TlsSessionCache::shard(const std::string& id){
+	return this->shards[std::hash<std::string>()(id) % TLS_SESSION_SHARDS];
+}
+
+/**
+ * @brief Takes over the caller's reference to session.
+ */
+void TlsSessionCache::add(SSL_SESSION* session){
+	unsigned int id_length;
+	const unsigned char* id_data = SSL_SESSION_get_id(session, &id_length);
+	std::string id(reinterpret_cast<const char*>(id_data), id_length);
+	Shard& s = this->shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto found = s.sessions.find(id);
+	if(found != s.sessions.end()){
+		SSL_SESSION_free(found->second);
+		found->second = session;
+		return;
+	}
+	while(s.sessions.size() >= this->shard_capacity && !s.order.empty()){
+		// Ids already removed are just skipped.
+		found = s.sessions.find(s.order.front());
+		if(found != s.sessions.end()){
+			SSL_SESSION_free(found->second);
+			s.sessions.erase(found);
+		}
+		s.order.pop_front();
+	}
+	if(s.order.size() > 2 * this->shard_capacity){
+		std::deque<std::string> order;
+		for(const std::string& old : s.order){
+			if(s.sessions.count(old)){
+				order.push_back(old);
+			}
+		}
+		s.order.swap(order);
+	}
+	s.sessions[id] = session;
+	s.order.push_back(id);
+}
+
+/**
+ * @return A new reference to the session, or 0 if it isn't cached or has expired.
+ */
+SSL_SESSION* TlsSessionCache::get(const unsigned char* id_data, unsigned int id_length){
+	std::string id(reinterpret_cast<const char*>(id_data), id_length);
+	Shard& s = this->shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto found = s.sessions.find(id);
+	if(found == s.sessions.end()){
+		return 0;
+	}
+	SSL_SESSION* session = found->second;
+	if(static_cast<time_t>(SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session)) < time(0)){
+		SSL_SESSION_free(session);
+		s.sessions.erase(found);
+		return 0;
+	}
+	SSL_SESSION_up_ref(session);
+	return session;
+}
+
+void TlsSessionCache::remove(SSL_SESSION* session){
+	unsigned int id_length;
+	const unsigned char* id_data = SSL_SESSION_get_id(session, &id_length);
+	std::string id(reinterpret_cast<const char*>(id_data), id_length);
+	Shard& s = this->shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto found = s.sessions.find(id);
+	if(found != s.sessions.end()){
+		SSL_SESSION_free(found->second);
+		s.sessions.erase(found);
+	}
+}
+
+TlsTicketKeys::TlsTicketKeys(time_t new_lifetime, size_t new_kept)
+:lifetime(new_lifetime), kept(new_kept), rotations(0){}
+
+TlsTicketKeys::~TlsTicketKeys(){
+	for(TlsTicketKey& key : this->keys){
+		OPENSSL_cleanse(&key, sizeof(key));
+	}
+}
+
+void TlsTicketKeys::set_lifetime(time_t seconds){
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->lifetime = seconds;
+}
+
+unsigned long TlsTicketKeys::rotation_count(){
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->rotations;
+}
+
+/**
+ * @brief Puts a fresh random key in front and forgets the oldest past kept. Call with the mutex held.
+ *
+ * @return false if there was no randomness to be had.
+ */
+bool TlsTicketKeys::rotate(){
+	TlsTicketKey key;
+	if(RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+	RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+	RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1){
+		return false;
+	}
+	key.created = time(0);
+	this->keys.push_front(key);
+	OPENSSL_cleanse(&key, sizeof(key));
+	while(this->keys.size() > this->kept){
+		OPENSSL_cleanse(&this->keys.back(), sizeof(TlsTicketKey));
+		this->keys.pop_back();
+	}
+	this->rotations++;
+	return true;
+}
+
+/**
+ * @brief The key to seal a new ticket with, rotated first if it's too old.
+ */
+bool TlsTicketKeys::current(TlsTicketKey* key){
+	std::lock_guard<std::mutex> lock(this->mutex);
+	if((this->keys.empty() || this->keys.front().created + this->lifetime <= time(0)) && !this->rotate()){
+		return false;
+	}
+	*key = this->keys.front();
+	return true;
+}
+
+/**
+ * @brief Finds the key a ticket was sealed with.
+ *
+ * @return 0 if it's unknown (or expired), 1 if it's the current key, 2 if the ticket should be reissued.
+ */
+int TlsTicketKeys::find(const unsigned char* name, TlsTicketKey* key){
+	std::lock_guard<std::mutex> lock(this->mutex);
+	for(size_t i = 0; i < this->keys.size(); ++i){
+		if(std::memcmp(this->keys[i].name, name, sizeof(key->name)) == 0){
+			// Keys past kept * lifetime would already be gone, but a lifetime may have been shortened since.
+			if(this->keys[i].created + static_cast<time_t>(this->kept) * this->lifetime <= time(0)){
+				return 0;
+			}
+			*key = this->keys[i];
+			return i == 0 && this->keys[i].created + this->lifetime > time(0) ? 1 : 2;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <ctime>
+
+#include "openssl/ssl.h"
+
+#define TLS_SESSION_SHARDS 16
+
+/// Resumption counters for a TlsEpollServer.
+struct TlsSessionStats{
+	unsigned long full_handshakes;
+	unsigned long resumed_handshakes;
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+	unsigned long ticket_hits;
+	unsigned long ticket_misses;
+	unsigned long ticket_key_rotations;
+};
+
+/**
+ * @brief A server-side TLS session cache, split into shards so handshakes on different threads rarely share a lock.
+ *
+ * OpenSSL's own cache is one list behind one lock. Each shard here holds capacity / TLS_SESSION_SHARDS sessions
+ * and evicts the oldest first; expired sessions are dropped when they're looked up.
+ */
+class TlsSessionCache{
+private:
+	struct Shard{
+		std::mutex mutex;
+		std::unordered_map<std::string /* session id */, SSL_SESSION*> sessions;
+		std::deque<std::string> order;
+	};
+
+	Shard shards[TLS_SESSION_SHARDS];
+	std::atomic<size_t> shard_capacity;
+
+	Shard& shard(const std::string& id);
+public:
+	TlsSessionCache(size_t capacity = 20480);
+	~TlsSessionCache();
+
+	void set_capacity(size_t capacity);
+
+	void add(SSL_SESSION* session);
+	SSL_SESSION* get(const unsigned char* id, unsigned int id_length);
+	void remove(SSL_SESSION* session);
+};
+
+struct TlsTicketKey{
+	unsigned char name[16];
+	unsigned char aes_key[32];
+	unsigned char hmac_key[32];
+	time_t created;
+};
+
+/**
+ * @brief The keys session tickets are sealed with.
+ *
+ * New tickets always use the newest key, which is replaced every lifetime seconds. The previous keys are kept
+ * so tickets issued shortly before a rotation still resume (and are reissued under the new key).
+ */
+class TlsTicketKeys{
+private:
+	std::mutex mutex;
+	std::deque<TlsTicketKey> keys;
+	time_t lifetime;
+	size_t kept;
+	unsigned long rotations;
+
+	bool rotate();
+public:
+	TlsTicketKeys(time_t new_lifetime = 43200, size_t new_kept = 3);
+	~TlsTicketKeys();
+
+	void set_lifetime(time_t seconds);
+	unsigned long rotation_count();
+
+	bool current(TlsTicketKey* key);
+	int find(const unsigned char* name, TlsTicketKey* key);
+};
@@ -5,12 +5,19 @@
 
 TlsWebsocketServer::TlsWebsocketServer(std::string certificate, std::string private_key, uint16_t port, size_t max_connections)
 :TlsEpollServer(certificate, private_key, port, max_connections, "TlsWebsocketServer"),
-websocket(this){}
+websocket(this, [this](int fd, const char* data, size_t data_length){
+	return this->TlsEpollServer::send(fd, data, data_length);
+}){
+	this->websocket.on_open = [this](int fd){
+		if(this->on_open != nullptr){
+			this->on_open(fd);
+		}
+	};
+}
 
 bool TlsWebsocketServer::send(int fd, const char* data, size_t data_length){
 	if(this->websocket.client_handshake_complete[fd]){
-		std::string frame = this->websocket.create_frame(data, data_length);
-		return TlsEpollServer::send(fd, frame.c_str(), frame.length());
+		return this->websocket.send_message(fd, data, data_length);
 	}else{
 		return TlsEpollServer::send(fd, data, data_length);
 	}
@@ -25,6 +32,45 @@ ssize_t TlsWebsocketServer::recv(int fd, char* data, size_t data_length){
 }
 
 bool TlsWebsocketServer::accept_continuation(int* fd){
-	this->websocket.client_handshake_complete[*fd] = false;
+	this->websocket.reset(*fd);
 	return TlsEpollServer::accept_continuation(fd);
 }
+
+void TlsWebsocketServer::set_permessage_deflate(WebsocketDeflateOptions options){
+	this->websocket.deflate_options = options;
+}
+
+/**
+ * @brief Subscribes a connected websocket to topic. Subscriptions end when the connection closes.
+ *
+ * @return false if fd hasn't completed the websocket handshake.
+ */
+bool TlsWebsocketServer::subscribe(int fd, const std::string& topic){
+	return this->websocket.subscribe(fd, topic);
+}
+
+void TlsWebsocketServer::unsubscribe(int fd, const std::string& topic){
+	this->websocket.unsubscribe(fd, topic);
+}
+
+/**
+ * @brief Sends data to every subscriber of topic, framing (and compressing) it as few times as possible.
+ *
+ * @return The number of subscribers it was sent to.
+ */
+size_t TlsWebsocketServer::publish(const std::string& topic, const char* data, size_t data_length){
+	return this->websocket.publish(topic, data, data_length);
+}
+
+size_t TlsWebsocketServer::publish(const std::string& topic, const std::string& data){
+	return this->websocket.publish(topic, data.c_str(), data.length());
+}
+
+WebsocketTopicStats TlsWebsocketServer::topic_stats(const std::string& topic){
+	return this->websocket.topic_stats(topic);
+}
+
+void TlsWebsocketServer::close_client(int* fd, std::function<void(int*)> callback){
+	this->websocket.reset(*fd);
+	TlsEpollServer::close_client(fd, callback);
+}
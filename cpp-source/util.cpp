@@ -348,7 +348,14 @@ std::string Util::get_redirection_html(const std::string& hostname){
 	return response;
 }
 
-enum RequestResult Util::parse_http_api_request(const char* request, JsonObject* request_obj){
+/**
+ * @brief Munges an HTTP request (or raw JSON) into request_obj.
+ *
+ * @param body If given, an API request body is not parsed into request_obj.
+ * Instead *body points at it so the caller can decide how much of it to parse.
+ * @param request_length If given, the body length is measured with it instead of strlen, so binary bodies work.
+ */
+enum RequestResult Util::parse_http_api_request(const char* request, JsonObject* request_obj, const char** body, size_t request_length){
 	const char* it = request;
 	bool exit_http_parse = false;
 	
@@ -528,12 +535,17 @@ enum RequestResult Util::parse_http_api_request(const char* request, JsonObject*
 
 	if(request_obj->objectValues["route"]->stringValue.length() >= 4 &&
 	request_obj->objectValues["route"]->stringValue.substr(0, 4) == "/api"){
+		size_t body_length = request_length > 0 ? request_length - static_cast<size_t>(it - request) : std::strlen(it);
 		if(request_obj->HasObj("Content-Length", STRING) &&
-		std::strlen(it) != static_cast<unsigned long>(std::stol(request_obj->GetStr("Content-Length")))){
+		body_length != static_cast<unsigned long>(std::stol(request_obj->GetStr("Content-Length")))){
 			return JSON;
 		}
 		
-		request_obj->parse(it);
+		if(body != 0){
+			*body = it;
+		}else{
+			request_obj->parse(it);
+		}
 		return HTTP_API;
 	}
 
@@ -105,7 +105,7 @@ public:
 	static bool endsWith(const std::string& str, const std::string& suffix);
 	static bool startsWith(const std::string& str, const std::string& prefix);
 
-	static enum RequestResult parse_http_api_request(const char* request, JsonObject* request_obj);
+	static enum RequestResult parse_http_api_request(const char* request, JsonObject* request_obj, const char** body = 0, size_t request_length = 0);
 
 	static std::string sha256_hash(std::string data);
 	static std::string hash_value_argon2d(std::string password);
@@ -0,0 +1,234 @@
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include "websocket-deflate.hpp"
+
+static std::string trim(const std::string& value){
+	size_t start = value.find_first_not_of(" \t");
+	if(start == std::string::npos){
+		return std::string();
+	}
+	size_t end = value.find_last_not_of(" \t");
+	return value.substr(start, end - start + 1);
+}
+
+static std::vector<std::string> split(const std::string& value, char delimiter){
+	std::vector<std::string> parts;
+	size_t start = 0, end;
+	while((end = value.find(delimiter, start)) != std::string::npos){
+		parts.push_back(trim(value.substr(start, end - start)));
+		start = end + 1;
+	}
+	parts.push_back(trim(value.substr(start)));
+	return parts;
+}
+
+/**
+ * @return The window bits, or 0 if value isn't 8 to 15.
+ */
+static int window_bits(std::string value){
+	if(value.length() >= 2 && value[0] == '"' && value[value.length() - 1] == '"'){
+		value = value.substr(1, value.length() - 2);
+	}
+	if(value.empty() || value.length() > 2 || value.find_first_not_of("0123456789") != std::string::npos){
+		return 0;
+	}
+	int bits = std::atoi(value.c_str());
+	return bits >= 8 && bits <= 15 ? bits : 0;
+}
+
+/**
+ * @brief Picks the first acceptable permessage-deflate offer from a Sec-WebSocket-Extensions header.
+ *
+ * zlib can't produce raw deflate with an 8 bit window, so offers limiting the server to 8 are declined
+ * (the client may offer a fallback after it).
+ *
+ * @param response Set to the Sec-WebSocket-Extensions value to answer with.
+ *
+ * @return false if no offer was acceptable, and the connection goes uncompressed.
+ */
+bool WebsocketDeflate::negotiate(const std::string& offers, const WebsocketDeflateOptions& options,
+WebsocketDeflateOptions* agreed, std::string* response){
+	if(!options.enabled){
+		return false;
+	}
+
+	for(const std::string& offer : split(offers, ',')){
+		std::vector<std::string> parameters = split(offer, ';');
+		if(parameters[0] != "permessage-deflate"){
+			continue;
+		}
+
+		bool valid = true;
+		bool server_no_context_takeover = false;
+		bool client_no_context_takeover = false;
+		int server_max_window_bits = 0;
+		int client_max_window_bits = 0;
+		bool client_max_window_bits_offered = false;
+
+		for(size_t i = 1; i < parameters.size() && valid; ++i){
+			std::string name = parameters[i];
+			std::string value;
+			size_t equals = name.find('=');
+			if(equals != std::string::npos){
+				value = trim(name.substr(equals + 1));
+				name = trim(name.substr(0, equals));
+			}
+
+			if(name == "server_no_context_takeover" && !server_no_context_takeover && equals == std::string::npos){
+				server_no_context_takeover = true;
+			}else if(name == "client_no_context_takeover" && !client_no_context_takeover && equals == std::string::npos){
+				client_no_context_takeover = true;
+			}else if(name == "server_max_window_bits" && server_max_window_bits == 0){
+				server_max_window_bits = window_bits(value);
+				valid = server_max_window_bits > 8;
+			}else if(name == "client_max_window_bits" && !client_max_window_bits_offered){
+				client_max_window_bits_offered = true;
+				if(equals != std::string::npos){
+					client_max_window_bits = window_bits(value);
+					valid = client_max_window_bits != 0;
+				}
+			}else{
+				valid = false;
+			}
+		}
+		if(!valid){
+			continue;
+		}
+
+		*agreed = options;
+		agreed->server_no_context_takeover = server_no_context_takeover || options.server_no_context_takeover;
+		agreed->client_no_context_takeover = client_no_context_takeover || options.client_no_context_takeover;
+		agreed->server_max_window_bits = std::max(9, std::min(options.server_max_window_bits,
+			server_max_window_bits == 0 ? 15 : server_max_window_bits));
+		agreed->client_max_window_bits = 15;
+
+		*response = "permessage-deflate";
+		if(agreed->server_no_context_takeover){
+			*response += "; server_no_context_takeover";
+		}
+		if(agreed->client_no_context_takeover){
+			*response += "; client_no_context_takeover";
+		}
+		if(agreed->server_max_window_bits < 15){
+			*response += "; server_max_window_bits=" + std::to_string(agreed->server_max_window_bits);
+		}
+		// The client window can only be limited if the client said it could be.
+		if(client_max_window_bits_offered){
+			agreed->client_max_window_bits = std::max(8, std::min(options.client_max_window_bits,
+				client_max_window_bits == 0 ? 15 : client_max_window_bits));
+			if(agreed->client_max_window_bits < 15){
+				*response += "; client_max_window_bits=" + std::to_string(agreed->client_max_window_bits);
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+WebsocketDeflate::WebsocketDeflate(const WebsocketDeflateOptions& new_agreed)
+:agreed(new_agreed),
+deflater_ready(false),
+inflater_ready(false){
+	std::memset(&this->deflater, 0, sizeof(this->deflater));
+	std::memset(&this->inflater, 0, sizeof(this->inflater));
+
+	// Negative window bits mean raw deflate, without the zlib header and checksum.
+	this->deflater_ready = deflateInit2(&this->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		-this->agreed.server_max_window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	// A 15 bit window inflates anything the client may send.
+	this->inflater_ready = inflateInit2(&this->inflater, -15) == Z_OK;
+}
+
+WebsocketDeflate::~WebsocketDeflate(){
+	if(this->deflater_ready){
+		deflateEnd(&this->deflater);
+	}
+	if(this->inflater_ready){
+		inflateEnd(&this->inflater);
+	}
+}
+
+const WebsocketDeflateOptions& WebsocketDeflate::options(){
+	return this->agreed;
+}
+
+/**
+ * @brief Compresses one message, without the 00 00 FF FF tail the receiver puts back.
+ *
+ * @return false if zlib failed, in which case the message should go uncompressed.
+ */
+bool WebsocketDeflate::compress(const char* data, size_t data_length, std::string* compressed){
+	std::lock_guard<std::mutex> lock(this->deflate_mutex);
+	if(!this->deflater_ready){
+		return false;
+	}
+
+	compressed->resize(deflateBound(&this->deflater, static_cast<uLong>(data_length)) + 16);
+	this->deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	this->deflater.avail_in = static_cast<uInt>(data_length);
+	size_t produced = 0;
+	do{
+		if(produced == compressed->length()){
+			compressed->resize(compressed->length() * 2);
+		}
+		this->deflater.next_out = reinterpret_cast<Bytef*>(&(*compressed)[produced]);
+		this->deflater.avail_out = static_cast<uInt>(compressed->length() - produced);
+		if(deflate(&this->deflater, Z_SYNC_FLUSH) == Z_STREAM_ERROR){
+			deflateReset(&this->deflater);
+			return false;
+		}
+		produced = compressed->length() - this->deflater.avail_out;
+	}while(this->deflater.avail_out == 0);
+	compressed->resize(produced);
+
+	if(compressed->length() >= 4 && compressed->compare(compressed->length() - 4, 4, "\x00\x00\xff\xff", 4) == 0){
+		compressed->resize(compressed->length() - 4);
+	}
+	if(this->agreed.server_no_context_takeover){
+		deflateReset(&this->deflater);
+	}
+	return true;
+}
+
+/**
+ * @brief Inflates one whole message.
+ *
+ * @return false if the data is corrupt or inflates past limit bytes.
+ */
+bool WebsocketDeflate::decompress(const char* data, size_t data_length, std::string* decompressed, size_t limit){
+	static const char tail[4] = {0x00, 0x00, static_cast<char>(0xff), static_cast<char>(0xff)};
+	char chunk[16384];
+
+	decompressed->clear();
+	if(!this->inflater_ready){
+		return false;
+	}
+
+	for(int part = 0; part < 2; ++part){
+		this->inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(part == 0 ? data : tail));
+		this->inflater.avail_in = static_cast<uInt>(part == 0 ? data_length : 4);
+		do{
+			this->inflater.next_out = reinterpret_cast<Bytef*>(chunk);
+			this->inflater.avail_out = sizeof(chunk);
+			int result = inflate(&this->inflater, Z_SYNC_FLUSH);
+			if(result != Z_OK && result != Z_BUF_ERROR && result != Z_STREAM_END){
+				inflateReset(&this->inflater);
+				return false;
+			}
+			decompressed->append(chunk, sizeof(chunk) - this->inflater.avail_out);
+			if(decompressed->length() > limit){
+				inflateReset(&this->inflater);
+				return false;
+			}
+		}while(this->inflater.avail_out == 0);
+	}
+
+	if(this->agreed.client_no_context_takeover){
+		inflateReset(&this->inflater);
+	}
+	return true;
+}
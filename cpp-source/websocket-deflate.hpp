@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+
+#include <zlib.h>
+
+/**
+ * @brief permessage-deflate (RFC 7692) parameters.
+ *
+ * As server options these are what the server would like; after negotiation they are what was agreed.
+ * Messages shorter than minimum_size are sent uncompressed.
+ */
+struct WebsocketDeflateOptions{
+	bool enabled;
+	bool server_no_context_takeover;
+	bool client_no_context_takeover;
+	int server_max_window_bits;
+	int client_max_window_bits;
+	size_t minimum_size;
+
+	WebsocketDeflateOptions()
+	:enabled(false),
+	server_no_context_takeover(false),
+	client_no_context_takeover(false),
+	server_max_window_bits(15),
+	client_max_window_bits(15),
+	minimum_size(64){}
+};
+
+/**
+ * @brief The compression state of one websocket connection.
+ *
+ * Without context takeover the deflater is reset after every message,
+ * so identical messages compress to identical bytes and can be shared between connections.
+ */
+class WebsocketDeflate{
+private:
+	WebsocketDeflateOptions agreed;
+
+	z_stream deflater;
+	z_stream inflater;
+	bool deflater_ready;
+	bool inflater_ready;
+
+	std::mutex deflate_mutex;
+public:
+	static bool negotiate(const std::string& offers, const WebsocketDeflateOptions& options,
+		WebsocketDeflateOptions* agreed, std::string* response);
+
+	WebsocketDeflate(const WebsocketDeflateOptions& new_agreed);
+	~WebsocketDeflate();
+
+	const WebsocketDeflateOptions& options();
+
+	bool compress(const char* data, size_t data_length, std::string* compressed);
+	bool decompress(const char* data, size_t data_length, std::string* decompressed, size_t limit);
+};
@@ -12,8 +12,20 @@ public:
 
 	bool send(int fd, const char* data, size_t data_length);
 	ssize_t recv(int fd, char* data, size_t data_length);
+
+	void set_permessage_deflate(WebsocketDeflateOptions options);
+
+	bool subscribe(int fd, const std::string& topic);
+	void unsubscribe(int fd, const std::string& topic);
+	size_t publish(const std::string& topic, const char* data, size_t data_length);
+	size_t publish(const std::string& topic, const std::string& data);
+	WebsocketTopicStats topic_stats(const std::string& topic);
+
+	/// When a connection has completed its websocket handshake, this is called. It can be subscribed from then on.
+	std::function<void(int)> on_open;
 private:
 	Websocket websocket;
 
 	bool accept_continuation(int* fd);
+	void close_client(int* fd, std::function<void(int*)> callback);
 };
@@ -1,5 +1,16 @@
 #pragma once
 
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
+
 #include "cryptopp/sha.h"
 #include "cryptopp/base64.h"
 #include "cryptopp/filters.h"
@@ -7,60 +18,229 @@
 
 #include "util.hpp"
 #include "tcp-server.hpp"
+#include "websocket-deflate.hpp"
+
+// Larger messages (or fragmented messages adding up to more) close the connection with 1009.
+#define WEBSOCKET_MESSAGE_LIMIT (16 * 1024 * 1024)
+
+// The most a frame header can take in front of a payload (without a mask, servers don't send one).
+#define WEBSOCKET_HEADROOM 10
+
+/**
+ * @brief One decoded frame. The payload is a view into the read buffer, already unmasked.
+ */
+struct WebsocketFrame{
+	bool fin;
+	bool compressed;
+	uint8_t opcode;
+	char* payload;
+	size_t payload_length;
+};
+
+/**
+ * @brief Per-connection decoder state.
+ */
+struct WebsocketConnection{
+	// Bytes of a frame that hasn't fully arrived yet.
+	std::string buffer;
+
+	// A fragmented message being put back together, and its opcode (0 when there is none).
+	std::string message;
+	uint8_t message_opcode;
+	bool message_compressed;
+
+	// Set when permessage-deflate was negotiated.
+	WebsocketDeflate* deflate;
+	std::string inflated;
+	// With context takeover, each message is compressed against the ones before it,
+	// so compressing and sending it happen under this, in that order, for the whole connection.
+	std::mutex send_mutex;
+
+	// Topics this connection is subscribed to, so they can be left on disconnect.
+	std::vector<std::string> topics;
+
+	WebsocketConnection(): message_opcode(0), message_compressed(false), deflate(0){}
+	~WebsocketConnection(){
+		delete this->deflate;
+	}
+private:
+	WebsocketConnection(const WebsocketConnection&);
+	WebsocketConnection& operator=(const WebsocketConnection&);
+};
+
+struct WebsocketTopicStats{
+	size_t subscribers;
+	uint64_t published;
+	uint64_t delivered;
+	uint64_t failed;
+	uint64_t bytes;
+
+	WebsocketTopicStats(): subscribers(0), published(0), delivered(0), failed(0), bytes(0){}
+};
+
+/**
+ * @brief A pub/sub topic. Subscribers are an immutable snapshot, replaced on (un)subscribe,
+ * so publishing never holds a lock while it writes.
+ */
+struct WebsocketTopic{
+	std::shared_ptr<const std::vector<int>> subscribers;
+	WebsocketTopicStats stats;
+
+	WebsocketTopic(): subscribers(std::make_shared<const std::vector<int>>()){}
+};
 
 class Websocket{
 private:
 	EpollServer* server;
+	std::function<bool(int, const char*, size_t)> send_raw;
 
-	std::string parse_frame(const char* data, size_t data_length){
-		std::stringstream message;
-		uint64_t len = data[1] & 0x7F;
-		uint64_t payload_length;
-		size_t offset;
+	std::mutex connections_mutex;
+	std::unordered_map<int, std::shared_ptr<WebsocketConnection>> connections;
 
-		if(len == 126){
-			payload_length = *(reinterpret_cast<const uint16_t*>(data + 2));
-			//payload_length = static_cast<uint16_t>(data[2]) + (static_cast<uint16_t>(data[3]) << 8);
-			offset = 4;
-		}else if(len == 127){
-			//TODO: read uint64_t not uint16_t
-			payload_length = static_cast<uint64_t>(data[2]) + (static_cast<uint64_t>(data[3]) << 8);
-			offset = 10;
-		}else{
-			payload_length = len;
-			offset = 2;
-		}
+	std::mutex topics_mutex;
+	std::unordered_map<std::string, WebsocketTopic> topics;
 
-		// I think this occurs sometimes, and it doesn't appear to matter.
-		if(PACKET_LIMIT < payload_length + offset){
-			ERROR("DIDNT READ ALL DATA")
-			DEBUG("L:" << len)
-			DEBUG("DATAL:" << data_length)
-			DEBUG("PAYLL:" << payload_length)
-			DEBUG("OFFSE:" << offset)
-		}
+	// Without context takeover the last compressed frame is reused for the same message to anyone else.
+	std::mutex shared_frame_mutex;
+	std::string shared_frame_message;
+	std::string shared_frame;
+	int shared_frame_window_bits;
 
-		unsigned char mask[4] = {0, 0, 0, 0};
-		if(data[1] & 0x80){
-			std::memcpy(mask, data + offset, 4);
-			offset += 4;
+	std::shared_ptr<WebsocketConnection> get_connection(int fd){
+		std::lock_guard<std::mutex> lock(this->connections_mutex);
+		std::shared_ptr<WebsocketConnection>& connection = this->connections[fd];
+		if(!connection){
+			connection = std::make_shared<WebsocketConnection>();
 		}
+		return connection;
+	}
 
-		for(size_t i = 0; i < payload_length && offset + i < data_length; ++i){
-			message << static_cast<char>(static_cast<unsigned char>(data[offset + i]) ^ mask[i % 4]);
+	/**
+	 * @return Null if fd hasn't completed a handshake.
+	 */
+	std::shared_ptr<WebsocketConnection> find_connection(int fd){
+		std::lock_guard<std::mutex> lock(this->connections_mutex);
+		auto iter = this->connections.find(fd);
+		return iter == this->connections.end() ? std::shared_ptr<WebsocketConnection>() : iter->second;
+	}
+
+	/**
+	 * @brief Expects topics_mutex to be held.
+	 */
+	void remove_subscriber(const std::string& topic, int fd){
+		auto iter = this->topics.find(topic);
+		if(iter == this->topics.end()){
+			return;
+		}
+		std::vector<int> subscribers;
+		for(int subscriber : *iter->second.subscribers){
+			if(subscriber != fd){
+				subscribers.push_back(subscriber);
+			}
+		}
+		if(subscribers.empty()){
+			this->topics.erase(iter);
+		}else{
+			iter->second.subscribers = std::make_shared<const std::vector<int>>(subscribers);
+			iter->second.stats.subscribers = subscribers.size();
 		}
+	}
+
+	void send_close(int fd, uint16_t code){
+		char status[2] = {static_cast<char>(code >> 8), static_cast<char>(code & 0xFF)};
+		std::string frame = this->create_frame(status, 2, 0x8);
+		this->send_raw(fd, frame.c_str(), frame.length());
+	}
 
+	ssize_t deliver(int fd, const char* data, size_t data_length){
 		#if defined(DO_DEBUG)
-			//PRINT("DATA:")
-			//Util::print_bits(data, data_length);
-			//PRINT("MASK:")
-			//Util::print_bits(reinterpret_cast<char*>(mask), 4);
+			// Simulate latency. (Mostly for multiplayer game testing.)
+			std::this_thread::sleep_for(std::chrono::milliseconds(70));
 		#endif
 
-		return message.str();
+		// Clients send "ping" as a keep-alive, it isn't a message.
+		if(data_length == 4 && std::memcmp(data, "ping", 4) == 0){
+			return static_cast<ssize_t>(data_length);
+		}
+		return this->server->on_read(fd, data, data_length);
+	}
+
+	ssize_t deliver_compressed(int fd, WebsocketConnection* connection, const char* data, size_t data_length){
+		if(!connection->deflate->decompress(data, data_length, &connection->inflated, WEBSOCKET_MESSAGE_LIMIT)){
+			this->send_close(fd, 1007);
+			return -1;
+		}
+		return this->deliver(fd, connection->inflated.c_str(), connection->inflated.length());
+	}
+
+	/**
+	 * @return Negative if the connection should close.
+	 */
+	ssize_t handle_frame(int fd, WebsocketConnection* connection, WebsocketFrame* frame){
+		ssize_t result = 0;
+		switch(frame->opcode){
+		case 0x0:
+			if(connection->message_opcode == 0){
+				this->send_close(fd, 1002);
+				return -1;
+			}
+			if(connection->message.length() + frame->payload_length > WEBSOCKET_MESSAGE_LIMIT){
+				this->send_close(fd, 1009);
+				return -1;
+			}
+			connection->message.append(frame->payload, frame->payload_length);
+			if(frame->fin){
+				if(connection->message_compressed){
+					result = this->deliver_compressed(fd, connection, connection->message.c_str(), connection->message.length());
+				}else{
+					result = this->deliver(fd, connection->message.c_str(), connection->message.length());
+				}
+				connection->message.clear();
+				connection->message_opcode = 0;
+				connection->message_compressed = false;
+			}
+			return result;
+		case 0x1:
+		case 0x2:
+			if(connection->message_opcode != 0){
+				this->send_close(fd, 1002);
+				return -1;
+			}
+			if(frame->fin){
+				if(frame->compressed){
+					return this->deliver_compressed(fd, connection, frame->payload, frame->payload_length);
+				}
+				return this->deliver(fd, frame->payload, frame->payload_length);
+			}
+			connection->message.assign(frame->payload, frame->payload_length);
+			connection->message_opcode = frame->opcode;
+			connection->message_compressed = frame->compressed;
+			return 0;
+		case 0x8:
+			DEBUG("WS DISCONNECT! " << fd)
+			if(frame->payload_length >= 2){
+				// Echo the status code, with the header written over the mask in front of it.
+				char* close_frame = prepend_header(frame->payload, 2, 0x8);
+				this->send_raw(fd, close_frame, 4);
+			}else{
+				this->send_close(fd, 1000);
+			}
+			return -1;
+		case 0x9:{
+			// A control payload is at most 125 bytes, so its 2 byte header fits where the mask was.
+			char* pong = prepend_header(frame->payload, frame->payload_length, 0xA);
+			if(this->send_raw(fd, pong, frame->payload_length + 2)){
+				return -1;
+			}
+			return 0;
+		}
+		default:
+			// Unsolicited pongs are allowed and ignored.
+			return 0;
+		}
 	}
 
-	std::string get_handshake_response(std::string key){
+	std::string get_handshake_response(std::string key, std::string extensions = std::string()){
 		std::string accept_hash;
 		CryptoPP::SHA1 hasher;
 		CryptoPP::StringSource source(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", true,
@@ -70,94 +250,414 @@ private:
 		return "HTTP/1.1 101 Switching Protocols\r\n"
 			"Upgrade: websocket\r\n"
 			"Connection: Upgrade\r\n"
-			"Sec-WebSocket-Accept: " + accept_hash + "\r\n"
+			"Sec-WebSocket-Accept: " + accept_hash + "\r\n" +
+			(extensions.empty() ? std::string() : "Sec-WebSocket-Extensions: " + extensions + "\r\n") +
 			"\r\n";
 	}
 public:
-	Websocket(EpollServer* new_server)
-	:server(new_server){}
+	Websocket(EpollServer* new_server, std::function<bool(int, const char*, size_t)> new_send_raw)
+	:server(new_server), send_raw(new_send_raw), shared_frame_window_bits(0){}
 
 	std::unordered_map<int, bool> client_handshake_complete;
 
-	std::string create_frame(const char* data, size_t data_length){
-		//char frame[data_length + 10];
-		std::stringstream frame;
-		char lsize[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	/// What permessage-deflate to offer new connections. Off by default.
+	WebsocketDeflateOptions deflate_options;
+
+	/// When a connection has completed its websocket handshake, this is called. It can be subscribed from then on.
+	std::function<void(int)> on_open;
+
+	/**
+	 * @brief Decodes one frame from the front of data, unmasking its payload in place.
+	 *
+	 * Lengths are big-endian, as RFC 6455 requires. Client frames must be masked.
+	 * RSV1 marks a compressed message, and is only allowed on its first frame when compressed is true.
+	 *
+	 * @return The bytes the frame occupies, 0 if data doesn't hold the whole frame yet,
+	 * or -1 if the frame is malformed or too large.
+	 */
+	static ssize_t decode_frame(char* data, size_t data_length, WebsocketFrame* frame, bool compressed = false){
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+		uint64_t payload_length;
 		size_t offset;
 
-		// Basic binary frame.
-		//frame[0] = static_cast<char>(0x81);
-		frame << static_cast<char>(0x81);
-		if(data_length <= 125){
-			frame << static_cast<char>(data_length);
-			//frame[1] = static_cast<char>(data_length);
-			offset = 2;
-		}else if(data_length <= 65535){
-			//DEBUG("DL:" << data_length)
-			frame << static_cast<char>(126);
-			//frame[1] = 126;
-			frame << static_cast<char>((static_cast<uint16_t>(data_length) >> 8) & 0xFF);
-			//frame[2] = static_cast<char>((static_cast<uint16_t>(data_length) >> 8) & 0xFF);
-			frame << static_cast<char>(static_cast<uint16_t>(data_length) & 0xFF);
-			//frame[3] = static_cast<char>(static_cast<uint16_t>(data_length) & 0xFF);
+		if(data_length < 2){
+			return 0;
+		}
+		if(bytes[0] & 0x30){
+			return -1;
+		}
+		frame->fin = (bytes[0] & 0x80) != 0;
+		frame->compressed = (bytes[0] & 0x40) != 0;
+		frame->opcode = bytes[0] & 0x0F;
+		if(frame->opcode > 0xA || (frame->opcode > 0x2 && frame->opcode < 0x8)){
+			return -1;
+		}
+		if(frame->compressed && (!compressed || (frame->opcode != 0x1 && frame->opcode != 0x2))){
+			return -1;
+		}
+		if(!(bytes[1] & 0x80)){
+			return -1;
+		}
+
+		payload_length = bytes[1] & 0x7F;
+		offset = 2;
+		if(payload_length == 126){
+			if(data_length < 4){
+				return 0;
+			}
+			payload_length = (static_cast<uint64_t>(bytes[2]) << 8) | bytes[3];
 			offset = 4;
-		}else{
-			*(reinterpret_cast<uint64_t*>(lsize)) = static_cast<uint64_t>(data_length);
-			/*frame[1] = 127;
-			frame[2] = lsize[0];
-			frame[3] = lsize[1];
-			frame[4] = lsize[2];
-			frame[5] = lsize[3];
-			frame[6] = lsize[4];
-			frame[7] = lsize[5];
-			frame[8] = lsize[6];
-			frame[9] = lsize[7];*/
+		}else if(payload_length == 127){
+			if(data_length < 10){
+				return 0;
+			}
+			payload_length = 0;
+			for(size_t i = 2; i < 10; ++i){
+				payload_length = (payload_length << 8) | bytes[i];
+			}
 			offset = 10;
 		}
 
-		frame << std::string(data, data_length);
-		//std::memcpy(frame + offset, data, data_length);
-		//frame[data_length + offset] = 0;
-		
-		#if defined(DO_DEBUG)
-			//PRINT("SDATA:")
-			//Util::print_bits(frame.str().c_str(), frame.str().length());
+		// Control frames can't be fragmented or carry more than 125 bytes.
+		if(frame->opcode >= 0x8 && (!frame->fin || payload_length > 125)){
+			return -1;
+		}
+		if(payload_length > WEBSOCKET_MESSAGE_LIMIT){
+			return -1;
+		}
+		if(data_length < offset + 4 + payload_length){
+			return 0;
+		}
+
+		const char* mask = data + offset;
+		offset += 4;
+		frame->payload = data + offset;
+		frame->payload_length = static_cast<size_t>(payload_length);
+		unmask(frame->payload, frame->payload_length, mask);
+		return static_cast<ssize_t>(offset + frame->payload_length);
+	}
+
+	/**
+	 * @brief XORs the 4 byte mask over data in place, a word (or SSE2 register) at a time.
+	 *
+	 * Every chunk starts at a multiple of 4 bytes from the start of data, so the mask
+	 * repeated across the chunk lines up no matter the byte order.
+	 */
+	static void unmask(char* data, size_t data_length, const char* mask){
+		size_t i = 0;
+		uint64_t mask_word;
+		std::memcpy(&mask_word, mask, 4);
+		std::memcpy(reinterpret_cast<char*>(&mask_word) + 4, mask, 4);
+
+		#if defined(__SSE2__)
+			__m128i mask_vector = _mm_set1_epi64x(static_cast<long long>(mask_word));
+			for(; i + 16 <= data_length; i += 16){
+				__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(chunk, mask_vector));
+			}
 		#endif
-		
-		return frame.str();
+
+		for(; i + 8 <= data_length; i += 8){
+			uint64_t chunk;
+			std::memcpy(&chunk, data + i, 8);
+			chunk ^= mask_word;
+			std::memcpy(data + i, &chunk, 8);
+		}
+		for(; i < data_length; ++i){
+			data[i] = static_cast<char>(data[i] ^ mask[i % 4]);
+		}
+	}
+
+	static size_t header_length(size_t payload_length){
+		if(payload_length <= 125){
+			return 2;
+		}else if(payload_length <= 65535){
+			return 4;
+		}
+		return 10;
+	}
+
+	/**
+	 * @brief Writes an unmasked, unfragmented frame header at frame. Lengths are big-endian.
+	 *
+	 * @return The header length; the payload goes right after it.
+	 */
+	static size_t write_header(char* frame, size_t payload_length, uint8_t opcode, bool compressed = false){
+		frame[0] = static_cast<char>(0x80 | (compressed ? 0x40 : 0) | opcode);
+		if(payload_length <= 125){
+			frame[1] = static_cast<char>(payload_length);
+			return 2;
+		}else if(payload_length <= 65535){
+			frame[1] = static_cast<char>(126);
+			frame[2] = static_cast<char>((payload_length >> 8) & 0xFF);
+			frame[3] = static_cast<char>(payload_length & 0xFF);
+			return 4;
+		}
+		frame[1] = static_cast<char>(127);
+		for(size_t i = 0; i < 8; ++i){
+			frame[2 + i] = static_cast<char>((static_cast<uint64_t>(payload_length) >> ((7 - i) * 8)) & 0xFF);
+		}
+		return 10;
+	}
+
+	/**
+	 * @brief Writes the header into the headroom just in front of payload, so the payload isn't copied.
+	 *
+	 * The caller must own at least header_length(payload_length) bytes before payload
+	 * (WEBSOCKET_HEADROOM is always enough).
+	 *
+	 * @return The start of the frame.
+	 */
+	static char* prepend_header(char* payload, size_t payload_length, uint8_t opcode){
+		char* frame = payload - header_length(payload_length);
+		write_header(frame, payload_length, opcode);
+		return frame;
+	}
+
+	/**
+	 * @brief Forgets any handshake, partial frames and subscriptions of fd.
+	 * Called for new connections and closed ones.
+	 */
+	void reset(int fd){
+		this->client_handshake_complete[fd] = false;
+		std::shared_ptr<WebsocketConnection> connection;
+		{
+			std::lock_guard<std::mutex> lock(this->connections_mutex);
+			auto iter = this->connections.find(fd);
+			if(iter == this->connections.end()){
+				return;
+			}
+			connection = iter->second;
+			this->connections.erase(iter);
+		}
+		std::lock_guard<std::mutex> lock(this->topics_mutex);
+		for(const std::string& topic : connection->topics){
+			this->remove_subscriber(topic, fd);
+		}
 	}
 
-	ssize_t recv(int fd, const char* data, size_t data_length){		
+	/**
+	 * @return false if fd hasn't completed a handshake.
+	 */
+	bool subscribe(int fd, const std::string& topic){
+		std::shared_ptr<WebsocketConnection> connection = this->find_connection(fd);
+		if(!connection){
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(this->topics_mutex);
+		for(const std::string& subscribed : connection->topics){
+			if(subscribed == topic){
+				return true;
+			}
+		}
+		connection->topics.push_back(topic);
+
+		WebsocketTopic& entry = this->topics[topic];
+		std::vector<int> subscribers(*entry.subscribers);
+		subscribers.push_back(fd);
+		entry.subscribers = std::make_shared<const std::vector<int>>(subscribers);
+		entry.stats.subscribers = subscribers.size();
+		return true;
+	}
+
+	void unsubscribe(int fd, const std::string& topic){
+		std::shared_ptr<WebsocketConnection> connection = this->find_connection(fd);
+		std::lock_guard<std::mutex> lock(this->topics_mutex);
+		if(connection){
+			for(auto iter = connection->topics.begin(); iter != connection->topics.end(); ++iter){
+				if(*iter == topic){
+					connection->topics.erase(iter);
+					break;
+				}
+			}
+		}
+		this->remove_subscriber(topic, fd);
+	}
+
+	/**
+	 * @brief Sends a message to every subscriber of topic.
+	 *
+	 * The message is framed once for all uncompressed subscribers, and compressed once per window size
+	 * for subscribers without context takeover. Only subscribers with context takeover are compressed individually.
+	 *
+	 * @return The number of subscribers it was sent to.
+	 */
+	size_t publish(const std::string& topic, const char* data, size_t data_length){
+		std::shared_ptr<const std::vector<int>> subscribers;
+		{
+			std::lock_guard<std::mutex> lock(this->topics_mutex);
+			auto iter = this->topics.find(topic);
+			if(iter == this->topics.end()){
+				return 0;
+			}
+			subscribers = iter->second.subscribers;
+		}
+
+		std::string plain_frame;
+		std::unordered_map<int, std::string> shared_compressed_frames;
+		std::string own_frame;
+		const std::string* frame;
+		bool sent;
+		uint64_t delivered = 0, failed = 0, bytes = 0;
+
+		for(int fd : *subscribers){
+			std::shared_ptr<WebsocketConnection> connection = this->find_connection(fd);
+			if(!connection){
+				continue;
+			}
+			if(connection->deflate == 0 || data_length == 0 || data_length < connection->deflate->options().minimum_size){
+				if(plain_frame.empty()){
+					plain_frame = this->create_frame(data, data_length);
+				}
+				frame = &plain_frame;
+				sent = !this->send_raw(fd, frame->c_str(), frame->length());
+			}else if(connection->deflate->options().server_no_context_takeover){
+				std::string& shared = shared_compressed_frames[connection->deflate->options().server_max_window_bits];
+				if(shared.empty()){
+					shared = this->compress_frame(connection.get(), data, data_length);
+				}
+				frame = &shared;
+				sent = !this->send_raw(fd, frame->c_str(), frame->length());
+			}else{
+				std::lock_guard<std::mutex> lock(connection->send_mutex);
+				own_frame = this->compress_frame(connection.get(), data, data_length);
+				frame = &own_frame;
+				sent = !this->send_raw(fd, frame->c_str(), frame->length());
+			}
+
+			if(!sent){
+				failed++;
+			}else{
+				delivered++;
+				bytes += frame->length();
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(this->topics_mutex);
+		auto iter = this->topics.find(topic);
+		if(iter != this->topics.end()){
+			iter->second.stats.published++;
+			iter->second.stats.delivered += delivered;
+			iter->second.stats.failed += failed;
+			iter->second.stats.bytes += bytes;
+		}
+		return static_cast<size_t>(delivered);
+	}
+
+	WebsocketTopicStats topic_stats(const std::string& topic){
+		std::lock_guard<std::mutex> lock(this->topics_mutex);
+		auto iter = this->topics.find(topic);
+		return iter == this->topics.end() ? WebsocketTopicStats() : iter->second.stats;
+	}
+
+	std::string create_frame(const char* data, size_t data_length, uint8_t opcode = 0x1, bool compressed = false){
+		std::string frame(header_length(data_length) + data_length, 0);
+		size_t offset = write_header(&frame[0], data_length, opcode, compressed);
+		std::memcpy(&frame[offset], data, data_length);
+		return frame;
+	}
+
+	/**
+	 * @brief Compresses with the connection's deflater, falling back to an uncompressed frame.
+	 */
+	std::string compress_frame(WebsocketConnection* connection, const char* data, size_t data_length){
+		std::string compressed;
+		if(!connection->deflate->compress(data, data_length, &compressed)){
+			return this->create_frame(data, data_length);
+		}
+		return this->create_frame(compressed.c_str(), compressed.length(), 0x1, true);
+	}
+
+	/**
+	 * @brief Frames a message for fd and sends it, compressing it if permessage-deflate was negotiated.
+	 *
+	 * Without context takeover, a message identical to the last one compressed is not compressed again.
+	 * With it, the message is compressed and sent under the connection's send_mutex,
+	 * so the client inflates messages in the order they were deflated.
+	 *
+	 * @return true on error.
+	 */
+	bool send_message(int fd, const char* data, size_t data_length){
+		std::shared_ptr<WebsocketConnection> connection = this->find_connection(fd);
+		if(!connection ||
+		connection->deflate == 0 ||
+		data_length == 0 ||
+		data_length < connection->deflate->options().minimum_size){
+			std::string frame = this->create_frame(data, data_length);
+			return this->send_raw(fd, frame.c_str(), frame.length());
+		}
+
+		const WebsocketDeflateOptions& agreed = connection->deflate->options();
+		if(!agreed.server_no_context_takeover){
+			std::lock_guard<std::mutex> lock(connection->send_mutex);
+			std::string frame = this->compress_frame(connection.get(), data, data_length);
+			return this->send_raw(fd, frame.c_str(), frame.length());
+		}
+
+		std::string frame;
+		{
+			std::lock_guard<std::mutex> lock(this->shared_frame_mutex);
+			if(this->shared_frame_window_bits == agreed.server_max_window_bits &&
+			this->shared_frame_message.length() == data_length &&
+			std::memcmp(this->shared_frame_message.c_str(), data, data_length) == 0){
+				frame = this->shared_frame;
+			}
+		}
+		if(frame.empty()){
+			frame = this->compress_frame(connection.get(), data, data_length);
+			std::lock_guard<std::mutex> lock(this->shared_frame_mutex);
+			this->shared_frame_window_bits = agreed.server_max_window_bits;
+			this->shared_frame_message.assign(data, data_length);
+			this->shared_frame = frame;
+		}
+		return this->send_raw(fd, frame.c_str(), frame.length());
+	}
+
+	/**
+	 * @brief Decodes every whole frame in the read, keeping any trailing partial frame for the next one.
+	 *
+	 * Frames are decoded straight out of data unless an earlier read left part of a frame behind.
+	 * Each message reaches on_read as a view, NUL terminated for the duration of the call.
+	 */
+	ssize_t recv(int fd, char* data, size_t data_length){
 		if(this->client_handshake_complete[fd]){
-			//DEBUG("CHAT RECV:" << data << " on " << fd);
-			//PRINT("RECV:" << message)
-			std::string message = this->parse_frame(data, data_length);
-		
-			#if defined(DO_DEBUG)
-				// Simulate latency. (Mostly for multiplayer game testing.)
-				std::this_thread::sleep_for(std::chrono::milliseconds(70));
-				
-			#endif
-			
-			// TODO: I think this is the websocket client from the browser sending a disconnect frame. Ok.
-			if(static_cast<int>(message[0]) == 3 &&
-			static_cast<int>(message[1]) == -23){
-				DEBUG("WS DISCONNECT! " << fd)
+			std::shared_ptr<WebsocketConnection> connection = this->get_connection(fd);
+			char* it = data;
+			size_t available = data_length;
+			size_t consumed = 0;
+			ssize_t frame_length;
+			WebsocketFrame frame;
+
+			if(!connection->buffer.empty()){
+				connection->buffer.append(data, data_length);
+				it = &connection->buffer[0];
+				available = connection->buffer.length();
+			}
+
+			while((frame_length = decode_frame(it + consumed, available - consumed, &frame, connection->deflate != 0)) > 0){
+				consumed += static_cast<size_t>(frame_length);
+
+				// The byte after the payload is the next frame (or the terminator), so it is restored afterwards.
+				char after = frame.payload[frame.payload_length];
+				frame.payload[frame.payload_length] = 0;
+				ssize_t result = this->handle_frame(fd, connection.get(), &frame);
+				frame.payload[frame.payload_length] = after;
+				if(result < 0){
+					return result;
+				}
+			}
+			if(frame_length < 0){
+				DEBUG("Bad websocket frame on " << fd)
+				this->send_close(fd, 1002);
 				return -1;
 			}
-			
-			//DEBUG("PINGPONG")
-			if(message == "ping"){
-				message = "pong";
-				// TODO: REVISIT THIS. IS IT NECESSARY? CAN WE SEGFAULT IF ANOTHER THREAD WRITES?
-				//if(this->server->send(fd, message.c_str(), message.length())){
-				//	DEBUG("Send handshake failed.")
-				//	return -1;
-				//}
-				return static_cast<ssize_t>(message.length());
+
+			if(it == data){
+				connection->buffer.assign(data + consumed, available - consumed);
+			}else{
+				connection->buffer.erase(0, consumed);
 			}
-			//PRINT("WEBSOCKET ONREAD")
-			return this->server->on_read(fd, message.c_str(), static_cast<size_t>(message.length()));
+			return static_cast<ssize_t>(data_length);
 		}
 
 		JsonObject request_obj(OBJECT);
@@ -168,13 +668,25 @@ public:
 			return -1;
 		}
 
-		std::string response = this->get_handshake_response(request_obj.GetStr("Sec-WebSocket-Key"));
+		std::string extensions;
+		WebsocketDeflateOptions agreed;
+		std::shared_ptr<WebsocketConnection> connection = this->get_connection(fd);
+		if(request_obj.HasObj("Sec-WebSocket-Extensions", STRING) &&
+		WebsocketDeflate::negotiate(request_obj.GetStr("Sec-WebSocket-Extensions"), this->deflate_options, &agreed, &extensions)){
+			delete connection->deflate;
+			connection->deflate = new WebsocketDeflate(agreed);
+		}
+
+		std::string response = this->get_handshake_response(request_obj.GetStr("Sec-WebSocket-Key"), extensions);
 		if(this->server->send(fd, response.c_str(), response.length())){
 			DEBUG("Send handshake failed.")
 			return -1;
 		}
 		//DEBUG("DELI: " << response)
 		this->client_handshake_complete[fd] = true;
+		if(this->on_open != nullptr){
+			this->on_open(fd);
+		}
 		return 1;
 	}
 };
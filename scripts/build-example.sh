@@ -31,6 +31,7 @@ build music
 
 build json-test
 build queue-test
+build ponal-log-test
 build read-stdin-tty
 build keyfile-gen
 
@@ -37,7 +37,7 @@ case "${argv[@]}" in
 		;;
 esac
 
-libs="-lpthread -lssl -lcryptopp -largon2"
+libs="-lpthread -lssl -lcrypto -lcryptopp -largon2 -lz"
 
 libcompiler="clang++ -std=c++11 -fPIC -shared -I$dir/cpp-source \
 $libs $warn $extra \
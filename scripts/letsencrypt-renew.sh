@@ -11,3 +11,5 @@ cp /etc/letsencrypt/live/$1/fullchain.pem /opt/libjaypea/artifacts/
 
 cp /etc/letsencrypt/live/$1/privkey.pem /opt/libjaypea/artifacts/
 
+# Running TlsEpollServers watching their certificates reload these on their own, without dropping connections.
+# Otherwise, send them a SIGHUP.